@@ -32,13 +32,47 @@
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Target/TargetMachine.h"
 #include <algorithm>
+#include <functional>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
 namespace llvm {
 namespace orc {
 
+/// A SectionMemoryManager that passes the stack map section of every object
+/// to a handler, once relocations are applied and the memory is finalized.
+class StackMapMemoryManager : public SectionMemoryManager {
+public:
+  typedef std::function<void(uint8_t *)> HandlerT;
+
+  StackMapMemoryManager(HandlerT Handler) : Handler(std::move(Handler)) {}
+
+  uint8_t *allocateDataSection(uintptr_t Size, unsigned Alignment,
+                               unsigned SectionID, StringRef SectionName,
+                               bool IsReadOnly) override {
+    uint8_t *Addr = SectionMemoryManager::allocateDataSection(
+        Size, Alignment, SectionID, SectionName, IsReadOnly);
+    if (SectionName == ".llvm_stackmaps" || SectionName == "__llvm_stackmaps")
+      StackMaps.push_back(Addr);
+    return Addr;
+  }
+
+  bool finalizeMemory(std::string *ErrMsg = nullptr) override {
+    bool Failed = SectionMemoryManager::finalizeMemory(ErrMsg);
+    if (!Failed && Handler)
+      for (uint8_t *Addr : StackMaps)
+        Handler(Addr);
+    StackMaps.clear();
+    return Failed;
+  }
+
+private:
+  HandlerT Handler;
+  std::vector<uint8_t *> StackMaps;
+};
+
 class KaleidoscopeJIT {
 public:
   typedef ObjectLinkingLayer<> ObjLayerT;
@@ -55,7 +89,14 @@ public:
 
   TargetMachine &getTargetMachine() { return *TM; }
 
-  ModuleHandleT addModule(std::unique_ptr<Module> M) {
+  /// Compile M with the backend at Level, FastISel at None. The JIT is
+  /// shared with the tier-up compiler thread, every entry point locks it.
+  ModuleHandleT addModule(std::unique_ptr<Module> M,
+                          CodeGenOpt::Level Level = CodeGenOpt::Default) {
+    std::lock_guard<std::recursive_mutex> Lock(Mutex);
+    TM->setOptLevel(Level);
+    TM->setFastISel(Level == CodeGenOpt::None);
+
     // We need a memory manager to allocate memory and resolve symbols for this
     // new module. Create one that resolves symbols by looking back into the
     // JIT.
@@ -67,7 +108,7 @@ public:
         },
         [](const std::string &S) { return nullptr; });
     auto H = CompileLayer.addModuleSet(singletonSet(std::move(M)),
-                                       make_unique<SectionMemoryManager>(),
+                                       make_unique<StackMapMemoryManager>(StackMapHandler),
                                        std::move(Resolver));
 
     ModuleHandles.push_back(H);
@@ -75,15 +116,27 @@ public:
   }
 
   void removeModule(ModuleHandleT H) {
+    std::lock_guard<std::recursive_mutex> Lock(Mutex);
     ModuleHandles.erase(
         std::find(ModuleHandles.begin(), ModuleHandles.end(), H));
     CompileLayer.removeModuleSet(H);
   }
 
   JITSymbol findSymbol(const std::string Name) {
+    std::lock_guard<std::recursive_mutex> Lock(Mutex);
     return findMangledSymbol(mangle(Name));
   }
 
+  /// The address of Name, 0 when there is none. Code is linked when its
+  /// address is first taken, so unlike findSymbol(Name).getAddress() this
+  /// is safe while another thread uses the JIT.
+  JITTargetAddress getSymbolAddress(const std::string Name) {
+    std::lock_guard<std::recursive_mutex> Lock(Mutex);
+    if (auto Sym = findMangledSymbol(mangle(Name)))
+      return Sym.getAddress();
+    return 0;
+  }
+
   
   /// add an existing object (function or pointer) via its
   /// mangled name. This function is best used for unmangled
@@ -92,6 +145,12 @@ public:
     MappingLayer.setGlobalMapping(Name, (uintptr_t) Addr);
   }
 
+  /// Handler called with the stack map section of every module added from
+  /// now on, for collectors that find roots through stack maps.
+  void setStackMapHandler(StackMapMemoryManager::HandlerT Handler) {
+    StackMapHandler = std::move(Handler);
+  }
+
 private:
   std::string mangle(const std::string &Name) {
     std::string MangledName;
@@ -129,6 +188,8 @@ private:
   CompileLayerT CompileLayer;
   GlobalMappingLayerT MappingLayer;
   std::vector<ModuleHandleT> ModuleHandles;
+  StackMapMemoryManager::HandlerT StackMapHandler;
+  std::recursive_mutex Mutex;
 };
 
 } // end namespace orc
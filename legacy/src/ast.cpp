@@ -5,15 +5,25 @@
 
 #include "common.h"
 #include "ast.h"
+#include "interp.h"
+#include "tierup.h"
 
 #define CUR_TOK (Driver::instance()->CurTok)
 #define JIT (Driver::instance()->TheJIT)
 #define MODULE (Driver::instance()->TheModule)
 #define BFUNCTIONS (Driver::instance()->BufferedFunctions)
+#define TFUNCTIONS (Driver::instance()->TieredFunctions)
 #define INIT Driver::instance()->Initialize()
 
 static Token getNextToken() { return Driver::instance()->getNextToken(); }
 
+/// registerJITFunction - Let the allocation profiler attribute samples to the
+/// JIT code of function Name.
+static void registerJITFunction(const std::string &Name) {
+  if (bt_profile_interval)
+    bt_profile_register_function(Name, (uintptr_t) JIT->getSymbolAddress(Name));
+}
+
 /// LogError* - These are little helper functions for error handling.
 std::unique_ptr<ExprAST> LogError(const char *Str) {
   fprintf(stderr, "Error: %s\n", Str);
@@ -32,14 +42,42 @@ bool expectToken(token_type expect) {
   return true;
 }
 
+/// float_expr ::= float
+static std::unique_ptr<ExprAST> ParseFloatExpr() {
+  double NumVal = stod(CUR_TOK.literal);
+  auto Result = llvm::make_unique<FloatExprAST>(NumVal);
+  getNextToken(); // consume the number
+  return std::move(Result);
+}
+
 /// int_expr ::= int
 static std::unique_ptr<ExprAST> ParseIntExpr() {
-  int NumVal = stoi(CUR_TOK.literal);
+  int64_t NumVal = stoll(CUR_TOK.literal);
   auto Result = llvm::make_unique<IntExprAST>(NumVal);
   getNextToken(); // consume the number
   return std::move(Result);
 }
 
+/// string_expr ::= string
+static std::unique_ptr<ExprAST> ParseStringExpr() {
+  const std::string &Lit = CUR_TOK.literal;
+  std::string Val;
+  // drop the quotes, escapes are \n, \t and a backslash before anything else
+  for (size_t i = 1; i + 1 < Lit.size(); i++) {
+    char ch = Lit[i];
+    if (ch == '\\') {
+      ch = Lit[++i];
+      if (ch == 'n')
+        ch = '\n';
+      else if (ch == 't')
+        ch = '\t';
+    }
+    Val.push_back(ch);
+  }
+  getNextToken(); // consume the string
+  return llvm::make_unique<StringExprAST>(Val);
+}
+
 /// id_expr
 ///   ::= identifier
 static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
@@ -48,9 +86,24 @@ static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
   return llvm::make_unique<VariableExprAST>(IdName);
 }
 
+/// quote_expr ::= ' id
+///   ::= quote id  (* inside a list *)
+static std::unique_ptr<ExprAST> ParseQuoteExpr() {
+  getNextToken(); // eat quote
+  // keywords are names too once quoted
+  if (CUR_TOK.literal.empty() || (!isalpha(CUR_TOK.literal[0]) && CUR_TOK.literal[0] != '_'))
+    return LogError("expect a symbol after quote.");
+  std::string Name = CUR_TOK.literal;
+  getNextToken(); // eat symbol
+  return llvm::make_unique<SymbolExprAST>(Name);
+}
+
 /// primary
 ///   ::= id_expr
 ///   ::= int_expr
+///   ::= float_expr
+///   ::= string_expr
+///   ::= quote_expr
 ///   ::= nil
 static std::unique_ptr<ExprAST> ParsePrimary() {
   switch (CUR_TOK.type) {
@@ -58,6 +111,12 @@ static std::unique_ptr<ExprAST> ParsePrimary() {
     return ParseIdentifierExpr();
   case tok_integer:
     return ParseIntExpr();
+  case tok_float:
+    return ParseFloatExpr();
+  case tok_string:
+    return ParseStringExpr();
+  case tok_quote:
+    return ParseQuoteExpr();
   case tok_nil:
     getNextToken(); // eat nil
     return llvm::make_unique<NilExprAST>();
@@ -108,6 +167,9 @@ static std::unique_ptr<ExprAST> ParseIfExpr() {
   return llvm::make_unique<IfExprAST>(std::move(Pred), std::move(Then), std::move(Else));
 }
 
+/// CondExprAST::lower - Nested Ifs, one per clause, the last one falling
+/// back to nil. IfExprAST::markTail then reaches the expression of every
+/// clause, else included, so they get tail calls like the arms of an If.
 std::unique_ptr<ExprAST> CondExprAST::lower() {
   // print();
   std::unique_ptr<ExprAST> base_else = llvm::make_unique<NilExprAST>();
@@ -131,7 +193,14 @@ static std::unique_ptr<ExprAST> ParseCondExpr() {
   while (CUR_TOK.type != tok_close) {
     if (!expectToken(tok_open)) return LogError("non '(' at begin of sub cond expression");
     getNextToken(); // eat open
-    if (auto pred = ParseExpression()) {
+    // an else clause is always taken, any value but #f is true
+    std::unique_ptr<ExprAST> pred;
+    if (CUR_TOK.type == tok_symbol && CUR_TOK.literal == "else") {
+      getNextToken(); // eat else
+      pred = llvm::make_unique<IntExprAST>(1);
+    } else
+      pred = ParseExpression();
+    if (pred) {
       if (auto expr = ParseExpression()) {  
         preds.push_back(std::move(pred));
         exprs.push_back(std::move(expr));
@@ -233,6 +302,61 @@ static std::unique_ptr<ExprAST> ParseGetField() {
     return LogError("non expr at getfield object.");
 }
 
+static std::unique_ptr<ExprAST> ParseListExpr() {
+  getNextToken(); // eat list
+  std::vector<std::unique_ptr<ExprAST>> Members;
+  while (CUR_TOK.type != tok_close) {
+    if (auto Member = ParseExpression())
+      Members.push_back(std::move(Member));
+    else
+      return LogError("non expr as list member.");
+  }
+  return llvm::make_unique<ListExprAST>(std::move(Members));
+}
+
+/// primitive
+///   ::= op expr*  (* with as many exprs as the primitive takes *)
+static std::unique_ptr<ExprAST> ParsePrimitiveExpr() {
+  token_type op = CUR_TOK.type;
+  unsigned nargs = 0;
+  switch (op) {
+  case tok_make_hash_table:
+    nargs = 0;
+    break;
+  case tok_make_f64vector:
+  case tok_make_i64vector:
+  case tok_vector_length:
+  case tok_vector_sum:
+  case tok_string_length:
+  case tok_hash_count:
+    nargs = 1;
+    break;
+  case tok_vector_ref:
+  case tok_vector_add:
+  case tok_vector_mul:
+  case tok_string_ref:
+  case tok_string_append:
+  case tok_string_eq:
+  case tok_string_lt:
+    nargs = 2;
+    break;
+  default:
+    nargs = 3;
+    break;
+  }
+  getNextToken(); // eat op
+  std::vector<std::unique_ptr<ExprAST>> Args;
+  while (CUR_TOK.type != tok_close) {
+    if (auto Arg = ParseExpression())
+      Args.push_back(std::move(Arg));
+    else
+      return LogError("non expr as arg at primitive.");
+  }
+  if (Args.size() != nargs)
+    return LogError("wrong number of args at primitive.");
+  return llvm::make_unique<PrimitiveExprAST>(op, std::move(Args));
+}
+
 /// list
 ///   ::= BinOp expr1 expr2
 ///   ::= if expr0 expr1 expr2
@@ -243,6 +367,8 @@ static std::unique_ptr<ExprAST> ParseGetField() {
 ///   ::= cond ((pred1) (expr1))+
 ///   ::= closure id expr+
 ///   ::= getfield int expr
+///   ::= list expr*
+///   ::= primitive
 ///   ::= begin expr*
 static std::unique_ptr<ExprAST> ParseList() {
   switch (CUR_TOK.type) {
@@ -253,14 +379,45 @@ static std::unique_ptr<ExprAST> ParseList() {
   case tok_gt:
   case tok_lt:
   case tok_eq:
+  case tok_eqp:
   case tok_and:
   case tok_or:
   case tok_setbox:
+  case tok_cons:
+  case tok_map:
     return ParseBinOpExpr();
   case tok_not:
   case tok_box:
   case tok_unbox:
+  case tok_car:
+  case tok_cdr:
+  case tok_nullp:
+  case tok_pairp:
     return ParseUnaryOpExpr();
+  case tok_list:
+    return ParseListExpr();
+  case tok_quote:
+    return ParseQuoteExpr();
+  case tok_make_f64vector:
+  case tok_make_i64vector:
+  case tok_vector_length:
+  case tok_vector_ref:
+  case tok_vector_set:
+  case tok_vector_add:
+  case tok_vector_mul:
+  case tok_vector_fma:
+  case tok_vector_sum:
+  case tok_string_length:
+  case tok_string_ref:
+  case tok_substring:
+  case tok_string_append:
+  case tok_string_eq:
+  case tok_string_lt:
+  case tok_make_hash_table:
+  case tok_hash_ref:
+  case tok_hash_set:
+  case tok_hash_count:
+    return ParsePrimitiveExpr();
   case tok_if:
     return ParseIfExpr();
   case tok_define:
@@ -316,6 +473,54 @@ static std::unique_ptr<ExprAST> ParseExpression() {
   }
 }
 
+/// bt_tier_up - Called by the profiling tier of a function once it is hot.
+/// Nothing is being generated while JIT code runs, so the optimized tier is
+/// generated right away into the current (empty) module, like a definition.
+/// Optimizing and compiling it is left to the tier-up thread (see tierup.h).
+extern "C" void bt_tier_up(bt_function_info_t *info) {
+  if (info->deopts >= BT_MAX_DEOPTS || __atomic_load_n(&info->compiling, __ATOMIC_ACQUIRE))
+    return;
+
+  FunctionAST *fn = (FunctionAST *) info->function;
+  llvm::Function *FnIR = fn->codegenOptimized();
+  if (!FnIR) {
+    // stay generic for good
+    info->deopts = BT_MAX_DEOPTS;
+    return;
+  }
+
+  std::string Name = FnIR->getName();
+  if (bt_tier_up_async) {
+    // optimized and compiled on the tier-up thread, the profiling tier runs
+    // until it is done
+    info->compiling = 1;
+    bt_compile_optimized(info, std::move(MODULE), Name);
+    INIT;
+    return;
+  }
+
+  bt_optimize_module(*MODULE);
+  finalize_butterfly_per_module();
+  JIT->addModule(std::move(MODULE), llvm::CodeGenOpt::Aggressive);
+  INIT;
+  registerJITFunction(Name);
+  info->optimized = (void *) JIT->getSymbolAddress(Name);
+}
+
+static void PrintResult(bt_value_t *ret) {
+  if (bt_is_int64(ret))
+    fprintf(stderr, "Evaluated to %ld\n", bt_to_int64(ret));
+  else if (bt_is_float64(ret))
+    fprintf(stderr, "Evaluated to %.17g\n", bt_to_float64(ret));
+  else if (bt_is_bool(ret))
+    fprintf(stderr, "Evaluated to %s\n", (char *) ret == bt_true ? "#t" : "#f");
+  else if (bt_is_symbol(ret))
+    fprintf(stderr, "Evaluated to '%s\n", ((bt_symbol_t *) ret)->name);
+  else if (bt_is_string(ret))
+    fprintf(stderr, "Evaluated to \"%.*s\"\n", (int) ((bt_string_t *) ret)->length,
+            bt_string_bytes(ret));
+}
+
 void HandleCommand() {
   // Evaluate a top-level expression into an anonymous function.
   if (auto ast = ParseExpression()) {
@@ -340,12 +545,21 @@ void HandleCommand() {
       // std::cout << "prepare to clear buffered functions " << BFUNCTIONS.size() << std::endl;
       // clear buffered definition
       for(unsigned i = 0, e = BFUNCTIONS.size(); i != e; ++i) {
+        BFUNCTIONS[i]->enableTiering();
         if (auto FnIR = BFUNCTIONS[i]->codegen()) {
           FnIR->dump();
-          JIT->addModule(std::move(MODULE));
+          std::string Name = FnIR->getName();
+          finalize_butterfly_per_module();
+          // tier 0 is compiled fast, it is compiled again when it gets hot
+          JIT->addModule(std::move(MODULE), BFUNCTIONS[i]->isTiered() ? llvm::CodeGenOpt::None
+                                                                      : llvm::CodeGenOpt::Default);
           INIT;
+          registerJITFunction(Name);
         } else
           LogError("Buffered Functions not working.");
+        // a tiered function is generated again once it is hot
+        if (BFUNCTIONS[i]->isTiered())
+          TFUNCTIONS.push_back(std::move(BFUNCTIONS[i]));
         BFUNCTIONS[i].reset();
       }
       BFUNCTIONS.clear();
@@ -357,23 +571,41 @@ void HandleCommand() {
       body.push_back(std::move(ast));
       auto fn = llvm::make_unique<FunctionAST>(std::move(proto), std::move(body));
       fn->registerMe();
-      fn->codegen()->dump();
+
+      // Interpret the expression when it is simple enough, it runs once, and
+      // JIT it otherwise. Both run the same optimized IR.
+      LIRFunction *LIR = fn->getLIR();
+      if (!LIR)
+        return;
+      LIR->dump();
+      std::unique_ptr<Bytecode> BC;
+      if (bt_interp_enabled)
+        BC = Bytecode::compile(*LIR);
+      if (BC) {
+        PrintResult((bt_value_t *) BC->run(nullptr));
+        return;
+      }
+
+      auto *FnIR = fn->codegen();
+      if (!FnIR)
+        return;
+      FnIR->dump();
 
       // JIT the module containing the anonymous expression, keeping a handle so
       // we can free it later.
+      finalize_butterfly_per_module();
       auto H = JIT->addModule(std::move(MODULE));
       INIT;
 
       // Search the JIT for the __anon_expr symbol.
-      auto ExprSymbol = JIT->findSymbol("__anon_expr");
-      assert(ExprSymbol && "Function not found");
+      auto ExprAddr = JIT->getSymbolAddress("__anon_expr");
+      assert(ExprAddr && "Function not found");
+      registerJITFunction("__anon_expr");
 
       // Get the symbol's address and cast it to the right type (takes no
       // arguments, returns a double) so we can call it as a native function.
-      char *(*FP)() = (char *(*)())(intptr_t)ExprSymbol.getAddress();
-      bt_value_t *ret = (bt_value_t *) FP();
-      if (bt_is_int64(ret))
-        fprintf(stderr, "Evaluated to %ld\n", bt_to_int64(ret));
+      char *(*FP)() = (char *(*)())(intptr_t)ExprAddr;
+      PrintResult((bt_value_t *) FP());
 
       // Delete the anonymous expression module from the JIT.
       JIT->removeModule(H);
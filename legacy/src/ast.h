@@ -3,6 +3,7 @@
 
 #include <iostream>
 #include "common.h"
+#include "lir.h"
 
 /// ExprAST - Base class for all expression nodes.
 class ExprAST {
@@ -10,17 +11,50 @@ public:
   virtual ~ExprAST() {}
   virtual void print() {}
   virtual bool isaFunction() { return false; }
-  virtual llvm::Value *codegen() { return nullptr; }
+  // marks the calls whose value is returned by the function as is
+  virtual void markTail() {}
+  // append the Lightning IR of the expression, the result is its slot
+  virtual int lirgen(LIRBuilder &B);
 };
 
-/// IntExprAST - Expression class for numeric literals like "1.0".
+/// IntExprAST - Expression class for integer literals like "1".
 class IntExprAST : public ExprAST {
-  int Val;
+  int64_t Val;
 
 public:
-  IntExprAST(int Val) : Val(Val) {}
+  IntExprAST(int64_t Val) : Val(Val) {}
   void print() override { std::cout << "(Int=" << Val << ")"; }
-  llvm::Value *codegen() override;
+  int lirgen(LIRBuilder &B) override;
+};
+
+/// FloatExprAST - Expression class for numeric literals like "1.0".
+class FloatExprAST : public ExprAST {
+  double Val;
+
+public:
+  FloatExprAST(double Val) : Val(Val) {}
+  void print() override { std::cout << "(Float=" << Val << ")"; }
+  int lirgen(LIRBuilder &B) override;
+};
+
+/// SymbolExprAST - Expression class for quoted symbols like "'foo".
+class SymbolExprAST : public ExprAST {
+  std::string Name;
+
+public:
+  SymbolExprAST(const std::string &Name) : Name(Name) {}
+  void print() override { std::cout << "(Symbol=" << Name << ")"; }
+  int lirgen(LIRBuilder &B) override;
+};
+
+/// StringExprAST - Expression class for string literals like "\"foo\"".
+class StringExprAST : public ExprAST {
+  std::string Val; // unescaped
+
+public:
+  StringExprAST(const std::string &Val) : Val(Val) {}
+  void print() override { std::cout << "(String=\"" << Val << "\")"; }
+  int lirgen(LIRBuilder &B) override;
 };
 
 /// IntExprAST - Expression class for numeric literals like "1.0".
@@ -28,7 +62,7 @@ class NilExprAST : public ExprAST {
 public:
   NilExprAST() {}
   void print() override { std::cout << "nil"; }
-  llvm::Value *codegen() override;
+  int lirgen(LIRBuilder &B) override;
 };
 
 /// VariableExprAST - Expression class for referencing a variable, like "a".
@@ -38,7 +72,7 @@ class VariableExprAST : public ExprAST {
 public:
   VariableExprAST(const std::string &Name) : Name(Name) {}
   void print() override { std::cout << "(Var=" << Name << ")"; }
-  llvm::Value *codegen() override;
+  int lirgen(LIRBuilder &B) override;
 };
 
 /// VarDefinitionExprAST - Expression class for referencing a variable, like "a".
@@ -53,7 +87,7 @@ public:
     Init->print();
     std::cout << ")";
   }
-  llvm::Value *codegen() override;
+  int lirgen(LIRBuilder &B) override;
 };
 
 /// VarSetExprAST - Expression class for referencing a variable, like "a".
@@ -68,7 +102,7 @@ public:
     Expr->print();
     std::cout << ")";
   }
-  llvm::Value *codegen() override;
+  int lirgen(LIRBuilder &B) override;
 };
 
 /// BinaryExprAST - Expression class for a binary operator.
@@ -87,7 +121,7 @@ public:
     RHS->print();
     std::cout << ")";
   }
-  llvm::Value *codegen() override;
+  int lirgen(LIRBuilder &B) override;
 };
 
 /// UnaryExprAST - Expression class for a binary operator.
@@ -104,7 +138,7 @@ public:
     RHS->print();
     std::cout << ")";
   }
-  llvm::Value *codegen() override;
+  int lirgen(LIRBuilder &B) override;
 };
 
 /// IfExprAST - Expression class for a if statement.
@@ -124,7 +158,11 @@ public:
     Else->print();
     std::cout << ")";
   }
-  llvm::Value *codegen() override;
+  void markTail() override {
+    Then->markTail();
+    Else->markTail();
+  }
+  int lirgen(LIRBuilder &B) override;
 };
 
 class BeginExprAST: public ExprAST {
@@ -142,7 +180,11 @@ public:
     }
     std::cout << "})" << std::endl;
   }
-  llvm::Value *codegen() override;
+  void markTail() override {
+    if (!Exprs.empty())
+      Exprs.back()->markTail();
+  }
+  int lirgen(LIRBuilder &B) override;
 };
 
 /// CallExprAST - Expression class for function calls.
@@ -151,6 +193,7 @@ class CallExprAST : public ExprAST {
   std::unique_ptr<ExprAST> Callee;
   std::vector<std::unique_ptr<ExprAST>> Args;
   std::string Symbol_; // candidate for static callee
+  bool Tail = false; // the caller returns the result right away
 
 public:
 /*
@@ -171,7 +214,8 @@ public:
     }
     std::cout << ")";
   }
-  llvm::Value *codegen() override;
+  void markTail() override { Tail = true; }
+  int lirgen(LIRBuilder &B) override;
 };
 
 /// ClosureExprAST - Expression class for new closure.
@@ -192,7 +236,44 @@ public:
     }
     std::cout << ")";
   }
-  llvm::Value *codegen() override;
+  int lirgen(LIRBuilder &B) override;
+};
+
+/// ListExprAST - Expression class for a new list.
+class ListExprAST : public ExprAST {
+  std::vector<std::unique_ptr<ExprAST>> Members;
+
+public:
+  ListExprAST(std::vector<std::unique_ptr<ExprAST>> Members)
+      : Members(std::move(Members)) {}
+
+  void print() override { 
+    std::cout << "(list "; 
+    for (auto &m : Members) {
+      m->print(); std::cout << ", ";  
+    }
+    std::cout << ")";
+  }
+  int lirgen(LIRBuilder &B) override;
+};
+
+/// PrimitiveExprAST - Expression class for a call of a runtime primitive.
+class PrimitiveExprAST : public ExprAST {
+  token_type Op;
+  std::vector<std::unique_ptr<ExprAST>> Args;
+
+public:
+  PrimitiveExprAST(token_type op, std::vector<std::unique_ptr<ExprAST>> Args)
+      : Op(op), Args(std::move(Args)) {}
+
+  void print() override { 
+    std::cout << "(Op=" << token_desc[Op] << ", "; 
+    for (auto &Arg : Args) {
+      Arg->print(); std::cout << ", ";  
+    }
+    std::cout << ")";
+  }
+  int lirgen(LIRBuilder &B) override;
 };
 
 /// GetFieldExprAST - Expression class for get field.
@@ -210,7 +291,7 @@ public:
     Object->print();
     std::cout << ")";
   }
-  llvm::Value *codegen() override;
+  int lirgen(LIRBuilder &B) override;
 };
 
 /// PrototypeAST - This class represents the "prototype" for a function,
@@ -238,10 +319,33 @@ public:
 
 class FunctionScope {
 public:
-  // scope of function local
-  std::map<std::string, llvm::Value *> NamedValues;
   llvm::Function *TheFunction;
-  FunctionScope() {}
+
+  // gc frame of this function: arguments, variables and the slots of the IR
+  // that need a root live in root slots, the frame size is patched once the
+  // body is generated
+  int NumRoots;
+  llvm::AllocaInst *FrameAlloca;
+  llvm::StoreInst *FrameSizeStore;
+  llvm::CallInst *FrameClear;
+
+  // self tail calls store the new arguments and jump back to L0
+  std::vector<llvm::Value *> ArgSlots;
+
+  // tiering (see feedback.h), Info is nullptr for code that is not tiered.
+  // Sites take their feedback words from Feedback in the order the IR is
+  // lowered, which is the same in every tier: the profiling tier allocates
+  // and fills them, the optimized tier (Speculate) reads them back. Self is
+  // the function that calls by name reach, the profiling tier.
+  bt_function_info_t *Info;
+  std::vector<std::unique_ptr<uint64_t[]>> *Feedback;
+  unsigned NextSite;
+  bool Speculate;
+  llvm::Function *Self;
+
+  FunctionScope() : NumRoots(0), FrameAlloca(nullptr), FrameSizeStore(nullptr), FrameClear(nullptr),
+                    Info(nullptr), Feedback(nullptr), NextSite(0),
+                    Speculate(false), Self(nullptr) {}
 };
 
 /// FunctionAST - This class represents a function definition itself.
@@ -250,6 +354,11 @@ class FunctionAST : public ExprAST {
   std::vector<std::unique_ptr<ExprAST>> Body;
   FunctionScope Scope;
   std::string name;
+  std::unique_ptr<bt_function_info_t> Info;
+  std::vector<std::unique_ptr<uint64_t[]>> Feedback;
+  std::unique_ptr<LIRFunction> LIR;
+
+  llvm::Function *codegenTier(bool Speculate);
 
 public:
   FunctionAST(std::unique_ptr<PrototypeAST> Proto,
@@ -265,9 +374,19 @@ public:
     }
     std::cout << ")" << std::endl;
   }
-  llvm::Value *codegen() override;
+  llvm::Function *codegen() { return codegenTier(false); }
+  // the optimized tier, speculating on the feedback of the profiling tier
+  llvm::Function *codegenOptimized() { return codegenTier(true); }
+  // the function in Lightning IR, nullptr after reporting an error
+  std::unique_ptr<LIRFunction> buildLIR();
+  // the optimized IR, built once and shared by the interpreter and every
+  // tier, nullptr after reporting an error
+  LIRFunction *getLIR();
 
   void registerMe();
+  // compile in the profiling tier, keeping the function for its optimization
+  void enableTiering();
+  bool isTiered() { return Info != nullptr; }
 
   // before generating function def, a few codegen pass have to be invoked
   // including but not limited to:
@@ -277,6 +396,7 @@ public:
   //   gc frame setup
 
   void allocaArgPass(void);
+  void finishGCFrame(void);
 };
 
 /**************************************************************************************************
@@ -326,6 +446,9 @@ std::unique_ptr<PrototypeAST> LogErrorP(const char *Str);
 
 void HandleCommand();
 
+// the full optimization pipeline, of TheFPM and of optimized tiers
+void addOptimizationPasses(llvm::legacy::FunctionPassManager &FPM);
+
 class Driver {
 public:
   Lexer lex;
@@ -335,11 +458,16 @@ public:
   llvm::LLVMContext TheContext;
   std::unique_ptr<llvm::Module> TheModule;
   std::unique_ptr<llvm::legacy::FunctionPassManager> TheFPM;
+  std::unique_ptr<llvm::legacy::FunctionPassManager> TheBaselineFPM; // tier 0
   std::unique_ptr<llvm::orc::KaleidoscopeJIT> TheJIT;
   std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos; // global function namespace
   std::vector<std::unique_ptr<FunctionAST>> BufferedFunctions;
+  std::vector<std::unique_ptr<FunctionAST>> TieredFunctions; // kept for bt_tier_up
   FunctionScope *TheScope;
   llvm::Value *btpgcstack_var;
+  llvm::Value *bttlab_var;
+  llvm::Value *btconstlab_var;
+  llvm::Value *btgcmarking_var;
   llvm::Value *gcframe;
 
   Token getNextToken() { return CurTok = lex.getNextToken(); } 
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <iostream>
 #include <string>
 #include <string.h>
@@ -10,10 +11,14 @@
 #define BUILDER (Driver::instance()->Builder)
 #define MODULE (Driver::instance()->TheModule)
 #define FPM (Driver::instance()->TheFPM)
+#define BASELINE_FPM (Driver::instance()->TheBaselineFPM)
 #define JIT (Driver::instance()->TheJIT)
 #define SCOPE (Driver::instance()->TheScope)
 #define FUNCTIONPROTOS (Driver::instance()->FunctionProtos)
 #define btpgcstack_var (Driver::instance()->btpgcstack_var)
+#define bttlab_var (Driver::instance()->bttlab_var)
+#define btconstlab_var (Driver::instance()->btconstlab_var)
+#define btgcmarking_var (Driver::instance()->btgcmarking_var)
 #define gcframe (Driver::instance()->gcframe)
 
 llvm::Value *LogErrorV(const char *Str) {
@@ -21,15 +26,64 @@ llvm::Value *LogErrorV(const char *Str) {
   return nullptr;
 }
 
+/// getValueTy - Type of butterfly values in generated code. In statepoint
+/// mode values live in address space 1, which is how LLVM tells the pointers
+/// the collector manages (and may move) from raw ones.
+llvm::PointerType *getValueTy() {
+  return llvm::Type::getInt8PtrTy(LLVM_CONTEXT, bt_gc_statepoints ? 1 : 0);
+}
+
+/// CreateToValue - Turn a raw pointer (fresh memory, code) into a value. In
+/// statepoint mode this goes through an integer, LLVM does not allow casting
+/// between the raw and the managed address space.
+llvm::Value *CreateToValue(llvm::Value *V) {
+  if (!bt_gc_statepoints)
+    return BUILDER.CreateBitCast(V, getValueTy());
+  llvm::Value *Bits = BUILDER.CreatePtrToInt(V, llvm::Type::getInt64Ty(LLVM_CONTEXT));
+  return BUILDER.CreateIntToPtr(Bits, getValueTy());
+}
+
 /// CreateEntryBlockAlloca - Create an alloca instruction in the entry block of
 /// the function.  This is used for mutable variables etc.
 llvm::AllocaInst *CreateEntryBlockAlloca(llvm::Function *TheFunction,
                                    const std::string &VarName) {
   llvm::IRBuilder<> TmpB(&TheFunction->getEntryBlock(),
                    TheFunction->getEntryBlock().begin());
-  return TmpB.CreateAlloca(llvm::Type::getInt8PtrTy(LLVM_CONTEXT), nullptr, VarName);
+  return TmpB.CreateAlloca(getValueTy(), nullptr, VarName);
 }
 
+/// CreateRootSlot - Reserve a new slot in the gc frame of the current
+/// function. The address is computed in the entry block so it dominates every
+/// use, and the slot is cleared on entry so the collector never sees garbage.
+/// In statepoint mode there is no gc frame: locals are plain allocas that
+/// mem2reg promotes, and the stack maps describe where the values live.
+llvm::Value *CreateRootSlot(const std::string &Name) {
+  if (bt_gc_statepoints)
+    return CreateEntryBlockAlloca(SCOPE->TheFunction, Name);
+  llvm::AllocaInst *Frame = SCOPE->FrameAlloca;
+  llvm::IRBuilder<> TmpB(Frame->getParent(), ++llvm::BasicBlock::iterator(Frame));
+  return TmpB.CreateConstGEP1_32(Frame, 2 + SCOPE->NumRoots++, Name);
+}
+
+/// GCRoot - Keeps a temporary visible to the collector while other code that
+/// may allocate (and thus collect) is generated. Constants are never heap
+/// objects, so they need no slot. In statepoint mode the SSA value itself is
+/// tracked (and relocated) across calls, so no slot is needed either.
+class GCRoot {
+  llvm::Value *Val;
+  llvm::Value *Slot;
+
+public:
+  GCRoot(llvm::Value *V) : Val(V), Slot(nullptr) {
+    if (!bt_gc_statepoints && !llvm::isa<llvm::Constant>(V)) {
+      Slot = CreateRootSlot("tmproot");
+      BUILDER.CreateStore(V, Slot);
+    }
+  }
+
+  llvm::Value *get() { return Slot ? BUILDER.CreateLoad(Slot, "reload") : Val; }
+};
+
 llvm::Function *getFunction(std::string Name) {
   // First, see if the function has already been added to the current module.
   if (auto *F = MODULE->getFunction(Name))
@@ -45,366 +99,1629 @@ llvm::Function *getFunction(std::string Name) {
   return nullptr;
 }
 
-llvm::Value *IntExprAST::codegen() {
-  std::string bt_new_int64_sym("bt_new_int64");
-  llvm::Function *newInt64 = getFunction(bt_new_int64_sym);
+/// CreateTaggedConstant - Materialize an immediate value (fixnum, boolean,
+/// nil) as a constant pointer, no runtime call or allocation is needed.
+llvm::Constant *CreateTaggedConstant(char *val) {
+  llvm::Constant *bits =
+      llvm::ConstantInt::get(llvm::Type::getInt64Ty(LLVM_CONTEXT), (uint64_t) (uintptr_t) val);
+  return llvm::ConstantExpr::getIntToPtr(bits, getValueTy());
+}
+
+/// CreateConstantObject - Reference the constant pool entry Name, an object
+/// of the given type and fields. Pool entries are private globals of the
+/// module, so they are materialized once when the JIT loads it and are
+/// immortal: the collector only manages its own heap and leaves them alone.
+llvm::Constant *CreateConstantObject(const std::string &Name, int32_t Type,
+                                     llvm::ArrayRef<llvm::Constant *> Fields) {
+  llvm::Type *T_int32 = llvm::Type::getInt32Ty(LLVM_CONTEXT);
+  llvm::Type *T_int64 = llvm::Type::getInt64Ty(LLVM_CONTEXT);
+
+  llvm::GlobalVariable *GV = MODULE->getNamedGlobal(Name);
+  if (!GV) {
+    std::vector<llvm::Type *> Types = { T_int32, T_int32 };
+    std::vector<llvm::Constant *> Inits = { llvm::ConstantInt::get(T_int32, Type),
+                                            llvm::ConstantInt::get(T_int32, Fields.size()) };
+    for (llvm::Constant *Field : Fields) {
+      Types.push_back(Field->getType());
+      Inits.push_back(Field);
+    }
+    llvm::StructType *T_object = llvm::StructType::get(LLVM_CONTEXT, Types);
+    GV = new llvm::GlobalVariable(*MODULE, T_object, true, llvm::GlobalVariable::PrivateLinkage,
+                                  llvm::ConstantStruct::get(T_object, Inits), Name);
+    // heap objects are 8-byte aligned, the low bits are the tag
+    GV->setAlignment(8);
+  }
+  return llvm::ConstantExpr::getIntToPtr(llvm::ConstantExpr::getPtrToInt(GV, T_int64), getValueTy());
+}
+
+/// CreateTruthTest - Inline version of bt_as_bool: only nil, #f and the
+/// fixnum 0 are false.
+llvm::Value *CreateTruthTest(llvm::Value *V) {
+  llvm::Type *T_int64 = llvm::Type::getInt64Ty(LLVM_CONTEXT);
+  llvm::Value *bits = BUILDER.CreatePtrToInt(V, T_int64, "condbits");
+  // nil (0) and fixnum 0 (1) are the only values below 2
+  llvm::Value *notZero = BUILDER.CreateICmpUGT(
+      bits, llvm::ConstantInt::get(T_int64, (uint64_t) (uintptr_t) bt_from_fixnum(0)), "notzero");
+  llvm::Value *notFalse = BUILDER.CreateICmpNE(
+      bits, llvm::ConstantInt::get(T_int64, (uint64_t) (uintptr_t) bt_false), "notfalse");
+  return BUILDER.CreateAnd(notZero, notFalse, "ifcond");
+}
+
+/// CreateBoolSelect - Turn an i1 into the #t/#f immediates.
+llvm::Value *CreateBoolSelect(llvm::Value *Cond) {
+  return BUILDER.CreateSelect(Cond, CreateTaggedConstant(bt_true),
+                              CreateTaggedConstant(bt_false), "booltmp");
+}
+
+/// CreateBumpAlloc - Inline bump-pointer allocation of size bytes out of the
+/// buffer Tlab. Only when the buffer is exhausted do we call SlowSym, with
+/// SlowArg, to refill it.
+static llvm::Value *CreateBumpAlloc(llvm::Value *Tlab, const std::string &SlowSym,
+                                    int64_t size, int64_t SlowArg) {
+  llvm::Type *T_praw = llvm::Type::getInt8PtrTy(LLVM_CONTEXT);
+  llvm::Type *T_int64 = llvm::Type::getInt64Ty(LLVM_CONTEXT);
+  llvm::MDBuilder MDB(LLVM_CONTEXT);
+
+  llvm::Function *TheFunction = BUILDER.GetInsertBlock()->getParent();
+  llvm::BasicBlock *fastBB = llvm::BasicBlock::Create(LLVM_CONTEXT, "bump", TheFunction);
+  llvm::BasicBlock *slowBB = llvm::BasicBlock::Create(LLVM_CONTEXT, "refill");
+  llvm::BasicBlock *mergeBB = llvm::BasicBlock::Create(LLVM_CONTEXT, "allocated");
+
+  llvm::Value *CurP = BUILDER.CreateStructGEP(nullptr, Tlab, 0);
+  llvm::Value *LimitP = BUILDER.CreateStructGEP(nullptr, Tlab, 1);
+  llvm::Value *Cur = BUILDER.CreateLoad(CurP, "tlabcur");
+  llvm::Value *Next = BUILDER.CreateConstGEP1_64(Cur, size, "tlabnext");
+  llvm::Value *Limit = BUILDER.CreateLoad(LimitP, "tlablimit");
+  llvm::Value *Fits = BUILDER.CreateICmpULE(Next, Limit, "fits");
+  BUILDER.CreateCondBr(Fits, fastBB, slowBB, MDB.createBranchWeights(2000, 1));
+
+  BUILDER.SetInsertPoint(fastBB);
+  BUILDER.CreateStore(Next, CurP);
+  BUILDER.CreateBr(mergeBB);
+
+  TheFunction->getBasicBlockList().push_back(slowBB);
+  BUILDER.SetInsertPoint(slowBB);
+  llvm::Function *allocSlow = getFunction(SlowSym);
   std::vector<llvm::Value *> ArgsV;
-  ArgsV.push_back( llvm::ConstantInt::get(LLVM_CONTEXT, llvm::APInt(32, Val, true)) );
-  return BUILDER.CreateCall(newInt64, ArgsV, "inttmp");
+  ArgsV.push_back( llvm::ConstantInt::get(T_int64, SlowArg) );
+  llvm::Value *SlowV = BUILDER.CreateCall(allocSlow, ArgsV, "slowalloc");
+  BUILDER.CreateBr(mergeBB);
+
+  TheFunction->getBasicBlockList().push_back(mergeBB);
+  BUILDER.SetInsertPoint(mergeBB);
+  llvm::PHINode *PN = BUILDER.CreatePHI(T_praw, 2, "obj");
+  PN->addIncoming(Cur, fastBB);
+  PN->addIncoming(SlowV, slowBB);
+  return CreateToValue(PN);
 }
 
-llvm::Value *NilExprAST::codegen() {
-  return llvm::ConstantPointerNull::get(llvm::Type::getInt8PtrTy(LLVM_CONTEXT));
+/// CreateAlloc - Allocate size bytes out of bt_tlab.
+llvm::Value *CreateAlloc(int64_t size) {
+  return CreateBumpAlloc(bttlab_var, "bt_alloc_slow", size, size);
 }
 
-llvm::Value *VariableExprAST::codegen() {
-  // check if this varaible is global var
-  // check if this variable is a function name
-  if (FUNCTIONPROTOS.count(Name) > 0) {
-    // this is a global function
-    auto F = getFunction(Name);
-    std::string bt_new_fptr_sym("bt_new_fptr");
-    llvm::Value *FP = BUILDER.CreateBitCast(F, llvm::Type::getInt8PtrTy(LLVM_CONTEXT), "fptr");
-    llvm::Value *Nargs = llvm::ConstantInt::get(LLVM_CONTEXT, llvm::APInt(32, (int) F->arg_size(), true));
-    llvm::Function *newFPtr = getFunction(bt_new_fptr_sym);
-    std::vector<llvm::Value *> ArgsV;
-    ArgsV.push_back(FP); 
-    ArgsV.push_back(Nargs);
-    return BUILDER.CreateCall(newFPtr, ArgsV, "fptmp");
-  }
+/// CreateConsAlloc - Allocate nwords words of cons space out of bt_cons_tlab.
+llvm::Value *CreateConsAlloc(int64_t nwords) {
+  return CreateBumpAlloc(btconstlab_var, "bt_cons_alloc_slow", nwords * 8, nwords);
+}
 
-  // Look this variable up in the function.
-  llvm::Value *V = SCOPE->NamedValues[Name];
-  if (!V)
-    return LogErrorV("Unknown variable name");
+/// CreateNewObject - Allocate a heap object and write its header inline.
+llvm::Value *CreateNewObject(DataType type, int nfields) {
+  llvm::Type *T_int32 = llvm::Type::getInt32Ty(LLVM_CONTEXT);
+  llvm::Value *Obj = CreateAlloc(bt_object_size(nfields));
+  llvm::Value *Hdr = BUILDER.CreateBitCast(Obj, llvm::PointerType::get(T_int32, getValueTy()->getAddressSpace()));
+  BUILDER.CreateStore(llvm::ConstantInt::get(T_int32, type), BUILDER.CreateConstGEP1_32(Hdr, 0));
+  BUILDER.CreateStore(llvm::ConstantInt::get(T_int32, nfields), BUILDER.CreateConstGEP1_32(Hdr, 1));
+  return Obj;
+}
+
+/// CreateFieldAddr - Address of field n of a heap object.
+llvm::Value *CreateFieldAddr(llvm::Value *Obj, int n) {
+  llvm::PointerType *T_pvalue = getValueTy();
+  llvm::Value *Fields = BUILDER.CreateBitCast(Obj, llvm::PointerType::get(T_pvalue, T_pvalue->getAddressSpace()));
+  // field 0 sits right after the 8-byte header
+  return BUILDER.CreateConstGEP1_32(Fields, n + 1);
+}
 
-  // Load the value.
-  llvm::Value *LoadV = BUILDER.CreateLoad(V, Name.c_str());
+/// CreateStoreField - Initialize field n of a freshly allocated object. No
+/// write barrier is needed: inline allocations always come from the nursery,
+/// and objects bt_alloc_slow places in the old space are remembered eagerly.
+void CreateStoreField(llvm::Value *Obj, int n, llvm::Value *V) {
+  BUILDER.CreateStore(V, CreateFieldAddr(Obj, n));
+}
 
-  return LoadV;
+/// CreateInNursery - Inline bt_in_nursery. The nursery never moves, so its
+/// bounds are baked into the code.
+llvm::Value *CreateInNursery(llvm::Value *V) {
+  llvm::Type *T_int64 = llvm::Type::getInt64Ty(LLVM_CONTEXT);
+  llvm::Value *Offset = BUILDER.CreateSub(
+      BUILDER.CreatePtrToInt(V, T_int64),
+      llvm::ConstantInt::get(T_int64, (uint64_t) (uintptr_t) bt_nursery.start), "nurseryoff");
+  return BUILDER.CreateICmpULT(Offset, llvm::ConstantInt::get(T_int64, BT_NURSERY_SIZE), "young");
 }
 
-llvm::Value *VarDefinitionExprAST::codegen() {
-  // VarDef is a alloca inst which will be allocated at entry block, hence here we only return nil
-  // normal scheme code will not rely on the return value of defineVar
-  llvm::Value *InitVal = Init->codegen();
-  if (!InitVal)
-    return LogErrorV("Unknown variable initialization");
+/// CreateWriteBarrier - Inline bt_gc_wb for a store of V into Obj: only a
+/// young value stored into an old object reaches the runtime.
+void CreateWriteBarrier(llvm::Value *Obj, llvm::Value *V) {
+  llvm::MDBuilder MDB(LLVM_CONTEXT);
+  llvm::Function *TheFunction = BUILDER.GetInsertBlock()->getParent();
+  llvm::BasicBlock *rememberBB = llvm::BasicBlock::Create(LLVM_CONTEXT, "remember", TheFunction);
+  llvm::BasicBlock *contBB = llvm::BasicBlock::Create(LLVM_CONTEXT, "wbcont");
 
-  llvm::AllocaInst *Alloca = CreateEntryBlockAlloca(SCOPE->TheFunction, Name);
+  llvm::Value *OldToYoung = BUILDER.CreateAnd(CreateInNursery(V),
+                                              BUILDER.CreateNot(CreateInNursery(Obj)), "oldtoyoung");
+  BUILDER.CreateCondBr(OldToYoung, rememberBB, contBB, MDB.createBranchWeights(1, 2000));
 
-  BUILDER.CreateStore(InitVal, Alloca);
-  SCOPE->NamedValues[Name] = Alloca;
-  return llvm::ConstantPointerNull::get(llvm::Type::getInt8PtrTy(LLVM_CONTEXT));
+  BUILDER.SetInsertPoint(rememberBB);
+  std::string bt_gc_wb_slow_sym("bt_gc_wb_slow");
+  BUILDER.CreateCall(getFunction(bt_gc_wb_slow_sym), Obj);
+  BUILDER.CreateBr(contBB);
+
+  TheFunction->getBasicBlockList().push_back(contBB);
+  BUILDER.SetInsertPoint(contBB);
 }
 
-llvm::Value *VarSetExprAST::codegen() {
-  // VarDef is a alloca inst which will be allocated at entry block, hence here we only return nil
-  // normal scheme code will not rely on the return value of defineVar
-  llvm::Value *Val = Expr->codegen();
-  if (!Val)
-    return LogErrorV("Unknown variable assignment");
+/// CreateSATBBarrier - Inline bt_gc_satb: log the value about to be
+/// overwritten while concurrent marking runs.
+void CreateSATBBarrier(llvm::Value *OldVal) {
+  llvm::MDBuilder MDB(LLVM_CONTEXT);
+  llvm::Function *TheFunction = BUILDER.GetInsertBlock()->getParent();
+  llvm::BasicBlock *logBB = llvm::BasicBlock::Create(LLVM_CONTEXT, "satb", TheFunction);
+  llvm::BasicBlock *contBB = llvm::BasicBlock::Create(LLVM_CONTEXT, "satbcont");
+
+  llvm::Value *Marking = BUILDER.CreateICmpNE(
+      BUILDER.CreateLoad(btgcmarking_var, "marking"),
+      llvm::ConstantInt::get(llvm::Type::getInt8Ty(LLVM_CONTEXT), 0));
+  BUILDER.CreateCondBr(Marking, logBB, contBB, MDB.createBranchWeights(1, 2000));
 
-  llvm::Value *Variable = SCOPE->NamedValues[Name];
-  BUILDER.CreateStore(Val, Variable);
-  return Val;
+  BUILDER.SetInsertPoint(logBB);
+  std::string bt_gc_satb_slow_sym("bt_gc_satb_slow");
+  BUILDER.CreateCall(getFunction(bt_gc_satb_slow_sym), OldVal);
+  BUILDER.CreateBr(contBB);
+
+  TheFunction->getBasicBlockList().push_back(contBB);
+  BUILDER.SetInsertPoint(contBB);
 }
 
-llvm::Value *UnaryExprAST::codegen() {
-  llvm::Value *R = RHS->codegen();
-  if (!R)
-    return LogErrorV("Unknown RHS.");
-  std::string bt_binary_int64_sym("bt_binary_int64");
-  std::string bt_box_sym("bt_box");
-  std::string bt_unbox_sym("bt_unbox");
-  llvm::Function *binOpInt64 = getFunction(bt_binary_int64_sym);
-  llvm::Function *box = getFunction(bt_box_sym);
-  llvm::Function *unbox = getFunction(bt_unbox_sym);
-  std::vector<llvm::Value *> ArgsV;
+/// CreateIsCons - Inline bt_is_cons. The cons space never moves either.
+llvm::Value *CreateIsCons(llvm::Value *V) {
+  llvm::Type *T_int64 = llvm::Type::getInt64Ty(LLVM_CONTEXT);
+  llvm::Value *bits = BUILDER.CreatePtrToInt(V, T_int64, "consbits");
+  llvm::Value *tagOk = BUILDER.CreateICmpEQ(
+      BUILDER.CreateAnd(bits, llvm::ConstantInt::get(T_int64, BT_TAG_MASK)),
+      llvm::ConstantInt::get(T_int64, 0));
+  llvm::Value *Offset = BUILDER.CreateSub(
+      bits, llvm::ConstantInt::get(T_int64, (uint64_t) (uintptr_t) bt_cons_space.start), "consoff");
+  llvm::Value *inSpace = BUILDER.CreateICmpULT(Offset, llvm::ConstantInt::get(T_int64, BT_CONS_SPACE_SIZE));
+  return BUILDER.CreateAnd(tagOk, inSpace, "iscons");
+}
 
-  switch (Op) {
-  case tok_not:
-    ArgsV.push_back( llvm::ConstantInt::get(LLVM_CONTEXT, llvm::APInt(32, Op, true)) );
-    ArgsV.push_back( R );
-    ArgsV.push_back( R );
-    return BUILDER.CreateCall(binOpInt64, ArgsV, "boptmp");
-  case tok_box:
-    ArgsV.push_back( R );
-    return BUILDER.CreateCall(box, ArgsV, "boxtmp");
-  case tok_unbox:
-    ArgsV.push_back( R );
-    return BUILDER.CreateCall(unbox, ArgsV, "unboxtmp");
-  default:
-    return LogErrorV("invalid binary operator or not implemented yet.");
+/// CreateIsObject - V points to a heap object with a header: not an
+/// immediate, not nil and not a pair.
+llvm::Value *CreateIsObject(llvm::Value *V) {
+  llvm::Type *T_int64 = llvm::Type::getInt64Ty(LLVM_CONTEXT);
+  llvm::Value *bits = BUILDER.CreatePtrToInt(V, T_int64, "objbits");
+  llvm::Value *tagOk = BUILDER.CreateICmpEQ(
+      BUILDER.CreateAnd(bits, llvm::ConstantInt::get(T_int64, BT_TAG_MASK)),
+      llvm::ConstantInt::get(T_int64, 0));
+  llvm::Value *isPtr = BUILDER.CreateAnd(
+      tagOk, BUILDER.CreateICmpNE(bits, llvm::ConstantInt::get(T_int64, 0)), "isptr");
+  // pairs have no header to look at
+  return BUILDER.CreateAnd(isPtr, BUILDER.CreateNot(CreateIsCons(V)), "isobj");
+}
+
+/// CreateRawPointer - A pointer to memory of the runtime, which never moves,
+/// as a constant of the code.
+static llvm::Constant *CreateRawPointer(void *P, llvm::Type *Ty) {
+  llvm::Constant *bits =
+      llvm::ConstantInt::get(llvm::Type::getInt64Ty(LLVM_CONTEXT), (uint64_t) (uintptr_t) P);
+  return llvm::ConstantExpr::getIntToPtr(bits, llvm::PointerType::get(Ty, 0));
+}
+
+/// getFeedbackSite - The Words feedback words of the next site of the
+/// current function, nullptr when the function is not tiered.
+static uint64_t *getFeedbackSite(unsigned Words) {
+  if (!SCOPE->Info)
+    return nullptr;
+  auto &Sites = *SCOPE->Feedback;
+  unsigned Site = SCOPE->NextSite++;
+  if (Site == Sites.size())
+    Sites.emplace_back(new uint64_t[Words]());
+  return Sites[Site].get();
+}
+
+/// CreateRecordFeedback - Profiling tier: or Bits into feedback word Word.
+static void CreateRecordFeedback(uint64_t *Word, llvm::Value *Bits) {
+  llvm::Value *P = CreateRawPointer(Word, llvm::Type::getInt64Ty(LLVM_CONTEXT));
+  BUILDER.CreateStore(BUILDER.CreateOr(BUILDER.CreateLoad(P, "seen"), Bits), P);
+}
+
+static void CreateRecordFeedback(uint64_t *Word, uint64_t Bits) {
+  CreateRecordFeedback(Word, llvm::ConstantInt::get(llvm::Type::getInt64Ty(LLVM_CONTEXT), Bits));
+}
+
+/// CreateCountFeedback - Profiling tier: count an event in feedback word
+/// Word.
+static void CreateCountFeedback(uint64_t *Word) {
+  llvm::Value *P = CreateRawPointer(Word, llvm::Type::getInt64Ty(LLVM_CONTEXT));
+  BUILDER.CreateStore(BUILDER.CreateAdd(BUILDER.CreateLoad(P, "count"),
+                                        llvm::ConstantInt::get(llvm::Type::getInt64Ty(LLVM_CONTEXT), 1)), P);
+}
+
+/// CreateDeopt - Optimized tier: the guard of Site failed on a case that
+/// feedback bits Seen describe, see bt_deopt. The caller goes on with the
+/// generic code of the site.
+static void CreateDeopt(uint64_t *Site, uint64_t Seen) {
+  llvm::Type *T_int64 = llvm::Type::getInt64Ty(LLVM_CONTEXT);
+  std::string bt_deopt_sym("bt_deopt");
+  BUILDER.CreateCall(getFunction(bt_deopt_sym),
+                     { CreateRawPointer(SCOPE->Info, llvm::Type::getInt8Ty(LLVM_CONTEXT)),
+                       CreateRawPointer(Site, T_int64), llvm::ConstantInt::get(T_int64, Seen) });
+}
+
+/// CreateBackedgeCount - Profiling tier: count a self tail call and have the
+/// function optimized once it loops a lot. The running call goes on in the
+/// profiling tier.
+static void CreateBackedgeCount(bt_function_info_t *Info) {
+  llvm::Type *T_int64 = llvm::Type::getInt64Ty(LLVM_CONTEXT);
+  llvm::Function *TheFunction = SCOPE->TheFunction;
+  llvm::BasicBlock *tierUpBB = llvm::BasicBlock::Create(LLVM_CONTEXT, "looptierup", TheFunction);
+  llvm::BasicBlock *loopBB = llvm::BasicBlock::Create(LLVM_CONTEXT, "loop");
+
+  llvm::Value *Backedges = CreateRawPointer(&Info->backedges, T_int64);
+  llvm::Value *N = BUILDER.CreateAdd(BUILDER.CreateLoad(Backedges, "backedges"), llvm::ConstantInt::get(T_int64, 1));
+  BUILDER.CreateStore(N, Backedges);
+  BUILDER.CreateCondBr(BUILDER.CreateICmpEQ(N, llvm::ConstantInt::get(T_int64, bt_tier_up_backedges)),
+                       tierUpBB, loopBB, llvm::MDBuilder(LLVM_CONTEXT).createBranchWeights(1, 2000));
+
+  BUILDER.SetInsertPoint(tierUpBB);
+  std::string bt_tier_up_sym("bt_tier_up");
+  BUILDER.CreateCall(getFunction(bt_tier_up_sym),
+                     { CreateRawPointer(Info, llvm::Type::getInt8Ty(LLVM_CONTEXT)) });
+  BUILDER.CreateBr(loopBB);
+
+  TheFunction->getBasicBlockList().push_back(loopBB);
+  BUILDER.SetInsertPoint(loopBB);
+}
+
+/// CreateCons - Allocate a full pair inline. Its initializing stores need no
+/// barrier, the collector scans the pairs allocated since the last minor
+/// collection.
+llvm::Value *CreateCons(llvm::Value *Car, llvm::Value *Cdr) {
+  llvm::PointerType *T_pvalue = getValueTy();
+  GCRoot RootCar(Car), RootCdr(Cdr);
+  llvm::Value *Cell = CreateConsAlloc(2);
+  llvm::Value *Words = BUILDER.CreateBitCast(Cell, llvm::PointerType::get(T_pvalue, T_pvalue->getAddressSpace()));
+  BUILDER.CreateStore(RootCar.get(), BUILDER.CreateConstGEP1_32(Words, 0));
+  BUILDER.CreateStore(RootCdr.get(), BUILDER.CreateConstGEP1_32(Words, 1));
+  return Cell;
+}
+
+/// CreateCarCdr - Inline car (IsCdr false) or cdr of V. For cdr the cdr code
+/// of the cell is read from its block: a full pair has the cdr in the next
+/// word, a cdr-coded cell is followed by the rest of its list or ends it.
+/// Anything but a pair goes to the runtime, which reports the error.
+llvm::Value *CreateCarCdr(llvm::Value *V, bool IsCdr) {
+  llvm::Type *T_int64 = llvm::Type::getInt64Ty(LLVM_CONTEXT);
+  llvm::PointerType *T_pvalue = getValueTy();
+  llvm::MDBuilder MDB(LLVM_CONTEXT);
+
+  llvm::Function *TheFunction = BUILDER.GetInsertBlock()->getParent();
+  llvm::BasicBlock *fastBB = llvm::BasicBlock::Create(LLVM_CONTEXT, IsCdr ? "cdr.fast" : "car.fast", TheFunction);
+  llvm::BasicBlock *slowBB = llvm::BasicBlock::Create(LLVM_CONTEXT, IsCdr ? "cdr.slow" : "car.slow");
+  llvm::BasicBlock *mergeBB = llvm::BasicBlock::Create(LLVM_CONTEXT, IsCdr ? "cdr.cont" : "car.cont");
+  BUILDER.CreateCondBr(CreateIsCons(V), fastBB, slowBB, MDB.createBranchWeights(2000, 1));
+
+  BUILDER.SetInsertPoint(fastBB);
+  llvm::Value *Words = BUILDER.CreateBitCast(V, llvm::PointerType::get(T_pvalue, T_pvalue->getAddressSpace()));
+  llvm::Value *FastV = nullptr;
+  if (!IsCdr) {
+    FastV = BUILDER.CreateLoad(BUILDER.CreateConstGEP1_32(Words, 0), "car");
+  } else {
+    llvm::BasicBlock *fullBB = llvm::BasicBlock::Create(LLVM_CONTEXT, "cdr.full");
+    llvm::BasicBlock *codedBB = llvm::BasicBlock::Create(LLVM_CONTEXT, "cdr.coded");
+    llvm::BasicBlock *doneBB = llvm::BasicBlock::Create(LLVM_CONTEXT, "cdr.done");
+
+    // the side tables are raw memory, reach them through an integer
+    llvm::Value *bits = BUILDER.CreatePtrToInt(V, T_int64, "cellbits");
+    llvm::Value *Block = BUILDER.CreateAnd(bits, ~(uint64_t) (BT_BLOCK_SIZE - 1), "block");
+    llvm::Value *Word = BUILDER.CreateLShr(BUILDER.CreateSub(bits, Block), 3, "word");
+    llvm::Value *CodesAddr = BUILDER.CreateAdd(
+        BUILDER.CreateAdd(Block, llvm::ConstantInt::get(T_int64, offsetof(bt_cons_block_t, codes))),
+        BUILDER.CreateShl(BUILDER.CreateLShr(Word, 5), 3));
+    llvm::Value *Codes = BUILDER.CreateLoad(
+        BUILDER.CreateIntToPtr(CodesAddr, llvm::PointerType::get(T_int64, 0)), "codes");
+    llvm::Value *Code = BUILDER.CreateAnd(
+        BUILDER.CreateLShr(Codes, BUILDER.CreateShl(BUILDER.CreateAnd(Word, 31), 1)), 3, "cdrcode");
+    llvm::Value *IsFull = BUILDER.CreateICmpEQ(Code, llvm::ConstantInt::get(T_int64, BT_CDR_FULL));
+    BUILDER.CreateCondBr(IsFull, fullBB, codedBB);
+
+    TheFunction->getBasicBlockList().push_back(fullBB);
+    BUILDER.SetInsertPoint(fullBB);
+    llvm::Value *FullV = BUILDER.CreateLoad(BUILDER.CreateConstGEP1_32(Words, 1), "cdr");
+    BUILDER.CreateBr(doneBB);
+
+    TheFunction->getBasicBlockList().push_back(codedBB);
+    BUILDER.SetInsertPoint(codedBB);
+    llvm::Value *NextV = BUILDER.CreateBitCast(BUILDER.CreateConstGEP1_32(Words, 1), T_pvalue);
+    llvm::Value *CodedV = BUILDER.CreateSelect(
+        BUILDER.CreateICmpEQ(Code, llvm::ConstantInt::get(T_int64, BT_CDR_NEXT)),
+        NextV, CreateTaggedConstant(bt_nil), "codedcdr");
+    BUILDER.CreateBr(doneBB);
+
+    TheFunction->getBasicBlockList().push_back(doneBB);
+    BUILDER.SetInsertPoint(doneBB);
+    llvm::PHINode *CdrPN = BUILDER.CreatePHI(T_pvalue, 2, "cdr");
+    CdrPN->addIncoming(FullV, fullBB);
+    CdrPN->addIncoming(CodedV, codedBB);
+    FastV = CdrPN;
   }
+  fastBB = BUILDER.GetInsertBlock();
+  BUILDER.CreateBr(mergeBB);
+
+  TheFunction->getBasicBlockList().push_back(slowBB);
+  BUILDER.SetInsertPoint(slowBB);
+  std::string sym(IsCdr ? "bt_cdr" : "bt_car");
+  llvm::Value *SlowV = BUILDER.CreateCall(getFunction(sym), V, IsCdr ? "cdrtmp" : "cartmp");
+  BUILDER.CreateBr(mergeBB);
+
+  TheFunction->getBasicBlockList().push_back(mergeBB);
+  BUILDER.SetInsertPoint(mergeBB);
+  llvm::PHINode *PN = BUILDER.CreatePHI(T_pvalue, 2, IsCdr ? "cdrtmp" : "cartmp");
+  PN->addIncoming(FastV, fastBB);
+  PN->addIncoming(SlowV, slowBB);
+  return PN;
 }
 
-llvm::Value *BinaryExprAST::codegen() {
-  llvm::Value *L = LHS->codegen();
-  llvm::Value *R = RHS->codegen();
-  if (!L || !R)
-    return LogErrorV("Unknown LHS or RHS.");
-  std::string bt_binary_int64_sym("bt_binary_int64");
+/// CreateHashKey - Inline bt_hash_key: immediates and symbols are hashed
+/// from their bits right here, only strings call the runtime to hash their
+/// contents. Keys that cannot be hashed get some hash too, bt_hash_ref and
+/// bt_hash_set reject them.
+llvm::Value *CreateHashKey(llvm::Value *Key) {
+  llvm::Type *T_int32 = llvm::Type::getInt32Ty(LLVM_CONTEXT);
+  llvm::Type *T_int64 = llvm::Type::getInt64Ty(LLVM_CONTEXT);
+  llvm::MDBuilder MDB(LLVM_CONTEXT);
+
+  llvm::Function *TheFunction = BUILDER.GetInsertBlock()->getParent();
+  llvm::BasicBlock *checkBB = llvm::BasicBlock::Create(LLVM_CONTEXT, "hash.isstr", TheFunction);
+  llvm::BasicBlock *strBB = llvm::BasicBlock::Create(LLVM_CONTEXT, "hash.str");
+  llvm::BasicBlock *wordBB = llvm::BasicBlock::Create(LLVM_CONTEXT, "hash.word");
+  llvm::BasicBlock *mergeBB = llvm::BasicBlock::Create(LLVM_CONTEXT, "hash.cont");
+
+  llvm::Value *bits = BUILDER.CreatePtrToInt(Key, T_int64, "keybits");
+  BUILDER.CreateCondBr(CreateIsObject(Key), checkBB, wordBB);
+
+  BUILDER.SetInsertPoint(checkBB);
+  llvm::Value *Hdr = BUILDER.CreateBitCast(Key, llvm::PointerType::get(T_int32, getValueTy()->getAddressSpace()));
+  llvm::Value *Type = BUILDER.CreateLoad(Hdr, "type");
+  llvm::Value *isStr = BUILDER.CreateOr(
+      BUILDER.CreateICmpEQ(Type, llvm::ConstantInt::get(T_int32, StrTy)),
+      BUILDER.CreateICmpEQ(Type, llvm::ConstantInt::get(T_int32, StrSliceTy)), "isstr");
+  BUILDER.CreateCondBr(isStr, strBB, wordBB, MDB.createBranchWeights(1, 1));
+
+  TheFunction->getBasicBlockList().push_back(strBB);
+  BUILDER.SetInsertPoint(strBB);
+  std::string bt_hash_string_sym("bt_hash_string");
+  llvm::Value *StrHash = BUILDER.CreateCall(getFunction(bt_hash_string_sym), { Key }, "strhash");
+  BUILDER.CreateBr(mergeBB);
+
+  // bt_hash_word
+  TheFunction->getBasicBlockList().push_back(wordBB);
+  BUILDER.SetInsertPoint(wordBB);
+  llvm::Value *H = BUILDER.CreateMul(bits, llvm::ConstantInt::get(T_int64, BT_HASH_MUL));
+  llvm::Value *WordHash = BUILDER.CreateXor(H, BUILDER.CreateLShr(H, 32), "wordhash");
+  BUILDER.CreateBr(mergeBB);
+
+  TheFunction->getBasicBlockList().push_back(mergeBB);
+  BUILDER.SetInsertPoint(mergeBB);
+  llvm::PHINode *PN = BUILDER.CreatePHI(T_int64, 2, "hash");
+  PN->addIncoming(StrHash, strBB);
+  PN->addIncoming(WordHash, wordBB);
+  return PN;
+}
+
+/// CreateSetBox - Inline bt_set_box: check that Box really is a box, swap
+/// its content and apply the write barriers. Anything else goes to the
+/// runtime, which reports the error.
+llvm::Value *CreateSetBox(llvm::Value *Box, llvm::Value *V) {
+  llvm::Type *T_int32 = llvm::Type::getInt32Ty(LLVM_CONTEXT);
+  llvm::Type *T_int64 = llvm::Type::getInt64Ty(LLVM_CONTEXT);
+  llvm::Type *T_pvalue = getValueTy();
+  llvm::MDBuilder MDB(LLVM_CONTEXT);
+
+  llvm::Function *TheFunction = BUILDER.GetInsertBlock()->getParent();
+  llvm::BasicBlock *checkBB = llvm::BasicBlock::Create(LLVM_CONTEXT, "isbox", TheFunction);
+  llvm::BasicBlock *fastBB = llvm::BasicBlock::Create(LLVM_CONTEXT, "setbox.fast");
+  llvm::BasicBlock *slowBB = llvm::BasicBlock::Create(LLVM_CONTEXT, "setbox.slow");
+  llvm::BasicBlock *mergeBB = llvm::BasicBlock::Create(LLVM_CONTEXT, "setbox.cont");
+
+  llvm::Value *bits = BUILDER.CreatePtrToInt(Box, T_int64, "boxbits");
+  llvm::Value *tagOk = BUILDER.CreateICmpEQ(
+      BUILDER.CreateAnd(bits, llvm::ConstantInt::get(T_int64, BT_TAG_MASK)),
+      llvm::ConstantInt::get(T_int64, 0));
+  llvm::Value *isPtr = BUILDER.CreateAnd(
+      tagOk, BUILDER.CreateICmpNE(bits, llvm::ConstantInt::get(T_int64, 0)), "isptr");
+  // pairs have no header to look at
+  isPtr = BUILDER.CreateAnd(isPtr, BUILDER.CreateNot(CreateIsCons(Box)));
+  BUILDER.CreateCondBr(isPtr, checkBB, slowBB, MDB.createBranchWeights(2000, 1));
+
+  BUILDER.SetInsertPoint(checkBB);
+  llvm::Value *Hdr = BUILDER.CreateBitCast(Box, llvm::PointerType::get(T_int32, getValueTy()->getAddressSpace()));
+  llvm::Value *isBox = BUILDER.CreateICmpEQ(BUILDER.CreateLoad(Hdr, "type"),
+                                            llvm::ConstantInt::get(T_int32, BoxTy));
+  BUILDER.CreateCondBr(isBox, fastBB, slowBB, MDB.createBranchWeights(2000, 1));
+
+  TheFunction->getBasicBlockList().push_back(fastBB);
+  BUILDER.SetInsertPoint(fastBB);
+  llvm::Value *Field = CreateFieldAddr(Box, 0);
+  llvm::Value *Old = BUILDER.CreateLoad(Field, "oldval");
+  CreateSATBBarrier(Old);
+  BUILDER.CreateStore(V, Field);
+  CreateWriteBarrier(Box, V);
+  fastBB = BUILDER.GetInsertBlock();
+  BUILDER.CreateBr(mergeBB);
+
+  TheFunction->getBasicBlockList().push_back(slowBB);
+  BUILDER.SetInsertPoint(slowBB);
   std::string bt_set_box_sym("bt_set_box");
-  llvm::Function *binOpInt64 = getFunction(bt_binary_int64_sym);
-  llvm::Function *setbox = getFunction(bt_set_box_sym);
   std::vector<llvm::Value *> ArgsV;
+  ArgsV.push_back(Box);
+  ArgsV.push_back(V);
+  llvm::Value *SlowV = BUILDER.CreateCall(getFunction(bt_set_box_sym), ArgsV, "setboxtmp");
+  BUILDER.CreateBr(mergeBB);
 
-  switch (Op) {
-  case tok_add:
-  case tok_sub:
-  case tok_mul:
-  case tok_div:
-  case tok_eq:
-  case tok_gt:
-  case tok_lt:
-  case tok_and:
-  case tok_or:
-    ArgsV.push_back( llvm::ConstantInt::get(LLVM_CONTEXT, llvm::APInt(32, Op, true)) );
-    ArgsV.push_back( L );
-    ArgsV.push_back( R );
-    return BUILDER.CreateCall(binOpInt64, ArgsV, "boptmp");
-  case tok_setbox:
-    ArgsV.push_back( L );
-    ArgsV.push_back( R );
-    return BUILDER.CreateCall(setbox, ArgsV, "setboxtmp");
-  default:
-    return LogErrorV("invalid binary operator or not implemented yet.");
-  }
+  TheFunction->getBasicBlockList().push_back(mergeBB);
+  BUILDER.SetInsertPoint(mergeBB);
+  llvm::PHINode *PN = BUILDER.CreatePHI(T_pvalue, 2, "setboxtmp");
+  PN->addIncoming(Old, fastBB);
+  PN->addIncoming(SlowV, slowBB);
+  return PN;
 }
 
-llvm::Value *IfExprAST::codegen() {
-  // return LogErrorV("IfExprAST::codegen() not implemented yet.");
-  std::string bt_as_bool_sym("bt_as_bool");
-  llvm::Value* cond = Pred->codegen();
-  if (!cond)
-    return LogErrorV("invalid predicate in If.");
-  llvm::Function *test = getFunction(bt_as_bool_sym);
-  std::vector<llvm::Value *> ArgsV;
-  ArgsV.push_back( cond );
-  llvm::Value* pred = BUILDER.CreateCall(test, ArgsV, "predtmp");
+/// CreateFromFlonum - Inline bt_flonum_value: decode the bits of a flonum
+/// into a double.
+llvm::Value *CreateFromFlonum(llvm::Value *Bits) {
+  llvm::Type *T_int64 = llvm::Type::getInt64Ty(LLVM_CONTEXT);
+  llvm::Value *Sign = BUILDER.CreateLShr(Bits, 63);
+  llvm::Value *T = BUILDER.CreateOr(BUILDER.CreateSub(llvm::ConstantInt::get(T_int64, 2), Sign),
+                                    BUILDER.CreateAnd(Bits, ~(uint64_t) BT_FLONUM_MASK));
+  llvm::Value *Raw = BUILDER.CreateOr(BUILDER.CreateLShr(T, 3), BUILDER.CreateShl(T, 61));
+  llvm::Value *IsZero = BUILDER.CreateICmpEQ(Bits, llvm::ConstantInt::get(T_int64, BT_FLONUM_ZERO));
+  Raw = BUILDER.CreateSelect(IsZero, llvm::ConstantInt::get(T_int64, 0), Raw);
+  return BUILDER.CreateBitCast(Raw, llvm::Type::getDoubleTy(LLVM_CONTEXT), "flonum");
+}
 
-  // Convert condition to a bool by comparing equal to 0.
-  pred = BUILDER.CreateICmpNE(
-                  pred, llvm::ConstantInt::get(LLVM_CONTEXT, llvm::APInt(32, 0, true)), "ifcond");
+/// CreateToFlonum - Inline bt_new_float64: encode D as a flonum, only a
+/// double out of the flonum range is boxed by the runtime.
+llvm::Value *CreateToFlonum(llvm::Value *D) {
+  llvm::Type *T_int64 = llvm::Type::getInt64Ty(LLVM_CONTEXT);
+  llvm::MDBuilder MDB(LLVM_CONTEXT);
 
   llvm::Function *TheFunction = BUILDER.GetInsertBlock()->getParent();
-
-  // Create blocks for the then and else cases.  Insert the 'then' block at the
-  // end of the function.
-  llvm::BasicBlock *thenBB = llvm::BasicBlock::Create(LLVM_CONTEXT, "then", TheFunction);
-  llvm::BasicBlock *elseBB = llvm::BasicBlock::Create(LLVM_CONTEXT, "else");
-  llvm::BasicBlock *mergeBB = llvm::BasicBlock::Create(LLVM_CONTEXT, "ifcont");
-
-  BUILDER.CreateCondBr(pred, thenBB, elseBB);
-  // Emit then value.
-  BUILDER.SetInsertPoint(thenBB);
-  llvm::Value *thenV = Then->codegen();
-  if (!thenV)
-    return LogErrorV("invalid then in If.");
+  llvm::BasicBlock *encodeBB = llvm::BasicBlock::Create(LLVM_CONTEXT, "encode", TheFunction);
+  llvm::BasicBlock *boxBB = llvm::BasicBlock::Create(LLVM_CONTEXT, "boxfloat");
+  llvm::BasicBlock *mergeBB = llvm::BasicBlock::Create(LLVM_CONTEXT, "encoded");
+
+  llvm::Value *Raw = BUILDER.CreateBitCast(D, T_int64, "fbits");
+  llvm::Value *Exp3 = BUILDER.CreateAnd(BUILDER.CreateLShr(Raw, 60), 7);
+  llvm::Value *InRange = BUILDER.CreateAnd(
+      BUILDER.CreateICmpULT(BUILDER.CreateSub(Exp3, llvm::ConstantInt::get(T_int64, 3)),
+                            llvm::ConstantInt::get(T_int64, 2)),
+      BUILDER.CreateICmpNE(Raw, llvm::ConstantInt::get(T_int64, 0x3000000000000000)));
+  llvm::Value *IsZero = BUILDER.CreateICmpEQ(Raw, llvm::ConstantInt::get(T_int64, 0));
+  BUILDER.CreateCondBr(BUILDER.CreateOr(InRange, IsZero), encodeBB, boxBB,
+                       MDB.createBranchWeights(2000, 1));
+
+  BUILDER.SetInsertPoint(encodeBB);
+  llvm::Value *Rot = BUILDER.CreateOr(BUILDER.CreateShl(Raw, 3), BUILDER.CreateLShr(Raw, 61));
+  llvm::Value *Enc = BUILDER.CreateOr(BUILDER.CreateAnd(Rot, ~(uint64_t) BT_FLONUM_MASK), BT_FLONUM_TAG);
+  Enc = BUILDER.CreateSelect(IsZero, llvm::ConstantInt::get(T_int64, BT_FLONUM_ZERO), Enc);
+  llvm::Value *EncV = BUILDER.CreateIntToPtr(Enc, getValueTy(), "flotmp");
   BUILDER.CreateBr(mergeBB);
-  // Codegen of 'Then' can change the current block, update ThenBB for the PHI.
-  thenBB = BUILDER.GetInsertBlock();
-
-  // Emit else block.
-  TheFunction->getBasicBlockList().push_back(elseBB);
-  BUILDER.SetInsertPoint(elseBB);
-  llvm::Value *elseV = Else->codegen();
-  if (!elseV)
-    return LogErrorV("invalid else in If.");
+
+  TheFunction->getBasicBlockList().push_back(boxBB);
+  BUILDER.SetInsertPoint(boxBB);
+  llvm::Value *BoxV = BUILDER.CreateCall(getFunction("bt_new_float64"), {D}, "boxtmp");
   BUILDER.CreateBr(mergeBB);
-  // codegen of 'Else' can change the current block, update ElseBB for the PHI.
-  elseBB = BUILDER.GetInsertBlock();  
 
-  // Emit merge block.
   TheFunction->getBasicBlockList().push_back(mergeBB);
   BUILDER.SetInsertPoint(mergeBB);
-  llvm::PHINode *PN =
-    BUILDER.CreatePHI(llvm::Type::getInt8PtrTy(LLVM_CONTEXT), 2, "phi");
-
-  PN->addIncoming(thenV, thenBB);
-  PN->addIncoming(elseV, elseBB);
+  llvm::PHINode *PN = BUILDER.CreatePHI(getValueTy(), 2, "floattmp");
+  PN->addIncoming(EncV, encodeBB);
+  PN->addIncoming(BoxV, boxBB);
   return PN;
 }
 
-llvm::Value *BeginExprAST::codegen() {
-  llvm::Value *ret = nullptr;
-  for (unsigned i = 0, e = Exprs.size(); i != e; ++i) {
-    ret = Exprs[i]->codegen();
-    if (!ret)
-      return LogErrorV("Invalid begin-clause.");
+/// CreateArithOp - Emit a binary arithmetic or comparison operator. When both
+/// operands are fixnums the operation is done inline on the tagged words:
+///   (2a+1) + 2b     = 2(a+b)+1
+///   (2a+1) - 2b     = 2(a-b)+1
+///   2a * b + 1      = 2(ab)+1
+/// and comparisons are monotonic in the tagged representation. When both are
+/// flonums they are decoded and the native fadd/fsub/fmul or fcmp is used.
+/// Anything else (heap numbers, mixed operands, overflow, division) goes
+/// through bt_binary_int64 on a cold slow path.
+llvm::Value *CreateArithOp(token_type Op, llvm::Value *L, llvm::Value *R) {
+  llvm::Type *T_int64 = llvm::Type::getInt64Ty(LLVM_CONTEXT);
+  llvm::Type *T_pvalue = getValueTy();
+  llvm::Constant *One = llvm::ConstantInt::get(T_int64, 1);
+  llvm::MDBuilder MDB(LLVM_CONTEXT);
+  llvm::MDNode *LikelyFast = MDB.createBranchWeights(2000, 1);
+  std::string bt_binary_int64_sym("bt_binary_int64");
+  llvm::Function *binOpInt64 = getFunction(bt_binary_int64_sym);
+  std::vector<llvm::Value *> ArgsV;
+  ArgsV.push_back( llvm::ConstantInt::get(LLVM_CONTEXT, llvm::APInt(32, Op, true)) );
+  ArgsV.push_back( L );
+  ArgsV.push_back( R );
+
+  // no inline fast path (e.g. division), always take the runtime call
+  if (Op != tok_add && Op != tok_sub && Op != tok_mul &&
+      Op != tok_eq && Op != tok_gt && Op != tok_lt)
+    return BUILDER.CreateCall(binOpInt64, ArgsV, "boptmp");
+
+  // The profiling tier records which paths the site takes. The optimized
+  // tier only generates the path the site always took, anything else
+  // deoptimizes on the slow path.
+  uint64_t *Site = getFeedbackSite(BT_FB_ARITH_WORDS);
+  bool Profile = Site && !SCOPE->Speculate;
+  bool Speculate = Site && SCOPE->Speculate && (Site[0] == BT_FB_FIXNUM || Site[0] == BT_FB_FLONUM);
+  bool DoFixnum = !Speculate || Site[0] == BT_FB_FIXNUM;
+  bool DoFlonum = !Speculate || Site[0] == BT_FB_FLONUM;
+
+  llvm::Function *TheFunction = BUILDER.GetInsertBlock()->getParent();
+  llvm::BasicBlock *fastBB = llvm::BasicBlock::Create(LLVM_CONTEXT, "fixnum");
+  llvm::BasicBlock *checkFloatBB = llvm::BasicBlock::Create(LLVM_CONTEXT, "checkflonum");
+  llvm::BasicBlock *floatBB = llvm::BasicBlock::Create(LLVM_CONTEXT, "flonum");
+  llvm::BasicBlock *slowBB = llvm::BasicBlock::Create(LLVM_CONTEXT, "slowpath");
+  llvm::BasicBlock *mergeBB = llvm::BasicBlock::Create(LLVM_CONTEXT, "arithcont");
+
+  llvm::Value *LBits = BUILDER.CreatePtrToInt(L, T_int64, "lbits");
+  llvm::Value *RBits = BUILDER.CreatePtrToInt(R, T_int64, "rbits");
+  llvm::Value *FastV = nullptr;
+  if (DoFixnum) {
+    // both operands are fixnums iff the AND of their low bits is set
+    llvm::Value *Tags = BUILDER.CreateAnd(BUILDER.CreateAnd(LBits, RBits), One, "tags");
+    llvm::Value *BothFixnum = BUILDER.CreateICmpNE(Tags, llvm::ConstantInt::get(T_int64, 0), "isfixnum");
+    BUILDER.CreateCondBr(BothFixnum, fastBB, DoFlonum ? checkFloatBB : slowBB, LikelyFast);
+
+    TheFunction->getBasicBlockList().push_back(fastBB);
+    BUILDER.SetInsertPoint(fastBB);
+    if (Profile)
+      CreateRecordFeedback(Site, BT_FB_FIXNUM);
+    llvm::Intrinsic::ID OvfID = llvm::Intrinsic::not_intrinsic;
+    llvm::Value *OvfL = nullptr, *OvfR = nullptr;
+    switch (Op) {
+    case tok_add:
+      OvfID = llvm::Intrinsic::sadd_with_overflow;
+      OvfL = LBits;
+      OvfR = BUILDER.CreateSub(RBits, One);
+      break;
+    case tok_sub:
+      OvfID = llvm::Intrinsic::ssub_with_overflow;
+      OvfL = LBits;
+      OvfR = BUILDER.CreateSub(RBits, One);
+      break;
+    case tok_mul:
+      OvfID = llvm::Intrinsic::smul_with_overflow;
+      OvfL = BUILDER.CreateSub(LBits, One);
+      OvfR = BUILDER.CreateAShr(RBits, One);
+      break;
+    case tok_eq:
+      FastV = CreateBoolSelect(BUILDER.CreateICmpEQ(LBits, RBits));
+      break;
+    case tok_gt:
+      FastV = CreateBoolSelect(BUILDER.CreateICmpSGT(LBits, RBits));
+      break;
+    case tok_lt:
+      FastV = CreateBoolSelect(BUILDER.CreateICmpSLT(LBits, RBits));
+      break;
+    default:
+      break;
+    }
+
+    if (OvfID != llvm::Intrinsic::not_intrinsic) {
+      llvm::Function *OvfF = llvm::Intrinsic::getDeclaration(MODULE.get(), OvfID, T_int64);
+      llvm::Value *Res = BUILDER.CreateCall(OvfF, {OvfL, OvfR}, "ovftmp");
+      llvm::Value *Bits = BUILDER.CreateExtractValue(Res, 0, "resbits");
+      llvm::Value *Ovf = BUILDER.CreateExtractValue(Res, 1, "overflow");
+      if (Op == tok_mul)
+        Bits = BUILDER.CreateOr(Bits, One);
+      FastV = BUILDER.CreateIntToPtr(Bits, T_pvalue, "fixtmp");
+      llvm::BasicBlock *noOvfBB = llvm::BasicBlock::Create(LLVM_CONTEXT, "noovf", TheFunction);
+      BUILDER.CreateCondBr(Ovf, slowBB, noOvfBB, MDB.createBranchWeights(1, 2000));
+      BUILDER.SetInsertPoint(noOvfBB);
+    }
+    BUILDER.CreateBr(mergeBB);
+    fastBB = BUILDER.GetInsertBlock();
+  } else {
+    BUILDER.CreateBr(checkFloatBB);
+  }
+
+  llvm::Value *FloatV = nullptr;
+  if (DoFlonum) {
+    // both operands are flonums iff both have the flonum tag
+    TheFunction->getBasicBlockList().push_back(checkFloatBB);
+    BUILDER.SetInsertPoint(checkFloatBB);
+    llvm::Constant *FlonumMask = llvm::ConstantInt::get(T_int64, BT_FLONUM_MASK);
+    llvm::Constant *FlonumTag = llvm::ConstantInt::get(T_int64, BT_FLONUM_TAG);
+    llvm::Value *BothFlonum = BUILDER.CreateAnd(
+        BUILDER.CreateICmpEQ(BUILDER.CreateAnd(LBits, FlonumMask), FlonumTag),
+        BUILDER.CreateICmpEQ(BUILDER.CreateAnd(RBits, FlonumMask), FlonumTag), "isflonum");
+    BUILDER.CreateCondBr(BothFlonum, floatBB, slowBB, LikelyFast);
+
+    TheFunction->getBasicBlockList().push_back(floatBB);
+    BUILDER.SetInsertPoint(floatBB);
+    if (Profile)
+      CreateRecordFeedback(Site, BT_FB_FLONUM);
+    llvm::Value *LD = CreateFromFlonum(LBits);
+    llvm::Value *RD = CreateFromFlonum(RBits);
+    switch (Op) {
+    case tok_add:
+      FloatV = CreateToFlonum(BUILDER.CreateFAdd(LD, RD, "faddtmp"));
+      break;
+    case tok_sub:
+      FloatV = CreateToFlonum(BUILDER.CreateFSub(LD, RD, "fsubtmp"));
+      break;
+    case tok_mul:
+      FloatV = CreateToFlonum(BUILDER.CreateFMul(LD, RD, "fmultmp"));
+      break;
+    case tok_eq:
+      FloatV = CreateBoolSelect(BUILDER.CreateFCmpOEQ(LD, RD));
+      break;
+    case tok_gt:
+      FloatV = CreateBoolSelect(BUILDER.CreateFCmpOGT(LD, RD));
+      break;
+    case tok_lt:
+      FloatV = CreateBoolSelect(BUILDER.CreateFCmpOLT(LD, RD));
+      break;
+    default:
+      break;
+    }
+    BUILDER.CreateBr(mergeBB);
+    floatBB = BUILDER.GetInsertBlock();
+  } else {
+    delete checkFloatBB;
+    delete floatBB;
   }
 
-  if (!ret) return LogErrorV("empty begin-clause.");
-  return ret;
+  // Emit the cold runtime call.
+  TheFunction->getBasicBlockList().push_back(slowBB);
+  BUILDER.SetInsertPoint(slowBB);
+  if (Profile)
+    CreateRecordFeedback(Site, BT_FB_OTHER);
+  if (Speculate)
+    CreateDeopt(Site, BT_FB_OTHER);
+  llvm::Value *SlowV = BUILDER.CreateCall(binOpInt64, ArgsV, "boptmp");
+  BUILDER.CreateBr(mergeBB);
+
+  TheFunction->getBasicBlockList().push_back(mergeBB);
+  BUILDER.SetInsertPoint(mergeBB);
+  llvm::PHINode *PN = BUILDER.CreatePHI(T_pvalue, 3, "arithtmp");
+  if (DoFixnum)
+    PN->addIncoming(FastV, fastBB);
+  else
+    delete fastBB;
+  if (DoFlonum)
+    PN->addIncoming(FloatV, floatBB);
+  PN->addIncoming(SlowV, slowBB);
+  return PN;
 }
 
-llvm::Value *ClosureExprAST::codegen() {
-  llvm::Function *CallbackF = getFunction(Callback);
-  std::string bt_closure_sym("bt_closure");
-  std::vector<llvm::Value *> ArgsV;
+/// CreatePopGCFrame - Unlink the gc frame of the current function from the
+/// shadow stack, right before the function returns or tail calls.
+static void CreatePopGCFrame() {
+  if (bt_gc_statepoints)
+    return;
+  llvm::Type *T_ppvalue = llvm::PointerType::get(getValueTy(), 0);
+  llvm::Value *gcpop = BUILDER.CreateConstGEP1_32(gcframe, 1);
+  BUILDER.CreateStore(BUILDER.CreateBitCast(BUILDER.CreateLoad(gcpop, false), T_ppvalue),
+                      btpgcstack_var);
+}
 
-  llvm::Value *FP = BUILDER.CreateBitCast(CallbackF, llvm::Type::getInt8PtrTy(LLVM_CONTEXT), "fptr");
-  int n = Members.size();
-
-  llvm::ArrayType *AT = llvm::ArrayType::get(llvm::Type::getInt8PtrTy(LLVM_CONTEXT), n);
-  llvm::Value *Mems = BUILDER.CreateAlloca(AT);
-  // Mems->dump();
-  for (int i = 0; i < n; i++) {
-    llvm::Value *Ms[] = { llvm::ConstantInt::get(LLVM_CONTEXT, llvm::APInt(32, 0, true)), 
-                          llvm::ConstantInt::get(LLVM_CONTEXT, llvm::APInt(32, i, true)) };
-    llvm::ArrayRef<llvm::Value *> Ma(Ms);
-    auto VI = BUILDER.CreateGEP(Mems, Ma);
-    llvm::Value *V = Members[i]->codegen();
-    if (!V)
-      return LogErrorV("Unknown closure member referenced");
-    BUILDER.CreateStore(V, VI);
-  }
-
-  // call bt_closure
-  llvm::Function *Closure = getFunction(bt_closure_sym);
-  ArgsV.push_back(FP);
-  ArgsV.push_back(llvm::ConstantInt::get(LLVM_CONTEXT, llvm::APInt(32, n, true)));
-  llvm::Value *BI[] = { llvm::ConstantInt::get(LLVM_CONTEXT, llvm::APInt(32, 0, true)), 
-                        llvm::ConstantInt::get(LLVM_CONTEXT, llvm::APInt(32, 0, true)) };
-  auto MBI = BUILDER.CreateGEP(Mems, BI);
-  MBI->dump();
-  ArgsV.push_back(MBI);
-  return BUILDER.CreateCall(Closure, ArgsV, "clos");
-}
-
-llvm::Value *GetFieldExprAST::codegen() {
-  std::string bt_getfield_sym("bt_getfield");
-  std::vector<llvm::Value *> ArgsV;
+/// CreateTailCall - Call FP and return its result. The gc frame is popped
+/// before the call, the arguments are already loaded and the callee roots
+/// them before anything may collect. When the callee has the type of the
+/// caller the call is musttail and the stack does not grow, otherwise it is
+/// only a hint. A statepoint cannot be a guaranteed tail call, so in
+/// statepoint mode it is always a hint.
+static void CreateTailCall(llvm::Value *FP, std::vector<llvm::Value *> &ArgsV) {
+  CreatePopGCFrame();
+  llvm::CallInst *Call = BUILDER.CreateCall(FP, ArgsV, "tailtmp");
+  if (!bt_gc_statepoints && Call->getFunctionType() == SCOPE->TheFunction->getFunctionType())
+    Call->setTailCallKind(llvm::CallInst::TCK_MustTail);
+  else
+    Call->setTailCall();
+  BUILDER.CreateRet(Call);
+}
 
-  // call bt_getfield
-  llvm::Value *CG_Object = Object->codegen();
-  llvm::Function *GetField = getFunction(bt_getfield_sym);
-  ArgsV.push_back(CG_Object);
-  ArgsV.push_back(llvm::ConstantInt::get(LLVM_CONTEXT, llvm::APInt(32, Index, true)));
-  return BUILDER.CreateCall(GetField, ArgsV, "getfieldtmp");
+/// CreateLoadType - The type in the header of heap object Obj.
+static llvm::Value *CreateLoadType(llvm::Value *Obj) {
+  llvm::Type *T_int32 = llvm::Type::getInt32Ty(LLVM_CONTEXT);
+  return BUILDER.CreateLoad(
+      BUILDER.CreateBitCast(Obj, llvm::PointerType::get(T_int32, getValueTy()->getAddressSpace())), "type");
 }
 
-llvm::Value *CallExprAST::codegen() {
-  // Look up the name in the global module table.
-  std::string bt_get_callable_sym("bt_get_callable");
-  std::string bt_typeof_sym("bt_typeof");
+/// CreateLoadCode - The code pointer of a function reference or a closure,
+/// as an integer.
+static llvm::Value *CreateLoadCode(llvm::Value *Callable) {
+  llvm::Type *T_int64 = llvm::Type::getInt64Ty(LLVM_CONTEXT);
+  return BUILDER.CreateLoad(
+      BUILDER.CreateBitCast(CreateFieldAddr(Callable, 0),
+                            llvm::PointerType::get(T_int64, getValueTy()->getAddressSpace())), "code");
+}
+
+/// CreateCallDispatch - Dispatch on the callee of an indirect call. The
+/// inline cache of the site (see bt_ic_t) comes first: a callee that is one
+/// of its entries goes on to fptrBB or closBB with the cached code, after a
+/// single compare that does not look into the callee. Any other function
+/// reference or closure is found by its type and goes on the same way with
+/// its own code, after bt_ic_miss caches it and, in the profiling tier, also
+/// records it in the feedback ways Site. Anything else is a runtime error.
+/// fptrBB and closBB are inserted with the phi of their code pointer,
+/// FptrCode and ClosCode.
+static void CreateCallDispatch(llvm::Value *Callable, uint64_t *Site, llvm::BasicBlock *fptrBB,
+                               llvm::BasicBlock *closBB, llvm::Value *&FptrCode, llvm::Value *&ClosCode) {
+  llvm::IntegerType *T_int32 = llvm::Type::getInt32Ty(LLVM_CONTEXT);
+  llvm::Type *T_int64 = llvm::Type::getInt64Ty(LLVM_CONTEXT);
+  llvm::MDNode *Likely = llvm::MDBuilder(LLVM_CONTEXT).createBranchWeights(2000, 1);
+  bt_ic_t *IC = bt_ic_new();
+
+  llvm::Function *TheFunction = BUILDER.GetInsertBlock()->getParent();
+  llvm::BasicBlock *callBB[2] = { fptrBB, closBB };
+  llvm::BasicBlock *hitBB[2], *missBB[2];
+  llvm::Value *HitCode[2];
+  llvm::BasicBlock *dispatchBB = llvm::BasicBlock::Create(LLVM_CONTEXT, "call.dispatch");
+  llvm::Value *Bits = BUILDER.CreatePtrToInt(Callable, T_int64, "calleebits");
+  for (int kind = 0; kind < 2; kind++) {
+    hitBB[kind] = llvm::BasicBlock::Create(LLVM_CONTEXT, "ic.hit", TheFunction);
+    llvm::BasicBlock *nextBB = kind == 0 ? llvm::BasicBlock::Create(LLVM_CONTEXT, "ic.next", TheFunction)
+                                         : dispatchBB;
+    llvm::Value *Cached = BUILDER.CreateLoad(CreateRawPointer(&IC->callee[kind], T_int64), "cached");
+    BUILDER.CreateCondBr(BUILDER.CreateICmpEQ(Bits, Cached, "ichit"), hitBB[kind], nextBB, Likely);
+
+    BUILDER.SetInsertPoint(hitBB[kind]);
+    HitCode[kind] = BUILDER.CreateLoad(CreateRawPointer(&IC->code[kind], T_int64), "cachedcode");
+    BUILDER.CreateBr(callBB[kind]);
+    BUILDER.SetInsertPoint(nextBB);
+  }
+
+  llvm::BasicBlock *typeBB = llvm::BasicBlock::Create(LLVM_CONTEXT, "call.type");
+  llvm::BasicBlock *errorBB = llvm::BasicBlock::Create(LLVM_CONTEXT, "call.error");
+  TheFunction->getBasicBlockList().push_back(dispatchBB);
+  BUILDER.SetInsertPoint(dispatchBB);
+  BUILDER.CreateCondBr(CreateIsObject(Callable), typeBB, errorBB, Likely);
+
+  TheFunction->getBasicBlockList().push_back(typeBB);
+  BUILDER.SetInsertPoint(typeBB);
+  llvm::Value *Type = CreateLoadType(Callable);
+  llvm::Value *Code = CreateLoadCode(Callable);
+  missBB[0] = llvm::BasicBlock::Create(LLVM_CONTEXT, "ic.miss", TheFunction);
+  missBB[1] = llvm::BasicBlock::Create(LLVM_CONTEXT, "ic.miss", TheFunction);
+  llvm::SwitchInst *Switch = BUILDER.CreateSwitch(Type, errorBB, 2);
+  Switch->addCase(llvm::ConstantInt::get(T_int32, FunctionRefTy), missBB[0]);
+  Switch->addCase(llvm::ConstantInt::get(T_int32, ClosureTy), missBB[1]);
+
+  std::string bt_ic_miss_sym("bt_ic_miss");
+  llvm::Value *Ways = Site && !SCOPE->Speculate
+                          ? (llvm::Value *) CreateRawPointer(Site, T_int64)
+                          : llvm::ConstantPointerNull::get(llvm::PointerType::get(T_int64, 0));
+  for (int kind = 0; kind < 2; kind++) {
+    BUILDER.SetInsertPoint(missBB[kind]);
+    BUILDER.CreateCall(getFunction(bt_ic_miss_sym), { CreateRawPointer(IC, T_int64), Ways, Callable });
+    BUILDER.CreateBr(callBB[kind]);
+  }
+
+  for (int kind = 0; kind < 2; kind++) {
+    TheFunction->getBasicBlockList().push_back(callBB[kind]);
+    BUILDER.SetInsertPoint(callBB[kind]);
+    llvm::PHINode *PN = BUILDER.CreatePHI(T_int64, 2, "code");
+    PN->addIncoming(HitCode[kind], hitBB[kind]);
+    PN->addIncoming(Code, missBB[kind]);
+    (kind == 0 ? FptrCode : ClosCode) = PN;
+  }
+
+  // bt_error reports the error and exits
+  TheFunction->getBasicBlockList().push_back(errorBB);
+  BUILDER.SetInsertPoint(errorBB);
   std::string bt_error_sym("bt_error");
-  std::vector<llvm::Value *> ArgsV;
+  BUILDER.CreateCall(getFunction(bt_error_sym));
+  BUILDER.CreateUnreachable();
+}
 
-  bool is_static = false;
-  llvm::Function *CalleeF = getFunction(Symbol_);
-  if (CalleeF) {
-    is_static = true;
+/// LIRLowering - Generates the LLVM IR of a function from its optimized
+/// Lightning IR, right after the gc frame is set up. This is the only code
+/// generator: every function, tier and top level expression that is not
+/// interpreted is compiled from the IR the interpreter runs.
+///
+/// Slots become SSA values. In shadow stack mode a slot that is live across
+/// an instruction that may collect is stored into a root slot of the gc frame
+/// and every use reloads it, the parameters use the slots of the arguments.
+/// A call marked Tail whose value really reaches Ret as is becomes a tail
+/// call, a self tail call jumps back to L0.
+class LIRLowering {
+  const LIRFunction &F;
+  std::vector<llvm::BasicBlock *> Blocks;
+  std::vector<llvm::Value *> Values;   // of every slot
+  std::vector<llvm::Value *> Roots;    // root slot of every slot that needs one
+  std::vector<bool> Aliased;           // the root is the slot of a variable
+  std::vector<llvm::Value *> VarSlots; // of every variable
+  // the LLVM block that takes every edge of a LIR block, to its target
+  std::vector<std::vector<std::pair<int, llvm::BasicBlock *>>> Edges;
+  bool Returned; // the current block ended with a tail call
+
+  static bool mayCollect(const LIRInst &I);
+  std::vector<int> getBlockOrder();
+  void createRoots();
+  llvm::Value *getValue(int Slot);
+  void setValue(int Slot, llvm::Value *V);
+  void addEdge(int B, int S) { Edges[B].push_back(std::make_pair(S, BUILDER.GetInsertBlock())); }
+  bool isReturned(int B, unsigned Index);
+
+  llvm::Value *lowerConstant(const LIRInst &I);
+  llvm::Value *lowerPrim(const LIRInst &I);
+  llvm::Value *lowerList(const LIRInst &I);
+  llvm::Value *lowerClosure(const LIRInst &I);
+  llvm::Value *lowerCall(const LIRInst &I, bool Tail);
+  llvm::Value *lowerApply(const LIRInst &I, bool Tail);
+  bool lowerInst(int B, unsigned Index);
+  void lowerIf(int B, const LIRInst &I);
+  void addIncoming(const std::vector<int> &Order);
+
+public:
+  LIRLowering(const LIRFunction &F) : F(F), Returned(false) {}
+  // false after reporting an error
+  bool lower();
+};
+
+// what calls into the runtime or JIT code, or allocates inline
+bool LIRLowering::mayCollect(const LIRInst &I) {
+  if (I.isConstant() || I.isTerminator())
+    return false;
+  switch (I.Op) {
+  case lir_vdefine:
+  case lir_vload:
+  case lir_vstore:
+  case lir_eqp:
+  case lir_and:
+  case lir_or:
+  case lir_not:
+  case lir_getfield:
+  case lir_phi:
+    return false;
+  case lir_prim:
+    return I.Imm != tok_unbox && I.Imm != tok_setbox && I.Imm != tok_car && I.Imm != tok_cdr &&
+           I.Imm != tok_nullp && I.Imm != tok_pairp;
+  default:
+    return true;
   }
+}
 
-  if (!is_static) {
-    // if not a static dispatch, then test if it is fptr or closure
-    llvm::Value *V = Callee->codegen();
-    if (!V)
-      return LogErrorV("Unknown function referenced");
-    llvm::Value *Callable = V;
-    // test callable...
-    llvm::Function *getCallable = getFunction(bt_get_callable_sym);
-    ArgsV.push_back(Callable);
-    llvm::Value *maybeFP = BUILDER.CreateCall(getCallable, ArgsV, "callable");
-    ArgsV.clear();
-    
-    llvm::Value *pred = BUILDER.CreateICmpEQ(maybeFP, 
-                                             llvm::ConstantPointerNull::get(llvm::Type::getInt8PtrTy(LLVM_CONTEXT)), "calltest");
-
-    llvm::Function *TheFunction = BUILDER.GetInsertBlock()->getParent();
-    llvm::BasicBlock *badBB = llvm::BasicBlock::Create(LLVM_CONTEXT, "badcall", TheFunction);
-    llvm::BasicBlock *passBB = llvm::BasicBlock::Create(LLVM_CONTEXT, "pass");
-    llvm::BasicBlock *fptrBB = llvm::BasicBlock::Create(LLVM_CONTEXT, "functptr");
-    llvm::BasicBlock *closBB = llvm::BasicBlock::Create(LLVM_CONTEXT, "closure");
-    llvm::BasicBlock *mergeBB = llvm::BasicBlock::Create(LLVM_CONTEXT, "merge");
-
-    BUILDER.CreateCondBr(pred, badBB, passBB);
-    BUILDER.SetInsertPoint(badBB);
-    llvm::Function *error = getFunction(bt_error_sym);
-    BUILDER.CreateCall(error, ArgsV, "error");
-    ArgsV.clear();
-    BUILDER.CreateBr(passBB);
-
-    // Emit pass block.
-    TheFunction->getBasicBlockList().push_back(passBB);
-    BUILDER.SetInsertPoint(passBB);
-    // Now test if it is a functin ptr
-    llvm::Function *typeOf = getFunction(bt_typeof_sym);
-    ArgsV.push_back(Callable);
-    llvm::Value *type = BUILDER.CreateCall(typeOf, ArgsV, "type");
-    ArgsV.clear();
-    llvm::Value *pred2 = BUILDER.CreateICmpEQ(type,
-                                              llvm::ConstantInt::get(LLVM_CONTEXT, llvm::APInt(32, FunctionRefTy, true)), "fptest");
-
-    std::vector<llvm::Value *> ArgValues;
-    for (unsigned i = 0, e = Args.size(); i != e; ++i) {
-      ArgValues.push_back(Args[i]->codegen());
+/// getBlockOrder - The reachable blocks in reverse postorder, where every
+/// block comes after the blocks that dominate it.
+std::vector<int> LIRLowering::getBlockOrder() {
+  std::vector<int> Order;
+  std::vector<bool> Seen(F.Blocks.size(), false);
+  std::vector<std::pair<int, unsigned>> Stack = { { 0, 0 } };
+  Seen[0] = true;
+  while (!Stack.empty()) {
+    int B = Stack.back().first;
+    auto &Succs = F.Blocks[B].Insts.back().Labels;
+    if (Stack.back().second < Succs.size()) {
+      int S = Succs[Stack.back().second++];
+      if (!Seen[S]) {
+        Seen[S] = true;
+        Stack.push_back(std::make_pair(S, 0));
+      }
+      continue;
     }
+    Order.push_back(B);
+    Stack.pop_back();
+  }
+  std::reverse(Order.begin(), Order.end());
+  return Order;
+}
 
-    BUILDER.CreateCondBr(pred2, fptrBB, closBB);
+void LIRLowering::createRoots() {
+  Roots.assign(F.NumSlots, nullptr);
+  Aliased.assign(F.NumSlots, false);
+  if (bt_gc_statepoints)
+    return;
+
+  int N = F.Blocks.size();
+  std::vector<const LIRInst *> Defs(F.NumSlots, nullptr);
+  std::vector<bool> Stored(F.Vars.size(), false);
+  for (auto &Block : F.Blocks)
+    for (auto &I : Block.Insts) {
+      if (I.Dest >= 0)
+        Defs[I.Dest] = &I;
+      if (I.Op == lir_vstore)
+        Stored[I.Var] = true;
+    }
 
-    TheFunction->getBasicBlockList().push_back(fptrBB);
-    BUILDER.SetInsertPoint(fptrBB);
-    // Make the function type:  double(double,double) etc.
-    std::vector<llvm::Type *> I8Ptrs(Args.size(), llvm::Type::getInt8PtrTy(LLVM_CONTEXT));
-    llvm::FunctionType *FT =
-        llvm::FunctionType::get(llvm::Type::getInt8PtrTy(LLVM_CONTEXT), I8Ptrs, false);
-    llvm::Value *FP = BUILDER.CreateBitCast(maybeFP, llvm::PointerType::get(FT, 0), "fptr");
+  // slots live at the start of every block, phis excluded
+  std::vector<std::vector<bool>> LiveIn(N, std::vector<bool>(F.NumSlots, false));
+  std::vector<bool> NeedsRoot(F.NumSlots, false);
+  bool Changed = true;
+  while (Changed) {
+    Changed = false;
+    for (int B = N - 1; B >= 0; B--) {
+      std::vector<bool> Live(F.NumSlots, false);
+      for (int S : F.Blocks[B].Insts.back().Labels) {
+        for (int Slot = 0; Slot < F.NumSlots; Slot++)
+          if (LiveIn[S][Slot])
+            Live[Slot] = true;
+        for (auto &I : F.Blocks[S].Insts) {
+          if (I.Op != lir_phi)
+            break;
+          for (unsigned k = 0, e = I.Args.size(); k != e; ++k)
+            if (I.Labels[k] == B)
+              Live[I.Args[k]] = true;
+        }
+      }
+
+      auto &Insts = F.Blocks[B].Insts;
+      for (int i = Insts.size() - 1; i >= 0; i--) {
+        const LIRInst &I = Insts[i];
+        if (I.Dest >= 0)
+          Live[I.Dest] = false;
+        if (I.Op == lir_phi)
+          continue;
+        if (mayCollect(I))
+          for (int Slot = 0; Slot < F.NumSlots; Slot++)
+            if (Live[Slot])
+              NeedsRoot[Slot] = true;
+        for (int A : I.Args)
+          Live[A] = true;
+      }
+      if (Live != LiveIn[B]) {
+        LiveIn[B] = std::move(Live);
+        Changed = true;
+      }
+    }
+  }
 
-    for (unsigned i = 0, e = Args.size(); i != e; ++i) {
-      ArgsV.push_back(ArgValues[i]);
+  for (int Slot = 0; Slot < F.NumSlots; Slot++) {
+    const LIRInst *I = Defs[Slot];
+    if (!NeedsRoot[Slot] || !I || I->isConstant())
+      continue;
+    // a variable nothing stores to is its own root
+    if (I->Op == lir_vload && !Stored[I->Var]) {
+      Roots[Slot] = VarSlots[I->Var];
+      Aliased[Slot] = true;
+    } else {
+      Roots[Slot] = CreateRootSlot("root");
     }
-    llvm::Value *call1 = BUILDER.CreateCall(FP, ArgsV, "calltmp");
-    ArgsV.clear();
-    BUILDER.CreateBr(mergeBB);
+  }
+}
+
+llvm::Value *LIRLowering::getValue(int Slot) {
+  return Roots[Slot] ? BUILDER.CreateLoad(Roots[Slot], "reload") : Values[Slot];
+}
+
+void LIRLowering::setValue(int Slot, llvm::Value *V) {
+  Values[Slot] = V;
+  if (Roots[Slot] && !Aliased[Slot])
+    BUILDER.CreateStore(V, Roots[Slot]);
+}
+
+/// isReturned - The call at Index of block B is returned as is: only
+/// constants, Goto, phis and Ret pass its value on.
+bool LIRLowering::isReturned(int B, unsigned Index) {
+  int Val = F.Blocks[B].Insts[Index].Dest;
+  unsigned i = Index + 1;
+  for (unsigned Hops = 0; Hops <= F.Blocks.size(); Hops++) {
+    auto &Insts = F.Blocks[B].Insts;
+    while (i < Insts.size() && Insts[i].isConstant())
+      i++;
+    if (i == Insts.size())
+      return false;
+    if (Insts[i].Op == lir_ret)
+      return Insts[i].Args[0] == Val;
+    if (Insts[i].Op != lir_goto)
+      return false;
+
+    int S = Insts[i].Labels[0];
+    auto &Next = F.Blocks[S].Insts;
+    int NextVal = Val;
+    for (i = 0; i < Next.size() && Next[i].Op == lir_phi; i++)
+      for (unsigned k = 0, e = Next[i].Args.size(); k != e; ++k)
+        if (Next[i].Labels[k] == B && Next[i].Args[k] == Val)
+          NextVal = Next[i].Dest;
+    Val = NextVal;
+    B = S;
+  }
+  return false;
+}
+
+llvm::Value *LIRLowering::lowerConstant(const LIRInst &I) {
+  switch (I.Op) {
+  case lir_int:
+    // fixnum immediates, the few that do not fit go to the constant pool
+    if (bt_fits_fixnum(I.Imm))
+      return CreateTaggedConstant(bt_from_fixnum(I.Imm));
+    return CreateConstantObject("bt.const.i64." + std::to_string(I.Imm), I64Ty,
+                                { llvm::ConstantInt::get(llvm::Type::getInt64Ty(LLVM_CONTEXT), I.Imm) });
+  case lir_float:
+    // flonum immediates, the few that do not fit go to the constant pool
+    if (bt_fits_flonum(I.FImm))
+      return CreateTaggedConstant(bt_from_flonum(I.FImm));
+    return CreateConstantObject("bt.const.f64." + std::to_string(bt_double_bits(I.FImm)), F64Ty,
+                                { llvm::ConstantFP::get(llvm::Type::getDoubleTy(LLVM_CONTEXT), I.FImm) });
+  case lir_nil:
+    return CreateTaggedConstant(bt_nil);
+  case lir_bool:
+    return CreateTaggedConstant(I.Imm ? bt_true : bt_false);
+  case lir_symbol:
+    // symbols are interned while compiling and never move or die, the code
+    // refers to them directly
+    return CreateTaggedConstant(bt_intern(I.Name.c_str(), I.Name.size()));
+  case lir_string: {
+    // literals are flat strings in the constant pool, read-only data of the
+    // module that the collector never touches. The pool entry is named after
+    // the contents, so equal literals share one.
+    llvm::Type *T_int64 = llvm::Type::getInt64Ty(LLVM_CONTEXT);
+    std::vector<llvm::Constant *> Fields = { llvm::ConstantInt::get(T_int64, I.Name.size()) };
+    // the bytes and the NUL, packed into words as in bt_string_t
+    std::vector<uint64_t> Words((I.Name.size() + 8) / 8, 0);
+    memcpy(Words.data(), I.Name.data(), I.Name.size());
+    for (uint64_t Word : Words)
+      Fields.push_back(llvm::ConstantInt::get(T_int64, Word));
+    return CreateConstantObject("bt.const.str." + I.Name, StrTy, Fields);
+  }
+  case lir_fref: {
+    // function references are immutable, one pool entry serves every use
+    llvm::Function *Fn = getFunction(I.Name);
+    if (!Fn)
+      return LogErrorV("Unknown function referenced");
+    llvm::Constant *FP = llvm::ConstantExpr::getBitCast(Fn, llvm::Type::getInt8PtrTy(LLVM_CONTEXT));
+    llvm::Constant *Nargs = llvm::ConstantInt::get(llvm::Type::getInt64Ty(LLVM_CONTEXT), Fn->arg_size());
+    return CreateConstantObject("bt.const.fref." + I.Name, FunctionRefTy, { FP, Nargs });
+  }
+  default:
+    return LogErrorV("invalid constant.");
+  }
+}
+
+llvm::Value *LIRLowering::lowerPrim(const LIRInst &I) {
+  std::vector<llvm::Value *> ArgsV;
+  for (int A : I.Args)
+    ArgsV.push_back(getValue(A));
+
+  std::string Sym;
+  switch (I.Imm) {
+  case tok_box: {
+    GCRoot RootR(ArgsV[0]);
+    llvm::Value *Box = CreateNewObject(BoxTy, 1);
+    CreateStoreField(Box, 0, RootR.get());
+    return Box;
+  }
+  case tok_unbox:
+    return BUILDER.CreateCall(getFunction("bt_unbox"), ArgsV, "unboxtmp");
+  case tok_car:
+    return CreateCarCdr(ArgsV[0], false);
+  case tok_cdr:
+    return CreateCarCdr(ArgsV[0], true);
+  case tok_nullp:
+    return CreateBoolSelect(BUILDER.CreateICmpEQ(ArgsV[0], CreateTaggedConstant(bt_nil)));
+  case tok_pairp:
+    return CreateBoolSelect(CreateIsCons(ArgsV[0]));
+  case tok_setbox:
+    return CreateSetBox(ArgsV[0], ArgsV[1]);
+  case tok_cons:
+    return CreateCons(ArgsV[0], ArgsV[1]);
+  case tok_map:
+    return BUILDER.CreateCall(getFunction("bt_map"), ArgsV, "maptmp");
+  case tok_make_f64vector:
+    Sym = "bt_make_f64vector";
+    break;
+  case tok_make_i64vector:
+    Sym = "bt_make_i64vector";
+    break;
+  case tok_vector_length:
+    Sym = "bt_vector_length";
+    break;
+  case tok_vector_ref:
+    Sym = "bt_vector_ref";
+    break;
+  case tok_vector_set:
+    Sym = "bt_vector_set";
+    break;
+  case tok_vector_add:
+    Sym = "bt_vector_add";
+    break;
+  case tok_vector_mul:
+    Sym = "bt_vector_mul";
+    break;
+  case tok_vector_fma:
+    Sym = "bt_vector_fma";
+    break;
+  case tok_vector_sum:
+    Sym = "bt_vector_sum";
+    break;
+  case tok_string_length:
+    Sym = "bt_string_length";
+    break;
+  case tok_string_ref:
+    Sym = "bt_string_ref";
+    break;
+  case tok_substring:
+    Sym = "bt_substring";
+    break;
+  case tok_string_append:
+    Sym = "bt_string_append";
+    break;
+  case tok_string_eq:
+    Sym = "bt_string_eq";
+    break;
+  case tok_string_lt:
+    Sym = "bt_string_lt";
+    break;
+  case tok_make_hash_table:
+    Sym = "bt_make_hash_table";
+    break;
+  case tok_hash_count:
+    Sym = "bt_hash_count";
+    break;
+  case tok_hash_ref:
+  case tok_hash_set:
+    // the hash goes right after the key, computing it never collects
+    ArgsV.insert(ArgsV.begin() + 2, CreateHashKey(ArgsV[1]));
+    return BUILDER.CreateCall(getFunction(I.Imm == tok_hash_ref ? "bt_hash_ref" : "bt_hash_set"),
+                              ArgsV, "hashtmp");
+  default:
+    return LogErrorV("invalid primitive or not implemented yet.");
+  }
+  return BUILDER.CreateCall(getFunction(Sym), ArgsV, "primtmp");
+}
+
+llvm::Value *LIRLowering::lowerList(const LIRInst &I) {
+  llvm::PointerType *T_pvalue = getValueTy();
+  llvm::Type *T_int32 = llvm::Type::getInt32Ty(LLVM_CONTEXT);
+  llvm::Type *T_int64 = llvm::Type::getInt64Ty(LLVM_CONTEXT);
+  int n = I.Args.size();
+
+  // members stay rooted until they are stored into the list
+  std::vector<GCRoot> Mems;
+  for (int A : I.Args)
+    Mems.push_back(GCRoot(getValue(A)));
+
+  // cdr-coded chunks built back to front, every chunk but the last ends
+  // with a full pair pointing to the chunks built so far
+  std::string bt_set_cdr_codes_sym("bt_set_cdr_codes");
+  llvm::Value *List = CreateTaggedConstant(bt_nil);
+  for (int end = n; end > 0; end -= BT_LIST_CHUNK) {
+    int start = std::max(0, end - BT_LIST_CHUNK);
+    int k = end - start;
+    bool last = end == n;
+    GCRoot RootList(List);
+    llvm::Value *Cells = CreateConsAlloc(last ? k : k + 1);
+    llvm::Value *Words = BUILDER.CreateBitCast(Cells, llvm::PointerType::get(T_pvalue, T_pvalue->getAddressSpace()));
+    for (int i = 0; i < k; i++)
+      BUILDER.CreateStore(Mems[start + i].get(), BUILDER.CreateConstGEP1_32(Words, i));
+    if (!last)
+      BUILDER.CreateStore(RootList.get(), BUILDER.CreateConstGEP1_32(Words, k));
+    std::vector<llvm::Value *> ArgsV = {
+        Cells, llvm::ConstantInt::get(T_int64, k),
+        llvm::ConstantInt::get(T_int32, last ? BT_CDR_NIL : BT_CDR_FULL) };
+    BUILDER.CreateCall(getFunction(bt_set_cdr_codes_sym), ArgsV);
+    List = Cells;
+  }
+  return List;
+}
+
+llvm::Value *LIRLowering::lowerClosure(const LIRInst &I) {
+  llvm::Function *CallbackF = getFunction(I.Name);
+  if (!CallbackF)
+    return LogErrorV("Unknown closure function referenced");
+  llvm::Value *FP = CreateToValue(CallbackF);
+  int n = I.Args.size();
+
+  // members stay rooted until they are stored into the new object
+  std::vector<GCRoot> Mems;
+  for (int A : I.Args)
+    Mems.push_back(GCRoot(getValue(A)));
+
+  // allocate the closure object inline: field 0 is the code, then members
+  llvm::Value *Clos = CreateNewObject(ClosureTy, n + 1);
+  CreateStoreField(Clos, 0, FP);
+  for (int i = 0; i < n; i++)
+    CreateStoreField(Clos, i + 1, Mems[i].get());
+  return Clos;
+}
+
+llvm::Value *LIRLowering::lowerCall(const LIRInst &I, bool Tail) {
+  llvm::Function *CalleeF = getFunction(I.Name);
+  if (!CalleeF)
+    return LogErrorV("Unknown function referenced");
+  if (CalleeF->arg_size() != I.Args.size())
+    return LogErrorV("Incorrect # arguments passed");
 
-    TheFunction->getBasicBlockList().push_back(closBB);
-    BUILDER.SetInsertPoint(closBB);
-    std::vector<llvm::Type *> I8Ptrs_Clos(Args.size() + 1, llvm::Type::getInt8PtrTy(LLVM_CONTEXT));
-    llvm::FunctionType *FT_Clos =
-        llvm::FunctionType::get(llvm::Type::getInt8PtrTy(LLVM_CONTEXT), I8Ptrs_Clos, false);
-    llvm::Value *FP_Clos = BUILDER.CreateBitCast(maybeFP, llvm::PointerType::get(FT_Clos, 0), "fptr");
- 
-    // push the closure object first
-    ArgsV.push_back(Callable);
-    for (unsigned i = 0, e = Args.size(); i != e; ++i) {
-      ArgsV.push_back(ArgValues[i]);
+  std::vector<llvm::Value *> ArgsV;
+  for (int A : I.Args)
+    ArgsV.push_back(getValue(A));
+
+  if (Tail && CalleeF == SCOPE->Self) {
+    // self tail call: a loop, the new arguments replace the old ones
+    for (unsigned i = 0, e = ArgsV.size(); i != e; ++i)
+      BUILDER.CreateStore(ArgsV[i], SCOPE->ArgSlots[i]);
+    if (SCOPE->Info && !SCOPE->Speculate)
+      CreateBackedgeCount(SCOPE->Info);
+    BUILDER.CreateBr(Blocks[0]);
+    Returned = true;
+    return llvm::UndefValue::get(getValueTy());
+  }
+  // the optimized tier calls itself, not the profiling tier
+  if (CalleeF == SCOPE->Self)
+    CalleeF = SCOPE->TheFunction;
+  if (Tail) {
+    CreateTailCall(CalleeF, ArgsV);
+    Returned = true;
+    return llvm::UndefValue::get(getValueTy());
+  }
+  return BUILDER.CreateCall(CalleeF, ArgsV, "calltmp");
+}
+
+llvm::Value *LIRLowering::lowerApply(const LIRInst &I, bool Tail) {
+  llvm::Value *Callable = getValue(I.Args[0]);
+  std::vector<llvm::Value *> ArgValues;
+  for (unsigned i = 1, e = I.Args.size(); i != e; ++i)
+    ArgValues.push_back(getValue(I.Args[i]));
+  unsigned NumArgs = ArgValues.size();
+  std::vector<llvm::Value *> ArgsV;
+
+  llvm::Function *TheFunction = BUILDER.GetInsertBlock()->getParent();
+  llvm::BasicBlock *fptrBB = llvm::BasicBlock::Create(LLVM_CONTEXT, "functptr");
+  llvm::BasicBlock *closBB = llvm::BasicBlock::Create(LLVM_CONTEXT, "closure");
+  llvm::BasicBlock *mergeBB = llvm::BasicBlock::Create(LLVM_CONTEXT, "merge");
+  std::vector<std::pair<llvm::Value *, llvm::BasicBlock *>> Results;
+
+  // The feedback ways of the site are the targets the profiling tier called
+  // there. The optimized tier calls each of them directly behind a compare
+  // of the code word of the callee, up to BT_IC_WAYS of either kind, and
+  // deoptimizes to the generic dispatch when none matches. The code word
+  // implies the kind unless the site saw both.
+  uint64_t *Site = getFeedbackSite(2 * BT_IC_WAYS);
+  std::vector<int> Targets;
+  for (int i = 0; Site && SCOPE->Speculate && i < 2 * BT_IC_WAYS; i++)
+    if (Site[i] != 0)
+      Targets.push_back(i);
+  if (!Targets.empty()) {
+    llvm::Type *T_int64 = llvm::Type::getInt64Ty(LLVM_CONTEXT);
+    llvm::IntegerType *T_int32 = llvm::Type::getInt32Ty(LLVM_CONTEXT);
+    bool Mixed = Targets.front() < BT_IC_WAYS && Targets.back() >= BT_IC_WAYS;
+    llvm::BasicBlock *guardBB = llvm::BasicBlock::Create(LLVM_CONTEXT, "guard", TheFunction);
+    llvm::BasicBlock *deoptBB = llvm::BasicBlock::Create(LLVM_CONTEXT, "deopt");
+    llvm::MDNode *Likely = llvm::MDBuilder(LLVM_CONTEXT).createBranchWeights(2000, 1);
+    BUILDER.CreateCondBr(CreateIsObject(Callable), guardBB, deoptBB, Likely);
+
+    BUILDER.SetInsertPoint(guardBB);
+    llvm::Value *Code = CreateLoadCode(Callable);
+    llvm::Value *Type = Mixed ? CreateLoadType(Callable) : nullptr;
+    for (unsigned t = 0, e = Targets.size(); t != e; ++t) {
+      bool IsClos = Targets[t] >= BT_IC_WAYS;
+      llvm::Value *Hit = BUILDER.CreateICmpEQ(Code, llvm::ConstantInt::get(T_int64, Site[Targets[t]]), "guardtmp");
+      if (Mixed)
+        Hit = BUILDER.CreateAnd(
+            Hit, BUILDER.CreateICmpEQ(Type, llvm::ConstantInt::get(T_int32, IsClos ? ClosureTy : FunctionRefTy)));
+      llvm::BasicBlock *directBB = llvm::BasicBlock::Create(LLVM_CONTEXT, "direct", TheFunction);
+      llvm::BasicBlock *nextBB = t + 1 < e ? llvm::BasicBlock::Create(LLVM_CONTEXT, "guard") : deoptBB;
+      BUILDER.CreateCondBr(Hit, directBB, nextBB, Likely);
+
+      BUILDER.SetInsertPoint(directBB);
+      std::vector<llvm::Type *> I8Ptrs(NumArgs + IsClos, getValueTy());
+      llvm::FunctionType *FT = llvm::FunctionType::get(getValueTy(), I8Ptrs, false);
+      llvm::Value *FP = CreateRawPointer((void *) Site[Targets[t]], FT);
+      if (IsClos)
+        ArgsV.push_back(Callable);
+      ArgsV.insert(ArgsV.end(), ArgValues.begin(), ArgValues.end());
+      if (Tail) {
+        CreateTailCall(FP, ArgsV);
+      } else {
+        llvm::Value *Call = BUILDER.CreateCall(FP, ArgsV, "calltmp");
+        BUILDER.CreateBr(mergeBB);
+        Results.push_back(std::make_pair(Call, BUILDER.GetInsertBlock()));
+      }
+      ArgsV.clear();
+
+      TheFunction->getBasicBlockList().push_back(nextBB);
+      BUILDER.SetInsertPoint(nextBB);
     }
-    llvm::Value *call2 = BUILDER.CreateCall(FP_Clos, ArgsV, "calltmp");
-    ArgsV.clear();
+    CreateDeopt(Site, 0);
+  }
+
+  // nothing in the dispatch may collect, Callable stays valid
+  llvm::Value *FptrCode = nullptr, *ClosCode = nullptr;
+  CreateCallDispatch(Callable, Site, fptrBB, closBB, FptrCode, ClosCode);
+
+  BUILDER.SetInsertPoint(fptrBB);
+  std::vector<llvm::Type *> I8Ptrs(NumArgs, getValueTy());
+  llvm::FunctionType *FT = llvm::FunctionType::get(getValueTy(), I8Ptrs, false);
+  llvm::Value *FP = BUILDER.CreateIntToPtr(FptrCode, llvm::PointerType::get(FT, 0), "fptr");
+  ArgsV = ArgValues;
+  if (Tail) {
+    CreateTailCall(FP, ArgsV);
+  } else {
+    Results.push_back(std::make_pair(BUILDER.CreateCall(FP, ArgsV, "calltmp"), BUILDER.GetInsertBlock()));
     BUILDER.CreateBr(mergeBB);
+  }
+  ArgsV.clear();
+
+  BUILDER.SetInsertPoint(closBB);
+  std::vector<llvm::Type *> I8Ptrs_Clos(NumArgs + 1, getValueTy());
+  llvm::FunctionType *FT_Clos = llvm::FunctionType::get(getValueTy(), I8Ptrs_Clos, false);
+  llvm::Value *FP_Clos = BUILDER.CreateIntToPtr(ClosCode, llvm::PointerType::get(FT_Clos, 0), "fptr");
+
+  // push the closure object first
+  ArgsV.push_back(Callable);
+  ArgsV.insert(ArgsV.end(), ArgValues.begin(), ArgValues.end());
+  if (Tail) {
+    // every path returned already, nothing to merge
+    CreateTailCall(FP_Clos, ArgsV);
+    delete mergeBB;
+    Returned = true;
+    return llvm::UndefValue::get(getValueTy());
+  }
+  Results.push_back(std::make_pair(BUILDER.CreateCall(FP_Clos, ArgsV, "calltmp"), BUILDER.GetInsertBlock()));
+  BUILDER.CreateBr(mergeBB);
 
-    // Emit merge value
-    TheFunction->getBasicBlockList().push_back(mergeBB);
-    BUILDER.SetInsertPoint(mergeBB);
-    llvm::PHINode *PN =
-      BUILDER.CreatePHI(llvm::Type::getInt8PtrTy(LLVM_CONTEXT), 2, "phi");
+  TheFunction->getBasicBlockList().push_back(mergeBB);
+  BUILDER.SetInsertPoint(mergeBB);
+  llvm::PHINode *PN = BUILDER.CreatePHI(getValueTy(), Results.size(), "phi");
+  for (auto &Result : Results)
+    PN->addIncoming(Result.first, Result.second);
+  return PN;
+}
+
+bool LIRLowering::lowerInst(int B, unsigned Index) {
+  const LIRInst &I = F.Blocks[B].Insts[Index];
+  llvm::Value *V = nullptr;
+  switch (I.Op) {
+  case lir_vdefine:
+    return true;
+  case lir_vload:
+    V = BUILDER.CreateLoad(VarSlots[I.Var], F.Vars[I.Var]);
+    break;
+  case lir_vstore:
+    BUILDER.CreateStore(getValue(I.Args[0]), VarSlots[I.Var]);
+    return true;
+  case lir_add:
+    V = CreateArithOp(tok_add, getValue(I.Args[0]), getValue(I.Args[1]));
+    break;
+  case lir_sub:
+    V = CreateArithOp(tok_sub, getValue(I.Args[0]), getValue(I.Args[1]));
+    break;
+  case lir_mult:
+    V = CreateArithOp(tok_mul, getValue(I.Args[0]), getValue(I.Args[1]));
+    break;
+  case lir_div:
+    V = CreateArithOp(tok_div, getValue(I.Args[0]), getValue(I.Args[1]));
+    break;
+  case lir_eq:
+    V = CreateArithOp(tok_eq, getValue(I.Args[0]), getValue(I.Args[1]));
+    break;
+  case lir_gt:
+    V = CreateArithOp(tok_gt, getValue(I.Args[0]), getValue(I.Args[1]));
+    break;
+  case lir_lt:
+    V = CreateArithOp(tok_lt, getValue(I.Args[0]), getValue(I.Args[1]));
+    break;
+  case lir_eqp:
+    // identity: interned symbols, immediates and the very same object
+    V = CreateBoolSelect(BUILDER.CreateICmpEQ(getValue(I.Args[0]), getValue(I.Args[1]), "eqtmp"));
+    break;
+  case lir_and:
+    V = CreateBoolSelect(BUILDER.CreateAnd(CreateTruthTest(getValue(I.Args[0])),
+                                           CreateTruthTest(getValue(I.Args[1]))));
+    break;
+  case lir_or:
+    V = CreateBoolSelect(BUILDER.CreateOr(CreateTruthTest(getValue(I.Args[0])),
+                                          CreateTruthTest(getValue(I.Args[1]))));
+    break;
+  case lir_not:
+    V = CreateBoolSelect(BUILDER.CreateNot(CreateTruthTest(getValue(I.Args[0]))));
+    break;
+  case lir_prim:
+    V = lowerPrim(I);
+    break;
+  case lir_list:
+    V = lowerList(I);
+    break;
+  case lir_closure:
+    V = lowerClosure(I);
+    break;
+  case lir_getfield: {
+    std::vector<llvm::Value *> ArgsV = {
+        getValue(I.Args[0]), llvm::ConstantInt::get(LLVM_CONTEXT, llvm::APInt(32, I.Imm, true)) };
+    V = BUILDER.CreateCall(getFunction("bt_getfield"), ArgsV, "getfieldtmp");
+    break;
+  }
+  case lir_call:
+    V = lowerCall(I, I.Tail && isReturned(B, Index));
+    break;
+  case lir_apply:
+    V = lowerApply(I, I.Tail && isReturned(B, Index));
+    break;
+  default:
+    LogErrorV("invalid instruction or not implemented yet.");
+    return false;
+  }
+  if (!V)
+    return false;
+  // after a tail call the value only completes code no path reaches
+  if (Returned)
+    Values[I.Dest] = V;
+  else
+    setValue(I.Dest, V);
+  return true;
+}
 
-    PN->addIncoming(call1, fptrBB);
-    PN->addIncoming(call2, closBB);
-    return PN;
+void LIRLowering::lowerIf(int B, const LIRInst &I) {
+  llvm::Value *cond = getValue(I.Args[0]);
+  llvm::Function *TheFunction = SCOPE->TheFunction;
+  llvm::BasicBlock *thenBB = Blocks[I.Labels[0]];
+  llvm::BasicBlock *elseBB = Blocks[I.Labels[1]];
+
+  // The profiling tier records whether the condition is a boolean and how
+  // often each branch is taken. The optimized tier lays the branches out by
+  // those counts and, when the condition always was a boolean, only
+  // compares it with #t and #f; anything else deoptimizes. Either way the
+  // branches go through a block of their own.
+  uint64_t *Site = getFeedbackSite(BT_FB_IF_WORDS);
+  if (!Site) {
+    BUILDER.CreateCondBr(CreateTruthTest(cond), thenBB, elseBB);
+    addEdge(B, I.Labels[0]);
+    addEdge(B, I.Labels[1]);
+    return;
+  }
+  thenBB = llvm::BasicBlock::Create(LLVM_CONTEXT, "then");
+  elseBB = llvm::BasicBlock::Create(LLVM_CONTEXT, "else");
+
+  llvm::MDNode *Weights = nullptr;
+  if (SCOPE->Speculate) {
+    uint64_t ThenCount = Site[1] + 1, ElseCount = Site[2] + 1;
+    while (ThenCount > UINT32_MAX || ElseCount > UINT32_MAX) {
+      ThenCount >>= 1;
+      ElseCount >>= 1;
+    }
+    Weights = llvm::MDBuilder(LLVM_CONTEXT).createBranchWeights(ThenCount, ElseCount);
   } else {
-    // If argument mismatch error.
-    if (CalleeF->arg_size() != Args.size())
-      return LogErrorV("Incorrect # arguments passed");
-
-    for (unsigned i = 0, e = Args.size(); i != e; ++i) {
-      ArgsV.push_back(Args[i]->codegen());
-      if (!ArgsV.back())
-        return nullptr;
+    llvm::Value *isBool = BUILDER.CreateOr(BUILDER.CreateICmpEQ(cond, CreateTaggedConstant(bt_true)),
+                                           BUILDER.CreateICmpEQ(cond, CreateTaggedConstant(bt_false)));
+    CreateRecordFeedback(Site, BUILDER.CreateSelect(
+        isBool, llvm::ConstantInt::get(llvm::Type::getInt64Ty(LLVM_CONTEXT), BT_FB_BOOL),
+        llvm::ConstantInt::get(llvm::Type::getInt64Ty(LLVM_CONTEXT), BT_FB_OTHER)));
+  }
+
+  if (SCOPE->Speculate && Site[0] == BT_FB_BOOL) {
+    llvm::BasicBlock *isFalseBB = llvm::BasicBlock::Create(LLVM_CONTEXT, "isfalse", TheFunction);
+    llvm::BasicBlock *deoptBB = llvm::BasicBlock::Create(LLVM_CONTEXT, "deopt");
+    BUILDER.CreateCondBr(BUILDER.CreateICmpEQ(cond, CreateTaggedConstant(bt_true)), thenBB, isFalseBB, Weights);
+    BUILDER.SetInsertPoint(isFalseBB);
+    BUILDER.CreateCondBr(BUILDER.CreateICmpEQ(cond, CreateTaggedConstant(bt_false)), elseBB, deoptBB,
+                         llvm::MDBuilder(LLVM_CONTEXT).createBranchWeights(2000, 1));
+    TheFunction->getBasicBlockList().push_back(deoptBB);
+    BUILDER.SetInsertPoint(deoptBB);
+    CreateDeopt(Site, BT_FB_OTHER);
+  }
+  // Convert condition to a bool without calling into the runtime.
+  BUILDER.CreateCondBr(CreateTruthTest(cond), thenBB, elseBB, Weights);
+
+  for (int k = 0; k < 2; k++) {
+    llvm::BasicBlock *EdgeBB = k == 0 ? thenBB : elseBB;
+    TheFunction->getBasicBlockList().push_back(EdgeBB);
+    BUILDER.SetInsertPoint(EdgeBB);
+    if (!SCOPE->Speculate)
+      CreateCountFeedback(Site + 1 + k);
+    BUILDER.CreateBr(Blocks[I.Labels[k]]);
+    addEdge(B, I.Labels[k]);
+  }
+}
+
+/// addIncoming - Complete the phis once every block has its code, taking
+/// every value from the end of the LLVM block of its edge. Edges that a tail
+/// call cut off are left out.
+void LIRLowering::addIncoming(const std::vector<int> &Order) {
+  for (int S : Order) {
+    for (auto &I : F.Blocks[S].Insts) {
+      if (I.Op != lir_phi)
+        break;
+      llvm::PHINode *PN = llvm::cast<llvm::PHINode>(Values[I.Dest]);
+      std::map<int, unsigned> Taken; // entries of every predecessor so far
+      for (unsigned k = 0, e = I.Args.size(); k != e; ++k) {
+        int P = I.Labels[k];
+        unsigned Nth = Taken[P]++;
+        llvm::BasicBlock *From = nullptr;
+        for (auto &Edge : Edges[P])
+          if (Edge.first == S && Nth-- == 0) {
+            From = Edge.second;
+            break;
+          }
+        if (!From)
+          continue;
+        llvm::Value *V = Values[I.Args[k]];
+        if (Roots[I.Args[k]]) {
+          BUILDER.SetInsertPoint(From->getTerminator());
+          V = BUILDER.CreateLoad(Roots[I.Args[k]], "reload");
+        }
+        PN->addIncoming(V, From);
+      }
+      if (PN->getNumIncomingValues() == 0) {
+        PN->replaceAllUsesWith(llvm::UndefValue::get(getValueTy()));
+        PN->eraseFromParent();
+      }
+    }
+  }
+}
+
+bool LIRLowering::lower() {
+  llvm::Function *TheFunction = SCOPE->TheFunction;
+
+  // the parameters live in the slots of the arguments, variables that are
+  // still memory get root slots
+  for (unsigned V = 0, e = F.Vars.size(); V != e; ++V) {
+    if (V < F.NumParams) {
+      VarSlots.push_back(SCOPE->ArgSlots[V]);
+      continue;
+    }
+    VarSlots.push_back(CreateRootSlot(F.Vars[V]));
+    BUILDER.CreateStore(CreateTaggedConstant(bt_nil), VarSlots.back());
+  }
+  createRoots();
+
+  std::vector<int> Order = getBlockOrder();
+  Blocks.assign(F.Blocks.size(), nullptr);
+  Edges.assign(F.Blocks.size(), std::vector<std::pair<int, llvm::BasicBlock *>>());
+  Values.assign(F.NumSlots, nullptr);
+  for (int B : Order)
+    Blocks[B] = llvm::BasicBlock::Create(LLVM_CONTEXT, B == 0 ? "tailrecurse" : "L" + std::to_string(B),
+                                         TheFunction);
+  // self tail calls jump back to L0, the gc frame is already set up
+  BUILDER.CreateBr(Blocks[0]);
+
+  // constants are no code, and phis are used before their operands exist
+  for (int B : Order) {
+    BUILDER.SetInsertPoint(Blocks[B]);
+    for (auto &I : F.Blocks[B].Insts) {
+      if (I.Op == lir_phi)
+        Values[I.Dest] = BUILDER.CreatePHI(getValueTy(), I.Args.size(), "phi");
+      else if (I.isConstant() && !(Values[I.Dest] = lowerConstant(I)))
+        return false;
     }
+  }
 
-    return BUILDER.CreateCall(CalleeF, ArgsV, "calltmp");
+  for (int B : Order) {
+    BUILDER.SetInsertPoint(Blocks[B]);
+    auto &Insts = F.Blocks[B].Insts;
+    Returned = false;
+    for (unsigned i = 0, e = Insts.size(); i != e && !Returned; ++i) {
+      const LIRInst &I = Insts[i];
+      if (I.isConstant())
+        continue;
+      if (I.Op == lir_phi) {
+        setValue(I.Dest, Values[I.Dest]);
+      } else if (I.Op == lir_if) {
+        lowerIf(B, I);
+      } else if (I.Op == lir_goto) {
+        BUILDER.CreateBr(Blocks[I.Labels[0]]);
+        addEdge(B, I.Labels[0]);
+      } else if (I.Op == lir_ret) {
+        llvm::Value *RetVal = getValue(I.Args[0]);
+        CreatePopGCFrame();
+        BUILDER.CreateRet(RetVal);
+      } else if (!lowerInst(B, i)) {
+        return false;
+      }
+    }
   }
+  addIncoming(Order);
+  return true;
 }
 
 llvm::Function *PrototypeAST::codegen() {
   // Make the function type:  double(double,double) etc.
-  std::vector<llvm::Type *> I8Ptrs(Args.size(), llvm::Type::getInt8PtrTy(LLVM_CONTEXT));
+  std::vector<llvm::Type *> I8Ptrs(Args.size(), getValueTy());
   llvm::FunctionType *FT =
-      llvm::FunctionType::get(llvm::Type::getInt8PtrTy(LLVM_CONTEXT), I8Ptrs, false);
+      llvm::FunctionType::get(getValueTy(), I8Ptrs, false);
 
   llvm::Function *F =
       llvm::Function::Create(FT, llvm::Function::ExternalLinkage, Name, MODULE.get());
@@ -420,82 +1737,183 @@ llvm::Function *PrototypeAST::codegen() {
 void FunctionAST::allocaArgPass() {
   llvm::Function *TheFunction = Scope.TheFunction;
 
-  llvm::Type *T_pvalue = llvm::Type::getInt8PtrTy(LLVM_CONTEXT);
+  llvm::Type *T_pvalue = getValueTy();
   llvm::Type *T_ppvalue = llvm::PointerType::get(T_pvalue, 0);
   llvm::Type *T_int32 = llvm::Type::getInt32Ty(LLVM_CONTEXT);
   llvm::Type *T_int64 = llvm::Type::getInt64Ty(LLVM_CONTEXT);
   llvm::Type *T_size = T_int64;
   llvm::Type *T_psize = llvm::PointerType::get(T_size, 0);
 
+  if (bt_gc_statepoints) {
+    // no gc frame, arguments are plain locals
+    for (auto &Arg : TheFunction->args()) {
+      auto Alloca = CreateEntryBlockAlloca(TheFunction, Arg.getName());
+      BUILDER.CreateStore(&Arg, Alloca);
+      Scope.ArgSlots.push_back(Alloca);
+    }
+    return;
+  }
+
+  // the frame size is not known until the whole body (locals and
+  // temporaries) is generated, finishGCFrame() patches these constants
   int n_roots = TheFunction->arg_size();
-  llvm::Value *argTemp = BUILDER.CreateAlloca(T_pvalue,
-                                      llvm::ConstantInt::get(T_int32, n_roots+2));
-  gcframe = argTemp;
-  argTemp = BUILDER.CreateConstGEP1_32(argTemp, 2);
-  BUILDER.CreateStore(llvm::ConstantInt::get(T_size, n_roots<<1),
+  llvm::IRBuilder<> TmpB(&TheFunction->getEntryBlock(), TheFunction->getEntryBlock().begin());
+  Scope.FrameAlloca = TmpB.CreateAlloca(T_pvalue, llvm::ConstantInt::get(T_int32, n_roots+2));
+  gcframe = Scope.FrameAlloca;
+  Scope.FrameSizeStore = BUILDER.CreateStore(llvm::ConstantInt::get(T_size, n_roots<<1),
                       BUILDER.CreateBitCast(BUILDER.CreateConstGEP1_32(gcframe, 0), T_psize));
+  Scope.FrameClear = BUILDER.CreateMemSet(BUILDER.CreateBitCast(BUILDER.CreateConstGEP1_32(gcframe, 2), T_pvalue),
+                      llvm::ConstantInt::get(llvm::Type::getInt8Ty(LLVM_CONTEXT), 0),
+                      llvm::ConstantInt::get(T_int64, n_roots * sizeof(void *)), sizeof(void *));
   BUILDER.CreateStore(BUILDER.CreateLoad(btpgcstack_var),
                       BUILDER.CreateBitCast(BUILDER.CreateConstGEP1_32(gcframe, 1), 
                                             llvm::PointerType::get(T_ppvalue, 0)));
   BUILDER.CreateStore(gcframe, btpgcstack_var);
 
-  int varnum = 0;
   for (auto &Arg : TheFunction->args()) {
     llvm::Value *arg = &Arg;
 
-    // Create an alloca for this variable.
-    auto Alloca = BUILDER.CreateConstGEP1_32(argTemp, varnum++); // CreateEntryBlockAlloca(TheFunction, Arg.getName());
+    // Arguments take the first root slots.
+    auto Alloca = CreateRootSlot(Arg.getName());
     // Store the initial value into the alloca.
     BUILDER.CreateStore(arg, Alloca);
     // Add arguments to variable symbol table.
-    Scope.NamedValues[Arg.getName()] = Alloca;
+    Scope.ArgSlots.push_back(Alloca);
   }
 }
 
+void FunctionAST::finishGCFrame() {
+  if (bt_gc_statepoints)
+    return;
+
+  llvm::Type *T_int32 = llvm::Type::getInt32Ty(LLVM_CONTEXT);
+  llvm::Type *T_int64 = llvm::Type::getInt64Ty(LLVM_CONTEXT);
+  int n_roots = Scope.NumRoots;
+
+  Scope.FrameAlloca->setOperand(0, llvm::ConstantInt::get(T_int32, n_roots+2));
+  Scope.FrameSizeStore->setOperand(0, llvm::ConstantInt::get(T_int64, n_roots<<1));
+  Scope.FrameClear->setArgOperand(2, llvm::ConstantInt::get(T_int64, n_roots * sizeof(void *)));
+}
+
 void FunctionAST::registerMe() {
   name = Proto->getName();
   FUNCTIONPROTOS[Proto->getName()] = std::move(Proto);
 }
 
-llvm::Value *FunctionAST::codegen() {
+void FunctionAST::enableTiering() {
+  if (bt_tier_up_calls <= 0)
+    return;
+  Info.reset(new bt_function_info_t());
+  Info->function = this;
+}
+
+/// CreateTierEntry - Entry of the profiling tier, before the gc frame is set
+/// up: forward to the optimized tier once there is one, and otherwise count
+/// the call and have the function optimized when it gets hot.
+static void CreateTierEntry(bt_function_info_t *Info) {
+  llvm::Type *T_int64 = llvm::Type::getInt64Ty(LLVM_CONTEXT);
+  llvm::Function *TheFunction = SCOPE->TheFunction;
+  llvm::BasicBlock *forwardBB = llvm::BasicBlock::Create(LLVM_CONTEXT, "forward", TheFunction);
+  llvm::BasicBlock *countBB = llvm::BasicBlock::Create(LLVM_CONTEXT, "count");
+  llvm::BasicBlock *tierUpBB = llvm::BasicBlock::Create(LLVM_CONTEXT, "tierup");
+  llvm::BasicBlock *bodyBB = llvm::BasicBlock::Create(LLVM_CONTEXT, "body");
+
+  // the tier-up thread publishes the optimized tier with a release store
+  llvm::LoadInst *Optimized = BUILDER.CreateLoad(CreateRawPointer(&Info->optimized, T_int64), "optimized");
+  Optimized->setAlignment(8);
+  Optimized->setAtomic(llvm::AtomicOrdering::Acquire);
+  BUILDER.CreateCondBr(BUILDER.CreateICmpNE(Optimized, llvm::ConstantInt::get(T_int64, 0)),
+                       forwardBB, countBB);
+
+  // the optimized tier has the same type, a musttail call forwards for free
+  BUILDER.SetInsertPoint(forwardBB);
+  std::vector<llvm::Value *> ArgsV;
+  for (auto &Arg : TheFunction->args())
+    ArgsV.push_back(&Arg);
+  llvm::Value *FP = BUILDER.CreateIntToPtr(Optimized, TheFunction->getType(), "fptr");
+  llvm::CallInst *Call = BUILDER.CreateCall(FP, ArgsV, "forwardtmp");
+  if (!bt_gc_statepoints)
+    Call->setTailCallKind(llvm::CallInst::TCK_MustTail);
+  BUILDER.CreateRet(Call);
+
+  TheFunction->getBasicBlockList().push_back(countBB);
+  BUILDER.SetInsertPoint(countBB);
+  llvm::Value *Calls = CreateRawPointer(&Info->calls, T_int64);
+  llvm::Value *N = BUILDER.CreateAdd(BUILDER.CreateLoad(Calls, "calls"), llvm::ConstantInt::get(T_int64, 1));
+  BUILDER.CreateStore(N, Calls);
+  BUILDER.CreateCondBr(BUILDER.CreateICmpEQ(N, llvm::ConstantInt::get(T_int64, bt_tier_up_calls)),
+                       tierUpBB, bodyBB, llvm::MDBuilder(LLVM_CONTEXT).createBranchWeights(1, 2000));
+
+  TheFunction->getBasicBlockList().push_back(tierUpBB);
+  BUILDER.SetInsertPoint(tierUpBB);
+  std::string bt_tier_up_sym("bt_tier_up");
+  BUILDER.CreateCall(getFunction(bt_tier_up_sym),
+                     { CreateRawPointer(Info, llvm::Type::getInt8Ty(LLVM_CONTEXT)) });
+  BUILDER.CreateBr(bodyBB);
+
+  TheFunction->getBasicBlockList().push_back(bodyBB);
+  BUILDER.SetInsertPoint(bodyBB);
+}
+
+llvm::Function *FunctionAST::codegenTier(bool Speculate) {
   // Transfer ownership of the prototype to the FunctionProtos map, but keep a
   // reference to it for use below.
   // auto &P = *Proto;
   // FUNCTIONPROTOS[Proto->getName()] = std::move(Proto);
   // First, check for an existing function from a previous 'extern' declaration.
-  llvm::Function *TheFunction = getFunction(name);
-  if (!TheFunction)
+  llvm::Function *Generic = getFunction(name);
+  if (!Generic)
+    return nullptr;
+  // every tier lowers the same optimized IR, see LIRLowering
+  if (!getLIR())
     return nullptr;
 
-  // Setup local function scope, make sure it is visible from anywhere
+  // the optimized tier is a function of its own, a new one every time
+  llvm::Function *TheFunction = Generic;
+  if (Speculate) {
+    TheFunction = llvm::Function::Create(Generic->getFunctionType(), llvm::Function::ExternalLinkage,
+                                         name + ".opt" + std::to_string(Info->deopts), MODULE.get());
+    auto GenericArg = Generic->arg_begin();
+    for (auto &Arg : TheFunction->args())
+      Arg.setName((GenericArg++)->getName());
+  }
+
+  // Setup local function scope, make sure it is visible from anywhere. The
+  // function may be generated more than once, start from a clean one.
+  Scope = FunctionScope();
   Scope.TheFunction = TheFunction;
+  Scope.Self = Generic;
+  Scope.Info = Info.get();
+  Scope.Feedback = &Feedback;
+  Scope.Speculate = Speculate;
   SCOPE = &Scope;
 
+  if (bt_gc_statepoints) {
+    // roots are found from stack maps, walking the frame pointer chain
+    TheFunction->setGC("statepoint-example");
+    TheFunction->addFnAttr("no-frame-pointer-elim", "true");
+  }
+  if (bt_profile_interval) {
+    // allocation samples are attributed by walking the frame pointer chain
+    TheFunction->addFnAttr("no-frame-pointer-elim", "true");
+  }
+
   // Create a new basic block to start insertion into.
   llvm::BasicBlock *BB = llvm::BasicBlock::Create(LLVM_CONTEXT, "entry", TheFunction);
   BUILDER.SetInsertPoint(BB);
 
-  // Record the function arguments in the NamedValues map.
-  allocaArgPass();
+  if (Info && !Speculate)
+    CreateTierEntry(Info.get());
 
-  llvm::Value *RetVal = nullptr;
-  for (unsigned i = 0, e = Body.size(); i != e; ++i) {
-    RetVal = Body[i]->codegen();
-    if (!RetVal)
-      return LogErrorV("Invalid body expr.");
-  }
-
-  if (RetVal) {
-    // pop the gc frame
-    llvm::Type *T_pvalue = llvm::Type::getInt8PtrTy(LLVM_CONTEXT);
-    llvm::Type *T_ppvalue = llvm::PointerType::get(T_pvalue, 0);
-    llvm::Value *gcpop = BUILDER.CreateConstGEP1_32(gcframe, 1);
-    BUILDER.CreateStore(BUILDER.CreateBitCast(BUILDER.CreateLoad(gcpop, false), T_ppvalue),
-                        btpgcstack_var);
+  // The arguments go to the first slots of the gc frame.
+  allocaArgPass();
 
-    // Finish off the function.
-    BUILDER.CreateRet(RetVal);
-    FPM->run(*TheFunction);
+  if (LIRLowering(*LIR).lower()) {
+    finishGCFrame();
+    // tier 0 is optimized just enough to be fast to compile, the optimized
+    // tier is optimized with the whole of its module by bt_tier_up
+    if (!Speculate)
+      (Info ? BASELINE_FPM : FPM)->run(*TheFunction);
 
     // Validate the generated code, checking for consistency.
     llvm::verifyFunction(*TheFunction);
@@ -513,6 +1931,7 @@ void init_butterfly_per_module(void) {
 
   std::string bt_typeof_sym("bt_typeof");
   std::string bt_new_int64_sym("bt_new_int64"), num_sym("num");
+  std::string bt_new_float64_sym("bt_new_float64");
   std::string bt_new_fptr_sym("bt_new_fptr"), fp_sym("fp"), nargs_sym("nargs");
   std::string bt_box_sym("bt_box");
   std::string bt_unbox_sym("bt_unbox"), box_sym("box");
@@ -520,9 +1939,29 @@ void init_butterfly_per_module(void) {
   std::string bt_closure_sym("bt_closure"), n_sym("n"), members_sym("members"); 
   std::string bt_getfield_sym("bt_getfield"), object_sym("object"); 
   std::string bt_get_callable_sym("bt_get_callable"), val_sym("val");
+  std::string bt_ic_miss_sym("bt_ic_miss"), cache_sym("cache"), ways_sym("ways");
+  std::string bt_tier_up_sym("bt_tier_up"), info_sym("info");
+  std::string bt_deopt_sym("bt_deopt"), site_sym("site"), seen_sym("seen");
   std::string bt_binary_int64_sym("bt_binary_int64"), op_sym("op"), lhs_sym("lhs"), rhs_sym("rhs");
   std::string bt_as_bool_sym("bt_as_bool"), cond_sym("cond");
   std::string bt_error_sym("bt_error");
+  std::string bt_alloc_slow_sym("bt_alloc_slow"), size_sym("size");
+  std::string bt_gc_wb_slow_sym("bt_gc_wb_slow"), obj_sym("obj");
+  std::string bt_gc_satb_slow_sym("bt_gc_satb_slow"), old_val_sym("old_val");
+  std::string bt_cons_alloc_slow_sym("bt_cons_alloc_slow"), nwords_sym("nwords");
+  std::string bt_set_cdr_codes_sym("bt_set_cdr_codes"), cell_sym("cell"), last_code_sym("last_code");
+  std::string bt_car_sym("bt_car"), bt_cdr_sym("bt_cdr"), pair_sym("pair");
+  std::string bt_map_sym("bt_map"), f_sym("f"), list_sym("list");
+  std::string bt_vector_set_sym("bt_vector_set");
+  std::string bt_string_length_sym("bt_string_length");
+  std::string bt_string_ref_sym("bt_string_ref");
+  std::string bt_string_eq_sym("bt_string_eq");
+  std::string bt_string_lt_sym("bt_string_lt");
+  std::string bt_make_hash_table_sym("bt_make_hash_table");
+  std::string bt_hash_count_sym("bt_hash_count"), table_sym("table");
+  std::string bt_hash_ref_sym("bt_hash_ref"), key_sym("key"), hash_sym("hash"), dflt_sym("dflt");
+  std::string bt_hash_set_sym("bt_hash_set");
+  std::string bt_hash_string_sym("bt_hash_string"), str_sym("str");
   llvm::FunctionType *FT = nullptr;
   llvm::Function *F = nullptr;
   unsigned Idx = 0;
@@ -532,7 +1971,7 @@ void init_butterfly_per_module(void) {
   
   // initialize bt_typeof
   formals_name.push_back(val_sym);
-  formals_type.push_back( llvm::Type::getInt8PtrTy(LLVM_CONTEXT) );
+  formals_type.push_back( getValueTy() );
   FT = llvm::FunctionType::get(llvm::Type::getInt32Ty(LLVM_CONTEXT), formals_type, false);
   F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, bt_typeof_sym, MODULE.get());
   // Set names for all arguments.
@@ -545,8 +1984,8 @@ void init_butterfly_per_module(void) {
 
   // initialize bt_new_int64
   formals_name.push_back(num_sym);
-  formals_type.push_back( llvm::Type::getInt32Ty(LLVM_CONTEXT) );
-  FT = llvm::FunctionType::get(llvm::Type::getInt8PtrTy(LLVM_CONTEXT), formals_type, false);
+  formals_type.push_back( llvm::Type::getInt64Ty(LLVM_CONTEXT) );
+  FT = llvm::FunctionType::get(getValueTy(), formals_type, false);
   F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, bt_new_int64_sym, MODULE.get());
   // Set names for all arguments.
   Idx = 0;
@@ -556,12 +1995,25 @@ void init_butterfly_per_module(void) {
   formals_name.clear();
   formals_type.clear();
 
+  // initialize bt_new_float64
+  formals_name.push_back(num_sym);
+  formals_type.push_back( llvm::Type::getDoubleTy(LLVM_CONTEXT) );
+  FT = llvm::FunctionType::get(getValueTy(), formals_type, false);
+  F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, bt_new_float64_sym, MODULE.get());
+  // Set names for all arguments.
+  Idx = 0;
+  for (auto &Arg : F->args())
+    Arg.setName(formals_name[Idx++]);
+  // cleanup 
+  formals_name.clear();
+  formals_type.clear();
+
   // initialize bt_new_fptr
   formals_name.push_back(fp_sym);
   formals_name.push_back(nargs_sym);
   formals_type.push_back( llvm::Type::getInt8PtrTy(LLVM_CONTEXT) );
   formals_type.push_back( llvm::Type::getInt32Ty(LLVM_CONTEXT) );
-  FT = llvm::FunctionType::get(llvm::Type::getInt8PtrTy(LLVM_CONTEXT), formals_type, false);
+  FT = llvm::FunctionType::get(getValueTy(), formals_type, false);
   F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, bt_new_fptr_sym, MODULE.get());
   // Set names for all arguments.
   Idx = 0;
@@ -573,8 +2025,8 @@ void init_butterfly_per_module(void) {
 
   // initialize bt_box
   formals_name.push_back(val_sym);
-  formals_type.push_back( llvm::Type::getInt8PtrTy(LLVM_CONTEXT) );
-  FT = llvm::FunctionType::get(llvm::Type::getInt8PtrTy(LLVM_CONTEXT), formals_type, false);
+  formals_type.push_back( getValueTy() );
+  FT = llvm::FunctionType::get(getValueTy(), formals_type, false);
   F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, bt_box_sym, MODULE.get());
   // Set names for all arguments.
   Idx = 0;
@@ -586,8 +2038,8 @@ void init_butterfly_per_module(void) {
 
   // initialize bt_unbox
   formals_name.push_back(box_sym);
-  formals_type.push_back( llvm::Type::getInt8PtrTy(LLVM_CONTEXT) );
-  FT = llvm::FunctionType::get(llvm::Type::getInt8PtrTy(LLVM_CONTEXT), formals_type, false);
+  formals_type.push_back( getValueTy() );
+  FT = llvm::FunctionType::get(getValueTy(), formals_type, false);
   F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, bt_unbox_sym, MODULE.get());
   // Set names for all arguments.
   Idx = 0;
@@ -600,9 +2052,9 @@ void init_butterfly_per_module(void) {
   // initialize bt_set_box
   formals_name.push_back(box_sym);
   formals_name.push_back(new_val_sym);
-  formals_type.push_back( llvm::Type::getInt8PtrTy(LLVM_CONTEXT) );
-  formals_type.push_back( llvm::Type::getInt8PtrTy(LLVM_CONTEXT) );
-  FT = llvm::FunctionType::get(llvm::Type::getInt8PtrTy(LLVM_CONTEXT), formals_type, false);
+  formals_type.push_back( getValueTy() );
+  formals_type.push_back( getValueTy() );
+  FT = llvm::FunctionType::get(getValueTy(), formals_type, false);
   F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, bt_set_box_sym, MODULE.get());
   // Set names for all arguments.
   Idx = 0;
@@ -618,8 +2070,8 @@ void init_butterfly_per_module(void) {
   formals_name.push_back(members_sym);
   formals_type.push_back( llvm::Type::getInt8PtrTy(LLVM_CONTEXT) );
   formals_type.push_back( llvm::Type::getInt32Ty(LLVM_CONTEXT) );
-  formals_type.push_back( llvm::PointerType::get(llvm::Type::getInt8PtrTy(LLVM_CONTEXT), 0) );
-  FT = llvm::FunctionType::get(llvm::Type::getInt8PtrTy(LLVM_CONTEXT), formals_type, false);
+  formals_type.push_back( llvm::PointerType::get(getValueTy(), 0) );
+  FT = llvm::FunctionType::get(getValueTy(), formals_type, false);
   F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, bt_closure_sym, MODULE.get());
   // Set names for all arguments.
   Idx = 0;
@@ -632,9 +2084,9 @@ void init_butterfly_per_module(void) {
   // initialize bt_closure
   formals_name.push_back(object_sym);
   formals_name.push_back(n_sym);
-  formals_type.push_back( llvm::Type::getInt8PtrTy(LLVM_CONTEXT) );
+  formals_type.push_back( getValueTy() );
   formals_type.push_back( llvm::Type::getInt32Ty(LLVM_CONTEXT) );
-  FT = llvm::FunctionType::get(llvm::Type::getInt8PtrTy(LLVM_CONTEXT), formals_type, false);
+  FT = llvm::FunctionType::get(getValueTy(), formals_type, false);
   F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, bt_getfield_sym, MODULE.get());
   // Set names for all arguments.
   Idx = 0;
@@ -646,7 +2098,8 @@ void init_butterfly_per_module(void) {
 
   // initialize bt_get_callable
   formals_name.push_back(val_sym);
-  formals_type.push_back( llvm::Type::getInt8PtrTy(LLVM_CONTEXT) );
+  formals_type.push_back( getValueTy() );
+  // the result is a raw code pointer, not a value
   FT = llvm::FunctionType::get(llvm::Type::getInt8PtrTy(LLVM_CONTEXT), formals_type, false);
   F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, bt_get_callable_sym, MODULE.get());
   // Set names for all arguments.
@@ -657,14 +2110,61 @@ void init_butterfly_per_module(void) {
   formals_name.clear();
   formals_type.clear();
 
+  // initialize bt_ic_miss
+  formals_name.push_back(cache_sym);
+  formals_name.push_back(ways_sym);
+  formals_name.push_back(val_sym);
+  formals_type.push_back( llvm::Type::getInt64PtrTy(LLVM_CONTEXT) );
+  formals_type.push_back( llvm::Type::getInt64PtrTy(LLVM_CONTEXT) );
+  formals_type.push_back( getValueTy() );
+  FT = llvm::FunctionType::get(llvm::Type::getVoidTy(LLVM_CONTEXT), formals_type, false);
+  F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, bt_ic_miss_sym, MODULE.get());
+  // Set names for all arguments.
+  Idx = 0;
+  for (auto &Arg : F->args())
+    Arg.setName(formals_name[Idx++]);
+  // cleanup 
+  formals_name.clear();
+  formals_type.clear();
+
+  // initialize bt_tier_up
+  formals_name.push_back(info_sym);
+  formals_type.push_back( llvm::Type::getInt8PtrTy(LLVM_CONTEXT) );
+  FT = llvm::FunctionType::get(llvm::Type::getVoidTy(LLVM_CONTEXT), formals_type, false);
+  F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, bt_tier_up_sym, MODULE.get());
+  // Set names for all arguments.
+  Idx = 0;
+  for (auto &Arg : F->args())
+    Arg.setName(formals_name[Idx++]);
+  // cleanup 
+  formals_name.clear();
+  formals_type.clear();
+
+  // initialize bt_deopt
+  formals_name.push_back(info_sym);
+  formals_name.push_back(site_sym);
+  formals_name.push_back(seen_sym);
+  formals_type.push_back( llvm::Type::getInt8PtrTy(LLVM_CONTEXT) );
+  formals_type.push_back( llvm::Type::getInt64PtrTy(LLVM_CONTEXT) );
+  formals_type.push_back( llvm::Type::getInt64Ty(LLVM_CONTEXT) );
+  FT = llvm::FunctionType::get(llvm::Type::getVoidTy(LLVM_CONTEXT), formals_type, false);
+  F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, bt_deopt_sym, MODULE.get());
+  // Set names for all arguments.
+  Idx = 0;
+  for (auto &Arg : F->args())
+    Arg.setName(formals_name[Idx++]);
+  // cleanup 
+  formals_name.clear();
+  formals_type.clear();
+
   // initialize bt_binary_int64
   formals_name.push_back(op_sym);
   formals_name.push_back(lhs_sym);
   formals_name.push_back(rhs_sym);
   formals_type.push_back( llvm::Type::getInt32Ty(LLVM_CONTEXT) );
-  formals_type.push_back( llvm::Type::getInt8PtrTy(LLVM_CONTEXT) );
-  formals_type.push_back( llvm::Type::getInt8PtrTy(LLVM_CONTEXT) );
-  FT = llvm::FunctionType::get(llvm::Type::getInt8PtrTy(LLVM_CONTEXT), formals_type, false);
+  formals_type.push_back( getValueTy() );
+  formals_type.push_back( getValueTy() );
+  FT = llvm::FunctionType::get(getValueTy(), formals_type, false);
   F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, bt_binary_int64_sym, MODULE.get());
   // Set names for all arguments.
   Idx = 0;
@@ -676,7 +2176,7 @@ void init_butterfly_per_module(void) {
 
   // initialize bt_new_int64
   formals_name.push_back(cond_sym);
-  formals_type.push_back( llvm::Type::getInt8PtrTy(LLVM_CONTEXT) );
+  formals_type.push_back( getValueTy() );
   FT = llvm::FunctionType::get(llvm::Type::getInt32Ty(LLVM_CONTEXT), formals_type, false);
   F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, bt_as_bool_sym, MODULE.get());
   // Set names for all arguments.
@@ -688,9 +2188,193 @@ void init_butterfly_per_module(void) {
   formals_type.clear();
 
   // initialize bt_error
-  FT = llvm::FunctionType::get(llvm::Type::getInt8PtrTy(LLVM_CONTEXT), formals_type, false);
+  FT = llvm::FunctionType::get(getValueTy(), formals_type, false);
   F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, bt_error_sym, MODULE.get());
 
+  // initialize bt_alloc_slow
+  formals_name.push_back(size_sym);
+  formals_type.push_back( llvm::Type::getInt64Ty(LLVM_CONTEXT) );
+  FT = llvm::FunctionType::get(llvm::Type::getInt8PtrTy(LLVM_CONTEXT), formals_type, false);
+  F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, bt_alloc_slow_sym, MODULE.get());
+  // Set names for all arguments.
+  Idx = 0;
+  for (auto &Arg : F->args())
+    Arg.setName(formals_name[Idx++]);
+  // cleanup 
+  formals_name.clear();
+  formals_type.clear();
+
+  // initialize bt_cons_alloc_slow
+  formals_name.push_back(nwords_sym);
+  formals_type.push_back( llvm::Type::getInt64Ty(LLVM_CONTEXT) );
+  FT = llvm::FunctionType::get(llvm::Type::getInt8PtrTy(LLVM_CONTEXT), formals_type, false);
+  F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, bt_cons_alloc_slow_sym, MODULE.get());
+  // Set names for all arguments.
+  Idx = 0;
+  for (auto &Arg : F->args())
+    Arg.setName(formals_name[Idx++]);
+  // cleanup 
+  formals_name.clear();
+  formals_type.clear();
+
+  // initialize bt_set_cdr_codes
+  formals_name.push_back(cell_sym);
+  formals_name.push_back(n_sym);
+  formals_name.push_back(last_code_sym);
+  formals_type.push_back( getValueTy() );
+  formals_type.push_back( llvm::Type::getInt64Ty(LLVM_CONTEXT) );
+  formals_type.push_back( llvm::Type::getInt32Ty(LLVM_CONTEXT) );
+  FT = llvm::FunctionType::get(llvm::Type::getVoidTy(LLVM_CONTEXT), formals_type, false);
+  F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, bt_set_cdr_codes_sym, MODULE.get());
+  // Set names for all arguments.
+  Idx = 0;
+  for (auto &Arg : F->args())
+    Arg.setName(formals_name[Idx++]);
+  // cleanup 
+  formals_name.clear();
+  formals_type.clear();
+
+  // initialize bt_car and bt_cdr
+  for (const std::string &Sym : {bt_car_sym, bt_cdr_sym}) {
+    formals_name.push_back(pair_sym);
+    formals_type.push_back( getValueTy() );
+    FT = llvm::FunctionType::get(getValueTy(), formals_type, false);
+    F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, Sym, MODULE.get());
+    // Set names for all arguments.
+    Idx = 0;
+    for (auto &Arg : F->args())
+      Arg.setName(formals_name[Idx++]);
+    // cleanup 
+    formals_name.clear();
+    formals_type.clear();
+  }
+
+  // initialize the vector and string primitives, they take and return values only
+  std::vector<std::pair<std::string, int>> vector_syms = {
+      { "bt_make_f64vector", 1 },
+      { "bt_make_i64vector", 1 },
+      { "bt_vector_length", 1 },
+      { "bt_vector_ref", 2 },
+      { "bt_vector_set", 3 },
+      { "bt_vector_add", 2 },
+      { "bt_vector_mul", 2 },
+      { "bt_vector_fma", 3 },
+      { "bt_vector_sum", 1 },
+      { "bt_string_length", 1 },
+      { "bt_string_ref", 2 },
+      { "bt_substring", 3 },
+      { "bt_string_append", 2 },
+      { "bt_string_eq", 2 },
+      { "bt_string_lt", 2 },
+  };
+  for (auto &Sym : vector_syms) {
+    formals_type.assign(Sym.second, getValueTy());
+    FT = llvm::FunctionType::get(getValueTy(), formals_type, false);
+    F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, Sym.first, MODULE.get());
+    formals_type.clear();
+  }
+
+  // initialize bt_make_hash_table and bt_hash_count
+  FT = llvm::FunctionType::get(getValueTy(), formals_type, false);
+  F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, bt_make_hash_table_sym, MODULE.get());
+  formals_name.push_back(table_sym);
+  formals_type.push_back( getValueTy() );
+  FT = llvm::FunctionType::get(getValueTy(), formals_type, false);
+  F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, bt_hash_count_sym, MODULE.get());
+  // Set names for all arguments.
+  Idx = 0;
+  for (auto &Arg : F->args())
+    Arg.setName(formals_name[Idx++]);
+  // cleanup 
+  formals_name.clear();
+  formals_type.clear();
+
+  // initialize bt_hash_ref and bt_hash_set, the hash of the key is computed
+  // by the caller
+  for (const std::string &Sym : {bt_hash_ref_sym, bt_hash_set_sym}) {
+    formals_name.push_back(table_sym);
+    formals_name.push_back(key_sym);
+    formals_name.push_back(hash_sym);
+    formals_name.push_back(Sym == bt_hash_ref_sym ? dflt_sym : val_sym);
+    formals_type.push_back( getValueTy() );
+    formals_type.push_back( getValueTy() );
+    formals_type.push_back( llvm::Type::getInt64Ty(LLVM_CONTEXT) );
+    formals_type.push_back( getValueTy() );
+    FT = llvm::FunctionType::get(getValueTy(), formals_type, false);
+    F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, Sym, MODULE.get());
+    // Set names for all arguments.
+    Idx = 0;
+    for (auto &Arg : F->args())
+      Arg.setName(formals_name[Idx++]);
+    // cleanup 
+    formals_name.clear();
+    formals_type.clear();
+  }
+
+  // initialize bt_hash_string
+  formals_name.push_back(str_sym);
+  formals_type.push_back( getValueTy() );
+  FT = llvm::FunctionType::get(llvm::Type::getInt64Ty(LLVM_CONTEXT), formals_type, false);
+  F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, bt_hash_string_sym, MODULE.get());
+  // Set names for all arguments.
+  Idx = 0;
+  for (auto &Arg : F->args())
+    Arg.setName(formals_name[Idx++]);
+  // cleanup 
+  formals_name.clear();
+  formals_type.clear();
+
+  // initialize bt_map
+  formals_name.push_back(f_sym);
+  formals_name.push_back(list_sym);
+  formals_type.push_back( getValueTy() );
+  formals_type.push_back( getValueTy() );
+  FT = llvm::FunctionType::get(getValueTy(), formals_type, false);
+  F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, bt_map_sym, MODULE.get());
+  // Set names for all arguments.
+  Idx = 0;
+  for (auto &Arg : F->args())
+    Arg.setName(formals_name[Idx++]);
+  // cleanup 
+  formals_name.clear();
+  formals_type.clear();
+
+  // initialize bt_gc_satb_slow
+  formals_name.push_back(old_val_sym);
+  formals_type.push_back( getValueTy() );
+  FT = llvm::FunctionType::get(llvm::Type::getVoidTy(LLVM_CONTEXT), formals_type, false);
+  F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, bt_gc_satb_slow_sym, MODULE.get());
+  // Set names for all arguments.
+  Idx = 0;
+  for (auto &Arg : F->args())
+    Arg.setName(formals_name[Idx++]);
+  // cleanup 
+  formals_name.clear();
+  formals_type.clear();
+
+  // initialize bt_gc_wb_slow
+  formals_name.push_back(obj_sym);
+  formals_type.push_back( getValueTy() );
+  FT = llvm::FunctionType::get(llvm::Type::getVoidTy(LLVM_CONTEXT), formals_type, false);
+  F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, bt_gc_wb_slow_sym, MODULE.get());
+  // Set names for all arguments.
+  Idx = 0;
+  for (auto &Arg : F->args())
+    Arg.setName(formals_name[Idx++]);
+  // cleanup 
+  formals_name.clear();
+  formals_type.clear();
+
+  // These never allocate, calls to them need no safepoint in statepoint mode.
+  for (const std::string &Leaf : {bt_typeof_sym, bt_unbox_sym, bt_set_box_sym, bt_getfield_sym,
+                                  bt_get_callable_sym, bt_ic_miss_sym, bt_tier_up_sym, bt_deopt_sym,
+                                  bt_as_bool_sym, bt_error_sym,
+                                  bt_gc_satb_slow_sym, bt_gc_wb_slow_sym, bt_set_cdr_codes_sym,
+                                  bt_car_sym, bt_cdr_sym, bt_vector_set_sym, bt_string_length_sym,
+                                  bt_string_ref_sym, bt_string_eq_sym, bt_string_lt_sym,
+                                  bt_hash_count_sym, bt_hash_ref_sym, bt_hash_string_sym})
+    MODULE->getFunction(Leaf)->addFnAttr("gc-leaf-function");
+
   // printf("init successful!\n");
   // MODULE->dump();
 
@@ -703,5 +2387,35 @@ void init_butterfly_per_module(void) {
   // Should I add global mapping?
   JIT->addGlobalMapping("bt_pgcstack", (char *)&bt_pgcstack);
 
+  llvm::Type *T_tlab = llvm::StructType::get(LLVM_CONTEXT, {T_pvalue, T_pvalue});
+  bttlab_var =
+        new llvm::GlobalVariable(*MODULE, T_tlab,
+                           false, llvm::GlobalVariable::ExternalLinkage,
+                           NULL, "bt_tlab");
+  JIT->addGlobalMapping("bt_tlab", (char *)&bt_tlab);
+
+  btconstlab_var =
+        new llvm::GlobalVariable(*MODULE, T_tlab,
+                           false, llvm::GlobalVariable::ExternalLinkage,
+                           NULL, "bt_cons_tlab");
+  JIT->addGlobalMapping("bt_cons_tlab", (char *)&bt_cons_tlab);
+
+  btgcmarking_var =
+        new llvm::GlobalVariable(*MODULE, llvm::Type::getInt8Ty(LLVM_CONTEXT),
+                           false, llvm::GlobalVariable::ExternalLinkage,
+                           NULL, "bt_gc_marking");
+  JIT->addGlobalMapping("bt_gc_marking", (char *)&bt_gc_marking);
+
   return;
 }
+
+void finalize_butterfly_per_module(void) {
+  if (!bt_gc_statepoints)
+    return;
+
+  // Rewrite every call that may collect into a statepoint, relocating the
+  // live values across it, and have the backend emit the stack maps.
+  llvm::legacy::PassManager PM;
+  PM.add(llvm::createRewriteStatepointsForGCPass());
+  PM.run(*MODULE);
+}
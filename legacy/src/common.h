@@ -8,7 +8,9 @@
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
@@ -20,6 +22,12 @@
 #include "../include/KaleidoscopeJIT.h"
 
 #include "objects.h"
+#include "gc.h"
+#include "profile.h"
+#include "simd.h"
+#include "symbol.h"
+#include "hash.h"
+#include "feedback.h"
 
 #include <map>
 #include <unordered_set>
@@ -37,6 +45,7 @@ enum token_type {
   tok_if,
   tok_cond,
   tok_begin,
+  tok_quote,
 
   // operators
   tok_open,
@@ -48,6 +57,7 @@ enum token_type {
   tok_gt,
   tok_lt,
   tok_eq,
+  tok_eqp,
   tok_and,
   tok_or,
   tok_not,
@@ -58,11 +68,43 @@ enum token_type {
   tok_closure,
   tok_getfield,
 
+  tok_cons,
+  tok_car,
+  tok_cdr,
+  tok_list,
+  tok_nullp,
+  tok_pairp,
+  tok_map,
+
+  tok_make_f64vector,
+  tok_make_i64vector,
+  tok_vector_length,
+  tok_vector_ref,
+  tok_vector_set,
+  tok_vector_add,
+  tok_vector_mul,
+  tok_vector_fma,
+  tok_vector_sum,
+
+  tok_string_length,
+  tok_string_ref,
+  tok_substring,
+  tok_string_append,
+  tok_string_eq,
+  tok_string_lt,
+
+  tok_make_hash_table,
+  tok_hash_ref,
+  tok_hash_set,
+  tok_hash_count,
+
   tok_nil,
 
   // primitive types
   tok_symbol,
   tok_integer,
+  tok_float,
+  tok_string,
 
   // whitespaces
   tok_space,
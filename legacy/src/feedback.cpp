@@ -0,0 +1,28 @@
+#include <cstdio>
+#include <cstdlib>
+
+#include "feedback.h"
+
+int64_t bt_tier_up_calls = 1000;
+int64_t bt_tier_up_backedges = 10000;
+
+extern "C"
+void bt_deopt(bt_function_info_t *info, uint64_t *site, uint64_t seen) {
+  // the caller finishes the generic way, later calls run the generic tier.
+  // Frames of the optimized tier still running may fail again, only the
+  // first failure counts.
+  if (info->optimized) {
+    info->optimized = nullptr;
+    info->calls = 0;
+    info->backedges = 0;
+    info->deopts++;
+  }
+  *site |= seen;
+}
+
+void init_feedback(void) {
+  if (getenv("BT_TIER_UP"))
+    bt_tier_up_calls = atol(getenv("BT_TIER_UP"));
+  if (getenv("BT_TIER_UP_LOOPS"))
+    bt_tier_up_backedges = atol(getenv("BT_TIER_UP_LOOPS"));
+}
@@ -0,0 +1,66 @@
+#ifndef _FEEDBACK_H
+#define _FEEDBACK_H
+
+#include <cstdint>
+
+// Tiered compilation with type feedback. A function is first compiled in the
+// profiling tier: fully generic code that also records what it sees at its
+// arithmetic, if and call sites. Once it has been called BT_TIER_UP times
+// (BT_TIER_UP=0 turns tiering off) it is compiled again, speculating that
+// each site keeps seeing what it saw so far: only that case is generated
+// inline, behind a guard. From then on the profiling tier forwards every
+// call to the optimized one. Self tail calls, the loops of the language,
+// count too: a function that loops BT_TIER_UP_LOOPS times is optimized as
+// well, its next call runs the optimized tier.
+//
+// The profiling tier is tier 0, compiled fast with only the allocas
+// promoted and the backend at O0, since most functions never get hot. The
+// optimized tier gets the full pass pipeline and the backend at O3 on a
+// thread of its own (see tierup.h).
+//
+// A guard that fails deoptimizes: the site gets the generic treatment right
+// there, the function stops forwarding, so the next calls run the generic
+// tier again, and the failure is added to the feedback. A function that is
+// still hot is then optimized again, a function that keeps deoptimizing
+// stays generic.
+
+// what an arithmetic site saw: both operands fixnums, both flonums, or
+// anything else (including overflow)
+#define BT_FB_FIXNUM 1
+#define BT_FB_FLONUM 2
+#define BT_FB_OTHER  4
+// what the condition of an if site was: #t or #f, or anything else
+#define BT_FB_BOOL   1
+
+// feedback words of the sites: the seen bits, an if site also counts how
+// often either branch was taken
+#define BT_FB_ARITH_WORDS 1
+#define BT_FB_IF_WORDS    3
+
+// optimizations of a function before it stays generic for good
+#define BT_MAX_DEOPTS 4
+
+typedef struct _bt_function_info_t {
+  int64_t calls;       // calls of the profiling tier since the last deopt
+  void *optimized;     // code of the optimized tier, nullptr when there is none
+  int64_t deopts;
+  void *function;      // the FunctionAST, for the compiler
+  int64_t backedges;   // self tail calls of the profiling tier since the last deopt
+  int64_t compiling;   // the optimized tier is being compiled in the background
+} bt_function_info_t;
+
+// calls before a function is optimized, 0 when tiering is off
+extern int64_t bt_tier_up_calls;
+// self tail calls before a function is optimized
+extern int64_t bt_tier_up_backedges;
+
+// Compile the optimized tier of a hot function, part of the compiler
+extern "C" void bt_tier_up(bt_function_info_t *info);
+
+// A guard of the optimized tier failed at the site with feedback words
+// site, which now also saw what seen says
+extern "C" void bt_deopt(bt_function_info_t *info, uint64_t *site, uint64_t seen);
+
+void init_feedback(void);
+
+#endif
@@ -0,0 +1,1033 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "gc.h"
+#include "profile.h"
+#include "stackmap.h"
+
+#include <sys/mman.h>
+
+// Precise generational collector.
+//
+// Objects are allocated in the nursery, a contiguous young space that bt_tlab
+// bumps through. When it fills up, a minor collection copies the objects
+// reachable from the roots and from the remembered set into the old space
+// and resets the nursery. Minor collections never look at the rest of the old
+// space, their cost is proportional to the survivors.
+//
+// The old space is collected by a non-moving mark-sweep. Small objects live
+// in BT_BLOCK_SIZE blocks that are always parseable: every byte from
+// bt_block_start to bt_block_end belongs to an object or to a FreeTy filler,
+// so the sweeper can walk a block object by object using the header sizes.
+// Dead runs are coalesced into fillers and handed back to the promotion
+// allocator as free ranges. Large objects are allocated one by one directly
+// in the old space and tracked separately.
+//
+// Marking is done by a pool of GC threads that steal work from each other.
+// By default the mutator is stopped while the pool marks (parallel mode).
+// With BT_GC_CONCURRENT set, the pool marks while the mutator keeps running
+// (concurrent mode): the roots are snapshotted in a short pause, and the SATB
+// barrier (bt_gc_satb) logs every old reference the mutator overwrites, so
+// everything reachable at the snapshot gets marked. Objects promoted or
+// allocated in the old space during marking are marked right away.
+//
+// Pairs are kept apart in the cons space (see gc.h). Cons blocks have mark
+// bits like the other blocks but are not parseable, a cell's extent comes
+// from its cdr code, so they are swept word by word. Cells are not copied by
+// minor collections: the cells allocated since the last one are scanned as
+// roots instead, since their initializing stores are not barriered.
+//
+// Roots come from the bt_pgcstack shadow stack, which JIT code maintains for
+// arguments, locals and temporaries, and runtime code extends with
+// BT_GC_PUSH*. Old objects that may point into the nursery are recorded by the
+// write barrier (bt_gc_wb) in the remembered set.
+//
+// With BT_GC_STATEPOINTS set, JIT code pushes no gc frames. Its roots are
+// found by walking the frame pointer chain and looking up every return
+// address in the stack maps of the JIT code (see stackmap.h); minor
+// collections update those stack slots in place, derived pointers included.
+// Runtime C code still uses the shadow stack.
+//
+// BT_GC_THREADS sets the number of marking threads. BT_GC_VERBOSE prints
+// every pause, and a summary per kind of pause at exit.
+
+bt_tlab_t bt_tlab;
+bt_space_t bt_nursery;
+bool bt_gc_marking;
+bool bt_gc_statepoints;
+bt_space_t bt_cons_space;
+bt_tlab_t bt_cons_tlab;
+
+typedef struct _bt_large_t {
+  struct _bt_large_t *next;
+  int64_t size;
+  int32_t marked;
+  int32_t remembered;
+  char *base; // what to free, the header may be placed further in
+  // object goes here
+} bt_large_t;
+
+#define bt_large_object(l) ((char *) (l) + sizeof(bt_large_t))
+#define bt_large_header(obj) ((bt_large_t *) ((char *) (obj) - sizeof(bt_large_t)))
+
+#define GC_MIN_THRESHOLD (4 * 1024 * 1024)
+// free ranges smaller than this are left as fillers until the next sweep
+#define GC_MIN_FREE_RANGE 256
+#define GC_MAX_THREADS 8
+// a marker shares half of its private stack once it grows past this
+#define GC_SHARE_THRESHOLD 64
+
+// Block map: tells whether an address is a heap block without taking a lock,
+// so marking threads can look blocks up while the mutator adds new ones.
+// Two levels indexed by the block number, which covers 48-bit addresses.
+#define BLOCK_MAP_BITS 16
+#define BLOCK_MAP_MASK ((1 << BLOCK_MAP_BITS) - 1)
+static std::atomic<uint8_t *> block_map[1 << BLOCK_MAP_BITS];
+
+static bt_block_t *blocks;
+static bt_large_t *large_objects;
+// large objects are rare, a lock is good enough for them
+static std::mutex large_lock;
+static std::unordered_set<uintptr_t> large_set;
+static std::vector<std::pair<char *, char *>> free_ranges;
+// promotion buffer, same discipline as bt_tlab but in the old space
+static bt_tlab_t old_buf;
+static std::vector<bt_value_t *> remembered_set;
+// old values logged by the SATB barrier while concurrent marking runs
+static std::vector<bt_value_t *> satb_buffer;
+
+// cons space: blocks are handed out from cons_top, freed cells come back as
+// runs of words after a sweep
+#define CONS_HEADER_WORDS (sizeof(bt_cons_block_t) / 8)
+// free runs (in words) smaller than a list chunk are left alone until the
+// next sweep
+#define CONS_MIN_FREE_RUN (BT_LIST_CHUNK + 1)
+static char *cons_top;
+static std::vector<bt_cons_block_t *> cons_blocks;
+static std::vector<std::pair<char *, char *>> cons_free_runs;
+// start of the cells bt_cons_tlab handed out since the last retire_cons_run
+static char *cons_run_start;
+// cells allocated since the last minor collection
+static std::vector<std::pair<char *, char *>> cons_young;
+// cells allocated during concurrent marking, marked at the remark
+static std::vector<std::pair<char *, char *>> cons_black;
+
+static int64_t allocated_since_gc;
+static int64_t gc_threshold = GC_MIN_THRESHOLD;
+static int64_t live_bytes;
+static int64_t num_collections;
+static bool gc_verbose;
+static bool gc_concurrent;
+static int gc_num_threads;
+
+typedef struct _gc_pause_stats_t {
+  const char *name;
+  int64_t count;
+  double total_us;
+  double max_us;
+} gc_pause_stats_t;
+
+static gc_pause_stats_t minor_pauses = { "minor", 0, 0, 0 };
+static gc_pause_stats_t major_pauses = { "major", 0, 0, 0 };
+static gc_pause_stats_t initial_mark_pauses = { "initial mark", 0, 0, 0 };
+static gc_pause_stats_t remark_pauses = { "remark", 0, 0, 0 };
+
+typedef std::chrono::steady_clock gc_clock;
+
+static void record_pause(gc_pause_stats_t &stats, gc_clock::time_point start) {
+  double us = std::chrono::duration<double, std::micro>(gc_clock::now() - start).count();
+  stats.count++;
+  stats.total_us += us;
+  if (us > stats.max_us)
+    stats.max_us = us;
+  if (gc_verbose)
+    fprintf(stderr, "[gc] %s pause %.1f us\n", stats.name, us);
+}
+
+static void print_pause_stats(void) {
+  gc_pause_stats_t *all[] = { &minor_pauses, &major_pauses, &initial_mark_pauses, &remark_pauses };
+  fprintf(stderr, "[gc] %s marking, %d threads\n",
+          gc_concurrent ? "concurrent" : "parallel", gc_num_threads);
+  for (gc_pause_stats_t *stats : all) {
+    if (!stats->count)
+      continue;
+    fprintf(stderr, "[gc] %-12s %6ld pauses, avg %8.1f us, max %8.1f us\n", stats->name,
+            (long) stats->count, stats->total_us / stats->count, stats->max_us);
+  }
+}
+
+static void make_filler(char *start, char *end) {
+  if (start >= end)
+    return;
+  bt_value_t *filler = (bt_value_t *) start;
+  filler->type = FreeTy;
+  filler->size = (int32_t) ((end - start - sizeof(bt_value_t)) / sizeof(bt_value_t *));
+}
+
+static void retire_old_buf(void) {
+  make_filler(old_buf.cur, old_buf.limit);
+  old_buf.cur = nullptr;
+  old_buf.limit = nullptr;
+}
+
+// With the allocation profiler on, the buffer ends at the next sample point
+// rather than at the end of the nursery, the allocation crossing it then
+// takes the slow path and gets sampled.
+static int64_t bytes_until_sample;
+static char *sample_base; // bt_tlab.cur when the limit was set
+
+static void count_sample_bytes(void) {
+  bytes_until_sample -= bt_tlab.cur - sample_base;
+  sample_base = bt_tlab.cur;
+}
+
+static void set_tlab_limit(void) {
+  bt_tlab.limit = bt_nursery.end;
+  sample_base = bt_tlab.cur;
+  if (bt_profile_interval && bytes_until_sample < bt_tlab.limit - bt_tlab.cur)
+    bt_tlab.limit = bt_tlab.cur + std::max(bytes_until_sample, (int64_t) 0);
+}
+
+static void reset_nursery(void) {
+  count_sample_bytes();
+  bt_tlab.cur = bt_nursery.start;
+  set_tlab_limit();
+}
+
+static void block_map_insert(bt_block_t *block) {
+  uintptr_t n = (uintptr_t) block / BT_BLOCK_SIZE;
+  std::atomic<uint8_t *> &leaf = block_map[(n >> BLOCK_MAP_BITS) & BLOCK_MAP_MASK];
+  uint8_t *entries = leaf.load(std::memory_order_acquire);
+  if (!entries) {
+    // only the mutator adds blocks, nobody races to create the leaf
+    entries = (uint8_t *) calloc(1 << BLOCK_MAP_BITS, 1);
+    leaf.store(entries, std::memory_order_release);
+  }
+  __atomic_store_n(&entries[n & BLOCK_MAP_MASK], 1, __ATOMIC_RELEASE);
+}
+
+static bool is_block(bt_block_t *block) {
+  uintptr_t n = (uintptr_t) block / BT_BLOCK_SIZE;
+  if (n >> (2 * BLOCK_MAP_BITS))
+    return false;
+  uint8_t *entries = block_map[n >> BLOCK_MAP_BITS].load(std::memory_order_acquire);
+  return entries && __atomic_load_n(&entries[n & BLOCK_MAP_MASK], __ATOMIC_ACQUIRE);
+}
+
+static bool is_large(char *ptr) {
+  std::lock_guard<std::mutex> guard(large_lock);
+  return large_set.count((uintptr_t) ptr);
+}
+
+static bool set_mark(char *ptr);
+
+static bt_block_t *new_block(void) {
+  bt_block_t *block = (bt_block_t *) aligned_alloc(BT_BLOCK_SIZE, BT_BLOCK_SIZE);
+  if (!block) {
+    fprintf(stderr, "Error: %s\n", "alloc failed.");
+    return nullptr;
+  }
+  memset(block->marks, 0, sizeof(block->marks));
+  memset(block->remembered, 0, sizeof(block->remembered));
+  block->next = blocks;
+  blocks = block;
+  block_map_insert(block);
+  return block;
+}
+
+// Allocate a large object whose start is a multiple of align, a power of two.
+static char *alloc_large(int64_t size, int64_t align) {
+  // the header sits right in front of the object
+  int64_t offset = std::max((int64_t) sizeof(bt_large_t), align);
+  int64_t total = (offset + size + align - 1) & ~(align - 1);
+  char *base = (char *) aligned_alloc(std::max(align, (int64_t) 8), total);
+  if (!base) {
+    fprintf(stderr, "Error: %s\n", "alloc failed.");
+    return nullptr;
+  }
+  bt_large_t *large = (bt_large_t *) (base + offset - sizeof(bt_large_t));
+  large->base = base;
+  large->size = size;
+  large->marked = 0;
+  large->remembered = 0;
+  large->next = large_objects;
+  large_objects = large;
+  {
+    std::lock_guard<std::mutex> guard(large_lock);
+    large_set.insert((uintptr_t) bt_large_object(large));
+  }
+  allocated_since_gc += size;
+  // allocate black while marking, the object is not part of the snapshot
+  if (bt_gc_marking)
+    set_mark(bt_large_object(large));
+  return bt_large_object(large);
+}
+
+static bool refill_old_buf(int64_t size) {
+  while (!free_ranges.empty()) {
+    std::pair<char *, char *> range = free_ranges.back();
+    free_ranges.pop_back();
+    if (range.second - range.first >= size) {
+      old_buf.cur = range.first;
+      old_buf.limit = range.second;
+      return true;
+    }
+    // too small for this request, it stays a filler
+  }
+
+  bt_block_t *block = new_block();
+  if (!block)
+    return false;
+  old_buf.cur = bt_block_start(block);
+  old_buf.limit = bt_block_end(block);
+  make_filler(old_buf.cur, old_buf.limit);
+  return true;
+}
+
+static char *alloc_old(int64_t size) {
+  if (size > BT_LARGE_OBJECT_SIZE)
+    return alloc_large(size, 8);
+  if (size > old_buf.limit - old_buf.cur) {
+    retire_old_buf();
+    if (!refill_old_buf(size))
+      return nullptr;
+  }
+  char *obj = old_buf.cur;
+  old_buf.cur += size;
+  allocated_since_gc += size;
+  if (bt_gc_marking)
+    set_mark(obj);
+  return obj;
+}
+
+static size_t cons_word(bt_cons_block_t *block, const void *ptr) {
+  return ((char *) ptr - (char *) block) / 8;
+}
+
+static int cons_code(bt_cons_block_t *block, size_t word) {
+  return (block->codes[word / 32] >> (word % 32 * 2)) & 3;
+}
+
+static void set_cons_code(bt_cons_block_t *block, size_t word, int code) {
+  uint64_t shift = word % 32 * 2;
+  block->codes[word / 32] = (block->codes[word / 32] & ~((uint64_t) 3 << shift)) |
+                            ((uint64_t) code << shift);
+}
+
+static bool cons_marked(bt_cons_block_t *block, size_t word) {
+  return (block->marks[word / 64] >> (word % 64)) & 1;
+}
+
+extern "C"
+void bt_set_cdr_codes(char *cell, int64_t n, int last_code) {
+  for (int64_t i = 0; i < n; i++) {
+    char *word = cell + i * 8;
+    bt_cons_block_t *block = (bt_cons_block_t *) bt_block_of(word);
+    set_cons_code(block, cons_word(block, word), i == n - 1 ? last_code : BT_CDR_NEXT);
+  }
+}
+
+// Close the run of cells handed out by bt_cons_tlab so far.
+static void retire_cons_run(void) {
+  if (cons_run_start && cons_run_start < bt_cons_tlab.cur) {
+    cons_young.push_back(std::make_pair(cons_run_start, bt_cons_tlab.cur));
+    if (bt_gc_marking)
+      cons_black.push_back(std::make_pair(cons_run_start, bt_cons_tlab.cur));
+  }
+  cons_run_start = bt_cons_tlab.cur;
+}
+
+// Give up the rest of the cons buffer, the sweep takes it back.
+static void retire_cons_tlab(void) {
+  retire_cons_run();
+  bt_cons_tlab.cur = nullptr;
+  bt_cons_tlab.limit = nullptr;
+  cons_run_start = nullptr;
+}
+
+static bt_cons_block_t *new_cons_block(void) {
+  if (cons_top + BT_BLOCK_SIZE > bt_cons_space.end)
+    return nullptr;
+  bt_cons_block_t *block = (bt_cons_block_t *) cons_top;
+  cons_top += BT_BLOCK_SIZE;
+  memset(block, 0, sizeof(bt_cons_block_t));
+  cons_blocks.push_back(block);
+  return block;
+}
+
+static bool refill_cons(int64_t size) {
+  char *start = nullptr, *end = nullptr;
+  while (!cons_free_runs.empty()) {
+    std::pair<char *, char *> run = cons_free_runs.back();
+    cons_free_runs.pop_back();
+    if (run.second - run.first >= size) {
+      start = run.first;
+      end = run.second;
+      break;
+    }
+  }
+  if (!start) {
+    bt_cons_block_t *block = new_cons_block();
+    if (!block)
+      return false;
+    start = (char *) block + sizeof(bt_cons_block_t);
+    end = (char *) block + BT_BLOCK_SIZE;
+  }
+
+  // fresh words are full pairs until bt_set_cdr_codes says otherwise
+  bt_cons_block_t *block = (bt_cons_block_t *) bt_block_of(start);
+  for (size_t word = cons_word(block, start); word < cons_word(block, end); word++)
+    set_cons_code(block, word, BT_CDR_FULL);
+  bt_cons_tlab.cur = start;
+  bt_cons_tlab.limit = end;
+  cons_run_start = start;
+  allocated_since_gc += end - start;
+  return true;
+}
+
+// Set the remembered bit of an old object and return its previous value.
+// Objects the collector does not manage are reported as already remembered.
+static bool test_and_set_remembered(bt_value_t *obj) {
+  if (bt_is_cons(obj)) {
+    bt_cons_block_t *block = (bt_cons_block_t *) bt_block_of(obj);
+    size_t word = cons_word(block, obj);
+    uint64_t bit = (uint64_t) 1 << (word % 64);
+    bool was = block->remembered[word / 64] & bit;
+    block->remembered[word / 64] |= bit;
+    return was;
+  }
+  bt_block_t *block = bt_block_of(obj);
+  if (is_block(block)) {
+    size_t word = ((char *) obj - (char *) block) / 8;
+    uint64_t bit = (uint64_t) 1 << (word % 64);
+    bool was = block->remembered[word / 64] & bit;
+    block->remembered[word / 64] |= bit;
+    return was;
+  }
+  if (is_large((char *) obj)) {
+    bt_large_t *large = bt_large_header(obj);
+    bool was = large->remembered;
+    large->remembered = 1;
+    return was;
+  }
+  // not a managed object, nothing can be promoted into it
+  return true;
+}
+
+static void clear_remembered(bt_value_t *obj) {
+  bt_block_t *block = bt_block_of(obj);
+  if (bt_is_cons(obj)) {
+    bt_cons_block_t *cons_block = (bt_cons_block_t *) block;
+    size_t word = cons_word(cons_block, obj);
+    cons_block->remembered[word / 64] &= ~((uint64_t) 1 << (word % 64));
+  } else if (is_block(block)) {
+    size_t word = ((char *) obj - (char *) block) / 8;
+    block->remembered[word / 64] &= ~((uint64_t) 1 << (word % 64));
+  } else {
+    bt_large_header(obj)->remembered = 0;
+  }
+}
+
+extern "C"
+void bt_gc_wb_slow(bt_value_t *obj) {
+  if (!test_and_set_remembered(obj))
+    remembered_set.push_back(obj);
+}
+
+extern "C"
+void bt_gc_satb_slow(bt_value_t *old_val) {
+  // young objects are not part of the snapshot, only the old space is
+  if (bt_is_pointer(old_val) && !bt_in_nursery(old_val))
+    satb_buffer.push_back(old_val);
+}
+
+// Copy a nursery object into the old space, leaving a forwarding pointer
+// behind. Every object has at least one field to hold it.
+static void evacuate(bt_value_t **slot, std::vector<bt_value_t *> &stack) {
+  bt_value_t *obj = *slot;
+  if (!bt_is_pointer(obj) || !bt_in_nursery(obj))
+    return;
+
+  bt_value_t **data = bt_value_data(obj);
+  if (obj->type == ForwardTy) {
+    *slot = data[0];
+    return;
+  }
+
+  size_t size = bt_object_size(obj->size);
+  bt_value_t *copy = (bt_value_t *) alloc_old(size);
+  if (!copy) {
+    fprintf(stderr, "Error: %s\n", "out of memory during promotion.");
+    exit(-1);
+  }
+  memcpy(copy, obj, size);
+  obj->type = ForwardTy;
+  data[0] = copy;
+  *slot = copy;
+  stack.push_back(copy);
+}
+
+static void minor_collect(void) {
+  gc_clock::time_point start = gc_clock::now();
+  if (bt_profile_interval)
+    bt_profile_flush();
+  std::vector<bt_value_t *> stack;
+
+  for (bt_gcframe_t *frame = bt_pgcstack; frame; frame = frame->prev) {
+    intptr_t n = frame->nroots >> 1;
+    bool indirect = frame->nroots & 1;
+    bt_value_t **slots = (bt_value_t **) (frame + 1);
+    for (intptr_t i = 0; i < n; i++)
+      evacuate(indirect ? (bt_value_t **) slots[i] : &slots[i], stack);
+  }
+
+  if (bt_gc_statepoints) {
+    // a derived pointer moves along with its base, so collect the old bases
+    // before anything is evacuated
+    std::vector<std::pair<bt_value_t **, bt_value_t **>> roots;
+    std::vector<bt_value_t *> old_bases;
+    bt_for_each_stack_root([&](bt_value_t **base, bt_value_t **derived) {
+      roots.push_back(std::make_pair(base, derived));
+      old_bases.push_back(*base);
+    });
+    for (auto &root : roots)
+      evacuate(root.first, stack);
+    std::unordered_set<bt_value_t **> fixed;
+    for (size_t i = 0; i < roots.size(); i++) {
+      bt_value_t **base = roots[i].first, **derived = roots[i].second;
+      if (derived == base || *base == old_bases[i] || !fixed.insert(derived).second)
+        continue;
+      *derived = (bt_value_t *) ((char *) *derived + ((char *) *base - (char *) old_bases[i]));
+    }
+  }
+
+  // young cells hold no forwarding pointers and are never copied, every word
+  // of them is a car or a cdr
+  retire_cons_run();
+  for (auto &run : cons_young)
+    for (char *word = run.first; word < run.second; word += 8)
+      evacuate((bt_value_t **) word, stack);
+  cons_young.clear();
+
+  for (bt_value_t *obj : remembered_set) {
+    clear_remembered(obj);
+    bt_for_each_field(obj, [&](bt_value_t **field) { evacuate(field, stack); });
+  }
+  remembered_set.clear();
+
+  // promoted objects are scanned like the roots, until no young reference is left
+  while (!stack.empty()) {
+    bt_value_t *obj = stack.back();
+    stack.pop_back();
+    bt_for_each_field(obj, [&](bt_value_t **field) { evacuate(field, stack); });
+  }
+
+  reset_nursery();
+  // the promoted callees moved
+  bt_ic_flush();
+  record_pause(minor_pauses, start);
+}
+
+// Mark bits are set atomically: several markers may race for the same
+// object, and only the one that sets the bit scans it.
+static bool set_mark(char *ptr) {
+  if (bt_is_cons(ptr)) {
+    bt_cons_block_t *block = (bt_cons_block_t *) bt_block_of(ptr);
+    size_t word = cons_word(block, ptr);
+    uint64_t bit = (uint64_t) 1 << (word % 64);
+    if (__atomic_load_n(&block->marks[word / 64], __ATOMIC_RELAXED) & bit)
+      return false;
+    return !(__atomic_fetch_or(&block->marks[word / 64], bit, __ATOMIC_RELAXED) & bit);
+  }
+  bt_block_t *block = bt_block_of(ptr);
+  if (is_block(block)) {
+    size_t word = (ptr - (char *) block) / 8;
+    uint64_t bit = (uint64_t) 1 << (word % 64);
+    if (__atomic_load_n(&block->marks[word / 64], __ATOMIC_RELAXED) & bit)
+      return false;
+    return !(__atomic_fetch_or(&block->marks[word / 64], bit, __ATOMIC_RELAXED) & bit);
+  }
+  if (is_large(ptr))
+    return !__atomic_exchange_n(&bt_large_header(ptr)->marked, 1, __ATOMIC_RELAXED);
+  // not a managed object (e.g. a static or immortal constant)
+  return false;
+}
+
+static bool is_marked(bt_block_t *block, char *ptr) {
+  size_t word = (ptr - (char *) block) / 8;
+  return (block->marks[word / 64] >> (word % 64)) & 1;
+}
+
+// Work-stealing marking. Every marker pops from a private stack and, when
+// that grows, moves half of it to its shared deque, where idle markers steal
+// from. Only the owner pushes to a shared deque, so once every marker is idle
+// no work can appear anymore and marking is over.
+typedef struct _gc_marker_t {
+  std::mutex lock;
+  std::deque<bt_value_t *> shared;
+  std::atomic<size_t> shared_size;
+  std::vector<bt_value_t *> stack;
+} gc_marker_t;
+
+static gc_marker_t *markers;
+static int active_markers; // markers taking part in the current phase
+static std::atomic<int> idle_markers;
+
+static void mark_value(bt_value_t *val, gc_marker_t &m) {
+  // the nursery is not marked, in concurrent mode it is not empty
+  if (bt_is_pointer(val) && !bt_in_nursery(val) && set_mark((char *) val))
+    m.stack.push_back(val);
+}
+
+static void share_work(gc_marker_t &m) {
+  std::lock_guard<std::mutex> guard(m.lock);
+  size_t half = m.stack.size() / 2;
+  m.shared.insert(m.shared.end(), m.stack.begin(), m.stack.begin() + half);
+  m.stack.erase(m.stack.begin(), m.stack.begin() + half);
+  m.shared_size.store(m.shared.size(), std::memory_order_release);
+}
+
+// Move one object from the shared deque of victim to the stack of m. The
+// owner takes from the back, thieves from the front.
+static bool take_work(gc_marker_t &victim, gc_marker_t &m) {
+  if (!victim.shared_size.load(std::memory_order_acquire))
+    return false;
+  std::lock_guard<std::mutex> guard(victim.lock);
+  if (victim.shared.empty())
+    return false;
+  if (&victim == &m) {
+    m.stack.push_back(victim.shared.back());
+    victim.shared.pop_back();
+  } else {
+    m.stack.push_back(victim.shared.front());
+    victim.shared.pop_front();
+  }
+  victim.shared_size.store(victim.shared.size(), std::memory_order_release);
+  return true;
+}
+
+static bool find_work(int id) {
+  gc_marker_t &m = markers[id];
+  for (int i = 0; i < active_markers; i++)
+    if (take_work(markers[(id + i) % active_markers], m))
+      return true;
+  return false;
+}
+
+static void mark_loop(int id) {
+  gc_marker_t &m = markers[id];
+  while (true) {
+    while (!m.stack.empty()) {
+      bt_value_t *obj = m.stack.back();
+      m.stack.pop_back();
+      bt_for_each_field(obj, [&](bt_value_t **field) { mark_value(*field, m); });
+      // an implied cdr is the next cell
+      if (bt_is_cons(obj) && bt_cdr_code(obj) == BT_CDR_NEXT)
+        mark_value((bt_value_t *) ((char *) obj + 8), m);
+      if (m.stack.size() > GC_SHARE_THRESHOLD &&
+          !m.shared_size.load(std::memory_order_relaxed))
+        share_work(m);
+    }
+    if (find_work(id))
+      continue;
+
+    idle_markers.fetch_add(1);
+    while (true) {
+      if (idle_markers.load() == active_markers)
+        return;
+      // leave the idle count before stealing, so that nobody sees every
+      // marker idle while this one holds work
+      idle_markers.fetch_sub(1);
+      if (find_work(id))
+        break;
+      idle_markers.fetch_add(1);
+      std::this_thread::yield();
+    }
+  }
+}
+
+// The pool threads sleep until a marking phase starts. In parallel mode the
+// mutator joins as the last marker, in concurrent mode it keeps running.
+// The pool is never destroyed: its threads are still waiting at exit.
+typedef struct _gc_pool_t {
+  std::mutex lock;
+  std::condition_variable start;
+  std::condition_variable done;
+  uint64_t epoch;
+  int running;
+  int size;
+} gc_pool_t;
+
+static gc_pool_t *pool;
+
+static void marker_main(int id) {
+  uint64_t seen = 0;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(pool->lock);
+      pool->start.wait(lock, [&] { return pool->epoch != seen; });
+      seen = pool->epoch;
+    }
+    mark_loop(id);
+    {
+      std::lock_guard<std::mutex> guard(pool->lock);
+      if (--pool->running == 0)
+        pool->done.notify_all();
+    }
+  }
+}
+
+// Hand the seeds out round-robin and wake the pool up.
+static void start_marking(std::vector<bt_value_t *> &seeds, int participants) {
+  active_markers = participants;
+  idle_markers.store(0);
+  for (size_t i = 0; i < seeds.size(); i++) {
+    gc_marker_t &m = markers[i % participants];
+    m.shared.push_back(seeds[i]);
+    m.shared_size.store(m.shared.size(), std::memory_order_release);
+  }
+  std::lock_guard<std::mutex> guard(pool->lock);
+  pool->running = pool->size;
+  pool->epoch++;
+  pool->start.notify_all();
+}
+
+static bool marking_finished(void) {
+  std::lock_guard<std::mutex> guard(pool->lock);
+  return pool->running == 0;
+}
+
+static void wait_for_marking(void) {
+  std::unique_lock<std::mutex> lock(pool->lock);
+  pool->done.wait(lock, [] { return pool->running == 0; });
+}
+
+static void collect_roots(std::vector<bt_value_t *> &seeds) {
+  for (bt_gcframe_t *frame = bt_pgcstack; frame; frame = frame->prev) {
+    intptr_t n = frame->nroots >> 1;
+    bool indirect = frame->nroots & 1;
+    bt_value_t **slots = (bt_value_t **) (frame + 1);
+    for (intptr_t i = 0; i < n; i++) {
+      bt_value_t *val = indirect ? *(bt_value_t **) slots[i] : slots[i];
+      if (bt_is_pointer(val) && set_mark((char *) val))
+        seeds.push_back(val);
+    }
+  }
+
+  if (bt_gc_statepoints) {
+    // derived pointers are kept alive by their base
+    bt_for_each_stack_root([&](bt_value_t **base, bt_value_t **) {
+      bt_value_t *val = *base;
+      if (bt_is_pointer(val) && set_mark((char *) val))
+        seeds.push_back(val);
+    });
+  }
+}
+
+// Stop-the-world mark of everything reachable from seeds, with the mutator
+// thread helping the pool.
+static void parallel_mark(std::vector<bt_value_t *> &seeds) {
+  int mutator_id = pool->size;
+  start_marking(seeds, mutator_id + 1);
+  mark_loop(mutator_id);
+  wait_for_marking();
+}
+
+// A word of a cons block is in use when it starts a marked cell, or is the
+// cdr of a marked full pair.
+static void sweep_conses(void) {
+  cons_free_runs.clear();
+  for (bt_cons_block_t *block : cons_blocks) {
+    size_t free_start = 0;
+    bool cdr = false;
+    for (size_t word = CONS_HEADER_WORDS; word < BT_BLOCK_WORDS; word++) {
+      bool used = cdr || cons_marked(block, word);
+      cdr = !cdr && cons_marked(block, word) && cons_code(block, word) == BT_CDR_FULL;
+      if (used) {
+        live_bytes += 8;
+        if (free_start && word - free_start >= CONS_MIN_FREE_RUN)
+          cons_free_runs.push_back(std::make_pair((char *) block + free_start * 8,
+                                                  (char *) block + word * 8));
+        free_start = 0;
+      } else if (!free_start) {
+        free_start = word;
+      }
+    }
+    if (free_start && BT_BLOCK_WORDS - free_start >= CONS_MIN_FREE_RUN)
+      cons_free_runs.push_back(std::make_pair((char *) block + free_start * 8,
+                                              (char *) block + BT_BLOCK_SIZE));
+    memset(block->marks, 0, sizeof(block->marks));
+  }
+}
+
+static void sweep(void) {
+  free_ranges.clear();
+  live_bytes = 0;
+  retire_cons_tlab();
+  sweep_conses();
+
+  for (bt_block_t *block = blocks; block; block = block->next) {
+    char *free_start = nullptr;
+    char *cur = bt_block_start(block);
+    char *end = bt_block_end(block);
+    while (cur < end) {
+      bt_value_t *obj = (bt_value_t *) cur;
+      size_t size = bt_object_size(obj->size);
+      if (obj->type != FreeTy && is_marked(block, cur)) {
+        live_bytes += size;
+        if (free_start) {
+          make_filler(free_start, cur);
+          if (cur - free_start >= GC_MIN_FREE_RANGE)
+            free_ranges.push_back(std::make_pair(free_start, cur));
+          free_start = nullptr;
+        }
+      } else if (!free_start) {
+        free_start = cur;
+      }
+      cur += size;
+    }
+    if (free_start) {
+      make_filler(free_start, end);
+      if (end - free_start >= GC_MIN_FREE_RANGE)
+        free_ranges.push_back(std::make_pair(free_start, end));
+    }
+    memset(block->marks, 0, sizeof(block->marks));
+  }
+
+  bt_large_t **link = &large_objects;
+  while (*link) {
+    bt_large_t *large = *link;
+    if (large->marked) {
+      large->marked = 0;
+      live_bytes += large->size;
+      link = &large->next;
+    } else {
+      *link = large->next;
+      {
+        std::lock_guard<std::mutex> guard(large_lock);
+        large_set.erase((uintptr_t) bt_large_object(large));
+      }
+      free(large->base);
+    }
+  }
+  // dead callees leave their space to new objects
+  bt_ic_flush();
+}
+
+static void finish_cycle(void) {
+  num_collections++;
+  allocated_since_gc = 0;
+  // let the heap grow to twice the live data before collecting again
+  gc_threshold = live_bytes > GC_MIN_THRESHOLD ? live_bytes : GC_MIN_THRESHOLD;
+  if (gc_verbose)
+    fprintf(stderr, "[gc #%ld] live %ld bytes, %zu free ranges\n",
+            (long) num_collections, (long) live_bytes, free_ranges.size());
+}
+
+// Stop-the-world collection of the old space. The nursery must be empty.
+static void major_collect(void) {
+  gc_clock::time_point start = gc_clock::now();
+  std::vector<bt_value_t *> seeds;
+  retire_old_buf();
+  collect_roots(seeds);
+  parallel_mark(seeds);
+  sweep();
+  finish_cycle();
+  record_pause(major_pauses, start);
+}
+
+// First pause of a concurrent cycle: snapshot the roots and turn the SATB
+// barrier on. The nursery is empty, so every root is an old object.
+static void start_concurrent_cycle(void) {
+  gc_clock::time_point start = gc_clock::now();
+  std::vector<bt_value_t *> seeds;
+  bt_gc_marking = true;
+  retire_cons_run();
+  cons_black.clear();
+  collect_roots(seeds);
+  start_marking(seeds, pool->size);
+  record_pause(initial_mark_pauses, start);
+}
+
+// Second pause of a concurrent cycle: mark from what the SATB barrier
+// logged, then sweep. Objects allocated during the cycle are already marked.
+static void finish_concurrent_cycle(void) {
+  wait_for_marking();
+  gc_clock::time_point start = gc_clock::now();
+  std::vector<bt_value_t *> seeds;
+  for (bt_value_t *val : satb_buffer)
+    if (set_mark((char *) val))
+      seeds.push_back(val);
+  satb_buffer.clear();
+  // allocate black: cells of the cycle survive it, walked cell by cell
+  retire_cons_run();
+  for (auto &run : cons_black) {
+    for (char *cell = run.first; cell < run.second;
+         cell += bt_cdr_code(cell) == BT_CDR_FULL ? 16 : 8)
+      set_mark(cell);
+  }
+  cons_black.clear();
+  parallel_mark(seeds);
+  bt_gc_marking = false;
+
+  retire_old_buf();
+  sweep();
+  finish_cycle();
+  record_pause(remark_pauses, start);
+}
+
+// Full collection: the minor collection empties the nursery first, so the
+// mark-sweep only has to deal with the old space.
+extern "C"
+void bt_gc_collect(void) {
+  if (bt_gc_marking)
+    finish_concurrent_cycle();
+  minor_collect();
+  major_collect();
+}
+
+// Called after each minor collection to run, start or finish a major one.
+static void maybe_collect_old(void) {
+  if (!gc_concurrent) {
+    if (allocated_since_gc >= gc_threshold)
+      major_collect();
+    return;
+  }
+  if (bt_gc_marking) {
+    // only wait for the markers when the heap grows well past the threshold
+    if (marking_finished() || allocated_since_gc >= 2 * gc_threshold)
+      finish_concurrent_cycle();
+  } else if (allocated_since_gc >= gc_threshold) {
+    start_concurrent_cycle();
+  }
+}
+
+static char *alloc_slow(int64_t size) {
+  // large objects get their own allocation instead of wasting most of the nursery
+  if (size > BT_LARGE_OBJECT_SIZE) {
+    if (allocated_since_gc >= gc_threshold)
+      bt_gc_collect();
+    char *obj = alloc_large(size, 8);
+    // the object is born old and its initializing stores are not barriered
+    if (obj)
+      bt_gc_wb_slow((bt_value_t *) obj);
+    return obj;
+  }
+
+  // the buffer may only have stopped at a sample point
+  if (size > bt_nursery.end - bt_tlab.cur) {
+    minor_collect();
+    maybe_collect_old();
+  }
+
+  char *obj = bt_tlab.cur;
+  bt_tlab.cur += size;
+  return obj;
+}
+
+extern "C"
+char *bt_alloc_pinned(int64_t size) {
+  if (allocated_since_gc >= gc_threshold)
+    bt_gc_collect();
+  return alloc_large(size, BT_PINNED_ALIGN);
+}
+
+extern "C"
+char *bt_cons_alloc_slow(int64_t nwords) {
+  int64_t size = nwords * 8;
+  retire_cons_run();
+  // the same pacing as the nursery, while marking only in case of emergency
+  if (allocated_since_gc >= (bt_gc_marking ? 2 : 1) * gc_threshold) {
+    minor_collect();
+    maybe_collect_old();
+  }
+  if (!refill_cons(size)) {
+    bt_gc_collect();
+    if (!refill_cons(size)) {
+      fprintf(stderr, "Error: %s\n", "out of cons space.");
+      exit(-1);
+    }
+  }
+
+  char *cell = bt_cons_tlab.cur;
+  bt_cons_tlab.cur += size;
+  return cell;
+}
+
+extern "C"
+char *bt_alloc_slow(int64_t size) {
+  if (!bt_profile_interval)
+    return alloc_slow(size);
+
+  count_sample_bytes();
+  bytes_until_sample -= size;
+  bool sample = bytes_until_sample <= 0;
+  if (sample)
+    bytes_until_sample = bt_profile_interval;
+
+  char *obj = alloc_slow(size);
+  set_tlab_limit();
+  if (sample && obj)
+    bt_profile_sample(obj, size, __builtin_frame_address(0));
+  return obj;
+}
+
+void init_gc(void) {
+  bt_nursery.start = (char *) aligned_alloc(BT_BLOCK_SIZE, BT_NURSERY_SIZE);
+  if (!bt_nursery.start) {
+    fprintf(stderr, "Error: %s\n", "cannot allocate the nursery.");
+    exit(-1);
+  }
+  bt_nursery.end = bt_nursery.start + BT_NURSERY_SIZE;
+
+  // only reserved, pages are committed as cons blocks get used
+  char *cons = (char *) mmap(nullptr, BT_CONS_SPACE_SIZE + BT_BLOCK_SIZE, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (cons == MAP_FAILED) {
+    fprintf(stderr, "Error: %s\n", "cannot reserve the cons space.");
+    exit(-1);
+  }
+  bt_cons_space.start = (char *) (((uintptr_t) cons + BT_BLOCK_SIZE - 1) & ~(uintptr_t) (BT_BLOCK_SIZE - 1));
+  bt_cons_space.end = bt_cons_space.start + BT_CONS_SPACE_SIZE;
+  cons_top = bt_cons_space.start;
+  bytes_until_sample = bt_profile_interval;
+  reset_nursery();
+  gc_verbose = getenv("BT_GC_VERBOSE") != nullptr;
+  gc_concurrent = getenv("BT_GC_CONCURRENT") != nullptr;
+  bt_gc_statepoints = getenv("BT_GC_STATEPOINTS") != nullptr;
+
+  gc_num_threads = std::thread::hardware_concurrency();
+  if (getenv("BT_GC_THREADS"))
+    gc_num_threads = atoi(getenv("BT_GC_THREADS"));
+  if (gc_num_threads > GC_MAX_THREADS)
+    gc_num_threads = GC_MAX_THREADS;
+  if (gc_num_threads < 1)
+    gc_num_threads = 1;
+
+  // in parallel mode the mutator is one of the markers, in concurrent mode
+  // all of them run in the background
+  int pool_size = gc_concurrent ? gc_num_threads : gc_num_threads - 1;
+  markers = new gc_marker_t[pool_size + 1];
+  for (int i = 0; i <= pool_size; i++)
+    markers[i].shared_size.store(0);
+  pool = new gc_pool_t();
+  pool->epoch = 0;
+  pool->running = 0;
+  pool->size = pool_size;
+  for (int i = 0; i < pool_size; i++)
+    std::thread(marker_main, i).detach();
+
+  if (gc_verbose)
+    atexit(print_pause_stats);
+}
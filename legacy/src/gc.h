@@ -0,0 +1,252 @@
+#ifndef _GC_H
+#define _GC_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "objects.h"
+
+// Thread-local allocation buffer: a [cur, limit) range carved out of the heap
+// that the mutator bumps through without taking any lock. JIT code performs
+// the same pointer bump inline and only calls bt_alloc_slow when the buffer is
+// exhausted. The runtime has a single mutator thread, so there is one buffer,
+// and it always covers the free part of the nursery.
+typedef struct _bt_tlab_t {
+  char *cur;
+  char *limit;
+} bt_tlab_t;
+
+extern bt_tlab_t bt_tlab;
+
+#define BT_TLAB_SIZE          (64 * 1024)
+#define BT_LARGE_OBJECT_SIZE  (BT_TLAB_SIZE / 4)
+
+// The young generation is a single contiguous nursery. Survivors of a minor
+// collection are copied (promoted) into the old space, so after every minor
+// collection the nursery is empty again.
+#define BT_NURSERY_SIZE       (2 * 1024 * 1024)
+
+typedef struct _bt_space_t {
+  char *start;
+  char *end;
+} bt_space_t;
+
+extern bt_space_t bt_nursery;
+
+static inline bool bt_in_nursery(const void *ptr) {
+  // a single unsigned compare; immediates are never inside the range
+  return (uintptr_t) ptr - (uintptr_t) bt_nursery.start < (uintptr_t) BT_NURSERY_SIZE;
+}
+
+// Heap blocks are BT_BLOCK_SIZE aligned, so the block (and its mark bitmap) of
+// any small object is found by masking the pointer.
+#define BT_BLOCK_SIZE         (64 * 1024)
+#define BT_BLOCK_WORDS        (BT_BLOCK_SIZE / 8)
+
+typedef struct _bt_block_t {
+  struct _bt_block_t *next;
+  uint64_t marks[BT_BLOCK_WORDS / 64]; // one mark bit per heap word
+  uint64_t remembered[BT_BLOCK_WORDS / 64]; // objects in the remembered set
+  // objects go here
+} bt_block_t;
+
+#define bt_block_of(ptr) ((bt_block_t *) ((uintptr_t) (ptr) & ~(uintptr_t) (BT_BLOCK_SIZE - 1)))
+#define bt_block_start(b) ((char *) (b) + sizeof(bt_block_t))
+#define bt_block_end(b) ((char *) (b) + BT_BLOCK_SIZE)
+
+// Pairs live in a dedicated cons space, reserved up front as one contiguous
+// range, so a pair is recognized by its address and its cells need no
+// header. The space is carved into BT_BLOCK_SIZE blocks, each starting with
+// its side tables. A cell is either a full pair (car and cdr in two words)
+// or, in lists built by the runtime, a single car word whose cdr is implied
+// by its cdr code: the next word, or nil at the end of the list (cdr-coding).
+// Pairs never move; they are allocated from their own buffer, bt_cons_tlab.
+#define BT_CONS_SPACE_SIZE    ((size_t) 1 << 30)
+
+#define BT_CDR_FULL           0 // the cdr is in the next word
+#define BT_CDR_NEXT           1 // the cdr is the cell in the next word
+#define BT_CDR_NIL            2 // the cdr is nil
+
+// cells per cdr-coded chunk of a list built by the runtime, a chunk and the
+// cdr of its last pair fill the smallest free run the sweeper keeps
+#define BT_LIST_CHUNK         63
+
+typedef struct _bt_cons_block_t {
+  uint64_t marks[BT_BLOCK_WORDS / 64]; // one mark bit per cell
+  uint64_t remembered[BT_BLOCK_WORDS / 64]; // cells in the remembered set
+  uint64_t codes[BT_BLOCK_WORDS / 32]; // two bits of cdr code per word
+  // cells go here
+} bt_cons_block_t;
+
+extern bt_space_t bt_cons_space;
+extern bt_tlab_t bt_cons_tlab;
+
+static inline bool bt_is_cons(const void *val) {
+  // fixnums and flonums may look like addresses in the space, pointers may not
+  return ((uintptr_t) val & BT_TAG_MASK) == 0 &&
+         (uintptr_t) val - (uintptr_t) bt_cons_space.start < (uintptr_t) BT_CONS_SPACE_SIZE;
+}
+
+static inline int bt_cdr_code(const void *cell) {
+  bt_cons_block_t *block = (bt_cons_block_t *) bt_block_of(cell);
+  size_t word = ((char *) cell - (char *) block) / 8;
+  return (block->codes[word / 32] >> (word % 32 * 2)) & 3;
+}
+
+static inline bt_value_t *bt_cell_car(const void *cell) {
+  return ((bt_value_t **) cell)[0];
+}
+
+static inline bt_value_t *bt_cell_cdr(const void *cell) {
+  switch (bt_cdr_code(cell)) {
+  case BT_CDR_FULL:
+    return ((bt_value_t **) cell)[1];
+  case BT_CDR_NEXT:
+    return (bt_value_t *) ((char *) cell + 8);
+  default:
+    return nullptr;
+  }
+}
+
+extern "C" char *bt_cons_alloc_slow(int64_t nwords);
+
+// Allocate nwords consecutive words of cons space. The cdr codes of fresh
+// words are BT_CDR_FULL.
+static inline char *bt_cons_alloc(int64_t nwords) {
+  char *cell = bt_cons_tlab.cur;
+  if (nwords * 8 <= bt_cons_tlab.limit - cell) {
+    bt_cons_tlab.cur = cell + nwords * 8;
+    return cell;
+  }
+  return bt_cons_alloc_slow(nwords);
+}
+
+// Turn the fresh words [cell, cell + 8 * n) into a cdr-coded list whose last
+// cell ends the list with last_code (BT_CDR_NIL, or BT_CDR_FULL to continue
+// it through the word after it).
+extern "C" void bt_set_cdr_codes(char *cell, int64_t n, int last_code);
+
+// all heap objects are a header plus `size` pointer-sized words
+#define bt_object_size(nfields) (sizeof(bt_value_t) + sizeof(bt_value_t *) * (nfields))
+
+// Root frames for runtime C code, in the same bt_pgcstack chain as the frames
+// pushed by JIT code. The low bit of nroots marks a frame whose slots hold the
+// *addresses* of the roots rather than the roots themselves.
+#define BT_GC_PUSH1(a)                                                      \
+  void *__gc_stkf[] = { (void *) ((1 << 1) | 1), (void *) bt_pgcstack,      \
+                        (void *) (a) };                                     \
+  bt_pgcstack = (bt_gcframe_t *) __gc_stkf;
+
+#define BT_GC_PUSH2(a, b)                                                   \
+  void *__gc_stkf[] = { (void *) ((2 << 1) | 1), (void *) bt_pgcstack,      \
+                        (void *) (a), (void *) (b) };                       \
+  bt_pgcstack = (bt_gcframe_t *) __gc_stkf;
+
+#define BT_GC_PUSH3(a, b, c)                                                \
+  void *__gc_stkf[] = { (void *) ((3 << 1) | 1), (void *) bt_pgcstack,      \
+                        (void *) (a), (void *) (b), (void *) (c) };         \
+  bt_pgcstack = (bt_gcframe_t *) __gc_stkf;
+
+// Pops the frame pushed in the same scope. The link is read back through the
+// array it was written to, a bt_gcframe_t load may not alias those stores.
+#define BT_GC_POP() (bt_pgcstack = (bt_gcframe_t *) __gc_stkf[1])
+
+extern "C" char *bt_alloc_slow(int64_t size);
+
+static inline char *bt_alloc(size_t size) {
+  char *obj = bt_tlab.cur;
+  if (size <= (size_t) (bt_tlab.limit - obj)) {
+    bt_tlab.cur = obj + size;
+    return obj;
+  }
+  return bt_alloc_slow(size);
+}
+
+// Allocate an object that never moves, with its start aligned to
+// BT_PINNED_ALIGN. It is born old, so it is meant for objects without
+// references (or whose initializing stores go through bt_gc_wb).
+#define BT_PINNED_ALIGN       64
+
+extern "C" char *bt_alloc_pinned(int64_t size);
+
+static inline bt_value_t *bt_alloc_object(int32_t type, int32_t nfields) {
+  bt_value_t *ptr = (bt_value_t *) bt_alloc(bt_object_size(nfields));
+  if (ptr) {
+    ptr->type = type;
+    ptr->size = nfields;
+  }
+  return ptr;
+}
+
+// Visit every field of obj that may hold a heap reference.
+template <typename F>
+static inline void bt_for_each_field(bt_value_t *obj, F f) {
+  if (bt_is_cons(obj)) {
+    // an implied cdr is not a field, it is the cell next door
+    f((bt_value_t **) obj);
+    if (bt_cdr_code(obj) == BT_CDR_FULL)
+      f((bt_value_t **) obj + 1);
+    return;
+  }
+  bt_value_t **data = bt_value_data(obj);
+  switch (obj->type) {
+  case BoxTy:
+    f(&data[0]);
+    break;
+  case ClosureTy:
+    // field 0 is the code pointer
+    for (int32_t i = 1; i < obj->size; i++)
+      f(&data[i]);
+    break;
+  case StrSliceTy:
+    f((bt_value_t **) &((bt_slice_t *) obj)->parent);
+    break;
+  case HashTy:
+    f((bt_value_t **) &((bt_hash_t *) obj)->store);
+    break;
+  case HashStoreTy: {
+    // free slots are nil, so every slot can be visited without looking at
+    // the control bytes, which the mutator may be writing concurrently
+    bt_value_t **slots = bt_hash_slots((bt_hash_store_t *) obj);
+    for (int64_t i = 0; i < 2 * ((bt_hash_store_t *) obj)->capacity; i++)
+      f(&slots[i]);
+    break;
+  }
+  default:
+    // I64Ty, F64Ty, FunctionRefTy, vectors, flat strings and fillers hold
+    // raw words only
+    break;
+  }
+}
+
+// Write barrier, required on every store of val into a field of an object
+// that may already be old. Stores of young values into old objects record
+// the object in the remembered set, which minor collections use as roots.
+extern "C" void bt_gc_wb_slow(bt_value_t *obj);
+
+static inline void bt_gc_wb(bt_value_t *obj, bt_value_t *val) {
+  if (bt_in_nursery(val) && !bt_in_nursery(obj))
+    bt_gc_wb_slow(obj);
+}
+
+// SATB (snapshot-at-the-beginning) barrier, required before overwriting a
+// field while concurrent marking runs: the old value is logged so that the
+// markers still find everything that was reachable when marking started.
+// Initializing stores into fresh objects overwrite nothing and need none.
+extern bool bt_gc_marking;
+extern "C" void bt_gc_satb_slow(bt_value_t *old_val);
+
+static inline void bt_gc_satb(bt_value_t *old_val) {
+  if (bt_gc_marking)
+    bt_gc_satb_slow(old_val);
+}
+
+// Statepoint mode (BT_GC_STATEPOINTS): JIT code is compiled with LLVM
+// statepoints, and its roots come from stack maps instead of gc frames.
+extern bool bt_gc_statepoints;
+
+extern "C" void bt_gc_collect(void);
+
+void init_gc(void);
+
+#endif
@@ -0,0 +1,211 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "gc.h"
+#include "hash.h"
+#include "symbol.h"
+
+#define HASH_MIN_CAPACITY 64
+
+// Bit i is set when control byte i of the group equals h
+static inline uint32_t group_match(const int8_t *group, int8_t h) {
+#ifdef __SSE2__
+  __m128i ctrl = _mm_load_si128((const __m128i *) group);
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(h)));
+#else
+  uint32_t mask = 0;
+  for (int i = 0; i < BT_HASH_GROUP; i++)
+    mask |= (uint32_t) (group[i] == h) << i;
+  return mask;
+#endif
+}
+
+extern "C"
+uint64_t bt_hash_string(char *str) {
+  return bt_hash_word(bt_symbol_hash(bt_string_bytes((bt_value_t *) str),
+                                     ((bt_string_t *) str)->length));
+}
+
+extern "C"
+uint64_t bt_hash_key(char *key) {
+  if (bt_is_string((bt_value_t *) key))
+    return bt_hash_string(key);
+  return bt_hash_word((uintptr_t) key);
+}
+
+static bool hashable(char *key) {
+  bt_value_t *val = (bt_value_t *) key;
+  return !bt_is_pointer(val) || bt_is_symbol(val) || bt_is_string(val);
+}
+
+static bool key_equal(char *a, char *b) {
+  if (a == b)
+    return true;
+  bt_value_t *x = (bt_value_t *) a, *y = (bt_value_t *) b;
+  if (!bt_is_string(x) || !bt_is_string(y))
+    return false;
+  int64_t n = ((bt_string_t *) x)->length;
+  return n == ((bt_string_t *) y)->length &&
+         !memcmp(bt_string_bytes(x), bt_string_bytes(y), n);
+}
+
+// A store of capacity free slots, or NULL after reporting an error
+static bt_hash_store_t *new_store(int64_t capacity) {
+  int64_t size = sizeof(bt_hash_store_t) + capacity + 16 * capacity;
+  if (size / 8 > INT32_MAX) {
+    LogErrorN("hash table too big.");
+    return nullptr;
+  }
+  bt_hash_store_t *store = (bt_hash_store_t *) bt_alloc_pinned(size);
+  if (!store) {
+    LogErrorN("alloc failed.");
+    return nullptr;
+  }
+  store->type = HashStoreTy;
+  store->size = (size - sizeof(bt_value_t)) / 8;
+  store->capacity = capacity;
+  memset(bt_hash_ctrl(store), BT_HASH_FREE, capacity);
+  memset(bt_hash_slots(store), 0, 16 * capacity);
+  return store;
+}
+
+// The slot of key, or -1 if it is not in the table. Without a match the
+// probe ends at the first group with a free slot, and *free is that slot.
+static int64_t find_slot(bt_hash_store_t *store, char *key, uint64_t hash, int64_t *free) {
+  int8_t *ctrl = bt_hash_ctrl(store);
+  bt_value_t **slots = bt_hash_slots(store);
+  int8_t h2 = bt_hash_h2(hash);
+  uint64_t groups_mask = store->capacity / BT_HASH_GROUP - 1;
+  uint64_t group = (hash >> 7) & groups_mask;
+  for (uint64_t step = 1;; step++) {
+    int8_t *g = ctrl + group * BT_HASH_GROUP;
+    for (uint32_t match = group_match(g, h2); match; match &= match - 1) {
+      int64_t slot = group * BT_HASH_GROUP + __builtin_ctz(match);
+      if (key_equal((char *) slots[2 * slot], key))
+        return slot;
+    }
+    uint32_t empty = group_match(g, BT_HASH_FREE);
+    if (empty) {
+      if (free)
+        *free = group * BT_HASH_GROUP + __builtin_ctz(empty);
+      return -1;
+    }
+    // triangular steps visit every group of a power-of-two table
+    group = (group + step) & groups_mask;
+  }
+}
+
+// Put an entry that is not in the table yet into a free slot. Slots are
+// written before the control byte, so a concurrent marker either sees a nil
+// slot or the entry.
+static void insert_new(bt_hash_store_t *store, char *key, uint64_t hash, char *val) {
+  int64_t slot = -1;
+  find_slot(store, key, hash, &slot);
+  bt_value_t **slots = bt_hash_slots(store);
+  slots[2 * slot] = (bt_value_t *) key;
+  slots[2 * slot + 1] = (bt_value_t *) val;
+  // the store is pinned and old, young keys and values must be remembered
+  bt_gc_wb((bt_value_t *) store, (bt_value_t *) key);
+  bt_gc_wb((bt_value_t *) store, (bt_value_t *) val);
+  __atomic_store_n(&bt_hash_ctrl(store)[slot], bt_hash_h2(hash), __ATOMIC_RELEASE);
+}
+
+extern "C"
+char *bt_make_hash_table() {
+  bt_hash_store_t *store = new_store(HASH_MIN_CAPACITY);
+  if (!store)
+    return nullptr;
+  // the store is pinned, it stays where it is while the table is allocated
+  BT_GC_PUSH1(&store);
+  bt_hash_t *table = (bt_hash_t *) bt_alloc_object(HashTy, 3);
+  BT_GC_POP();
+  if (!table)
+    return LogErrorN("alloc failed.");
+  table->store = store;
+  table->count = 0;
+  table->growth_left = HASH_MIN_CAPACITY / 8 * 7;
+  return (char *) table;
+}
+
+extern "C"
+char *bt_hash_count(char *table) {
+  if (!bt_is_hash((bt_value_t *) table))
+    return LogErrorN("not a hash table.");
+  return bt_new_int64(((bt_hash_t *) table)->count);
+}
+
+extern "C"
+char *bt_hash_ref(char *table, char *key, uint64_t hash, char *dflt) {
+  if (!bt_is_hash((bt_value_t *) table))
+    return LogErrorN("not a hash table.");
+  if (!hashable(key))
+    return LogErrorN("hash table key must be a number, symbol or string.");
+  bt_hash_store_t *store = ((bt_hash_t *) table)->store;
+  int64_t slot = find_slot(store, key, hash, nullptr);
+  if (slot < 0)
+    return dflt;
+  return (char *) bt_hash_slots(store)[2 * slot + 1];
+}
+
+// Move every entry to a store twice as big
+static bool grow(char **table) {
+  bt_hash_t *t = (bt_hash_t *) *table;
+  bt_hash_store_t *store = new_store(2 * t->store->capacity);
+  if (!store)
+    return false;
+  // the allocation may have moved the table, but not the old store
+  t = (bt_hash_t *) *table;
+  bt_hash_store_t *old = t->store;
+  int8_t *ctrl = bt_hash_ctrl(old);
+  bt_value_t **slots = bt_hash_slots(old);
+  for (int64_t i = 0; i < old->capacity; i++) {
+    if (ctrl[i] != BT_HASH_FREE)
+      insert_new(store, (char *) slots[2 * i], bt_hash_key((char *) slots[2 * i]),
+                 (char *) slots[2 * i + 1]);
+  }
+  bt_gc_satb((bt_value_t *) old);
+  t->store = store;
+  t->growth_left = store->capacity / 8 * 7 - t->count;
+  return true;
+}
+
+extern "C"
+char *bt_hash_set(char *table, char *key, uint64_t hash, char *val) {
+  if (!bt_is_hash((bt_value_t *) table))
+    return LogErrorN("not a hash table.");
+  if (!hashable(key))
+    return LogErrorN("hash table key must be a number, symbol or string.");
+
+  bt_hash_store_t *store = ((bt_hash_t *) table)->store;
+  int64_t slot = find_slot(store, key, hash, nullptr);
+  if (slot >= 0) {
+    bt_value_t **field = &bt_hash_slots(store)[2 * slot + 1];
+    bt_gc_satb(*field);
+    *field = (bt_value_t *) val;
+    bt_gc_wb((bt_value_t *) store, (bt_value_t *) val);
+    return val;
+  }
+
+  if (((bt_hash_t *) table)->growth_left == 0) {
+    BT_GC_PUSH3(&table, &key, &val);
+    bool grown = grow(&table);
+    BT_GC_POP();
+    if (!grown)
+      return nullptr;
+  }
+  bt_hash_t *t = (bt_hash_t *) table;
+  insert_new(t->store, key, hash, val);
+  t->count++;
+  t->growth_left--;
+  return val;
+}
+
+bool bt_is_hash(bt_value_t *val) {
+  if (!bt_is_pointer(val)) return false;
+  if (bt_is_cons(val)) return false;
+  return val->type == HashTy;
+}
@@ -0,0 +1,47 @@
+#ifndef _HASH_H
+#define _HASH_H
+
+#include <cstdint>
+
+#include "objects.h"
+
+// Hash tables in the style of Swiss tables: open addressing, with a control
+// byte per slot that is either free or holds 7 bits of the hash of its key.
+// A lookup compares a whole group of BT_HASH_GROUP control bytes at once
+// (one SSE2 compare) and only looks at the keys whose 7 bits match, so most
+// probes touch a single cache line of control bytes. Groups are probed
+// quadratically, and the table grows at 7/8 full. Entries are never removed.
+//
+// Keys are compared with eq?, except that strings compare by contents. Only
+// keys whose hash survives a collection are allowed: immediates, symbols
+// (which never move) and strings (hashed by contents).
+
+#define BT_HASH_FREE ((int8_t) 0x80)
+
+// Hash of a key that is no string, from its bits. JIT code inlines this for
+// fixnums and symbols (CreateHashKey), so the two must stay in sync.
+#define BT_HASH_MUL 0x9e3779b97f4a7c15ULL
+
+static inline uint64_t bt_hash_word(uint64_t bits) {
+  uint64_t h = bits * BT_HASH_MUL;
+  return h ^ (h >> 32);
+}
+
+// The low 7 bits of a hash go to the control byte, the rest pick the group
+static inline int8_t bt_hash_h2(uint64_t hash) {
+  return (int8_t) (hash & 0x7f);
+}
+
+extern "C" uint64_t bt_hash_string(char *str);
+// The hash of any key, or the hash of its bits if it is not hashable
+extern "C" uint64_t bt_hash_key(char *key);
+
+extern "C" char *bt_make_hash_table();
+extern "C" char *bt_hash_count(char *table);
+// hash is bt_hash_key(key), which the caller may have computed inline
+extern "C" char *bt_hash_ref(char *table, char *key, uint64_t hash, char *dflt);
+extern "C" char *bt_hash_set(char *table, char *key, uint64_t hash, char *val);
+
+bool bt_is_hash(bt_value_t *val);
+
+#endif
@@ -0,0 +1,864 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "common.h"
+#include "ast.h"
+#include "interp.h"
+
+#define JIT (Driver::instance()->TheJIT)
+#define FUNCTIONPROTOS (Driver::instance()->FunctionProtos)
+
+bool bt_interp_enabled = true;
+
+// Bytecode instructions and their operands. d is the frame index the result
+// goes to, a, b, c and s are frame indices, k is a tagged fixnum, L is the
+// address of an instruction and fn the address of native code. Every
+// operation with a fixnum variant is followed by it.
+enum bc_opcode {
+  BC_MOV,      // d a
+  BC_ADD,      // d a b
+  BC_ADDI,     // d a k
+  BC_SUB,
+  BC_SUBI,
+  BC_MUL,
+  BC_MULI,
+  BC_DIV,
+  BC_EQ,
+  BC_EQI,
+  BC_GT,
+  BC_GTI,
+  BC_LT,
+  BC_LTI,
+  BC_BEQ,      // a b L, go on at L unless a = b
+  BC_BEQI,     // a k L
+  BC_BGT,
+  BC_BGTI,
+  BC_BLT,
+  BC_BLTI,
+  BC_EQP,      // d a b
+  BC_AND,
+  BC_OR,
+  BC_NOT,      // d a
+  BC_NULLP,
+  BC_PAIRP,
+  BC_PRIM0,    // d fn
+  BC_PRIM1,    // d fn a
+  BC_PRIM2,    // d fn a b
+  BC_PRIM3,    // d fn a b c
+  BC_HASHREF,  // d table key dflt
+  BC_HASHSET,  // d table key val
+  BC_GETFIELD, // d a n
+  BC_LIST,     // d s n a1 .. an, the members are copied to s and up
+  BC_CLOSURE,  // d fn s n a1 .. an
+  BC_CALL,     // d fn n a1 .. an
+  BC_APPLY,    // d f n a1 .. an
+  BC_JUMP,     // L
+  BC_JUMPF,    // a L, go on at L when a is false
+  BC_RET,      // a
+  BC_NUM
+};
+
+// handler addresses by opcode, see execute()
+static const void *const *handlers;
+
+// Same as bt_as_bool and CreateTruthTest: only nil, #f and fixnum 0 are false
+static inline bool truthy(char *val) {
+  return (uintptr_t) val > (uintptr_t) bt_from_fixnum(0) && val != bt_false;
+}
+
+static inline bool both_fixnum(char *a, char *b) {
+  return ((uintptr_t) a & (uintptr_t) b & BT_FIXNUM_TAG) != 0;
+}
+
+// The arithmetic of CreateArithOp: fixnums inline on the tagged words,
+// everything else in the runtime.
+static inline char *interp_add(char *a, char *b) {
+  intptr_t r;
+  if (both_fixnum(a, b) && !__builtin_add_overflow((intptr_t) a, (intptr_t) b - 1, &r))
+    return (char *) r;
+  return bt_binary_int64(tok_add, a, b);
+}
+
+static inline char *interp_sub(char *a, char *b) {
+  intptr_t r;
+  if (both_fixnum(a, b) && !__builtin_sub_overflow((intptr_t) a, (intptr_t) b - 1, &r))
+    return (char *) r;
+  return bt_binary_int64(tok_sub, a, b);
+}
+
+static inline char *interp_mul(char *a, char *b) {
+  intptr_t r;
+  if (both_fixnum(a, b) && !__builtin_mul_overflow((intptr_t) a - 1, (intptr_t) b >> 1, &r))
+    return (char *) (r | 1);
+  return bt_binary_int64(tok_mul, a, b);
+}
+
+static inline char *interp_eq(char *a, char *b) {
+  if (both_fixnum(a, b))
+    return a == b ? bt_true : bt_false;
+  return bt_binary_int64(tok_eq, a, b);
+}
+
+static inline char *interp_gt(char *a, char *b) {
+  if (both_fixnum(a, b))
+    return (intptr_t) a > (intptr_t) b ? bt_true : bt_false;
+  return bt_binary_int64(tok_gt, a, b);
+}
+
+static inline char *interp_lt(char *a, char *b) {
+  if (both_fixnum(a, b))
+    return (intptr_t) a < (intptr_t) b ? bt_true : bt_false;
+  return bt_binary_int64(tok_lt, a, b);
+}
+
+// Call the native code fn with self (a closure, unless nullptr) and the
+// values of the frame indices args. The callee roots its arguments.
+static char *call_native(intptr_t fn, char *self, char **F, const intptr_t *args, intptr_t n) {
+  typedef char *V;
+  V a[BT_INTERP_MAX_ARGS];
+  int k = 0;
+  if (self)
+    a[k++] = self;
+  for (intptr_t i = 0; i < n; i++)
+    a[k++] = F[args[i]];
+
+  switch (k) {
+  case 0:
+    return ((V (*)()) fn)();
+  case 1:
+    return ((V (*)(V)) fn)(a[0]);
+  case 2:
+    return ((V (*)(V, V)) fn)(a[0], a[1]);
+  case 3:
+    return ((V (*)(V, V, V)) fn)(a[0], a[1], a[2]);
+  case 4:
+    return ((V (*)(V, V, V, V)) fn)(a[0], a[1], a[2], a[3]);
+  case 5:
+    return ((V (*)(V, V, V, V, V)) fn)(a[0], a[1], a[2], a[3], a[4]);
+  case 6:
+    return ((V (*)(V, V, V, V, V, V)) fn)(a[0], a[1], a[2], a[3], a[4], a[5]);
+  case 7:
+    return ((V (*)(V, V, V, V, V, V, V)) fn)(a[0], a[1], a[2], a[3], a[4], a[5], a[6]);
+  default:
+    return ((V (*)(V, V, V, V, V, V, V, V)) fn)(a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7]);
+  }
+}
+
+/// execute - The interpreter loop, pc is the first instruction and F the
+/// frame. Called with pc nullptr it only sets up the handler table.
+static char *execute(const intptr_t *pc, char **F) {
+  static const void *const labels[BC_NUM] = {
+    &&do_mov,
+    &&do_add, &&do_addi, &&do_sub, &&do_subi, &&do_mul, &&do_muli, &&do_div,
+    &&do_eq, &&do_eqi, &&do_gt, &&do_gti, &&do_lt, &&do_lti,
+    &&do_beq, &&do_beqi, &&do_bgt, &&do_bgti, &&do_blt, &&do_blti,
+    &&do_eqp, &&do_and, &&do_or, &&do_not, &&do_nullp, &&do_pairp,
+    &&do_prim0, &&do_prim1, &&do_prim2, &&do_prim3,
+    &&do_hashref, &&do_hashset, &&do_getfield,
+    &&do_list, &&do_closure, &&do_call, &&do_apply,
+    &&do_jump, &&do_jumpf, &&do_ret
+  };
+  if (!pc) {
+    handlers = labels;
+    return nullptr;
+  }
+
+#define DISPATCH() goto *(const void *) *pc
+#define NEXT(n) do { pc += (n); DISPATCH(); } while (0)
+#define BINARY(NAME, fn)                                            \
+  do_##NAME:                                                        \
+    F[pc[1]] = fn(F[pc[2]], F[pc[3]]);                              \
+    NEXT(4);                                                        \
+  do_##NAME##i:                                                     \
+    F[pc[1]] = fn(F[pc[2]], (char *) pc[3]);                        \
+    NEXT(4);
+#define BRANCH(NAME, fn)                                            \
+  do_b##NAME:                                                       \
+    if (truthy(fn(F[pc[1]], F[pc[2]])))                             \
+      NEXT(4);                                                      \
+    pc = (const intptr_t *) pc[3];                                  \
+    DISPATCH();                                                     \
+  do_b##NAME##i:                                                    \
+    if (truthy(fn(F[pc[1]], (char *) pc[2])))                       \
+      NEXT(4);                                                      \
+    pc = (const intptr_t *) pc[3];                                  \
+    DISPATCH();
+
+  DISPATCH();
+
+do_mov:
+  F[pc[1]] = F[pc[2]];
+  NEXT(3);
+
+  BINARY(add, interp_add)
+  BINARY(sub, interp_sub)
+  BINARY(mul, interp_mul)
+
+do_div:
+  F[pc[1]] = bt_binary_int64(tok_div, F[pc[2]], F[pc[3]]);
+  NEXT(4);
+
+  BINARY(eq, interp_eq)
+  BINARY(gt, interp_gt)
+  BINARY(lt, interp_lt)
+
+  BRANCH(eq, interp_eq)
+  BRANCH(gt, interp_gt)
+  BRANCH(lt, interp_lt)
+
+do_eqp:
+  F[pc[1]] = F[pc[2]] == F[pc[3]] ? bt_true : bt_false;
+  NEXT(4);
+
+do_and:
+  F[pc[1]] = truthy(F[pc[2]]) && truthy(F[pc[3]]) ? bt_true : bt_false;
+  NEXT(4);
+
+do_or:
+  F[pc[1]] = truthy(F[pc[2]]) || truthy(F[pc[3]]) ? bt_true : bt_false;
+  NEXT(4);
+
+do_not:
+  F[pc[1]] = truthy(F[pc[2]]) ? bt_false : bt_true;
+  NEXT(3);
+
+do_nullp:
+  F[pc[1]] = F[pc[2]] == bt_nil ? bt_true : bt_false;
+  NEXT(3);
+
+do_pairp:
+  F[pc[1]] = bt_is_cons(F[pc[2]]) ? bt_true : bt_false;
+  NEXT(3);
+
+do_prim0:
+  F[pc[1]] = ((char *(*)()) pc[2])();
+  NEXT(3);
+
+do_prim1:
+  F[pc[1]] = ((char *(*)(char *)) pc[2])(F[pc[3]]);
+  NEXT(4);
+
+do_prim2:
+  F[pc[1]] = ((char *(*)(char *, char *)) pc[2])(F[pc[3]], F[pc[4]]);
+  NEXT(5);
+
+do_prim3:
+  F[pc[1]] = ((char *(*)(char *, char *, char *)) pc[2])(F[pc[3]], F[pc[4]], F[pc[5]]);
+  NEXT(6);
+
+do_hashref: {
+  // computing the hash never collects
+  char *key = F[pc[3]];
+  F[pc[1]] = bt_hash_ref(F[pc[2]], key, bt_hash_key(key), F[pc[4]]);
+  NEXT(5);
+}
+
+do_hashset: {
+  char *key = F[pc[3]];
+  F[pc[1]] = bt_hash_set(F[pc[2]], key, bt_hash_key(key), F[pc[4]]);
+  NEXT(5);
+}
+
+do_getfield:
+  F[pc[1]] = bt_getfield(F[pc[2]], (int) pc[3]);
+  NEXT(4);
+
+do_list: {
+  // the runtime reads the members after allocating, from rooted memory
+  intptr_t n = pc[3];
+  char **members = F + pc[2];
+  for (intptr_t i = 0; i < n; i++)
+    members[i] = F[pc[4 + i]];
+  char *list = bt_list(n, members);
+  F[pc[1]] = list;
+  NEXT(4 + n);
+}
+
+do_closure: {
+  intptr_t n = pc[4];
+  char **members = F + pc[3];
+  for (intptr_t i = 0; i < n; i++)
+    members[i] = F[pc[5 + i]];
+  char *clos = bt_closure((char *) pc[2], n, members);
+  F[pc[1]] = clos;
+  NEXT(5 + n);
+}
+
+do_call: {
+  char *ret = call_native(pc[2], nullptr, F, pc + 4, pc[3]);
+  F[pc[1]] = ret;
+  NEXT(4 + pc[3]);
+}
+
+do_apply: {
+  // the code of a function reference or a closure, as in bt_ic_miss
+  char *f = F[pc[2]];
+  char *ret;
+  if (bt_is_fptr((bt_value_t *) f))
+    ret = call_native((intptr_t) bt_value_data(f)[0], nullptr, F, pc + 4, pc[3]);
+  else if (bt_is_closure((bt_value_t *) f))
+    ret = call_native((intptr_t) bt_value_data(f)[0], f, F, pc + 4, pc[3]);
+  else
+    ret = bt_error();
+  F[pc[1]] = ret;
+  NEXT(4 + pc[3]);
+}
+
+do_jump:
+  pc = (const intptr_t *) pc[1];
+  DISPATCH();
+
+do_jumpf:
+  if (truthy(F[pc[1]]))
+    NEXT(3);
+  pc = (const intptr_t *) pc[2];
+  DISPATCH();
+
+do_ret:
+  return F[pc[1]];
+
+#undef BRANCH
+#undef BINARY
+#undef NEXT
+#undef DISPATCH
+}
+
+// Literal objects of interpreted code. Like the constant pool of JIT code
+// they live outside the heap and are immortal, equal literals share one.
+static std::map<std::string, uint64_t *> literals;
+
+static char *literal(const std::string &Key, int32_t Type, const std::vector<uint64_t> &Fields) {
+  uint64_t *&Obj = literals[Key];
+  if (!Obj) {
+    Obj = new uint64_t[Fields.size() + 1];
+    ((bt_value_t *) Obj)->type = Type;
+    ((bt_value_t *) Obj)->size = Fields.size();
+    std::copy(Fields.begin(), Fields.end(), Obj + 1);
+  }
+  return (char *) Obj;
+}
+
+/// getPrimitive - The runtime function of a Prim, nullptr when there is none.
+static void *getPrimitive(int64_t Op) {
+  switch (Op) {
+  case tok_box: return (void *) bt_box;
+  case tok_unbox: return (void *) bt_unbox;
+  case tok_setbox: return (void *) bt_set_box;
+  case tok_cons: return (void *) bt_cons;
+  case tok_car: return (void *) bt_car;
+  case tok_cdr: return (void *) bt_cdr;
+  case tok_map: return (void *) bt_map;
+  case tok_make_f64vector: return (void *) bt_make_f64vector;
+  case tok_make_i64vector: return (void *) bt_make_i64vector;
+  case tok_vector_length: return (void *) bt_vector_length;
+  case tok_vector_ref: return (void *) bt_vector_ref;
+  case tok_vector_set: return (void *) bt_vector_set;
+  case tok_vector_add: return (void *) bt_vector_add;
+  case tok_vector_mul: return (void *) bt_vector_mul;
+  case tok_vector_fma: return (void *) bt_vector_fma;
+  case tok_vector_sum: return (void *) bt_vector_sum;
+  case tok_string_length: return (void *) bt_string_length;
+  case tok_string_ref: return (void *) bt_string_ref;
+  case tok_substring: return (void *) bt_substring;
+  case tok_string_append: return (void *) bt_string_append;
+  case tok_string_eq: return (void *) bt_string_eq;
+  case tok_string_lt: return (void *) bt_string_lt;
+  case tok_make_hash_table: return (void *) bt_make_hash_table;
+  case tok_hash_count: return (void *) bt_hash_count;
+  default: return nullptr;
+  }
+}
+
+/// BytecodeEncoder - Encodes one LIRFunction (see interp.h).
+class BytecodeEncoder {
+  struct Use {
+    int Block;
+    int Index;
+    bool Phi;
+  };
+
+  const LIRFunction &F;
+  std::vector<intptr_t> &Code;
+  std::vector<char *> &Frame;
+
+  std::vector<int> Loc;                  // frame index of every slot
+  std::vector<const LIRInst *> Def;      // instruction of every slot
+  std::vector<std::vector<Use>> Uses;    // operands that are the slot
+  std::vector<std::vector<bool>> Skip;   // instructions merged into others
+  std::vector<bool> MergedCmp;           // the If of the block does its comparison
+  std::vector<std::vector<int>> Writes;  // variable an instruction writes, or -1
+  int Scratch, Temp;
+
+  std::vector<size_t> Ops;               // where the opcodes are
+  std::vector<size_t> Targets;           // where the jump targets are
+  std::vector<std::pair<size_t, int>> BlockTargets;
+  std::vector<size_t> BlockStart;
+
+public:
+  BytecodeEncoder(const LIRFunction &F, std::vector<intptr_t> &Code, std::vector<char *> &Frame)
+      : F(F), Code(Code), Frame(Frame), Scratch(0), Temp(0) {}
+
+  bool encode();
+
+private:
+  bool setConstant(const LIRInst &I);
+  void forwardStores(int B);
+  void forwardLoads(int B);
+  bool isFixnum(int Slot) {
+    return Def[Slot] && Def[Slot]->Op == lir_int && bt_fits_fixnum(Def[Slot]->Imm);
+  }
+
+  void emit(bc_opcode Op, std::vector<intptr_t> Operands) {
+    Ops.push_back(Code.size());
+    Code.push_back(Op);
+    Code.insert(Code.end(), Operands.begin(), Operands.end());
+  }
+  // the jump target operand, patched later
+  size_t emitTarget() {
+    Targets.push_back(Code.size());
+    Code.push_back(0);
+    return Code.size() - 1;
+  }
+  void emitMove(int To, int From) {
+    if (To != From)
+      emit(BC_MOV, { To, From });
+  }
+  void emitJump(int Block) {
+    emit(BC_JUMP, {});
+    BlockTargets.push_back(std::make_pair(emitTarget(), Block));
+  }
+  void emitBinary(bc_opcode Op, const LIRInst &I);
+  bool emitCall(const LIRInst &I);
+  bool encodeInst(int B, int Index);
+  void encodeTerminator(int B, const LIRInst &I);
+  size_t emitCondBranch(int B, const LIRInst &I);
+  std::vector<std::pair<int, int>> getEdgeMoves(int From, int To);
+  void emitEdgeMoves(std::vector<std::pair<int, int>> Moves);
+};
+
+bool BytecodeEncoder::setConstant(const LIRInst &I) {
+  char *&V = Frame[Loc[I.Dest]];
+  switch (I.Op) {
+  case lir_int:
+    if (bt_fits_fixnum(I.Imm))
+      V = bt_from_fixnum(I.Imm);
+    else
+      V = literal("i64." + std::to_string(I.Imm), I64Ty, { (uint64_t) I.Imm });
+    return true;
+  case lir_float:
+    if (bt_fits_flonum(I.FImm))
+      V = bt_from_flonum(I.FImm);
+    else
+      V = literal("f64." + std::to_string(bt_double_bits(I.FImm)), F64Ty, { bt_double_bits(I.FImm) });
+    return true;
+  case lir_nil:
+    V = bt_nil;
+    return true;
+  case lir_bool:
+    V = I.Imm ? bt_true : bt_false;
+    return true;
+  case lir_symbol:
+    V = bt_intern(I.Name.c_str(), I.Name.size());
+    return true;
+  case lir_string: {
+    // the bytes and the NUL, packed into words as in bt_string_t
+    std::vector<uint64_t> Fields((I.Name.size() + 8) / 8 + 1, 0);
+    Fields[0] = I.Name.size();
+    memcpy(&Fields[1], I.Name.data(), I.Name.size());
+    V = literal("str." + I.Name, StrTy, Fields);
+    return true;
+  }
+  case lir_fref: {
+    uint64_t Addr = JIT->getSymbolAddress(I.Name);
+    if (!Addr)
+      return false;
+    // the address is part of the key, a name may be defined again
+    V = literal("fref." + std::to_string(Addr), FunctionRefTy,
+                { Addr, (uint64_t) FUNCTIONPROTOS[I.Name]->nargs() });
+    return true;
+  }
+  default:
+    return false;
+  }
+}
+
+/// forwardStores - An instruction whose value is only stored into a
+/// variable right after writes the variable itself.
+void BytecodeEncoder::forwardStores(int B) {
+  auto &Insts = F.Blocks[B].Insts;
+  for (unsigned i = 0; i + 1 < Insts.size(); i++) {
+    const LIRInst &I = Insts[i], &Store = Insts[i + 1];
+    if (I.Dest < 0 || I.isConstant() || I.Op == lir_vload || I.Op == lir_phi)
+      continue;
+    if (Store.Op != lir_vstore || Store.Args[0] != I.Dest || Uses[I.Dest].size() != 1)
+      continue;
+    Loc[I.Dest] = Store.Var;
+    Skip[B][i + 1] = true;
+    Writes[B][i] = Store.Var;
+    Writes[B][i + 1] = -1;
+  }
+}
+
+/// forwardLoads - A Vload whose value is only used further down its block,
+/// before the variable is written again, is not done at all: the users read
+/// the variable instead.
+void BytecodeEncoder::forwardLoads(int B) {
+  auto &Insts = F.Blocks[B].Insts;
+  for (int i = 0, e = Insts.size(); i != e; ++i) {
+    const LIRInst &I = Insts[i];
+    if (I.Op != lir_vload)
+      continue;
+    int Last = i;
+    bool Local = true;
+    for (auto &U : Uses[I.Dest]) {
+      Local &= U.Block == B && U.Index > i && !U.Phi;
+      Last = std::max(Last, U.Index);
+    }
+    // the users read their operands before they write
+    for (int j = i + 1; Local && j < Last; j++)
+      Local = Writes[B][j] != I.Var;
+    if (Local) {
+      Loc[I.Dest] = I.Var;
+      Skip[B][i] = true;
+    }
+  }
+}
+
+/// emitBinary - Emit arithmetic Op, or its fixnum variant when an operand
+/// is a fixnum literal.
+void BytecodeEncoder::emitBinary(bc_opcode Op, const LIRInst &I) {
+  int L = I.Args[0], R = I.Args[1];
+  if (Op != BC_DIV && Op != BC_SUB && isFixnum(L) && !isFixnum(R)) {
+    std::swap(L, R);
+    if (Op == BC_GT)
+      Op = BC_LT;
+    else if (Op == BC_LT)
+      Op = BC_GT;
+  }
+  if (Op != BC_DIV && isFixnum(R))
+    emit((bc_opcode) (Op + 1), { Loc[I.Dest], Loc[L], (intptr_t) Frame[Loc[R]] });
+  else
+    emit(Op, { Loc[I.Dest], Loc[L], Loc[R] });
+}
+
+bool BytecodeEncoder::emitCall(const LIRInst &I) {
+  std::vector<intptr_t> Operands = { Loc[I.Dest] };
+  unsigned First = 0;
+  if (I.Op == lir_call) {
+    uint64_t Addr = JIT->getSymbolAddress(I.Name);
+    if (!Addr || I.Args.size() > BT_INTERP_MAX_ARGS)
+      return false;
+    Operands.push_back(Addr);
+  } else {
+    // the closure takes an argument too
+    if (I.Args.size() > BT_INTERP_MAX_ARGS)
+      return false;
+    Operands.push_back(Loc[I.Args[0]]);
+    First = 1;
+  }
+  Operands.push_back(I.Args.size() - First);
+  for (unsigned i = First; i < I.Args.size(); i++)
+    Operands.push_back(Loc[I.Args[i]]);
+  emit(I.Op == lir_call ? BC_CALL : BC_APPLY, Operands);
+  return true;
+}
+
+bool BytecodeEncoder::encodeInst(int B, int Index) {
+  const LIRInst &I = F.Blocks[B].Insts[Index];
+  switch (I.Op) {
+  case lir_vdefine:
+  case lir_phi:
+    return true;
+  case lir_vload:
+    emitMove(Loc[I.Dest], I.Var);
+    return true;
+  case lir_vstore:
+    emitMove(I.Var, Loc[I.Args[0]]);
+    return true;
+  case lir_add:
+    emitBinary(BC_ADD, I);
+    return true;
+  case lir_sub:
+    emitBinary(BC_SUB, I);
+    return true;
+  case lir_mult:
+    emitBinary(BC_MUL, I);
+    return true;
+  case lir_div:
+    emitBinary(BC_DIV, I);
+    return true;
+  case lir_eq:
+    emitBinary(BC_EQ, I);
+    return true;
+  case lir_gt:
+    emitBinary(BC_GT, I);
+    return true;
+  case lir_lt:
+    emitBinary(BC_LT, I);
+    return true;
+  case lir_eqp:
+    emit(BC_EQP, { Loc[I.Dest], Loc[I.Args[0]], Loc[I.Args[1]] });
+    return true;
+  case lir_and:
+    emit(BC_AND, { Loc[I.Dest], Loc[I.Args[0]], Loc[I.Args[1]] });
+    return true;
+  case lir_or:
+    emit(BC_OR, { Loc[I.Dest], Loc[I.Args[0]], Loc[I.Args[1]] });
+    return true;
+  case lir_not:
+    emit(BC_NOT, { Loc[I.Dest], Loc[I.Args[0]] });
+    return true;
+  case lir_prim: {
+    if (I.Imm == tok_nullp || I.Imm == tok_pairp) {
+      emit(I.Imm == tok_nullp ? BC_NULLP : BC_PAIRP, { Loc[I.Dest], Loc[I.Args[0]] });
+      return true;
+    }
+    if (I.Imm == tok_hash_ref || I.Imm == tok_hash_set) {
+      emit(I.Imm == tok_hash_ref ? BC_HASHREF : BC_HASHSET,
+           { Loc[I.Dest], Loc[I.Args[0]], Loc[I.Args[1]], Loc[I.Args[2]] });
+      return true;
+    }
+    void *Fn = getPrimitive(I.Imm);
+    if (!Fn || I.Args.size() > 3)
+      return false;
+    std::vector<intptr_t> Operands = { Loc[I.Dest], (intptr_t) Fn };
+    for (int Arg : I.Args)
+      Operands.push_back(Loc[Arg]);
+    emit((bc_opcode) (BC_PRIM0 + I.Args.size()), Operands);
+    return true;
+  }
+  case lir_list:
+  case lir_closure: {
+    std::vector<intptr_t> Operands = { Loc[I.Dest] };
+    if (I.Op == lir_closure) {
+      uint64_t Addr = JIT->getSymbolAddress(I.Name);
+      if (!Addr)
+        return false;
+      Operands.push_back(Addr);
+    }
+    Operands.push_back(Scratch);
+    Operands.push_back(I.Args.size());
+    for (int Arg : I.Args)
+      Operands.push_back(Loc[Arg]);
+    emit(I.Op == lir_list ? BC_LIST : BC_CLOSURE, Operands);
+    return true;
+  }
+  case lir_getfield:
+    emit(BC_GETFIELD, { Loc[I.Dest], Loc[I.Args[0]], I.Imm });
+    return true;
+  case lir_call:
+  case lir_apply:
+    return emitCall(I);
+  case lir_if:
+  case lir_goto:
+  case lir_ret:
+    encodeTerminator(B, I);
+    return true;
+  default:
+    // constants are in the frame already
+    return I.isConstant();
+  }
+}
+
+/// getEdgeMoves - The moves into the phis of block To along the edge from
+/// block From, as (destination, source) pairs.
+std::vector<std::pair<int, int>> BytecodeEncoder::getEdgeMoves(int From, int To) {
+  std::vector<std::pair<int, int>> Moves;
+  for (auto &I : F.Blocks[To].Insts) {
+    if (I.Op != lir_phi)
+      break;
+    for (unsigned i = 0, e = I.Args.size(); i != e; ++i) {
+      if (I.Labels[i] != From)
+        continue;
+      if (Loc[I.Dest] != Loc[I.Args[i]])
+        Moves.push_back(std::make_pair(Loc[I.Dest], Loc[I.Args[i]]));
+      break;
+    }
+  }
+  return Moves;
+}
+
+/// emitEdgeMoves - Emit moves that happen all at once: a move goes first
+/// when no other one still reads its destination, a cycle is broken up
+/// through the Temp cell.
+void BytecodeEncoder::emitEdgeMoves(std::vector<std::pair<int, int>> Moves) {
+  while (!Moves.empty()) {
+    bool Progress = false;
+    for (unsigned i = 0; i < Moves.size(); i++) {
+      bool Read = false;
+      for (unsigned j = 0; j < Moves.size(); j++)
+        Read |= j != i && Moves[j].second == Moves[i].first;
+      if (Read)
+        continue;
+      emitMove(Moves[i].first, Moves[i].second);
+      Moves.erase(Moves.begin() + i);
+      Progress = true;
+      break;
+    }
+    if (!Progress) {
+      emitMove(Temp, Moves[0].second);
+      Moves[0].second = Temp;
+    }
+  }
+}
+
+/// emitCondBranch - Emit the branch of If I to its else edge, merged with
+/// the comparison computing its condition when encode() chose to. The
+/// result is where the target goes.
+size_t BytecodeEncoder::emitCondBranch(int B, const LIRInst &I) {
+  auto &Insts = F.Blocks[B].Insts;
+  int T = Insts.size() - 1;
+  if (MergedCmp[B]) {
+    const LIRInst &Cmp = Insts[T - 1];
+    bc_opcode Op = Cmp.Op == lir_eq ? BC_BEQ : Cmp.Op == lir_gt ? BC_BGT : BC_BLT;
+    int L = Cmp.Args[0], R = Cmp.Args[1];
+    if (isFixnum(L) && !isFixnum(R)) {
+      std::swap(L, R);
+      if (Op == BC_BGT)
+        Op = BC_BLT;
+      else if (Op == BC_BLT)
+        Op = BC_BGT;
+    }
+    if (isFixnum(R))
+      emit((bc_opcode) (Op + 1), { Loc[L], (intptr_t) Frame[Loc[R]] });
+    else
+      emit(Op, { Loc[L], Loc[R] });
+  } else {
+    emit(BC_JUMPF, { Loc[I.Args[0]] });
+  }
+  return emitTarget();
+}
+
+void BytecodeEncoder::encodeTerminator(int B, const LIRInst &I) {
+  if (I.Op == lir_ret) {
+    emit(BC_RET, { Loc[I.Args[0]] });
+    return;
+  }
+
+  // blocks are laid out in order, the next one needs no jump
+  int Then = I.Labels[0];
+  if (I.Op == lir_goto) {
+    emitEdgeMoves(getEdgeMoves(B, Then));
+    if (Then != B + 1)
+      emitJump(Then);
+    return;
+  }
+
+  int Else = I.Labels[1];
+  size_t ElseTarget = emitCondBranch(B, I);
+  auto ElseMoves = getEdgeMoves(B, Else);
+  emitEdgeMoves(getEdgeMoves(B, Then));
+  if (Then != B + 1 || !ElseMoves.empty())
+    emitJump(Then);
+  if (ElseMoves.empty()) {
+    BlockTargets.push_back(std::make_pair(ElseTarget, Else));
+    return;
+  }
+  // the moves of the else edge go between the branch and the block
+  Code[ElseTarget] = Code.size();
+  emitEdgeMoves(ElseMoves);
+  if (Else != B + 1)
+    emitJump(Else);
+}
+
+bool BytecodeEncoder::encode() {
+  int NumVars = F.Vars.size();
+  Loc.resize(F.NumSlots);
+  Def.assign(F.NumSlots, nullptr);
+  Uses.resize(F.NumSlots);
+  unsigned MaxMembers = 0;
+  for (int B = 0, e = F.Blocks.size(); B != e; ++B) {
+    auto &Insts = F.Blocks[B].Insts;
+    Skip.push_back(std::vector<bool>(Insts.size(), false));
+    Writes.push_back(std::vector<int>(Insts.size(), -1));
+    for (int i = 0, n = Insts.size(); i != n; ++i) {
+      const LIRInst &I = Insts[i];
+      if (I.Dest >= 0) {
+        Def[I.Dest] = &I;
+        Loc[I.Dest] = NumVars + I.Dest;
+      }
+      for (int Arg : I.Args)
+        Uses[Arg].push_back({ B, i, I.Op == lir_phi });
+      if (I.Op == lir_vstore || I.Op == lir_vdefine)
+        Writes[B][i] = I.Var;
+      if (I.Op == lir_list || I.Op == lir_closure)
+        MaxMembers = std::max(MaxMembers, (unsigned) I.Args.size());
+    }
+  }
+  Scratch = NumVars + F.NumSlots;
+  Temp = Scratch + MaxMembers;
+  Frame.assign(Temp + 1, bt_nil);
+
+  for (auto &Block : F.Blocks)
+    for (auto &I : Block.Insts)
+      if (I.isConstant() && !setConstant(I))
+        return false;
+
+  MergedCmp.assign(F.Blocks.size(), false);
+  for (int B = 0, e = F.Blocks.size(); B != e; ++B) {
+    forwardStores(B);
+    forwardLoads(B);
+    // a comparison only used by the If right after it is merged into the
+    // branch. Skip alone does not tell, forwardLoads skips a Vload the If
+    // reads too.
+    auto &Insts = F.Blocks[B].Insts;
+    int T = Insts.size() - 1;
+    if (T > 0 && Insts[T].Op == lir_if && Insts[T - 1].Dest == Insts[T].Args[0] &&
+        Uses[Insts[T - 1].Dest].size() == 1 &&
+        (Insts[T - 1].Op == lir_eq || Insts[T - 1].Op == lir_gt || Insts[T - 1].Op == lir_lt)) {
+      Skip[B][T - 1] = true;
+      MergedCmp[B] = true;
+    }
+  }
+
+  for (int B = 0, e = F.Blocks.size(); B != e; ++B) {
+    BlockStart.push_back(Code.size());
+    for (int i = 0, n = F.Blocks[B].Insts.size(); i != n; ++i)
+      if (!Skip[B][i] && !encodeInst(B, i))
+        return false;
+  }
+
+  // thread the code: opcodes become handler addresses, targets addresses
+  for (auto &T : BlockTargets)
+    Code[T.first] = BlockStart[T.second];
+  for (size_t Pos : Targets)
+    Code[Pos] = (intptr_t) (Code.data() + Code[Pos]);
+  for (size_t Pos : Ops)
+    Code[Pos] = (intptr_t) handlers[Code[Pos]];
+  return true;
+}
+
+std::unique_ptr<Bytecode> Bytecode::compile(const LIRFunction &F) {
+  std::unique_ptr<Bytecode> BC(new Bytecode());
+  BC->NumParams = F.NumParams;
+  BytecodeEncoder Encoder(F, BC->Code, BC->Frame);
+  if (!Encoder.encode())
+    return nullptr;
+  return BC;
+}
+
+char *Bytecode::run(char **Args) {
+  // the frame is a gc frame of its own, right below its header
+  std::vector<char *> Roots(Frame.size() + 2);
+  Roots[0] = (char *) (intptr_t) (Frame.size() << 1);
+  Roots[1] = (char *) bt_pgcstack;
+  std::copy(Frame.begin(), Frame.end(), Roots.begin() + 2);
+  for (unsigned i = 0; i < NumParams; i++)
+    Roots[2 + i] = Args[i];
+  bt_pgcstack = (bt_gcframe_t *) Roots.data();
+  char *Ret = execute(Code.data(), Roots.data() + 2);
+  bt_pgcstack = (bt_gcframe_t *) Roots[1];
+  return Ret;
+}
+
+void init_interp(void) {
+  if (getenv("BT_INTERP"))
+    bt_interp_enabled = atoi(getenv("BT_INTERP")) != 0;
+  execute(nullptr, nullptr);
+}
@@ -0,0 +1,51 @@
+#ifndef _INTERP_H
+#define _INTERP_H
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "lir.h"
+
+// Threaded interpreter of the Lightning IR, so that top level expressions run
+// right away instead of paying for an LLVM compile first.
+//
+// A LIRFunction is encoded into direct-threaded bytecode: a word array where
+// every instruction is the address of its handler followed by its operands,
+// and every handler ends by jumping to the handler of the next instruction.
+// Operands are indices into the frame, which holds the variables, then the
+// slots, then a scratch area for the operands the runtime takes by address.
+// Constants are not instructions, their slots are preset when the frame is
+// created. The frame is a gc frame on the shadow stack, everything in it is
+// a root, so values never need to be reloaded after a call.
+//
+// The encoder merges common sequences into superinstructions:
+//   Vload %x, then Add %1 %2     the Add reads %x right from its variable
+//   Int 1, then Add %1 %2        AddI, with the fixnum in the instruction
+//   Lt %1 %2, then If %3         BLt, compare and branch at once
+//   Add %1 %2, then Vstore %x %3 the Add writes %x directly
+// Phis become moves on the edges into their block.
+//
+// BT_INTERP=0 turns the interpreter off, everything is compiled then.
+
+// calls take up to that many arguments in interpreted code, the closure of
+// an Apply included; calls with more are left to the JIT
+#define BT_INTERP_MAX_ARGS 8
+
+extern bool bt_interp_enabled;
+
+/// Bytecode - A LIRFunction encoded for the interpreter.
+class Bytecode {
+  std::vector<intptr_t> Code;
+  std::vector<char *> Frame; // initial frame: constants are set, the rest nil
+  unsigned NumParams;
+
+public:
+  // nullptr when F does something the interpreter does not do
+  static std::unique_ptr<Bytecode> compile(const LIRFunction &F);
+  char *run(char **Args);
+};
+
+void init_interp(void);
+
+#endif
@@ -17,6 +17,7 @@ std::string token_desc[] = {
                 "tok_if",
                 "tok_cond",
                 "tok_begin",
+                "tok_quote",
                 "tok_open",
                 "tok_close",
                 "tok_add",
@@ -26,6 +27,7 @@ std::string token_desc[] = {
                 "tok_gt",
                 "tok_lt",
                 "tok_eq",
+                "tok_eqp",
                 "tok_and",
                 "tok_or",
                 "tok_not",
@@ -34,9 +36,37 @@ std::string token_desc[] = {
                 "tok_setbox",
                 "tok_closure",
                 "tok_getfield",
+                "tok_cons",
+                "tok_car",
+                "tok_cdr",
+                "tok_list",
+                "tok_nullp",
+                "tok_pairp",
+                "tok_map",
+                "tok_make_f64vector",
+                "tok_make_i64vector",
+                "tok_vector_length",
+                "tok_vector_ref",
+                "tok_vector_set",
+                "tok_vector_add",
+                "tok_vector_mul",
+                "tok_vector_fma",
+                "tok_vector_sum",
+                "tok_string_length",
+                "tok_string_ref",
+                "tok_substring",
+                "tok_string_append",
+                "tok_string_eq",
+                "tok_string_lt",
+                "tok_make_hash_table",
+                "tok_hash_ref",
+                "tok_hash_set",
+                "tok_hash_count",
                 "tok_nil",
                 "tok_symbol",
                 "tok_integer",
+                "tok_float",
+                "tok_string",
                 "tok_space",
                 "tok_newline",
               }; 
@@ -51,7 +81,7 @@ bool isDelim(char ch) {
 
 bool maybeInt(const char *str) {
   char ch = str[0];
-  return ch == '+' || ch == '-' || isdigit(ch);
+  return ch == '+' || ch == '-' || isdigit(ch) || (ch == '.' && isdigit(str[1]));
 }
 
 int readInt(const char *str) {
@@ -67,6 +97,33 @@ token_type getIntToken(const char *text, int *len) {
   }
 
   int int_len = readInt(text + sign);
+
+  // decimals: [sign] digits [. digits] [e [sign] digits], with digits on at
+  // least one side of the point
+  int n = sign + int_len;
+  bool is_float = false;
+  if (text[n] == '.') {
+    int frac_len = readInt(text + n + 1);
+    if (int_len == 0 && frac_len == 0)
+      return tok_error;
+    n += 1 + frac_len;
+    is_float = true;
+  }
+  if ((text[n] == 'e' || text[n] == 'E') && (int_len > 0 || is_float)) {
+    int exp_sign = (text[n+1] == '+' || text[n+1] == '-') ? 1 : 0;
+    int exp_len = readInt(text + n + 1 + exp_sign);
+    if (exp_len == 0)
+      return tok_error;
+    n += 1 + exp_sign + exp_len;
+    is_float = true;
+  }
+  if (is_float) {
+    if (!isDelim(text[n]))
+      return tok_error;
+    *len = n;
+    return tok_float;
+  }
+
   if (!isDelim(text[sign+int_len])) {
     return tok_error;
   }
@@ -91,7 +148,8 @@ int isIdChar0(char ch) {
 }
 
 int isIdChar(char ch) {
-  return isIdChar0(ch) || isdigit(ch) || ch == '!' || ch == '-' || ch == '?' || ch == '#';
+  return isIdChar0(ch) || isdigit(ch) || ch == '!' || ch == '-' || ch == '?' || ch == '#' ||
+         ch == '=' || ch == '<' || ch == '>';
 }
 
 bool equalsKeyword(const char *a, int n, const char *b) {
@@ -124,6 +182,10 @@ token_type getIdToken(const char *text, int *len) {
     return tok_cond;
   if (equalsKeyword(text, n, "begin"))
     return tok_begin;
+  if (equalsKeyword(text, n, "quote"))
+    return tok_quote;
+  if (equalsKeyword(text, n, "eq?"))
+    return tok_eqp;
   if (equalsKeyword(text, n, "and"))
     return tok_and;
   if (equalsKeyword(text, n, "or"))
@@ -140,6 +202,58 @@ token_type getIdToken(const char *text, int *len) {
     return tok_closure;
   if (equalsKeyword(text, n, "getfield"))
     return tok_getfield;
+  if (equalsKeyword(text, n, "cons"))
+    return tok_cons;
+  if (equalsKeyword(text, n, "car"))
+    return tok_car;
+  if (equalsKeyword(text, n, "cdr"))
+    return tok_cdr;
+  if (equalsKeyword(text, n, "list"))
+    return tok_list;
+  if (equalsKeyword(text, n, "null?"))
+    return tok_nullp;
+  if (equalsKeyword(text, n, "pair?"))
+    return tok_pairp;
+  if (equalsKeyword(text, n, "map"))
+    return tok_map;
+  if (equalsKeyword(text, n, "make-f64vector"))
+    return tok_make_f64vector;
+  if (equalsKeyword(text, n, "make-i64vector"))
+    return tok_make_i64vector;
+  if (equalsKeyword(text, n, "vector-length"))
+    return tok_vector_length;
+  if (equalsKeyword(text, n, "vector-ref"))
+    return tok_vector_ref;
+  if (equalsKeyword(text, n, "vector-set!"))
+    return tok_vector_set;
+  if (equalsKeyword(text, n, "vector-add"))
+    return tok_vector_add;
+  if (equalsKeyword(text, n, "vector-mul"))
+    return tok_vector_mul;
+  if (equalsKeyword(text, n, "vector-fma"))
+    return tok_vector_fma;
+  if (equalsKeyword(text, n, "vector-sum"))
+    return tok_vector_sum;
+  if (equalsKeyword(text, n, "string-length"))
+    return tok_string_length;
+  if (equalsKeyword(text, n, "string-ref"))
+    return tok_string_ref;
+  if (equalsKeyword(text, n, "substring"))
+    return tok_substring;
+  if (equalsKeyword(text, n, "string-append"))
+    return tok_string_append;
+  if (equalsKeyword(text, n, "string=?"))
+    return tok_string_eq;
+  if (equalsKeyword(text, n, "string<?"))
+    return tok_string_lt;
+  if (equalsKeyword(text, n, "make-hash-table"))
+    return tok_make_hash_table;
+  if (equalsKeyword(text, n, "hash-ref"))
+    return tok_hash_ref;
+  if (equalsKeyword(text, n, "hash-set!"))
+    return tok_hash_set;
+  if (equalsKeyword(text, n, "hash-count"))
+    return tok_hash_count;
   if (equalsKeyword(text, n, "nil"))
     return tok_nil;
   if (equalsKeyword(text, n, "set!"))
@@ -148,6 +262,20 @@ token_type getIdToken(const char *text, int *len) {
   return tok_symbol;
 }
 
+// A string literal, quotes and escapes included; the parser unescapes it
+token_type getStringToken(const char *text, int *len) {
+  int n = 1;
+  while (text[n] != '"') {
+    if (text[n] == '\0')
+      return tok_error;
+    if (text[n] == '\\' && text[n+1] != '\0')
+      n++;
+    n++;
+  }
+  *len = n + 1;
+  return tok_string;
+}
+
 token_type getToken(const char *text, int *len) {
   token_type ret = tok_error;
   int n = 0;
@@ -191,11 +319,20 @@ token_type getToken(const char *text, int *len) {
     return tok_lt;
   }
 
+  if (text[0] == '\'') {
+    *len = 1;
+    return tok_quote;
+  }
+
   if (text[0] == '=') {
     *len = 1;
     return tok_eq;
   }
 
+  if (text[0] == '"') {
+    return getStringToken(text, len);
+  }
+
   if (isWhitespace(text[0])) {
     do {
       n++;
@@ -0,0 +1,456 @@
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "ast.h"
+#include "lir.h"
+#include "liropt.h"
+
+#define FUNCTIONPROTOS (Driver::instance()->FunctionProtos)
+
+static const char *opcode_name[] = {
+  "Int", "Float", "Nil", "Bool", "Quote", "String", "Vload",
+  "Vdefine", "Vload", "Vstore",
+  "Add", "Sub", "Mult", "Div", "Eq", "Gt", "Lt",
+  "Eqp", "And", "Or", "Not",
+  "Prim", "List", "Closure", "GetField",
+  "Call", "Apply",
+  "Phi",
+  "If", "Goto", "Ret"
+};
+
+void LIRInst::print(std::ostream &OS, const std::vector<std::string> &Vars) const {
+  if (Dest >= 0)
+    OS << "%" << Dest + 1 << " = ";
+  OS << opcode_name[Op];
+  switch (Op) {
+  case lir_int:
+    OS << " " << Imm;
+    break;
+  case lir_float:
+    OS << " " << FImm;
+    break;
+  case lir_bool:
+    OS << (Imm ? " #t" : " #f");
+    break;
+  case lir_symbol:
+    OS << " " << Name;
+    break;
+  case lir_string:
+    OS << " \"" << Name << "\"";
+    break;
+  case lir_fref:
+  case lir_closure:
+  case lir_call:
+    OS << " @" << Name;
+    break;
+  case lir_vdefine:
+  case lir_vload:
+  case lir_vstore:
+    OS << " %" << Vars[Var];
+    break;
+  case lir_prim:
+    OS << " " << token_desc[Imm].substr(4);
+    break;
+  case lir_getfield:
+    OS << " " << Imm;
+    break;
+  case lir_phi:
+    for (unsigned i = 0, e = Args.size(); i != e; ++i)
+      OS << (i ? " or %" : " %") << Args[i] + 1 << " from L" << Labels[i];
+    return;
+  case lir_if:
+    OS << " %" << Args[0] + 1 << " then L" << Labels[0] << " else L" << Labels[1];
+    return;
+  case lir_goto:
+    OS << " L" << Labels[0];
+    return;
+  default:
+    break;
+  }
+  for (int Arg : Args)
+    OS << " %" << Arg + 1;
+  if (Tail)
+    OS << " (tail)";
+}
+
+void LIRFunction::print(std::ostream &OS) const {
+  OS << "function @" << Name << " (";
+  for (unsigned i = 0; i < NumParams; i++)
+    OS << (i ? ", %" : "%") << Vars[i];
+  OS << "):\n";
+  for (unsigned i = 0, e = Blocks.size(); i != e; ++i) {
+    OS << "  Label L" << i << "\n";
+    for (auto &I : Blocks[i].Insts) {
+      OS << "    ";
+      I.print(OS, Vars);
+      OS << "\n";
+    }
+  }
+  OS << "end\n";
+}
+
+void LIRFunction::dump() const {
+  print(std::cerr);
+}
+
+int LIRBuilder::createBlock() {
+  F->Blocks.push_back(LIRBlock());
+  return F->Blocks.size() - 1;
+}
+
+int LIRBuilder::createVar(const std::string &Name) {
+  F->Vars.push_back(Name);
+  return NamedVars[Name] = F->Vars.size() - 1;
+}
+
+int LIRBuilder::insert(LIRInst I, bool HasValue) {
+  if (HasValue)
+    I.Dest = F->NumSlots++;
+  int Dest = I.Dest;
+  F->Blocks[Block].Insts.push_back(std::move(I));
+  return Dest;
+}
+
+int LIRBuilder::createInt(int64_t Val) {
+  LIRInst I(lir_int);
+  I.Imm = Val;
+  return insert(std::move(I));
+}
+
+int LIRBuilder::createNil() {
+  return insert(LIRInst(lir_nil));
+}
+
+int LIRBuilder::createOp(lir_opcode Op, std::vector<int> Args) {
+  LIRInst I(Op);
+  I.Args = std::move(Args);
+  return insert(std::move(I));
+}
+
+void LIRBuilder::createIf(int Cond, int Then, int Else) {
+  LIRInst I(lir_if);
+  I.Args.push_back(Cond);
+  I.Labels = { Then, Else };
+  insert(std::move(I), false);
+}
+
+void LIRBuilder::createGoto(int Target) {
+  LIRInst I(lir_goto);
+  I.Labels.push_back(Target);
+  insert(std::move(I), false);
+}
+
+void LIRBuilder::createRet(int Val) {
+  LIRInst I(lir_ret);
+  I.Args.push_back(Val);
+  insert(std::move(I), false);
+}
+
+static int LogErrorL(const char *Str) {
+  LogError(Str);
+  return -1;
+}
+
+int ExprAST::lirgen(LIRBuilder &B) {
+  return LogErrorL("expression not supported in Lightning IR.");
+}
+
+int IntExprAST::lirgen(LIRBuilder &B) {
+  return B.createInt(Val);
+}
+
+int FloatExprAST::lirgen(LIRBuilder &B) {
+  LIRInst I(lir_float);
+  I.FImm = Val;
+  return B.insert(std::move(I));
+}
+
+int SymbolExprAST::lirgen(LIRBuilder &B) {
+  LIRInst I(lir_symbol);
+  I.Name = Name;
+  return B.insert(std::move(I));
+}
+
+int StringExprAST::lirgen(LIRBuilder &B) {
+  LIRInst I(lir_string);
+  I.Name = Val;
+  return B.insert(std::move(I));
+}
+
+int NilExprAST::lirgen(LIRBuilder &B) {
+  return B.createNil();
+}
+
+int VariableExprAST::lirgen(LIRBuilder &B) {
+  // function names are global, as in codegen they win over variables
+  if (FUNCTIONPROTOS.count(Name) > 0) {
+    LIRInst I(lir_fref);
+    I.Name = Name;
+    return B.insert(std::move(I));
+  }
+
+  auto V = B.NamedVars.find(Name);
+  if (V == B.NamedVars.end())
+    return LogErrorL("Unknown variable name");
+  LIRInst I(lir_vload);
+  I.Var = V->second;
+  return B.insert(std::move(I));
+}
+
+int VarDefinitionExprAST::lirgen(LIRBuilder &B) {
+  int InitVal = Init->lirgen(B);
+  if (InitVal < 0)
+    return LogErrorL("Unknown variable initialization");
+
+  LIRInst Def(lir_vdefine);
+  Def.Var = B.createVar(Name);
+  B.insert(Def, false);
+  LIRInst Store(lir_vstore);
+  Store.Var = Def.Var;
+  Store.Args.push_back(InitVal);
+  B.insert(std::move(Store), false);
+  return B.createNil();
+}
+
+int VarSetExprAST::lirgen(LIRBuilder &B) {
+  int Val = Expr->lirgen(B);
+  if (Val < 0)
+    return LogErrorL("Unknown variable assignment");
+
+  auto V = B.NamedVars.find(Name);
+  if (V == B.NamedVars.end())
+    return LogErrorL("Unknown variable name");
+  LIRInst Store(lir_vstore);
+  Store.Var = V->second;
+  Store.Args.push_back(Val);
+  B.insert(std::move(Store), false);
+  return Val;
+}
+
+int UnaryExprAST::lirgen(LIRBuilder &B) {
+  int R = RHS->lirgen(B);
+  if (R < 0)
+    return LogErrorL("Unknown RHS.");
+
+  switch (Op) {
+  case tok_not:
+    return B.createOp(lir_not, { R });
+  case tok_box:
+  case tok_unbox:
+  case tok_car:
+  case tok_cdr:
+  case tok_nullp:
+  case tok_pairp: {
+    LIRInst I(lir_prim);
+    I.Imm = Op;
+    I.Args.push_back(R);
+    return B.insert(std::move(I));
+  }
+  default:
+    return LogErrorL("invalid binary operator or not implemented yet.");
+  }
+}
+
+int BinaryExprAST::lirgen(LIRBuilder &B) {
+  int L = LHS->lirgen(B);
+  if (L < 0)
+    return LogErrorL("Unknown LHS or RHS.");
+  int R = RHS->lirgen(B);
+  if (R < 0)
+    return LogErrorL("Unknown LHS or RHS.");
+
+  switch (Op) {
+  case tok_add:
+    return B.createOp(lir_add, { L, R });
+  case tok_sub:
+    return B.createOp(lir_sub, { L, R });
+  case tok_mul:
+    return B.createOp(lir_mult, { L, R });
+  case tok_div:
+    return B.createOp(lir_div, { L, R });
+  case tok_eq:
+    return B.createOp(lir_eq, { L, R });
+  case tok_gt:
+    return B.createOp(lir_gt, { L, R });
+  case tok_lt:
+    return B.createOp(lir_lt, { L, R });
+  case tok_eqp:
+    return B.createOp(lir_eqp, { L, R });
+  case tok_and:
+    return B.createOp(lir_and, { L, R });
+  case tok_or:
+    return B.createOp(lir_or, { L, R });
+  case tok_setbox:
+  case tok_cons:
+  case tok_map: {
+    LIRInst I(lir_prim);
+    I.Imm = Op;
+    I.Args = { L, R };
+    return B.insert(std::move(I));
+  }
+  default:
+    return LogErrorL("invalid binary operator or not implemented yet.");
+  }
+}
+
+int IfExprAST::lirgen(LIRBuilder &B) {
+  int Cond = Pred->lirgen(B);
+  if (Cond < 0)
+    return LogErrorL("invalid predicate in If.");
+
+  int ThenBB = B.createBlock();
+  int ElseBB = B.createBlock();
+  int MergeBB = B.createBlock();
+  B.createIf(Cond, ThenBB, ElseBB);
+
+  B.setInsertBlock(ThenBB);
+  int ThenV = Then->lirgen(B);
+  if (ThenV < 0)
+    return LogErrorL("invalid then in If.");
+  // Then may end in another block
+  ThenBB = B.getInsertBlock();
+  B.createGoto(MergeBB);
+
+  B.setInsertBlock(ElseBB);
+  int ElseV = Else->lirgen(B);
+  if (ElseV < 0)
+    return LogErrorL("invalid else in If.");
+  ElseBB = B.getInsertBlock();
+  B.createGoto(MergeBB);
+
+  B.setInsertBlock(MergeBB);
+  LIRInst Phi(lir_phi);
+  Phi.Args = { ThenV, ElseV };
+  Phi.Labels = { ThenBB, ElseBB };
+  return B.insert(std::move(Phi));
+}
+
+int BeginExprAST::lirgen(LIRBuilder &B) {
+  int Ret = -1;
+  for (auto &E : Exprs) {
+    Ret = E->lirgen(B);
+    if (Ret < 0)
+      return LogErrorL("Invalid begin-clause.");
+  }
+
+  if (Ret < 0)
+    return LogErrorL("empty begin-clause.");
+  return Ret;
+}
+
+int ClosureExprAST::lirgen(LIRBuilder &B) {
+  if (FUNCTIONPROTOS.count(Callback) == 0)
+    return LogErrorL("Unknown closure function referenced");
+
+  LIRInst I(lir_closure);
+  I.Name = Callback;
+  for (auto &M : Members) {
+    int V = M->lirgen(B);
+    if (V < 0)
+      return LogErrorL("Unknown closure member referenced");
+    I.Args.push_back(V);
+  }
+  return B.insert(std::move(I));
+}
+
+int ListExprAST::lirgen(LIRBuilder &B) {
+  LIRInst I(lir_list);
+  for (auto &M : Members) {
+    int V = M->lirgen(B);
+    if (V < 0)
+      return LogErrorL("Unknown list member referenced");
+    I.Args.push_back(V);
+  }
+  return B.insert(std::move(I));
+}
+
+int GetFieldExprAST::lirgen(LIRBuilder &B) {
+  int Obj = Object->lirgen(B);
+  if (Obj < 0)
+    return -1;
+  LIRInst I(lir_getfield);
+  I.Imm = Index;
+  I.Args.push_back(Obj);
+  return B.insert(std::move(I));
+}
+
+int PrimitiveExprAST::lirgen(LIRBuilder &B) {
+  LIRInst I(lir_prim);
+  I.Imm = Op;
+  for (auto &Arg : Args) {
+    int V = Arg->lirgen(B);
+    if (V < 0)
+      return LogErrorL("Unknown primitive argument.");
+    I.Args.push_back(V);
+  }
+  return B.insert(std::move(I));
+}
+
+int CallExprAST::lirgen(LIRBuilder &B) {
+  auto Proto = FUNCTIONPROTOS.find(Symbol_);
+  LIRInst I(Proto != FUNCTIONPROTOS.end() ? lir_call : lir_apply);
+  I.Tail = Tail;
+
+  if (I.Op == lir_call) {
+    if ((unsigned) Proto->second->nargs() != Args.size())
+      return LogErrorL("Incorrect # arguments passed");
+    I.Name = Symbol_;
+  } else {
+    int V = Callee->lirgen(B);
+    if (V < 0)
+      return LogErrorL("Unknown function referenced");
+    I.Args.push_back(V);
+  }
+
+  for (auto &Arg : Args) {
+    int V = Arg->lirgen(B);
+    if (V < 0)
+      return LogErrorL("Unknown argument in call");
+    I.Args.push_back(V);
+  }
+  return B.insert(std::move(I));
+}
+
+std::unique_ptr<LIRFunction> FunctionAST::buildLIR() {
+  auto P = FUNCTIONPROTOS.find(name);
+  if (P == FUNCTIONPROTOS.end())
+    return nullptr;
+
+  auto F = llvm::make_unique<LIRFunction>(name);
+  LIRBuilder B(F.get());
+  for (auto &Arg : P->second->Args)
+    B.createVar(Arg);
+  F->NumParams = P->second->Args.size();
+
+  B.setInsertBlock(B.createBlock());
+  if (!Body.empty())
+    Body.back()->markTail();
+
+  int RetVal = -1;
+  for (auto &E : Body) {
+    RetVal = E->lirgen(B);
+    if (RetVal < 0) {
+      LogError("Invalid body expr.");
+      return nullptr;
+    }
+  }
+  if (RetVal < 0)
+    return nullptr;
+
+  B.createRet(RetVal);
+  return F;
+}
+
+LIRFunction *FunctionAST::getLIR() {
+  if (LIR)
+    return LIR.get();
+  LIR = buildLIR();
+  if (!LIR)
+    return nullptr;
+  LIRPassManager PM;
+  addLIROptimizationPasses(PM);
+  PM.run(*LIR);
+  return LIR.get();
+}
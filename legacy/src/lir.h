@@ -0,0 +1,147 @@
+#ifndef _LIR_H
+#define _LIR_H
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+// Lightning IR, the low-level IR of Design.rst. A function is a list of basic
+// blocks, block i has label Li and L0 is the entry. Every value is a slot
+// (%1, %2, ...), assigned once by the instruction that computes it. Named
+// variables (%x) are only reached through Vdefine, Vload and Vstore, the
+// parameters are the first variables of the function. The optimizer
+// promotes the variables to slots and phis, leaving loads of the parameters.
+//
+// The IR is built from the AST by ExprAST::lirgen and optimized (see
+// liropt.h). The optimized IR runs in the threaded interpreter (see interp.h)
+// or is lowered to LLVM IR for the JIT (see LIRLowering in codegen.cpp).
+
+enum lir_opcode {
+  // constants: Int Imm, Float FImm, Nil, Bool Imm (only made by the
+  // optimizer, see liropt.h), Quote Name (a symbol), String Name and
+  // Vload @Name (the reference of a global function)
+  lir_int,
+  lir_float,
+  lir_nil,
+  lir_bool,
+  lir_symbol,
+  lir_string,
+  lir_fref,
+
+  // variables, Var is the index into LIRFunction::Vars
+  lir_vdefine,
+  lir_vload,
+  lir_vstore,
+
+  // arithmetic and comparisons, on any numbers
+  lir_add,
+  lir_sub,
+  lir_mult,
+  lir_div,
+  lir_eq,
+  lir_gt,
+  lir_lt,
+
+  // logic, on any values
+  lir_eqp,
+  lir_and,
+  lir_or,
+  lir_not,
+
+  // other operations of the runtime, Imm is the token of the operator:
+  // box, unbox, setbox!, cons, car, cdr, null?, pair?, map and the primitives
+  lir_prim,
+  // List of the operands, Closure @Name of the operands, GetField Imm
+  lir_list,
+  lir_closure,
+  lir_getfield,
+
+  // Call @Name with the operands, Apply to the callable in operand 0 the
+  // rest of them. Tail marks a call whose value the function returns.
+  lir_call,
+  lir_apply,
+
+  // Phi of operand i coming from block Labels[i]
+  lir_phi,
+
+  // terminators: If the operand then Labels[0] else Labels[1], Goto
+  // Labels[0], Ret the operand
+  lir_if,
+  lir_goto,
+  lir_ret
+};
+
+/// LIRInst - One instruction. Dest is the slot it assigns, -1 for none.
+struct LIRInst {
+  lir_opcode Op;
+  int Dest;
+  std::vector<int> Args;   // operand slots
+  std::vector<int> Labels; // successors of a terminator, predecessors of a Phi
+  int Var;
+  int64_t Imm;
+  double FImm;
+  std::string Name;
+  bool Tail;
+
+  LIRInst(lir_opcode op) : Op(op), Dest(-1), Var(-1), Imm(0), FImm(0), Tail(false) {}
+
+  bool isTerminator() const { return Op == lir_if || Op == lir_goto || Op == lir_ret; }
+  bool isConstant() const { return Op <= lir_fref; }
+  void print(std::ostream &OS, const std::vector<std::string> &Vars) const;
+};
+
+/// LIRBlock - A basic block, the last instruction is its terminator.
+struct LIRBlock {
+  std::vector<LIRInst> Insts;
+};
+
+/// LIRFunction - A function in Lightning IR.
+class LIRFunction {
+public:
+  std::string Name;
+  unsigned NumParams;
+  std::vector<std::string> Vars; // the parameters come first
+  std::vector<LIRBlock> Blocks;
+  int NumSlots;
+
+  LIRFunction(const std::string &Name) : Name(Name), NumParams(0), NumSlots(0) {}
+
+  void print(std::ostream &OS) const;
+  void dump() const;
+};
+
+/// LIRBuilder - Appends instructions to the current block of a function,
+/// and keeps the variables of the function in scope by name.
+class LIRBuilder {
+  LIRFunction *F;
+  int Block;
+
+public:
+  std::map<std::string, int> NamedVars;
+
+  LIRBuilder(LIRFunction *F) : F(F), Block(-1) {}
+
+  LIRFunction *getFunction() { return F; }
+  int getInsertBlock() { return Block; }
+  void setInsertBlock(int B) { Block = B; }
+  int createBlock();
+
+  // a new variable, Name refers to it from now on
+  int createVar(const std::string &Name);
+
+  // Append I, giving it a new slot when HasValue. The result is the slot,
+  // -1 when there is none.
+  int insert(LIRInst I, bool HasValue = true);
+
+  int createInt(int64_t Val);
+  int createNil();
+  int createOp(lir_opcode Op, std::vector<int> Args);
+  void createIf(int Cond, int Then, int Else);
+  void createGoto(int Target);
+  void createRet(int Val);
+};
+
+#endif
@@ -0,0 +1,794 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "common.h"
+#include "liropt.h"
+
+// rounds of all passes before the pass manager gives up on a fixed point
+#define BT_LIR_MAX_ROUNDS 4
+
+bool LIRPassManager::run(LIRFunction &F) {
+  bool Changed = false;
+  for (int Round = 0; Round < BT_LIR_MAX_ROUNDS; Round++) {
+    bool Again = false;
+    for (auto &P : Passes)
+      Again |= P->run(F);
+    if (!Again)
+      break;
+    Changed = true;
+  }
+  return Changed;
+}
+
+/// getDefs - The instruction of every slot of F, nullptr for slots that are
+/// gone. Valid until instructions are added or removed.
+static std::vector<LIRInst *> getDefs(LIRFunction &F) {
+  std::vector<LIRInst *> Defs(F.NumSlots, nullptr);
+  for (auto &B : F.Blocks)
+    for (auto &I : B.Insts)
+      if (I.Dest >= 0)
+        Defs[I.Dest] = &I;
+  return Defs;
+}
+
+/// getPredecessors - The predecessors of every block, once per edge.
+static std::vector<std::vector<int>> getPredecessors(const LIRFunction &F) {
+  std::vector<std::vector<int>> Preds(F.Blocks.size());
+  for (int B = 0, e = F.Blocks.size(); B != e; ++B)
+    for (int S : F.Blocks[B].Insts.back().Labels)
+      Preds[S].push_back(B);
+  return Preds;
+}
+
+static std::vector<int> getIdentity(int N) {
+  std::vector<int> Rep(N);
+  for (int i = 0; i < N; i++)
+    Rep[i] = i;
+  return Rep;
+}
+
+/// replaceSlots - Rewrite the operands of F through Rep, where Rep[s] is the
+/// slot replacing s, s itself when it stays.
+static void replaceSlots(LIRFunction &F, const std::vector<int> &Rep) {
+  for (auto &B : F.Blocks)
+    for (auto &I : B.Insts)
+      for (int &A : I.Args)
+        while (Rep[A] != A)
+          A = Rep[A];
+}
+
+/// removeReplaced - Remove the instructions whose slot Rep replaces.
+static void removeReplaced(LIRFunction &F, const std::vector<int> &Rep) {
+  for (auto &B : F.Blocks)
+    B.Insts.erase(std::remove_if(B.Insts.begin(), B.Insts.end(),
+                                 [&](const LIRInst &I) { return I.Dest >= 0 && Rep[I.Dest] != I.Dest; }),
+                  B.Insts.end());
+}
+
+/// removeTrivialPhis - Replace the phis that merge one value, apart from
+/// themselves, by that value.
+static bool removeTrivialPhis(LIRFunction &F) {
+  std::vector<int> Rep = getIdentity(F.NumSlots);
+  bool Changed = false;
+  for (auto &B : F.Blocks) {
+    for (auto &I : B.Insts) {
+      if (I.Op != lir_phi)
+        break;
+      int Value = -1;
+      bool Trivial = true;
+      for (int A : I.Args) {
+        while (Rep[A] != A)
+          A = Rep[A];
+        if (A == I.Dest || A == Value)
+          continue;
+        Trivial &= Value < 0;
+        Value = A;
+      }
+      if (Trivial && Value >= 0) {
+        Rep[I.Dest] = Value;
+        Changed = true;
+      }
+    }
+  }
+  if (Changed) {
+    replaceSlots(F, Rep);
+    removeReplaced(F, Rep);
+  }
+  return Changed;
+}
+
+/// removeUnreachable - Remove the blocks that cannot be reached from the
+/// entry, the others keep their order.
+static bool removeUnreachable(LIRFunction &F) {
+  int N = F.Blocks.size();
+  std::vector<bool> Reachable(N, false);
+  std::vector<int> Work = { 0 };
+  Reachable[0] = true;
+  while (!Work.empty()) {
+    int B = Work.back();
+    Work.pop_back();
+    for (int S : F.Blocks[B].Insts.back().Labels)
+      if (!Reachable[S]) {
+        Reachable[S] = true;
+        Work.push_back(S);
+      }
+  }
+  if (std::count(Reachable.begin(), Reachable.end(), true) == N)
+    return false;
+
+  std::vector<int> Index(N, -1);
+  std::vector<LIRBlock> Blocks;
+  for (int B = 0; B < N; B++) {
+    if (!Reachable[B])
+      continue;
+    Index[B] = Blocks.size();
+    Blocks.push_back(std::move(F.Blocks[B]));
+  }
+  for (auto &Block : Blocks) {
+    for (auto &I : Block.Insts) {
+      if (I.Op == lir_phi) {
+        for (unsigned i = 0; i < I.Args.size(); ) {
+          if (Index[I.Labels[i]] < 0) {
+            I.Args.erase(I.Args.begin() + i);
+            I.Labels.erase(I.Labels.begin() + i);
+          } else {
+            I.Labels[i] = Index[I.Labels[i]];
+            i++;
+          }
+        }
+      } else if (I.isTerminator()) {
+        for (int &L : I.Labels)
+          L = Index[L];
+      }
+    }
+  }
+  F.Blocks = std::move(Blocks);
+  return true;
+}
+
+/// getTruth - How If takes constant C: 1 for then, 0 for else, -1 when that
+/// is not known. Only nil, #f and 0 are false.
+static int getTruth(const LIRInst *C) {
+  if (!C)
+    return -1;
+  switch (C->Op) {
+  case lir_nil:
+    return 0;
+  case lir_int:
+  case lir_bool:
+    return C->Imm != 0;
+  case lir_symbol:
+  case lir_string:
+  case lir_fref:
+    return 1;
+  default:
+    return -1;
+  }
+}
+
+static bool isFixnum(const LIRInst *C) {
+  return C && C->Op == lir_int && bt_fits_fixnum(C->Imm);
+}
+
+// constants that are immediates or interned: the same value is the same word
+static bool isIdentical(const LIRInst *C) {
+  return C && (isFixnum(C) || C->Op == lir_nil || C->Op == lir_bool || C->Op == lir_symbol);
+}
+
+static void setConstant(LIRInst &I, lir_opcode Op, int64_t Imm) {
+  int Dest = I.Dest;
+  I = LIRInst(Op);
+  I.Dest = Dest;
+  I.Imm = Imm;
+}
+
+/// ConstantFolding - Computes what only depends on constants.
+class ConstantFolding : public LIRPass {
+  bool fold(LIRInst &I, const std::vector<LIRInst *> &Defs);
+  bool forwardBoxes(LIRFunction &F);
+
+public:
+  const char *getName() const override { return "constfold"; }
+  bool run(LIRFunction &F) override;
+};
+
+bool ConstantFolding::fold(LIRInst &I, const std::vector<LIRInst *> &Defs) {
+  const LIRInst *L = I.Args.size() > 0 ? Defs[I.Args[0]] : nullptr;
+  const LIRInst *R = I.Args.size() > 1 ? Defs[I.Args[1]] : nullptr;
+  int64_t V;
+  switch (I.Op) {
+  case lir_add:
+  case lir_sub:
+  case lir_mult: {
+    // as the fixnum fast path computes it, overflow is left to the runtime
+    if (!isFixnum(L) || !isFixnum(R))
+      return false;
+    bool Overflow = I.Op == lir_add ? __builtin_add_overflow(L->Imm, R->Imm, &V)
+                  : I.Op == lir_sub ? __builtin_sub_overflow(L->Imm, R->Imm, &V)
+                  : __builtin_mul_overflow(L->Imm, R->Imm, &V);
+    if (Overflow || !bt_fits_fixnum(V))
+      return false;
+    setConstant(I, lir_int, V);
+    return true;
+  }
+  case lir_eq:
+  case lir_gt:
+  case lir_lt:
+    if (!L || !R || L->Op != lir_int || R->Op != lir_int)
+      return false;
+    setConstant(I, lir_bool, I.Op == lir_eq ? L->Imm == R->Imm
+                           : I.Op == lir_gt ? L->Imm > R->Imm : L->Imm < R->Imm);
+    return true;
+  case lir_eqp:
+    if (!isIdentical(L) || !isIdentical(R))
+      return false;
+    setConstant(I, lir_bool, L->Op == R->Op && L->Imm == R->Imm && L->Name == R->Name);
+    return true;
+  case lir_not:
+    if (getTruth(L) < 0)
+      return false;
+    setConstant(I, lir_bool, !getTruth(L));
+    return true;
+  case lir_and:
+    if (getTruth(L) == 0 || getTruth(R) == 0)
+      setConstant(I, lir_bool, 0);
+    else if (getTruth(L) == 1 && getTruth(R) == 1)
+      setConstant(I, lir_bool, 1);
+    else
+      return false;
+    return true;
+  case lir_or:
+    if (getTruth(L) == 1 || getTruth(R) == 1)
+      setConstant(I, lir_bool, 1);
+    else if (getTruth(L) == 0 && getTruth(R) == 0)
+      setConstant(I, lir_bool, 0);
+    else
+      return false;
+    return true;
+  case lir_prim:
+    // no constant is a pair
+    if ((I.Imm != tok_nullp && I.Imm != tok_pairp) || !L || !L->isConstant())
+      return false;
+    setConstant(I, lir_bool, I.Imm == tok_nullp && L->Op == lir_nil);
+    return true;
+  default:
+    return false;
+  }
+}
+
+/// forwardBoxes - Unbox of a box made earlier in the same block is the value
+/// it was made with, unless the box may have been set in between: only
+/// setbox! and calls set boxes.
+bool ConstantFolding::forwardBoxes(LIRFunction &F) {
+  std::vector<int> Rep = getIdentity(F.NumSlots);
+  bool Changed = false;
+  for (auto &B : F.Blocks) {
+    std::map<int, int> Fresh; // box slot to its value
+    for (auto &I : B.Insts) {
+      if (I.Op == lir_call || I.Op == lir_apply ||
+          (I.Op == lir_prim && (I.Imm == tok_setbox || I.Imm == tok_map))) {
+        Fresh.clear();
+      } else if (I.Op == lir_prim && I.Imm == tok_box) {
+        Fresh[I.Dest] = I.Args[0];
+      } else if (I.Op == lir_prim && I.Imm == tok_unbox && Fresh.count(I.Args[0])) {
+        Rep[I.Dest] = Fresh[I.Args[0]];
+        Changed = true;
+      }
+    }
+  }
+  if (Changed) {
+    replaceSlots(F, Rep);
+    removeReplaced(F, Rep);
+  }
+  return Changed;
+}
+
+bool ConstantFolding::run(LIRFunction &F) {
+  bool Changed = forwardBoxes(F);
+  // folded instructions stay where they are, so later ones see them
+  std::vector<LIRInst *> Defs = getDefs(F);
+  for (auto &B : F.Blocks)
+    for (auto &I : B.Insts)
+      Changed |= fold(I, Defs);
+  return Changed;
+}
+
+/// CFGSimplification - Removes branches that are known, blocks that are only
+/// ever entered from one other, and unreachable blocks.
+class CFGSimplification : public LIRPass {
+  bool foldBranches(LIRFunction &F);
+  bool mergeBlocks(LIRFunction &F);
+
+public:
+  const char *getName() const override { return "simplifycfg"; }
+  bool run(LIRFunction &F) override {
+    bool Changed = foldBranches(F);
+    Changed |= mergeBlocks(F);
+    Changed |= removeUnreachable(F);
+    Changed |= removeTrivialPhis(F);
+    return Changed;
+  }
+};
+
+/// removeIncoming - Remove the entries of the phis of Block for the edge
+/// from Pred.
+static void removeIncoming(LIRBlock &Block, int Pred) {
+  for (auto &I : Block.Insts) {
+    if (I.Op != lir_phi)
+      break;
+    for (unsigned i = 0, e = I.Args.size(); i != e; ++i) {
+      if (I.Labels[i] == Pred) {
+        I.Args.erase(I.Args.begin() + i);
+        I.Labels.erase(I.Labels.begin() + i);
+        break;
+      }
+    }
+  }
+}
+
+bool CFGSimplification::foldBranches(LIRFunction &F) {
+  std::vector<LIRInst *> Defs = getDefs(F);
+  bool Changed = false;
+  for (int B = 0, e = F.Blocks.size(); B != e; ++B) {
+    LIRInst &T = F.Blocks[B].Insts.back();
+    if (T.Op != lir_if || T.Labels[0] == T.Labels[1])
+      continue;
+    int Truth = getTruth(Defs[T.Args[0]]);
+    if (Truth < 0)
+      continue;
+    int Taken = T.Labels[Truth ? 0 : 1];
+    removeIncoming(F.Blocks[T.Labels[Truth ? 1 : 0]], B);
+    T = LIRInst(lir_goto);
+    T.Labels.push_back(Taken);
+    Changed = true;
+  }
+  return Changed;
+}
+
+bool CFGSimplification::mergeBlocks(LIRFunction &F) {
+  std::vector<std::vector<int>> Preds = getPredecessors(F);
+  std::vector<int> Into = getIdentity(F.Blocks.size()); // where merged blocks went
+  std::vector<int> Rep = getIdentity(F.NumSlots);
+  bool Changed = false;
+  for (int B = 1, e = F.Blocks.size(); B != e; ++B) {
+    if (Preds[B].size() != 1)
+      continue;
+    int P = Preds[B][0];
+    while (Into[P] != P)
+      P = Into[P];
+    auto &PI = F.Blocks[P].Insts;
+    if (P == B || PI.back().Op != lir_goto)
+      continue;
+
+    // phis of a block with one predecessor have one entry
+    auto &BI = F.Blocks[B].Insts;
+    PI.pop_back();
+    for (auto &I : BI) {
+      if (I.Op == lir_phi)
+        Rep[I.Dest] = I.Args[0];
+      else
+        PI.push_back(std::move(I));
+    }
+    BI.clear();
+    for (int S : PI.back().Labels)
+      for (auto &I : F.Blocks[S].Insts) {
+        if (I.Op != lir_phi)
+          break;
+        std::replace(I.Labels.begin(), I.Labels.end(), B, P);
+      }
+    Into[B] = P;
+    Changed = true;
+  }
+  if (Changed)
+    replaceSlots(F, Rep);
+  return Changed;
+}
+
+/// getImmediateDominators - The immediate dominator of every block, -1 for
+/// unreachable ones, as in "A Simple, Fast Dominance Algorithm" by Cooper,
+/// Harvey and Kennedy.
+static std::vector<int> getImmediateDominators(const LIRFunction &F) {
+  int N = F.Blocks.size();
+  std::vector<int> PostOrder, PostNum(N, -1);
+  std::vector<bool> Seen(N, false);
+  std::vector<std::pair<int, unsigned>> Stack = { { 0, 0 } };
+  Seen[0] = true;
+  while (!Stack.empty()) {
+    int B = Stack.back().first;
+    auto &Succs = F.Blocks[B].Insts.back().Labels;
+    if (Stack.back().second < Succs.size()) {
+      int S = Succs[Stack.back().second++];
+      if (!Seen[S]) {
+        Seen[S] = true;
+        Stack.push_back(std::make_pair(S, 0));
+      }
+      continue;
+    }
+    PostNum[B] = PostOrder.size();
+    PostOrder.push_back(B);
+    Stack.pop_back();
+  }
+
+  std::vector<std::vector<int>> Preds = getPredecessors(F);
+  std::vector<int> IDom(N, -1);
+  IDom[0] = 0;
+  bool Changed = true;
+  while (Changed) {
+    Changed = false;
+    for (auto It = PostOrder.rbegin(); It != PostOrder.rend(); ++It) {
+      int B = *It;
+      if (B == 0)
+        continue;
+      int New = -1;
+      for (int P : Preds[B]) {
+        if (IDom[P] < 0)
+          continue;
+        if (New < 0) {
+          New = P;
+          continue;
+        }
+        int A = P;
+        while (A != New) {
+          while (PostNum[A] < PostNum[New])
+            A = IDom[A];
+          while (PostNum[New] < PostNum[A])
+            New = IDom[New];
+        }
+      }
+      if (IDom[B] != New) {
+        IDom[B] = New;
+        Changed = true;
+      }
+    }
+  }
+  return IDom;
+}
+
+/// getDominatorTree - The children of every block in the dominator tree.
+static std::vector<std::vector<int>> getDominatorTree(const std::vector<int> &IDom) {
+  std::vector<std::vector<int>> Children(IDom.size());
+  for (int B = 1, e = IDom.size(); B < e; B++)
+    if (IDom[B] >= 0)
+      Children[IDom[B]].push_back(B);
+  return Children;
+}
+
+/// Promotion - Turns variables into slots: a Vload becomes the value last
+/// stored to the variable, with phis where stores on different paths meet.
+/// Parameters are loaded once, at the start of the entry block.
+class Promotion : public LIRPass {
+  std::vector<std::vector<int>> Children;
+  std::vector<std::vector<int>> Stacks; // values of every variable, innermost last
+  std::vector<int> Rep;
+
+  static bool isPromoted(const LIRFunction &F);
+  void rename(LIRFunction &F, int B);
+
+public:
+  const char *getName() const override { return "mem2reg"; }
+  bool run(LIRFunction &F) override;
+};
+
+// nothing left to do when only the loads of the parameters in the entry block
+// are left, once each
+bool Promotion::isPromoted(const LIRFunction &F) {
+  std::vector<bool> Loaded(F.Vars.size(), false);
+  for (int B = 0, e = F.Blocks.size(); B != e; ++B) {
+    for (auto &I : F.Blocks[B].Insts) {
+      if (I.Op == lir_vdefine || I.Op == lir_vstore)
+        return false;
+      if (I.Op != lir_vload)
+        continue;
+      if (B != 0 || I.Var >= (int) F.NumParams || Loaded[I.Var])
+        return false;
+      Loaded[I.Var] = true;
+    }
+  }
+  return true;
+}
+
+void Promotion::rename(LIRFunction &F, int B) {
+  std::vector<int> Pushed;
+  for (auto &I : F.Blocks[B].Insts) {
+    if (I.Op == lir_phi && I.Var >= 0) {
+      Stacks[I.Var].push_back(I.Dest);
+      Pushed.push_back(I.Var);
+    } else if (I.Op == lir_vload && I.Dest != Stacks[I.Var].back()) {
+      Rep[I.Dest] = Stacks[I.Var].back();
+    } else if (I.Op == lir_vstore) {
+      Stacks[I.Var].push_back(I.Args[0]);
+      Pushed.push_back(I.Var);
+    }
+  }
+
+  for (int S : F.Blocks[B].Insts.back().Labels)
+    for (auto &I : F.Blocks[S].Insts) {
+      if (I.Op != lir_phi)
+        break;
+      if (I.Var < 0)
+        continue;
+      I.Args.push_back(Stacks[I.Var].back());
+      I.Labels.push_back(B);
+    }
+
+  for (int C : Children[B])
+    rename(F, C);
+  for (int V : Pushed)
+    Stacks[V].pop_back();
+}
+
+bool Promotion::run(LIRFunction &F) {
+  // the entry has no phis to merge the initial values with a loop
+  if (isPromoted(F) || !getPredecessors(F)[0].empty())
+    return false;
+  removeUnreachable(F);
+
+  int N = F.Blocks.size(), NumVars = F.Vars.size();
+  // the variables every block loads before storing them, and stores
+  std::vector<std::vector<bool>> Used(N, std::vector<bool>(NumVars, false));
+  std::vector<std::vector<bool>> Stored(N, std::vector<bool>(NumVars, false));
+  for (int B = 0; B < N; B++)
+    for (auto &I : F.Blocks[B].Insts) {
+      if (I.Op == lir_vload && !Stored[B][I.Var])
+        Used[B][I.Var] = true;
+      else if (I.Op == lir_vstore)
+        Stored[B][I.Var] = true;
+    }
+
+  // live variables at the start of every block
+  std::vector<std::vector<bool>> LiveIn = Used;
+  bool Changed = true;
+  while (Changed) {
+    Changed = false;
+    for (int B = N - 1; B >= 0; B--)
+      for (int S : F.Blocks[B].Insts.back().Labels)
+        for (int V = 0; V < NumVars; V++)
+          if (LiveIn[S][V] && !Stored[B][V] && !LiveIn[B][V]) {
+            LiveIn[B][V] = true;
+            Changed = true;
+          }
+  }
+
+  std::vector<int> IDom = getImmediateDominators(F);
+  std::vector<std::vector<int>> Preds = getPredecessors(F);
+  std::vector<std::vector<int>> Frontier(N);
+  for (int B = 1; B < N; B++) {
+    if (Preds[B].size() < 2)
+      continue;
+    for (int P : Preds[B])
+      for (int R = P; R != IDom[B]; R = IDom[R])
+        if (Frontier[R].empty() || Frontier[R].back() != B)
+          Frontier[R].push_back(B);
+  }
+
+  // phis where the variable is live, on the iterated frontier of its stores
+  for (int V = 0; V < NumVars; V++) {
+    std::vector<bool> HasPhi(N, false), Queued(N, false);
+    std::vector<int> Work;
+    for (int B = 0; B < N; B++)
+      if (Stored[B][V]) {
+        Queued[B] = true;
+        Work.push_back(B);
+      }
+    while (!Work.empty()) {
+      int B = Work.back();
+      Work.pop_back();
+      for (int D : Frontier[B]) {
+        if (HasPhi[D] || !LiveIn[D][V])
+          continue;
+        LIRInst Phi(lir_phi);
+        Phi.Dest = F.NumSlots++;
+        Phi.Var = V;
+        auto &Insts = F.Blocks[D].Insts;
+        Insts.insert(Insts.begin(), std::move(Phi));
+        HasPhi[D] = true;
+        if (!Queued[D]) {
+          Queued[D] = true;
+          Work.push_back(D);
+        }
+      }
+    }
+  }
+
+  // the initial values: the parameters, and nil until a variable is defined
+  std::vector<LIRInst> Initial;
+  Stacks.assign(NumVars, std::vector<int>());
+  for (int V = 0; V < NumVars; V++) {
+    if (V <= (int) F.NumParams) {
+      LIRInst I(V < (int) F.NumParams ? lir_vload : lir_nil);
+      I.Dest = F.NumSlots++;
+      if (V < (int) F.NumParams)
+        I.Var = V;
+      Initial.push_back(std::move(I));
+    }
+    Stacks[V].push_back(Initial.back().Dest);
+  }
+  auto &Entry = F.Blocks[0].Insts;
+  Entry.insert(Entry.begin(), Initial.begin(), Initial.end());
+
+  Rep = getIdentity(F.NumSlots);
+  Children = getDominatorTree(IDom);
+  rename(F, 0);
+
+  for (auto &B : F.Blocks)
+    B.Insts.erase(std::remove_if(B.Insts.begin(), B.Insts.end(), [&](const LIRInst &I) {
+                    return I.Op == lir_vdefine || I.Op == lir_vstore ||
+                           (I.Op == lir_vload && Rep[I.Dest] != I.Dest);
+                  }),
+                  B.Insts.end());
+  replaceSlots(F, Rep);
+  for (auto &B : F.Blocks)
+    for (auto &I : B.Insts)
+      if (I.Op == lir_phi)
+        I.Var = -1;
+  F.Vars.resize(F.NumParams);
+  return true;
+}
+
+/// GVN - Replaces a pure instruction by an equal one that dominates it.
+class GVN : public LIRPass {
+  typedef std::tuple<int, int64_t, uint64_t, std::string, std::vector<int>> ValueKey;
+
+  std::map<ValueKey, int> Leaders;
+  std::vector<int> Rep;
+  std::vector<std::vector<int>> Children;
+
+  static bool isPure(const LIRInst &I);
+  void visit(LIRFunction &F, int B);
+
+public:
+  const char *getName() const override { return "gvn"; }
+  bool run(LIRFunction &F) override;
+};
+
+// the same operands give the same value, and nothing else happens (errors
+// aside, which the equal instruction reports already)
+bool GVN::isPure(const LIRInst &I) {
+  if (I.isConstant())
+    return true;
+  switch (I.Op) {
+  case lir_add:
+  case lir_sub:
+  case lir_mult:
+  case lir_div:
+  case lir_eq:
+  case lir_gt:
+  case lir_lt:
+  case lir_eqp:
+  case lir_and:
+  case lir_or:
+  case lir_not:
+  case lir_getfield:
+    return true;
+  case lir_prim:
+    // pairs and closures never change, boxes do
+    return I.Imm == tok_car || I.Imm == tok_cdr || I.Imm == tok_nullp || I.Imm == tok_pairp;
+  default:
+    return false;
+  }
+}
+
+void GVN::visit(LIRFunction &F, int B) {
+  std::vector<ValueKey> Added;
+  for (auto &I : F.Blocks[B].Insts) {
+    if (I.Dest < 0 || !isPure(I))
+      continue;
+    for (int &A : I.Args)
+      while (Rep[A] != A)
+        A = Rep[A];
+    std::vector<int> Args = I.Args;
+    if (I.Op == lir_add || I.Op == lir_mult || I.Op == lir_eq || I.Op == lir_eqp ||
+        I.Op == lir_and || I.Op == lir_or)
+      std::sort(Args.begin(), Args.end());
+    uint64_t FBits;
+    memcpy(&FBits, &I.FImm, sizeof(FBits));
+    ValueKey Key(I.Op, I.Imm, FBits, I.Name, Args);
+
+    auto Leader = Leaders.find(Key);
+    if (Leader != Leaders.end()) {
+      Rep[I.Dest] = Leader->second;
+      continue;
+    }
+    Leaders[Key] = I.Dest;
+    Added.push_back(Key);
+  }
+
+  for (int C : Children[B])
+    visit(F, C);
+  // out of the blocks this one dominates, its values are not available
+  for (auto &Key : Added)
+    Leaders.erase(Key);
+}
+
+bool GVN::run(LIRFunction &F) {
+  bool Changed = removeTrivialPhis(F);
+  Rep = getIdentity(F.NumSlots);
+  Children = getDominatorTree(getImmediateDominators(F));
+  visit(F, 0);
+  if (Rep == getIdentity(F.NumSlots))
+    return Changed;
+  replaceSlots(F, Rep);
+  removeReplaced(F, Rep);
+  return true;
+}
+
+/// DeadSlotElimination - Removes the instructions whose slot is not used and
+/// that do nothing else, and then what only they used.
+class DeadSlotElimination : public LIRPass {
+  static bool isRemovable(const LIRInst &I);
+
+public:
+  const char *getName() const override { return "dse"; }
+  bool run(LIRFunction &F) override;
+};
+
+// no side effects and no errors, allocations included
+bool DeadSlotElimination::isRemovable(const LIRInst &I) {
+  if (I.isConstant())
+    return true;
+  switch (I.Op) {
+  case lir_vload:
+  case lir_phi:
+  case lir_eqp:
+  case lir_and:
+  case lir_or:
+  case lir_not:
+  case lir_list:
+  case lir_closure:
+    return true;
+  case lir_prim:
+    return I.Imm == tok_box || I.Imm == tok_cons || I.Imm == tok_nullp || I.Imm == tok_pairp;
+  default:
+    return false;
+  }
+}
+
+bool DeadSlotElimination::run(LIRFunction &F) {
+  std::vector<LIRInst *> Defs = getDefs(F);
+  std::vector<int> Uses(F.NumSlots, 0);
+  for (auto &B : F.Blocks)
+    for (auto &I : B.Insts)
+      for (int A : I.Args)
+        Uses[A]++;
+
+  std::vector<int> Work;
+  for (int S = 0; S < F.NumSlots; S++)
+    if (Defs[S] && Uses[S] == 0 && isRemovable(*Defs[S]))
+      Work.push_back(S);
+  if (Work.empty())
+    return false;
+
+  std::vector<bool> Dead(F.NumSlots, false);
+  while (!Work.empty()) {
+    int S = Work.back();
+    Work.pop_back();
+    Dead[S] = true;
+    for (int A : Defs[S]->Args)
+      if (--Uses[A] == 0 && Defs[A] && !Dead[A] && isRemovable(*Defs[A]))
+        Work.push_back(A);
+  }
+  for (auto &B : F.Blocks)
+    B.Insts.erase(std::remove_if(B.Insts.begin(), B.Insts.end(),
+                                 [&](const LIRInst &I) { return I.Dest >= 0 && Dead[I.Dest]; }),
+                  B.Insts.end());
+  return true;
+}
+
+LIRPass *createLIRPromotionPass() { return new Promotion(); }
+LIRPass *createLIRConstantFoldingPass() { return new ConstantFolding(); }
+LIRPass *createLIRCFGSimplificationPass() { return new CFGSimplification(); }
+LIRPass *createLIRGVNPass() { return new GVN(); }
+LIRPass *createLIRDeadSlotEliminationPass() { return new DeadSlotElimination(); }
+
+void addLIROptimizationPasses(LIRPassManager &PM) {
+  PM.add(createLIRPromotionPass());
+  PM.add(createLIRConstantFoldingPass());
+  PM.add(createLIRCFGSimplificationPass());
+  PM.add(createLIRGVNPass());
+  PM.add(createLIRDeadSlotEliminationPass());
+}
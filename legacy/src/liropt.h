@@ -0,0 +1,56 @@
+#ifndef _LIROPT_H
+#define _LIROPT_H
+
+#include <memory>
+#include <vector>
+
+#include "lir.h"
+
+// Optimizer of the Lightning IR. The IR has no types, so these are the
+// type-free optimizations Design.rst has in mind, done once on the IR for
+// every code generator behind it:
+//   mem2reg    promotes variables to slots: loads become the value stored
+//              last, with phis where paths with different stores meet
+//   constfold  folds Int arithmetic and comparisons, truth tests of
+//              constants and unbox of a box made in the same block
+//   simplifycfg  turns If on a constant into Goto, merges a block into its
+//              only predecessor and removes unreachable blocks
+//   gvn        value numbering of pure slots over the dominator tree, and
+//              removal of phis that merge a single value
+//   dse        dead slot elimination: instructions without side effects
+//              whose slot is never used, allocations included
+// After mem2reg the only variables left are the parameters, loaded once in
+// the entry block. Nothing reaches a variable but Vload and Vstore: there is
+// no eval, a Quote is a symbol, and a closure gets the values of its members
+// (state it shares is in boxes). So every variable is promoted, one read by
+// name at run time would have to stay memory.
+
+/// LIRPass - A transformation of a LIRFunction.
+class LIRPass {
+public:
+  virtual ~LIRPass() {}
+  virtual const char *getName() const = 0;
+  // true when F changed
+  virtual bool run(LIRFunction &F) = 0;
+};
+
+/// LIRPassManager - Runs its passes in order, and again while they change
+/// the function.
+class LIRPassManager {
+  std::vector<std::unique_ptr<LIRPass>> Passes;
+
+public:
+  void add(LIRPass *P) { Passes.emplace_back(P); }
+  bool run(LIRFunction &F);
+};
+
+LIRPass *createLIRPromotionPass();
+LIRPass *createLIRConstantFoldingPass();
+LIRPass *createLIRCFGSimplificationPass();
+LIRPass *createLIRGVNPass();
+LIRPass *createLIRDeadSlotEliminationPass();
+
+// the passes above, in that order
+void addLIROptimizationPasses(LIRPassManager &PM);
+
+#endif
@@ -5,33 +5,43 @@
 
 #include "common.h"
 #include "ast.h"
+#include "stackmap.h"
+#include "tierup.h"
 #include "../lib/shared.h"
 
 Driver *Driver::_instance;
 
-void Driver::Initialize() {
-  // Open a new module.
-  TheModule = llvm::make_unique<llvm::Module>("my cool jit", TheContext);
-  TheModule->setDataLayout(TheJIT->getTargetMachine().createDataLayout());
-
-  // Create a new pass manager attached to it.
-  TheFPM = llvm::make_unique<llvm::legacy::FunctionPassManager>(TheModule.get());
-
+void addOptimizationPasses(llvm::legacy::FunctionPassManager &FPM) {
   // Do simple "peephole" optimizations and bit-twiddling optzns.
-  TheFPM->add(llvm::createInstructionCombiningPass());
+  FPM.add(llvm::createInstructionCombiningPass());
   // Promote allocas to registers.
-  TheFPM->add(llvm::createPromoteMemoryToRegisterPass());
+  FPM.add(llvm::createPromoteMemoryToRegisterPass());
   // Do simple "peephole" optimizations and bit-twiddling optzns.
-  TheFPM->add(llvm::createInstructionCombiningPass());
+  FPM.add(llvm::createInstructionCombiningPass());
   // Reassociate expressions.
-  TheFPM->add(llvm::createReassociatePass());
+  FPM.add(llvm::createReassociatePass());
   // Eliminate Common SubExpressions.
-  TheFPM->add(llvm::createGVNPass());
+  FPM.add(llvm::createGVNPass());
   // Simplify the control flow graph (deleting unreachable blocks, etc).
-  TheFPM->add(llvm::createCFGSimplificationPass());
+  FPM.add(llvm::createCFGSimplificationPass());
+}
 
+void Driver::Initialize() {
+  // Open a new module.
+  TheModule = llvm::make_unique<llvm::Module>("my cool jit", TheContext);
+  TheModule->setDataLayout(TheJIT->getTargetMachine().createDataLayout());
+
+  // Create a new pass manager attached to it.
+  TheFPM = llvm::make_unique<llvm::legacy::FunctionPassManager>(TheModule.get());
+  addOptimizationPasses(*TheFPM);
   TheFPM->doInitialization();
 
+  // Tier 0 only promotes allocas to registers, everything else waits until
+  // the function is hot.
+  TheBaselineFPM = llvm::make_unique<llvm::legacy::FunctionPassManager>(TheModule.get());
+  TheBaselineFPM->add(llvm::createPromoteMemoryToRegisterPass());
+  TheBaselineFPM->doInitialization();
+
   init_butterfly_per_module();
 }
 
@@ -54,6 +64,7 @@ static char test_scm[MAX_FLEN];
 
 int main(int argc, char **argv) {
   init_butterfly();
+  init_tier_up();
   llvm::InitializeNativeTarget();
   llvm::InitializeNativeTargetAsmPrinter();
   llvm::InitializeNativeTargetAsmParser();
@@ -81,8 +92,13 @@ int main(int argc, char **argv) {
 
   // initialize
   Driver *driver = Driver::instance(test_scm);
+  if (bt_gc_statepoints)
+    driver->TheJIT->setStackMapHandler(bt_register_stackmap);
   driver->Initialize();
 
+  // JIT frames are all below this one
+  bt_gc_stack_base = (char *) __builtin_frame_address(0);
+
   // Prime the first token.
   driver->getNextToken();
 
@@ -92,5 +108,6 @@ int main(int argc, char **argv) {
   // Print out all of the generated code.
   // (Driver::instance()->TheModule)->dump();
 
+  shutdown_tier_up();
   return 0;
 } 
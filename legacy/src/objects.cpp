@@ -1,5 +1,6 @@
 #include "common.h"
 #include "ast.h"
+#include "interp.h"
 
 bt_gcframe_t *bt_pgcstack;
 
@@ -8,70 +9,122 @@ char *LogErrorN(const char *Str) {
   return nullptr;
 }
 
-static void stacktrace() {
-  bt_gcframe_t *head = bt_pgcstack;
-  int n = 0;
-  while (head) {
-    std::cout << "nroots = " << head->nroots << std::endl;
-    head = head->prev;
-    n++;
-  }
-  std::cout << "stack_depth = " << n << std::endl;
-}
-
 #define ISA(val, Ty) if (val->type == Ty) return Ty;
 
 extern "C"
 int32_t bt_typeof(char *val) {
+  if (bt_is_fixnum(val)) return I64Ty;
+  if (bt_is_flonum(val)) return F64Ty;
+  if (val == bt_nil) return NilTy;
+  if (val == bt_true || val == bt_false) return BoolTy;
+  if (bt_is_cons(val)) return ConsTy;
   bt_value_t *bt_val = (bt_value_t *) val;
   return bt_val->type;
 }
 
 extern "C"
-char *bt_new_int64(int num) {
-  stacktrace();
-  // for now, just use malloc
-  // gc support will be added in future
+char *bt_new_int64(int64_t num) {
+  // small integers are immediates and never touch the heap
+  if (bt_fits_fixnum(num))
+    return bt_from_fixnum(num);
+
   uintptr_t num_l = num;
-  bt_value_t *ptr = (bt_value_t *)aligned_alloc(8, sizeof(bt_value_t) + sizeof(bt_value_t *));
+  bt_value_t *ptr = bt_alloc_object(I64Ty, 1);
   if (!ptr) {
     // allocation failed. should perform gc
     // for now, return Null
     return LogErrorN("alloc failed.");
   }
 
-  ptr->type = I64Ty;
-  ptr->size = 1;
   bt_value_t **data = bt_value_data(ptr);
   data[0] = (bt_value_t *) num_l;
 
   return (char *) ptr;
 }
 
+extern "C"
+char *bt_new_float64(double num) {
+  // most doubles are immediates and never touch the heap
+  if (bt_fits_flonum(num))
+    return bt_from_flonum(num);
+
+  bt_float64_t *ptr = (bt_float64_t *) bt_alloc_object(F64Ty, 1);
+  if (!ptr)
+    return LogErrorN("alloc failed.");
+  ptr->data = num;
+  return (char *) ptr;
+}
+
+// Arithmetic with at least one double operand, the other one is converted.
+static char *binary_float64(int op, double lhs_v, double rhs_v) {
+  switch (op) {
+  case tok_add:
+    return bt_new_float64(lhs_v + rhs_v);
+  case tok_sub:
+    return bt_new_float64(lhs_v - rhs_v);
+  case tok_mul:
+    return bt_new_float64(lhs_v * rhs_v);
+  case tok_div:
+    return bt_new_float64(lhs_v / rhs_v);
+  case tok_eq:
+    return lhs_v == rhs_v ? bt_true : bt_false;
+  case tok_gt:
+    return lhs_v > rhs_v ? bt_true : bt_false;
+  case tok_lt:
+    return lhs_v < rhs_v ? bt_true : bt_false;
+  default:
+    return LogErrorN("invalid binary operator or not implemented yet.");
+  }
+}
+
 extern "C"
 char *bt_binary_int64(int op, char *lhs, char *rhs) {
   bt_value_t *lhs_ref = (bt_value_t *) lhs;
   bt_value_t *rhs_ref = (bt_value_t *) rhs;
 
+  // logical operators work on any value, not just integers
+  switch (op) {
+  case tok_and:
+    return ( bt_as_bool(lhs) && bt_as_bool(rhs) ) ? bt_true : bt_false;
+  case tok_or:
+    return ( bt_as_bool(lhs) || bt_as_bool(rhs) ) ? bt_true : bt_false;
+  case tok_not:
+    return bt_as_bool(lhs) ? bt_false : bt_true;
+  default:
+    break;
+  }
+
+  if (bt_is_float64(lhs_ref) || bt_is_float64(rhs_ref)) {
+    if ((!bt_is_float64(lhs_ref) && !bt_is_int64(lhs_ref)) ||
+        (!bt_is_float64(rhs_ref) && !bt_is_int64(rhs_ref)))
+      return nullptr;
+    return binary_float64(op, bt_to_float64(lhs_ref), bt_to_float64(rhs_ref));
+  }
+
   if (!bt_is_int64(lhs_ref) || !bt_is_int64(rhs_ref)) {
     return nullptr;
   }
 
   auto lhs_v = bt_to_int64(lhs_ref);
   auto rhs_v = bt_to_int64(rhs_ref);
-  uint64_t res_v = 0;
+  int64_t res_v = 0;
 
   switch (op) {
   case tok_add:
-    res_v = lhs_v + rhs_v;
+    if (__builtin_add_overflow(lhs_v, rhs_v, &res_v))
+      return LogErrorN("integer overflow in +.");
     break;
   case tok_sub:
-    res_v = lhs_v - rhs_v;
+    if (__builtin_sub_overflow(lhs_v, rhs_v, &res_v))
+      return LogErrorN("integer overflow in -.");
     break;
   case tok_mul:
-    res_v = lhs_v * rhs_v;
+    if (__builtin_mul_overflow(lhs_v, rhs_v, &res_v))
+      return LogErrorN("integer overflow in *.");
     break;
   case tok_div:
+    if (rhs_v == 0)
+      return LogErrorN("division by zero.");
     res_v = lhs_v / rhs_v;
     break;
   case tok_eq:
@@ -83,12 +136,6 @@ char *bt_binary_int64(int op, char *lhs, char *rhs) {
   case tok_lt:
     res_v = (lhs_v < rhs_v) ? 1 : 0;
     return res_v ? bt_true : bt_false;
-  case tok_and:
-    return ( (lhs_v != 0) && (rhs_v != 0) ) ? bt_true : bt_false;
-  case tok_or:
-    return ( (lhs_v != 0) || (rhs_v != 0) ) ? bt_true : bt_false;
-  case tok_not:
-    return (lhs_v == 0) ? bt_true : bt_false;
   default:
     return LogErrorN("invalid binary operator or not implemented yet.");
   }
@@ -99,7 +146,8 @@ char *bt_binary_int64(int op, char *lhs, char *rhs) {
 
 extern "C" 
 int32_t bt_as_bool(char *cond) {
-  if (cond == nullptr) return 0;
+  if (cond == bt_nil || cond == bt_false) return 0;
+  if (cond == bt_true) return 1;
   bt_value_t *cond_ref = (bt_value_t *) cond;
 
   if (bt_is_int64(cond_ref)) {
@@ -111,15 +159,13 @@ int32_t bt_as_bool(char *cond) {
 extern "C"
 char *bt_new_fptr(char *fp, int nargs) {
   uintptr_t nargs_p = nargs;
-  bt_value_t *ptr = (bt_value_t *)aligned_alloc(8, sizeof(bt_value_t) + sizeof(bt_value_t *) * 2);
+  bt_value_t *ptr = bt_alloc_object(FunctionRefTy, 2);
   if (!ptr) {
     // allocation failed. should perform gc
     // for now, return Null
     return LogErrorN("alloc failed.");
   }
 
-  ptr->type = FunctionRefTy;
-  ptr->size = 2;
   bt_value_t **data = bt_value_data(ptr);
   data[0] = (bt_value_t *) fp;
   data[1] = (bt_value_t *) nargs_p;
@@ -145,45 +191,104 @@ char *bt_get_callable(char *val) {
   return LogErrorN("not a callable object.");
 }
 
+// the inline caches of every call site compiled so far, in chunks that
+// never move
+#define BT_IC_CHUNK 256
+static std::vector<std::unique_ptr<bt_ic_t[]>> ic_chunks;
+static int ic_used = BT_IC_CHUNK;
+
+/// bt_ic_new - A new, empty inline cache for a call site being compiled.
+bt_ic_t *bt_ic_new(void) {
+  if (ic_used == BT_IC_CHUNK) {
+    ic_chunks.emplace_back(new bt_ic_t[BT_IC_CHUNK]);
+    ic_used = 0;
+  }
+  bt_ic_t *ic = &ic_chunks.back()[ic_used++];
+  for (int kind = 0; kind < 2; kind++) {
+    ic->callee[kind] = BT_IC_EMPTY;
+    ic->code[kind] = 0;
+  }
+  return ic;
+}
+
+/// bt_ic_flush - Empties every inline cache, the collector calls it once
+/// the callees may have moved or died.
+void bt_ic_flush(void) {
+  for (auto &chunk : ic_chunks)
+    for (int i = 0; i < BT_IC_CHUNK; i++)
+      chunk[i].callee[0] = chunk[i].callee[1] = BT_IC_EMPTY;
+}
+
+/// bt_ic_miss - The callee val of a call site is not in its inline cache ic.
+/// It replaces the entry of its kind. In the profiling tier its code also
+/// becomes the most recent of the feedback ways, moving up if it was there
+/// already and dropping the oldest if not, so the ways stay the distinct
+/// targets seen there.
+extern "C"
+void bt_ic_miss(bt_ic_t *ic, uintptr_t *ways, char *val) {
+  bt_value_t *callable = (bt_value_t *) val;
+  int kind;
+
+  if (bt_is_fptr(callable))
+    kind = 0;
+  else if (bt_is_closure(callable))
+    kind = 1;
+  else {
+    bt_error();
+    return;
+  }
+
+  uintptr_t code = (uintptr_t) bt_value_data(callable)[0];
+  ic->callee[kind] = val;
+  ic->code[kind] = code;
+  if (!ways)
+    return;
+
+  ways += kind * BT_IC_WAYS;
+  int i = 0;
+  while (i < BT_IC_WAYS - 1 && ways[i] != code)
+    i++;
+  memmove(ways + 1, ways, i * sizeof(uintptr_t));
+  ways[0] = code;
+}
+
 extern "C" 
 char *bt_box(char *val) {
+  // val must survive a collection triggered by the allocation
+  BT_GC_PUSH1(&val);
+  bt_value_t *ptr = bt_alloc_object(BoxTy, 1);
+  BT_GC_POP();
   bt_value_t *ref = (bt_value_t *) val;
-  bt_value_t *ptr = (bt_value_t *)aligned_alloc(8, sizeof(bt_value_t) + sizeof(bt_value_t *));
   if (!ptr) {
     // allocation failed. should perform gc
     // for now, return Null
     return LogErrorN("alloc failed.");
   }
 
-  ptr->type = BoxTy;
-  ptr->size = 1;
   bt_value_t **data = bt_value_data(ptr);
   data[0] = ref;
 
   return (char *) ptr;
 }
 
+// members must be rooted by the caller, they are read after the allocation
 extern "C"
 char *bt_closure(char *fp, int n, char **members) {
-  bt_value_t *ptr = (bt_value_t *)aligned_alloc(8, sizeof(bt_value_t) + sizeof(bt_value_t *) * (n + 1));
+  bt_value_t *ptr = bt_alloc_object(ClosureTy, n + 1);
   if (!ptr) {
     // allocation failed. should perform gc
     // for now, return Null
     return LogErrorN("alloc failed.");
   }
 
-  ptr->type = ClosureTy;
-  ptr->size = n + 1;
   bt_value_t **data = bt_value_data(ptr);
   data[0] = (bt_value_t *) fp;
 
-  for (int i = 0; i < n; i++) {
-    bt_value_t *box = (bt_value_t *) members[i];
-    if (bt_is_box(box)) {
-      data[i+1] = box;
-    } else
-      return LogErrorN("closure cannot take non-box member.");
-  }
+  // initializing stores: nothing is overwritten, so no SATB barrier, and an
+  // object allocated in the old space is already in the remembered set.
+  // Members are boxes of assigned vars or plain values of the others.
+  for (int i = 0; i < n; i++)
+    data[i+1] = (bt_value_t *) members[i];
 
   return (char *) ptr;
 }
@@ -225,13 +330,416 @@ char *bt_set_box(char *box, char *new_val) {
   if (bt_is_box(bt_val)) {
     data = bt_value_data(bt_val);
     bt_value_t *old_data = data[0];
+    bt_gc_satb(old_data);
     data[0] = (bt_value_t *) new_val;
+    bt_gc_wb(bt_val, data[0]);
     return (char *) old_data;
   }
 
   return LogErrorN("not a box object.");
 }
 
+extern "C"
+char *bt_car(char *pair) {
+  if (bt_is_cons(pair))
+    return (char *) bt_cell_car(pair);
+  return LogErrorN("car of a non-pair.");
+}
+
+extern "C"
+char *bt_cdr(char *pair) {
+  if (bt_is_cons(pair))
+    return (char *) bt_cell_cdr(pair);
+  return LogErrorN("cdr of a non-pair.");
+}
+
+extern "C"
+char *bt_cons(char *car, char *cdr) {
+  BT_GC_PUSH2(&car, &cdr);
+  char *cell = bt_cons_alloc(2);
+  BT_GC_POP();
+  ((bt_value_t **) cell)[0] = (bt_value_t *) car;
+  ((bt_value_t **) cell)[1] = (bt_value_t *) cdr;
+  return cell;
+}
+
+// A list of n nil cars, laid out as cdr-coded chunks. A chunk ends with a
+// full pair whose cdr links it to the next one.
+static char *alloc_list(int64_t n) {
+  char *head = bt_nil;
+  char *last = nullptr;
+  // pairs do not move, but head must keep the chunks alive
+  BT_GC_PUSH1(&head);
+  while (n > 0) {
+    int64_t k = n < BT_LIST_CHUNK ? n : BT_LIST_CHUNK;
+    bool end = k == n;
+    int64_t nwords = end ? k : k + 1;
+    char *chunk = bt_cons_alloc(nwords);
+    memset(chunk, 0, nwords * 8);
+    bt_set_cdr_codes(chunk, k, end ? BT_CDR_NIL : BT_CDR_FULL);
+    if (last)
+      ((bt_value_t **) last)[1] = (bt_value_t *) chunk;
+    else
+      head = chunk;
+    last = chunk + (k - 1) * 8;
+    n -= k;
+  }
+  BT_GC_POP();
+  return head;
+}
+
+// members must be rooted by the caller, they are read after the allocation
+extern "C"
+char *bt_list(int64_t n, char **members) {
+  char *list = alloc_list(n);
+  // initializing stores into fresh cells need no barrier
+  char *cell = list;
+  for (int64_t i = 0; i < n; i++) {
+    ((bt_value_t **) cell)[0] = (bt_value_t *) members[i];
+    cell = (char *) bt_cell_cdr(cell);
+  }
+  return list;
+}
+
+static char *apply1(char *f, char *arg) {
+  bt_value_t *callable = (bt_value_t *) f;
+  char *fp = bt_get_callable(f);
+  if (!fp)
+    return bt_error();
+  if (bt_is_fptr(callable))
+    return ((char *(*)(char *)) fp)(arg);
+  return ((char *(*)(char *, char *)) fp)(f, arg);
+}
+
+extern "C"
+char *bt_map(char *f, char *list) {
+  int64_t n = 0;
+  for (char *cell = list; cell != bt_nil; cell = (char *) bt_cell_cdr(cell)) {
+    if (!bt_is_cons(cell))
+      return LogErrorN("map over an improper list.");
+    n++;
+  }
+
+  char *result = bt_nil;
+  BT_GC_PUSH3(&f, &list, &result);
+  result = alloc_list(n);
+  char *src = list, *dst = result;
+  while (src != bt_nil) {
+    // f may move, list and result keep the cells alive
+    char *val = apply1(f, (char *) bt_cell_car(src));
+    ((bt_value_t **) dst)[0] = (bt_value_t *) val;
+    bt_gc_wb((bt_value_t *) dst, (bt_value_t *) val);
+    src = (char *) bt_cell_cdr(src);
+    dst = (char *) bt_cell_cdr(dst);
+  }
+  BT_GC_POP();
+  return result;
+}
+
+// A zero-filled vector of n elements, or NULL after reporting an error
+static bt_vector_t *new_vector(int32_t type, int64_t n) {
+  if (n > INT32_MAX - (int64_t) (sizeof(bt_vector_t) / 8)) {
+    LogErrorN("vector too long.");
+    return nullptr;
+  }
+  bt_vector_t *vec = (bt_vector_t *) bt_alloc_pinned(sizeof(bt_vector_t) + 8 * n);
+  if (!vec) {
+    LogErrorN("alloc failed.");
+    return nullptr;
+  }
+  vec->type = type;
+  vec->size = (sizeof(bt_vector_t) - sizeof(bt_value_t)) / 8 + n;
+  vec->length = n;
+  memset(bt_vector_data(vec), 0, 8 * n);
+  return vec;
+}
+
+static char *make_vector(int32_t type, char *length) {
+  bt_value_t *len = (bt_value_t *) length;
+  if (!bt_is_int64(len) || bt_to_int64(len) < 0)
+    return LogErrorN("vector length must be a non-negative integer.");
+  return (char *) new_vector(type, bt_to_int64(len));
+}
+
+extern "C"
+char *bt_make_f64vector(char *length) {
+  return make_vector(F64VecTy, length);
+}
+
+extern "C"
+char *bt_make_i64vector(char *length) {
+  return make_vector(I64VecTy, length);
+}
+
+extern "C"
+char *bt_vector_length(char *vec) {
+  if (!bt_is_vector((bt_value_t *) vec))
+    return LogErrorN("not a vector.");
+  return bt_new_int64(((bt_vector_t *) vec)->length);
+}
+
+// The element index of vec, or -1 after reporting an error
+static int64_t vector_index(char *vec, char *index) {
+  if (!bt_is_vector((bt_value_t *) vec)) {
+    LogErrorN("not a vector.");
+    return -1;
+  }
+  bt_value_t *idx = (bt_value_t *) index;
+  if (!bt_is_int64(idx) || bt_to_int64(idx) < 0 ||
+      bt_to_int64(idx) >= ((bt_vector_t *) vec)->length) {
+    LogErrorN("vector index out of range.");
+    return -1;
+  }
+  return bt_to_int64(idx);
+}
+
+extern "C"
+char *bt_vector_ref(char *vec, char *index) {
+  int64_t i = vector_index(vec, index);
+  if (i < 0)
+    return nullptr;
+  if (((bt_vector_t *) vec)->type == F64VecTy)
+    return bt_new_float64(((double *) bt_vector_data(vec))[i]);
+  return bt_new_int64(((int64_t *) bt_vector_data(vec))[i]);
+}
+
+extern "C"
+char *bt_vector_set(char *vec, char *index, char *val) {
+  int64_t i = vector_index(vec, index);
+  if (i < 0)
+    return nullptr;
+  bt_value_t *num = (bt_value_t *) val;
+  if (((bt_vector_t *) vec)->type == F64VecTy) {
+    if (!bt_is_int64(num) && !bt_is_float64(num))
+      return LogErrorN("f64vector element must be a number.");
+    ((double *) bt_vector_data(vec))[i] = bt_to_float64(num);
+  } else {
+    if (!bt_is_int64(num))
+      return LogErrorN("i64vector element must be an integer.");
+    ((int64_t *) bt_vector_data(vec))[i] = bt_to_int64(num);
+  }
+  return val;
+}
+
+// Elementwise kernels: the operands are vectors of the same type and length,
+// and the result is a fresh vector like them.
+static bool same_shape(bt_value_t *a, bt_value_t *b) {
+  if (!bt_is_vector(a) || !bt_is_vector(b)) {
+    LogErrorN("not a vector.");
+    return false;
+  }
+  bt_vector_t *va = (bt_vector_t *) a, *vb = (bt_vector_t *) b;
+  if (va->type != vb->type || va->length != vb->length) {
+    LogErrorN("vectors differ in type or length.");
+    return false;
+  }
+  return true;
+}
+
+static char *vector_binary(char *a, char *b, bool mul) {
+  if (!same_shape((bt_value_t *) a, (bt_value_t *) b))
+    return nullptr;
+  // vectors do not move, but the operands must survive the allocation
+  BT_GC_PUSH2(&a, &b);
+  bt_vector_t *dst = new_vector(((bt_vector_t *) a)->type, ((bt_vector_t *) a)->length);
+  BT_GC_POP();
+  if (!dst)
+    return nullptr;
+  void *x = bt_vector_data(a), *y = bt_vector_data(b), *r = bt_vector_data(dst);
+  if (dst->type == F64VecTy)
+    (mul ? bt_simd.f64_mul : bt_simd.f64_add)((double *) r, (double *) x, (double *) y, dst->length);
+  else
+    (mul ? bt_simd.i64_mul : bt_simd.i64_add)((int64_t *) r, (int64_t *) x, (int64_t *) y, dst->length);
+  return (char *) dst;
+}
+
+extern "C"
+char *bt_vector_add(char *a, char *b) {
+  return vector_binary(a, b, false);
+}
+
+extern "C"
+char *bt_vector_mul(char *a, char *b) {
+  return vector_binary(a, b, true);
+}
+
+extern "C"
+char *bt_vector_fma(char *a, char *b, char *c) {
+  if (!same_shape((bt_value_t *) a, (bt_value_t *) b) || !same_shape((bt_value_t *) a, (bt_value_t *) c))
+    return nullptr;
+  BT_GC_PUSH3(&a, &b, &c);
+  bt_vector_t *dst = new_vector(((bt_vector_t *) a)->type, ((bt_vector_t *) a)->length);
+  BT_GC_POP();
+  if (!dst)
+    return nullptr;
+  void *x = bt_vector_data(a), *y = bt_vector_data(b), *z = bt_vector_data(c), *r = bt_vector_data(dst);
+  if (dst->type == F64VecTy)
+    bt_simd.f64_fma((double *) r, (double *) x, (double *) y, (double *) z, dst->length);
+  else
+    bt_simd.i64_fma((int64_t *) r, (int64_t *) x, (int64_t *) y, (int64_t *) z, dst->length);
+  return (char *) dst;
+}
+
+extern "C"
+char *bt_vector_sum(char *vec) {
+  bt_vector_t *v = (bt_vector_t *) vec;
+  if (!bt_is_vector((bt_value_t *) v))
+    return LogErrorN("not a vector.");
+  if (v->type == F64VecTy)
+    return bt_new_float64(bt_simd.f64_sum((double *) bt_vector_data(v), v->length));
+  return bt_new_int64(bt_simd.i64_sum((int64_t *) bt_vector_data(v), v->length));
+}
+
+// A flat string of length bytes, which the caller fills in, or NULL after
+// reporting an error
+static bt_string_t *new_string(int64_t length) {
+  if (length > 8 * (int64_t) (INT32_MAX - 2)) {
+    LogErrorN("string too long.");
+    return nullptr;
+  }
+  bt_string_t *str = (bt_string_t *) bt_alloc_object(StrTy, 1 + (length + 8) / 8);
+  if (!str) {
+    LogErrorN("alloc failed.");
+    return nullptr;
+  }
+  str->length = length;
+  bt_string_chars(str)[length] = '\0';
+  return str;
+}
+
+const char *bt_string_bytes(bt_value_t *str) {
+  if (str->type == StrSliceTy) {
+    bt_slice_t *slice = (bt_slice_t *) str;
+    return bt_string_chars(slice->parent) + slice->offset;
+  }
+  return bt_string_chars(str);
+}
+
+static int64_t string_length(char *str) {
+  return ((bt_string_t *) str)->length;
+}
+
+// The integer index, if it is in [0, limit], or -1 after reporting an error
+static int64_t string_index(char *index, int64_t limit) {
+  bt_value_t *idx = (bt_value_t *) index;
+  if (!bt_is_int64(idx) || bt_to_int64(idx) < 0 || bt_to_int64(idx) > limit) {
+    LogErrorN("string index out of range.");
+    return -1;
+  }
+  return bt_to_int64(idx);
+}
+
+extern "C"
+char *bt_string_length(char *str) {
+  if (!bt_is_string((bt_value_t *) str))
+    return LogErrorN("not a string.");
+  return bt_new_int64(string_length(str));
+}
+
+// The byte at index, as an integer
+extern "C"
+char *bt_string_ref(char *str, char *index) {
+  if (!bt_is_string((bt_value_t *) str))
+    return LogErrorN("not a string.");
+  int64_t i = string_index(index, string_length(str) - 1);
+  if (i < 0)
+    return nullptr;
+  return bt_new_int64((uint8_t) bt_string_bytes((bt_value_t *) str)[i]);
+}
+
+extern "C"
+char *bt_substring(char *str, char *start, char *end) {
+  if (!bt_is_string((bt_value_t *) str))
+    return LogErrorN("not a string.");
+  int64_t length = string_length(str);
+  int64_t s = string_index(start, length);
+  int64_t e = string_index(end, length);
+  if (s < 0 || e < 0)
+    return nullptr;
+  if (e < s)
+    return LogErrorN("substring ends before it starts.");
+  // strings are immutable, the whole string can stand for itself
+  if (e - s == length)
+    return str;
+
+  BT_GC_PUSH1(&str);
+  bt_value_t *sub;
+  if (e - s < BT_STRING_SHORT)
+    sub = (bt_value_t *) new_string(e - s);
+  else if (!(sub = bt_alloc_object(StrSliceTy, 3)))
+    LogErrorN("alloc failed.");
+  BT_GC_POP();
+  if (!sub)
+    return nullptr;
+
+  // str may have moved, it is only read from now on
+  bt_value_t *src = (bt_value_t *) str;
+  if (sub->type == StrTy) {
+    memcpy(bt_string_chars(sub), bt_string_bytes(src) + s, e - s);
+    return (char *) sub;
+  }
+  bt_slice_t *slice = (bt_slice_t *) sub;
+  slice->length = e - s;
+  if (src->type == StrSliceTy) {
+    slice->parent = ((bt_slice_t *) src)->parent;
+    slice->offset = ((bt_slice_t *) src)->offset + s;
+  } else {
+    slice->parent = (bt_string_t *) src;
+    slice->offset = s;
+  }
+  return (char *) slice;
+}
+
+extern "C"
+char *bt_string_append(char *a, char *b) {
+  if (!bt_is_string((bt_value_t *) a) || !bt_is_string((bt_value_t *) b))
+    return LogErrorN("not a string.");
+  int64_t na = string_length(a), nb = string_length(b);
+  if (na == 0)
+    return b;
+  if (nb == 0)
+    return a;
+
+  BT_GC_PUSH2(&a, &b);
+  bt_string_t *str = new_string(na + nb);
+  BT_GC_POP();
+  if (!str)
+    return nullptr;
+  // the operands may have moved, their bytes are only looked up now
+  memcpy(bt_string_chars(str), bt_string_bytes((bt_value_t *) a), na);
+  memcpy(bt_string_chars(str) + na, bt_string_bytes((bt_value_t *) b), nb);
+  return (char *) str;
+}
+
+// Byte order, which for UTF-8 is also code point order. memcmp does the
+// bulk of the work, it is vectorized in every libc worth the name.
+static int string_compare(char *a, char *b) {
+  int64_t na = string_length(a), nb = string_length(b);
+  int cmp = memcmp(bt_string_bytes((bt_value_t *) a), bt_string_bytes((bt_value_t *) b),
+                   na < nb ? na : nb);
+  if (cmp)
+    return cmp;
+  return (na > nb) - (na < nb);
+}
+
+extern "C"
+char *bt_string_eq(char *a, char *b) {
+  if (!bt_is_string((bt_value_t *) a) || !bt_is_string((bt_value_t *) b))
+    return LogErrorN("not a string.");
+  if (a == b)
+    return bt_true;
+  if (string_length(a) != string_length(b))
+    return bt_false;
+  return string_compare(a, b) == 0 ? bt_true : bt_false;
+}
+
+extern "C"
+char *bt_string_lt(char *a, char *b) {
+  if (!bt_is_string((bt_value_t *) a) || !bt_is_string((bt_value_t *) b))
+    return LogErrorN("not a string.");
+  return string_compare(a, b) < 0 ? bt_true : bt_false;
+}
+
 extern "C" char *bt_error() {
   LogErrorN("Runtime error: not a callable object");
   exit(-1);
@@ -239,33 +747,74 @@ extern "C" char *bt_error() {
 }
 
 bool bt_is_int64(bt_value_t *val) {
-  if (!val) return false;
+  if (bt_is_fixnum(val)) return true;
+  if (!bt_is_pointer(val)) return false;
+  if (bt_is_cons(val)) return false;
   return val->type == I64Ty && val->size == 1;
 }
 
+bool bt_is_float64(bt_value_t *val) {
+  if (bt_is_flonum(val)) return true;
+  if (!bt_is_pointer(val)) return false;
+  if (bt_is_cons(val)) return false;
+  return val->type == F64Ty && val->size == 1;
+}
+
 bool bt_is_fptr(bt_value_t *val) {
-  if (!val) return false;
+  if (!bt_is_pointer(val)) return false;
+  if (bt_is_cons(val)) return false;
   return val->type == FunctionRefTy && val->size == 2;
 }
 
 bool bt_is_box(bt_value_t *val) {
-  if (!val) return false;
+  if (!bt_is_pointer(val)) return false;
+  if (bt_is_cons(val)) return false;
   return val->type == BoxTy && val->size == 1;
 }
 
 bool bt_is_closure(bt_value_t *val) {
-  if (!val) return false;
+  if (!bt_is_pointer(val)) return false;
+  if (bt_is_cons(val)) return false;
   return val->type == ClosureTy;
 }
 
+bool bt_is_vector(bt_value_t *val) {
+  if (!bt_is_pointer(val)) return false;
+  if (bt_is_cons(val)) return false;
+  return val->type == F64VecTy || val->type == I64VecTy;
+}
+
+bool bt_is_string(bt_value_t *val) {
+  if (!bt_is_pointer(val)) return false;
+  if (bt_is_cons(val)) return false;
+  return val->type == StrTy || val->type == StrSliceTy;
+}
+
+bool bt_is_bool(bt_value_t *val) {
+  return (char *) val == bt_true || (char *) val == bt_false;
+}
+
 int64_t bt_to_int64(bt_value_t *val) {
+  if (bt_is_fixnum(val))
+    return bt_fixnum_value(val);
   bt_value_t **data = bt_value_data(val);
   return (int64_t) data[0];
 }
 
-char *bt_true, *bt_false;
+// Any number as a double, integers are converted.
+double bt_to_float64(bt_value_t *val) {
+  if (bt_is_flonum(val))
+    return bt_flonum_value(val);
+  if (bt_is_int64(val))
+    return (double) bt_to_int64(val);
+  return ((bt_float64_t *) val)->data;
+}
 
 void init_butterfly(void) {
-  bt_true = bt_new_int64(1);
-  bt_false = bt_new_int64(0);
+  // fixnums, flonums, booleans and nil are immediates, only the heap needs setup
+  init_profile();
+  init_gc();
+  init_simd();
+  init_feedback();
+  init_interp();
 }
@@ -2,6 +2,7 @@
 #define _OBJECTS_H
 
 #include <cstdint>
+#include <cstring>
 
 #define container_of(ptr, type, member) \
     ((type *) ((char *)(ptr) - offsetof(type, member)))
@@ -12,9 +13,105 @@ enum DataType {
   BoxTy,
   ConsTy,
   FunctionRefTy,
-  ClosureTy
+  ClosureTy,
+  BoolTy,
+  NilTy,
+  F64Ty,
+  F64VecTy,
+  I64VecTy,
+  StrTy,
+  StrSliceTy,
+  HashTy,
+  HashStoreTy,
+  FreeTy, // heap filler left by the collector, never visible to programs
+  ForwardTy // promoted nursery object, field 0 points to the copy
 };
 
+// Tagged value representation. A value is a pointer-sized word:
+//   ...xxx1  fixnum, a 63-bit signed integer stored in the upper bits
+//   ...x000  pointer to a heap bt_value_t (nullptr is nil)
+//   ...x100  immediate constant (#f, #t)
+//   ...xx10  flonum, an immediate double (see bt_from_flonum)
+// Heap objects are at least 8-byte aligned, so the low 3 bits are free.
+// Integers that do not fit into a fixnum fall back to a heap bt_int64_t, and
+// doubles that do not fit into a flonum to a heap bt_float64_t.
+#define BT_TAG_MASK     7
+#define BT_FIXNUM_TAG   1
+#define BT_IMM_TAG      4
+#define BT_FLONUM_MASK  3
+#define BT_FLONUM_TAG   2
+// 0.0 has no exponent in the flonum range and gets an encoding of its own
+#define BT_FLONUM_ZERO  ((uintptr_t) 0x8000000000000002)
+
+#define BT_FIXNUM_MIN   (INT64_MIN >> 1)
+#define BT_FIXNUM_MAX   (INT64_MAX >> 1)
+
+#define BT_IMM(n)       (((uintptr_t) (n) << 3) | BT_IMM_TAG)
+
+#define bt_nil          ((char *) 0)
+#define bt_false        ((char *) BT_IMM(0))
+#define bt_true         ((char *) BT_IMM(1))
+
+static inline bool bt_is_fixnum(const void *val) {
+  return ((uintptr_t) val & BT_FIXNUM_TAG) != 0;
+}
+
+static inline bool bt_is_pointer(const void *val) {
+  return val && ((uintptr_t) val & BT_TAG_MASK) == 0;
+}
+
+static inline bool bt_fits_fixnum(int64_t num) {
+  return num >= BT_FIXNUM_MIN && num <= BT_FIXNUM_MAX;
+}
+
+static inline char *bt_from_fixnum(int64_t num) {
+  return (char *) (((uintptr_t) num << 1) | BT_FIXNUM_TAG);
+}
+
+static inline int64_t bt_fixnum_value(const void *val) {
+  return (int64_t) (intptr_t) val >> 1;
+}
+
+static inline bool bt_is_flonum(const void *val) {
+  return ((uintptr_t) val & BT_FLONUM_MASK) == BT_FLONUM_TAG;
+}
+
+static inline uint64_t bt_double_bits(double num) {
+  uint64_t bits;
+  memcpy(&bits, &num, sizeof(bits));
+  return bits;
+}
+
+// A double is a flonum when the top 3 bits of its exponent are 011 or 100,
+// magnitudes from about 1e-77 to 1e77, or when it is +0.0. Those 3 bits are
+// implied by the 4th, so rotating them to the bottom frees room for the tag.
+static inline bool bt_fits_flonum(double num) {
+  uint64_t bits = bt_double_bits(num);
+  uint64_t exp3 = (bits >> 60) & 7;
+  return (exp3 - 3 < 2 && bits != 0x3000000000000000) || bits == 0;
+}
+
+static inline char *bt_from_flonum(double num) {
+  uint64_t bits = bt_double_bits(num);
+  if (bits == 0)
+    return (char *) BT_FLONUM_ZERO;
+  uint64_t rotated = (bits << 3) | (bits >> 61);
+  return (char *) ((rotated & ~(uint64_t) BT_FLONUM_MASK) | BT_FLONUM_TAG);
+}
+
+static inline double bt_flonum_value(const void *val) {
+  uint64_t v = (uint64_t) (uintptr_t) val;
+  uint64_t bits = 0;
+  if (v != BT_FLONUM_ZERO) {
+    // bit 63 was exponent bit 60, the dropped bit 61 is its complement
+    uint64_t t = (2 - (v >> 63)) | (v & ~(uint64_t) BT_FLONUM_MASK);
+    bits = (t >> 3) | (t << 61);
+  }
+  double num;
+  memcpy(&num, &bits, sizeof(num));
+  return num;
+}
+
 typedef struct _bt_value_t {
   int32_t type;
   int32_t size; // as in fields
@@ -27,6 +124,86 @@ typedef struct _bt_int64_t {
   int64_t data;
 } bt_int64_t;
 
+typedef struct _bt_float64_t {
+  int32_t type;
+  int32_t size; // as in fields
+  double data;
+} bt_float64_t;
+
+typedef struct _bt_symbol_t {
+  int32_t type;
+  int32_t size; // as in fields
+  uint64_t hash;
+  int64_t length;
+  char name[]; // NUL terminated
+} bt_symbol_t;
+
+// Typed vectors hold raw numbers, no references. The elements start
+// BT_VECTOR_ALIGN bytes into the object, and vectors are pinned objects
+// aligned to as much (see bt_alloc_pinned), so every element array is
+// aligned for the widest SIMD loads.
+#define BT_VECTOR_ALIGN 64
+
+typedef struct _bt_vector_t {
+  int32_t type; // F64VecTy or I64VecTy
+  int32_t size; // as in fields, the length plus the padding and elements
+  int64_t length;
+  int64_t pad[6];
+  // elements go here
+} bt_vector_t;
+
+#define bt_vector_data(v) ((void *) ((char *) (v) + sizeof(bt_vector_t)))
+
+// Strings are immutable UTF-8, lengths and indices count bytes. A flat
+// string (StrTy) keeps its bytes, NUL terminated, in the object itself, so
+// there is no separate buffer to allocate or chase. A slice (StrSliceTy)
+// shares the bytes of a flat parent instead of copying them; slices shorter
+// than BT_STRING_SHORT are copied anyway, a few bytes are cheaper than a
+// reference that keeps a big parent alive.
+#define BT_STRING_SHORT 32
+
+typedef struct _bt_string_t {
+  int32_t type; // StrTy
+  int32_t size; // as in fields
+  int64_t length;
+  // bytes and a NUL go here
+} bt_string_t;
+
+typedef struct _bt_slice_t {
+  int32_t type; // StrSliceTy
+  int32_t size; // as in fields
+  int64_t length;
+  bt_string_t *parent; // always flat, slices of slices share the same parent
+  int64_t offset;
+} bt_slice_t;
+
+#define bt_string_chars(s) ((char *) (s) + sizeof(bt_string_t))
+
+// Hash tables (see hash.h). The table object is small and may move, its
+// slots live in a pinned store that is replaced when the table grows. The
+// store starts with one control byte per slot, BT_HASH_GROUP of which are
+// probed at a time, followed by the slots as key and value pairs.
+#define BT_HASH_GROUP 16
+
+typedef struct _bt_hash_store_t {
+  int32_t type; // HashStoreTy
+  int32_t size; // as in fields
+  int64_t capacity; // slots, a power of two, at least BT_HASH_GROUP
+  int64_t pad[6]; // the control bytes start aligned like a vector
+  // control bytes and slots go here
+} bt_hash_store_t;
+
+#define bt_hash_ctrl(s) ((int8_t *) (s) + sizeof(bt_hash_store_t))
+#define bt_hash_slots(s) ((bt_value_t **) (bt_hash_ctrl(s) + (s)->capacity))
+
+typedef struct _bt_hash_t {
+  int32_t type; // HashTy
+  int32_t size; // as in fields
+  bt_hash_store_t *store;
+  int64_t count;
+  int64_t growth_left; // entries to go before the store has to grow
+} bt_hash_t;
+
 typedef struct _bt_fptr_t {
   int32_t type;
   int32_t size; // as in fields
@@ -34,6 +211,24 @@ typedef struct _bt_fptr_t {
   int64_t nargs;
 } bt_fptr_t;
 
+// The feedback of an indirect call site in the profiling tier: the code of
+// the last BT_IC_WAYS function references called there, then that of the
+// last BT_IC_WAYS closures, most recent first
+#define BT_IC_WAYS 4
+
+// The inline cache of an indirect call site, tiered or not: the last function
+// reference and the last closure called there, with their code. JIT code
+// compares the callee itself with them, so a hit calls the code without
+// looking into the callee. A callee is only known by its address until the
+// next collection moves or frees it, so every collection empties the caches.
+typedef struct _bt_ic_t {
+  char *callee[2]; // function reference, closure
+  uintptr_t code[2];
+} bt_ic_t;
+
+// what an empty way holds, an immediate that no value is
+#define BT_IC_EMPTY ((char *) BT_IMM(2))
+
 typedef struct _bt_gcframe_t {
     intptr_t nroots;
     struct _bt_gcframe_t *prev;
@@ -44,30 +239,64 @@ extern bt_gcframe_t *bt_pgcstack;
 
 #define bt_value_data(t) ((bt_value_t**)((char*)(t) + sizeof(bt_value_t)))
 
-extern char *bt_true, *bt_false;
-
 extern "C" int32_t bt_typeof(char *val);
 
-extern "C" char *bt_new_int64(int num);
+extern "C" char *bt_new_int64(int64_t num);
+extern "C" char *bt_new_float64(double num);
 extern "C" char *bt_binary_int64(int op, char *lhs, char *rhs);
 extern "C" int32_t bt_as_bool(char *cond);
 extern "C" char *bt_new_fptr(char *fp, int nargs);
 extern "C" char *bt_get_callable(char *val);
+extern "C" void bt_ic_miss(bt_ic_t *ic, uintptr_t *ways, char *val);
+bt_ic_t *bt_ic_new(void);
+void bt_ic_flush(void);
 extern "C" char *bt_box(char *val);
 extern "C" char *bt_getfield(char *object, int n);
 extern "C" char *bt_unbox(char *box);
 extern "C" char *bt_set_box(char *box, char *new_val);
 extern "C" char *bt_closure(char *fp, int n, char **members);
+extern "C" char *bt_car(char *pair);
+extern "C" char *bt_cdr(char *pair);
+extern "C" char *bt_cons(char *car, char *cdr);
+extern "C" char *bt_list(int64_t n, char **members);
+extern "C" char *bt_map(char *f, char *list);
+extern "C" char *bt_make_f64vector(char *length);
+extern "C" char *bt_make_i64vector(char *length);
+extern "C" char *bt_vector_length(char *vec);
+extern "C" char *bt_vector_ref(char *vec, char *index);
+extern "C" char *bt_vector_set(char *vec, char *index, char *val);
+extern "C" char *bt_vector_add(char *a, char *b);
+extern "C" char *bt_vector_mul(char *a, char *b);
+extern "C" char *bt_vector_fma(char *a, char *b, char *c);
+extern "C" char *bt_vector_sum(char *vec);
+extern "C" char *bt_string_length(char *str);
+extern "C" char *bt_string_ref(char *str, char *index);
+extern "C" char *bt_substring(char *str, char *start, char *end);
+extern "C" char *bt_string_append(char *a, char *b);
+extern "C" char *bt_string_eq(char *a, char *b);
+extern "C" char *bt_string_lt(char *a, char *b);
 extern "C" char *bt_error();
 
+// Report a runtime error, the result is the nullptr to return
+char *LogErrorN(const char *Str);
+
 bool bt_is_int64(bt_value_t *val);
+bool bt_is_float64(bt_value_t *val);
 bool bt_is_fptr(bt_value_t *val);
 bool bt_is_box(bt_value_t *val);
 bool bt_is_closure(bt_value_t *val);
+bool bt_is_vector(bt_value_t *val);
+bool bt_is_string(bt_value_t *val);
+bool bt_is_bool(bt_value_t *val);
+
+// The bytes of a string of either kind, valid until the next allocation
+const char *bt_string_bytes(bt_value_t *str);
 
 int64_t bt_to_int64(bt_value_t *val);
+double bt_to_float64(bt_value_t *val);
 
 void init_butterfly(void);
 void init_butterfly_per_module(void);
+void finalize_butterfly_per_module(void);
 
 #endif
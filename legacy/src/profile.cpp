@@ -0,0 +1,147 @@
+#include <dlfcn.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <tuple>
+#include <vector>
+
+#include "profile.h"
+#include "stackmap.h"
+
+#define PROFILE_MAX_DEPTH 64
+
+int64_t bt_profile_interval;
+
+// samples are aggregated by (function, site, type)
+typedef std::tuple<std::string, std::string, int32_t> profile_key_t;
+
+typedef struct _profile_stats_t {
+  int64_t samples;
+  int64_t bytes; // estimated
+  int64_t sampled_bytes;
+} profile_stats_t;
+
+static std::map<profile_key_t, profile_stats_t> profile;
+static std::map<uintptr_t, std::string> jit_functions;
+
+// the last sample, waiting for the type of its object
+static char *pending_obj;
+static int64_t pending_size;
+static std::string pending_function;
+static std::string pending_site;
+
+static const char *type_name(int32_t type) {
+  switch (type) {
+  case I64Ty: return "int64";
+  case SymTy: return "symbol";
+  case BoxTy: return "box";
+  case ConsTy: return "cons";
+  case FunctionRefTy: return "function-ref";
+  case ClosureTy: return "closure";
+  case F64Ty: return "float64";
+  case F64VecTy: return "f64vector";
+  case I64VecTy: return "i64vector";
+  case StrTy: return "string";
+  case StrSliceTy: return "string-slice";
+  case HashTy: return "hash-table";
+  case HashStoreTy: return "hash-store";
+  default: return "other";
+  }
+}
+
+// The Scheme function whose JIT code contains addr, or NULL. Code of the
+// runtime is known to the dynamic linker, JIT code is not.
+static const std::string *jit_function(uintptr_t addr) {
+  Dl_info info;
+  if (dladdr((void *) addr, &info))
+    return NULL;
+  auto it = jit_functions.upper_bound(addr);
+  if (it == jit_functions.begin())
+    return NULL;
+  return &(--it)->second;
+}
+
+static std::string site_name(uintptr_t addr) {
+  char buf[32];
+  Dl_info info;
+  if (dladdr((void *) addr, &info) && info.dli_sname)
+    return info.dli_sname;
+  if (const std::string *name = jit_function(addr)) {
+    auto it = jit_functions.upper_bound(addr);
+    snprintf(buf, sizeof(buf), "+0x%lx", (unsigned long) (addr - (--it)->first));
+    return *name + buf;
+  }
+  snprintf(buf, sizeof(buf), "0x%lx", (unsigned long) addr);
+  return buf;
+}
+
+void bt_profile_sample(char *obj, int64_t size, void *frame) {
+  bt_profile_flush();
+
+  // the site is where the allocator returns to, the function is the
+  // innermost Scheme function on the stack
+  char **fp = (char **) frame;
+  uintptr_t site = (uintptr_t) fp[1];
+  const std::string *function = NULL;
+  for (int depth = 0; fp && (char *) fp < bt_gc_stack_base && depth < PROFILE_MAX_DEPTH; depth++) {
+    if ((function = jit_function((uintptr_t) fp[1])))
+      break;
+    fp = (char **) fp[0];
+  }
+
+  pending_obj = obj;
+  pending_size = size;
+  pending_function = function ? *function : "<runtime>";
+  pending_site = site_name(site);
+}
+
+void bt_profile_flush(void) {
+  if (!pending_obj)
+    return;
+  int32_t type = ((bt_value_t *) pending_obj)->type;
+  profile_stats_t &stats = profile[std::make_tuple(pending_function, pending_site, type)];
+  stats.samples++;
+  // a sample stands for interval bytes, unless the object alone is bigger
+  stats.bytes += std::max(pending_size, bt_profile_interval);
+  stats.sampled_bytes += pending_size;
+  pending_obj = NULL;
+}
+
+void bt_profile_register_function(const std::string &name, uintptr_t addr) {
+  jit_functions[addr] = name;
+}
+
+static void print_profile(void) {
+  bt_profile_flush();
+
+  std::vector<std::pair<profile_key_t, profile_stats_t>> entries(profile.begin(), profile.end());
+  std::sort(entries.begin(), entries.end(),
+            [](const std::pair<profile_key_t, profile_stats_t> &a,
+               const std::pair<profile_key_t, profile_stats_t> &b) {
+              return a.second.bytes > b.second.bytes;
+            });
+
+  int64_t samples = 0;
+  for (auto &entry : entries)
+    samples += entry.second.samples;
+  fprintf(stderr, "[alloc] %ld samples, one per %ld bytes\n", samples, bt_profile_interval);
+  fprintf(stderr, "[alloc] %12s %8s %8s  %-12s %-24s %s\n",
+          "est. bytes", "samples", "avg size", "type", "function", "site");
+  for (auto &entry : entries) {
+    const profile_stats_t &stats = entry.second;
+    fprintf(stderr, "[alloc] %12ld %8ld %8ld  %-12s %-24s %s\n", stats.bytes, stats.samples,
+            stats.sampled_bytes / stats.samples, type_name(std::get<2>(entry.first)),
+            std::get<0>(entry.first).c_str(), std::get<1>(entry.first).c_str());
+  }
+}
+
+void init_profile(void) {
+  if (!getenv("BT_ALLOC_PROFILE"))
+    return;
+  bt_profile_interval = atol(getenv("BT_ALLOC_PROFILE"));
+  if (bt_profile_interval <= 0)
+    bt_profile_interval = 512 * 1024;
+  atexit(print_profile);
+}
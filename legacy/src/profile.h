@@ -0,0 +1,33 @@
+#ifndef _PROFILE_H
+#define _PROFILE_H
+
+#include <cstdint>
+#include <string>
+
+#include "objects.h"
+
+// Sampling allocation profiler, enabled with BT_ALLOC_PROFILE=<bytes>. About
+// once every that many allocated bytes the collector ends the allocation
+// buffer early, so the allocation crossing the sample point takes the slow
+// path and is recorded with its type, size and allocation site. The inline
+// fast path stays a plain pointer bump, and with the profiler off nothing
+// changes at all. An aggregated report is printed to stderr at exit.
+
+// sample interval in bytes, 0 when the profiler is off
+extern int64_t bt_profile_interval;
+
+// Record a sampled allocation. frame is the frame of the allocator, whose
+// return address is the allocation site.
+void bt_profile_sample(char *obj, int64_t size, void *frame);
+
+// Read the type of the last sampled object. Called before the collector may
+// move it, the type is only written once the allocation returns.
+void bt_profile_flush(void);
+
+// Tell the profiler where JIT code for a Scheme function starts, so samples
+// can be attributed to it.
+void bt_profile_register_function(const std::string &name, uintptr_t addr);
+
+void init_profile(void);
+
+#endif
@@ -0,0 +1,73 @@
+#include <cstdlib>
+#include <cstring>
+
+#include "simd.h"
+
+#define CAT_(a, b) a##_##b
+#define CAT(a, b) CAT_(a, b)
+#define K(name) CAT(name, SIMD_ISA)
+
+bt_simd_kernels_t bt_simd;
+
+// Load lane group i of every argument array. The third one is unused by the
+// kernels of two arguments.
+template <typename V, typename T>
+static inline __attribute__((always_inline)) void load_args(int64_t i, V *x, V *y, V *, const T *a, const T *b) {
+  memcpy(x, a + i, sizeof(V));
+  memcpy(y, b + i, sizeof(V));
+}
+
+template <typename V, typename T>
+static inline __attribute__((always_inline)) void load_args(int64_t i, V *x, V *y, V *z, const T *a, const T *b, const T *c) {
+  memcpy(x, a + i, sizeof(V));
+  memcpy(y, b + i, sizeof(V));
+  memcpy(z, c + i, sizeof(V));
+}
+
+#define SIMD_ISA scalar
+#define SIMD_NAME "scalar"
+#define SIMD_WIDTH 1
+#define SIMD_TARGET
+#include "simd_kernels.inc"
+#undef SIMD_ISA
+#undef SIMD_NAME
+#undef SIMD_WIDTH
+#undef SIMD_TARGET
+
+#if defined(__x86_64__)
+#define SIMD_ISA avx2
+#define SIMD_NAME "avx2"
+#define SIMD_WIDTH 4
+#define SIMD_TARGET __attribute__((target("avx2,fma")))
+#include "simd_kernels.inc"
+#undef SIMD_ISA
+#undef SIMD_NAME
+#undef SIMD_WIDTH
+#undef SIMD_TARGET
+
+#define SIMD_ISA avx512
+#define SIMD_NAME "avx512"
+#define SIMD_WIDTH 8
+#define SIMD_TARGET __attribute__((target("avx512f,fma")))
+#include "simd_kernels.inc"
+#undef SIMD_ISA
+#undef SIMD_NAME
+#undef SIMD_WIDTH
+#undef SIMD_TARGET
+#endif
+
+void init_simd(void) {
+  const char *want = getenv("BT_SIMD");
+  bt_simd = kernels_scalar;
+  if (want && !strcmp(want, "scalar"))
+    return;
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  bool avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+  bool avx512 = avx2 && __builtin_cpu_supports("avx512f");
+  if (avx512 && !(want && !strcmp(want, "avx2")))
+    bt_simd = kernels_avx512;
+  else if (avx2)
+    bt_simd = kernels_avx2;
+#endif
+}
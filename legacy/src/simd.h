@@ -0,0 +1,31 @@
+#ifndef _SIMD_H
+#define _SIMD_H
+
+#include <cstdint>
+
+// Elementwise kernels over the elements of typed vectors. They are compiled
+// for AVX-512 and AVX2 besides plain x86-64, and init_simd picks the widest
+// set the CPU supports (BT_SIMD=scalar|avx2|avx512 overrides the choice).
+// Inputs may alias the output, every element is read before it is written.
+// Sums are taken lane by lane, so float sums of the vector kernels may round
+// differently than a sum from left to right.
+
+typedef struct _bt_simd_kernels_t {
+  const char *name;
+  void (*f64_add)(double *dst, const double *a, const double *b, int64_t n);
+  void (*f64_mul)(double *dst, const double *a, const double *b, int64_t n);
+  // dst = a * b + c, fused where the instruction set has fma
+  void (*f64_fma)(double *dst, const double *a, const double *b, const double *c, int64_t n);
+  double (*f64_sum)(const double *a, int64_t n);
+  // integer kernels wrap around on overflow
+  void (*i64_add)(int64_t *dst, const int64_t *a, const int64_t *b, int64_t n);
+  void (*i64_mul)(int64_t *dst, const int64_t *a, const int64_t *b, int64_t n);
+  void (*i64_fma)(int64_t *dst, const int64_t *a, const int64_t *b, const int64_t *c, int64_t n);
+  int64_t (*i64_sum)(const int64_t *a, int64_t n);
+} bt_simd_kernels_t;
+
+extern bt_simd_kernels_t bt_simd;
+
+void init_simd(void);
+
+#endif
@@ -0,0 +1,148 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unordered_map>
+
+#include "stackmap.h"
+
+// Parser for the stack map format the LLVM backend emits, versions 2 and 3:
+//
+//   header    u8 version, u8, u16, u32 NumFunctions, u32 NumConstants,
+//             u32 NumRecords
+//   functions NumFunctions x { u64 address, u64 stack size, u64 NumRecords }
+//   constants NumConstants x u64
+//   records   NumRecords x { u64 id, u32 offset, u16 flags, u16 NumLocations,
+//             locations, align 8, u16, u16 NumLiveOuts, live outs (4 bytes
+//             each), align 8 }
+//
+// A location is { u8 type, u8 size, u16 reg, i32 offset } in version 2, and
+// { u8 type, u8, u16 size, u16 reg, u16, i32 offset } in version 3. The
+// locations of a statepoint are the calling convention, the flags and the
+// number of deopt values, that many deopt values, and then a (base, derived)
+// pair per live gc value.
+
+char *bt_gc_stack_base;
+
+static std::unordered_map<uintptr_t, std::vector<bt_gc_pair_t>> safepoints;
+
+enum {
+  LocRegister = 1,
+  LocDirect = 2,
+  LocIndirect = 3,
+  LocConstant = 4,
+  LocConstantIndex = 5,
+};
+
+typedef struct _stackmap_loc_t {
+  uint8_t type;
+  uint16_t reg;
+  int32_t offset;
+} stackmap_loc_t;
+
+template <typename T>
+static T read(uint8_t *&p) {
+  T val;
+  memcpy(&val, p, sizeof(T));
+  p += sizeof(T);
+  return val;
+}
+
+static uint8_t *align8(uint8_t *p, uint8_t *start) {
+  return p + ((8 - (p - start) % 8) % 8);
+}
+
+static stackmap_loc_t read_loc(uint8_t *&p, uint8_t version) {
+  stackmap_loc_t loc;
+  loc.type = read<uint8_t>(p);
+  if (version == 2) {
+    read<uint8_t>(p); // size
+  } else {
+    read<uint8_t>(p);
+    read<uint16_t>(p); // size
+  }
+  loc.reg = read<uint16_t>(p);
+  if (version != 2)
+    read<uint16_t>(p);
+  loc.offset = read<int32_t>(p);
+  return loc;
+}
+
+static int64_t loc_constant(const stackmap_loc_t &loc, const std::vector<uint64_t> &constants) {
+  if (loc.type == LocConstant)
+    return loc.offset;
+  return (int64_t) constants[loc.offset];
+}
+
+static bt_stack_slot_t loc_slot(const stackmap_loc_t &loc) {
+  // values are spilled around calls, a value left in a register could not
+  // be found again once the callee has clobbered it
+  if (loc.type != LocIndirect) {
+    fprintf(stderr, "Error: %s\n", "gc value not spilled at statepoint.");
+    exit(-1);
+  }
+  bt_stack_slot_t slot = { loc.reg, loc.offset };
+  return slot;
+}
+
+void bt_register_stackmap(uint8_t *section) {
+  uint8_t *start = section;
+  uint8_t *p = section;
+  uint8_t version = read<uint8_t>(p);
+  if (version != 2 && version != 3) {
+    fprintf(stderr, "Error: unsupported stack map version %d.\n", version);
+    exit(-1);
+  }
+  read<uint8_t>(p);
+  read<uint16_t>(p);
+  uint32_t num_functions = read<uint32_t>(p);
+  uint32_t num_constants = read<uint32_t>(p);
+  read<uint32_t>(p); // NumRecords, we go by the per function counts
+
+  std::vector<std::pair<uint64_t, uint64_t>> functions;
+  for (uint32_t i = 0; i < num_functions; i++) {
+    uint64_t addr = read<uint64_t>(p);
+    read<uint64_t>(p); // stack size
+    uint64_t num_records = read<uint64_t>(p);
+    functions.push_back(std::make_pair(addr, num_records));
+  }
+
+  std::vector<uint64_t> constants;
+  for (uint32_t i = 0; i < num_constants; i++)
+    constants.push_back(read<uint64_t>(p));
+
+  for (auto &func : functions) {
+    for (uint64_t r = 0; r < func.second; r++) {
+      read<uint64_t>(p); // id
+      uint32_t offset = read<uint32_t>(p);
+      read<uint16_t>(p); // flags
+      uint16_t num_locs = read<uint16_t>(p);
+
+      std::vector<stackmap_loc_t> locs;
+      for (uint16_t i = 0; i < num_locs; i++)
+        locs.push_back(read_loc(p, version));
+
+      p = align8(p, start);
+      read<uint16_t>(p);
+      uint16_t num_live_outs = read<uint16_t>(p);
+      p += 4 * num_live_outs;
+      p = align8(p, start);
+
+      // patchpoints and plain stackmaps have fewer than the three header
+      // constants of a statepoint
+      if (num_locs < 3)
+        continue;
+      int64_t num_deopt = loc_constant(locs[2], constants);
+      std::vector<bt_gc_pair_t> &pairs = safepoints[func.first + offset];
+      pairs.clear();
+      for (size_t i = 3 + num_deopt; i + 1 < locs.size(); i += 2) {
+        bt_gc_pair_t pair = { loc_slot(locs[i]), loc_slot(locs[i + 1]) };
+        pairs.push_back(pair);
+      }
+    }
+  }
+}
+
+const std::vector<bt_gc_pair_t> *bt_find_safepoint(uintptr_t ret_addr) {
+  auto it = safepoints.find(ret_addr);
+  return it == safepoints.end() ? NULL : &it->second;
+}
@@ -0,0 +1,59 @@
+#ifndef _STACKMAP_H
+#define _STACKMAP_H
+
+#include <cstdint>
+#include <vector>
+
+#include "objects.h"
+
+// Stack maps for statepoint mode (BT_GC_STATEPOINTS). JIT code keeps no gc
+// frames there; instead every call that may collect is a statepoint, and the
+// backend records in the .llvm_stackmaps section where the live values are
+// spilled around it. The JIT hands each section to bt_register_stackmap, and
+// the collector finds the roots of a JIT frame by looking up its return
+// address.
+
+// A spill slot, at offset from the stack or frame pointer of the caller
+typedef struct _bt_stack_slot_t {
+  uint16_t reg; // DWARF register number
+  int32_t offset;
+} bt_stack_slot_t;
+
+// A relocated value: derived may point into the middle of the object at base
+typedef struct _bt_gc_pair_t {
+  bt_stack_slot_t base;
+  bt_stack_slot_t derived;
+} bt_gc_pair_t;
+
+// Bottom of the stack, frames at or above it are never walked
+extern char *bt_gc_stack_base;
+
+void bt_register_stackmap(uint8_t *section);
+
+// The live values at the call that returns to ret_addr, or NULL when
+// ret_addr is not a statepoint in JIT code
+const std::vector<bt_gc_pair_t> *bt_find_safepoint(uintptr_t ret_addr);
+
+// Visit the base and derived slot of every live value in the JIT frames on
+// the stack. Frames are found through the frame pointer chain, so runtime
+// code must keep frame pointers as well.
+template <typename F>
+__attribute__((noinline)) void bt_for_each_stack_root(F f) {
+  char **fp = (char **) __builtin_frame_address(0);
+  while (fp && (char *) fp < bt_gc_stack_base) {
+    // fp belongs to the callee, the return address leads into the caller
+    uintptr_t ret_addr = (uintptr_t) fp[1];
+    char *caller_sp = (char *) (fp + 2);
+    char *caller_fp = fp[0];
+    if (const std::vector<bt_gc_pair_t> *pairs = bt_find_safepoint(ret_addr)) {
+      for (const bt_gc_pair_t &pair : *pairs) {
+        char *base = (pair.base.reg == 6 ? caller_fp : caller_sp) + pair.base.offset;
+        char *derived = (pair.derived.reg == 6 ? caller_fp : caller_sp) + pair.derived.offset;
+        f((bt_value_t **) base, (bt_value_t **) derived);
+      }
+    }
+    fp = (char **) caller_fp;
+  }
+}
+
+#endif
@@ -0,0 +1,89 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "gc.h"
+#include "symbol.h"
+
+#define SYMBOL_TABLE_MIN_CAPACITY 256
+
+typedef struct _symbol_entry_t {
+  uint64_t hash;
+  bt_symbol_t *sym; // NULL for a free entry
+} symbol_entry_t;
+
+static symbol_entry_t *table;
+static uint64_t capacity; // a power of two
+static uint64_t count;
+
+uint64_t bt_symbol_hash(const char *name, int64_t length) {
+  // FNV-1a
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (int64_t i = 0; i < length; i++) {
+    hash ^= (uint8_t) name[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+static symbol_entry_t *find_entry(symbol_entry_t *entries, uint64_t cap, uint64_t hash,
+                                  const char *name, int64_t length) {
+  for (uint64_t i = hash & (cap - 1);; i = (i + 1) & (cap - 1)) {
+    symbol_entry_t *entry = &entries[i];
+    if (!entry->sym)
+      return entry;
+    if (entry->hash == hash && entry->sym->length == length &&
+        !memcmp(entry->sym->name, name, length))
+      return entry;
+  }
+}
+
+static void grow(void) {
+  uint64_t new_capacity = capacity ? capacity * 2 : SYMBOL_TABLE_MIN_CAPACITY;
+  symbol_entry_t *entries = (symbol_entry_t *) calloc(new_capacity, sizeof(symbol_entry_t));
+  if (!entries) {
+    fprintf(stderr, "Error: %s\n", "cannot grow the symbol table.");
+    exit(-1);
+  }
+  for (uint64_t i = 0; i < capacity; i++) {
+    if (table[i].sym)
+      *find_entry(entries, new_capacity, table[i].hash, nullptr, -1) = table[i];
+  }
+  free(table);
+  table = entries;
+  capacity = new_capacity;
+}
+
+extern "C"
+char *bt_intern(const char *name, int64_t length) {
+  // keep the load factor at most one half, probes stay short
+  if (2 * (count + 1) > capacity)
+    grow();
+
+  uint64_t hash = bt_symbol_hash(name, length);
+  symbol_entry_t *entry = find_entry(table, capacity, hash, name, length);
+  if (entry->sym)
+    return (char *) entry->sym;
+
+  bt_symbol_t *sym = (bt_symbol_t *) malloc(sizeof(bt_symbol_t) + length + 1);
+  if (!sym) {
+    fprintf(stderr, "Error: %s\n", "alloc failed.");
+    exit(-1);
+  }
+  sym->type = SymTy;
+  sym->size = (sizeof(bt_symbol_t) - sizeof(bt_value_t) + length + 1 + 7) / 8;
+  sym->hash = hash;
+  sym->length = length;
+  memcpy(sym->name, name, length);
+  sym->name[length] = '\0';
+  entry->hash = hash;
+  entry->sym = sym;
+  count++;
+  return (char *) sym;
+}
+
+bool bt_is_symbol(bt_value_t *val) {
+  if (!bt_is_pointer(val)) return false;
+  if (bt_is_cons(val)) return false;
+  return val->type == SymTy;
+}
@@ -0,0 +1,23 @@
+#ifndef _SYMBOL_H
+#define _SYMBOL_H
+
+#include <cstdint>
+
+#include "objects.h"
+
+// Interned symbols. Every name has exactly one bt_symbol_t, so symbols are
+// compared by pointer. Symbols are immortal and live outside the heap, the
+// collector leaves them alone like other unmanaged objects.
+//
+// The table is open addressing with linear probing. An entry keeps the hash
+// next to the symbol, so a probe only touches the symbol itself on a full
+// hash match.
+
+// Hash of a name, as stored in bt_symbol_t::hash
+uint64_t bt_symbol_hash(const char *name, int64_t length);
+
+extern "C" char *bt_intern(const char *name, int64_t length);
+
+bool bt_is_symbol(bt_value_t *val);
+
+#endif
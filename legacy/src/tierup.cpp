@@ -0,0 +1,111 @@
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "common.h"
+#include "ast.h"
+#include "tierup.h"
+
+#define JIT (Driver::instance()->TheJIT)
+
+bool bt_tier_up_async = true;
+
+// An optimized tier waiting for the tier-up thread
+struct TierUpJob {
+  bt_function_info_t *info;
+  std::string Name;
+  llvm::SmallVector<char, 0> Bitcode;
+};
+
+static std::mutex jobs_lock;
+static std::condition_variable jobs_cond;
+static std::deque<std::unique_ptr<TierUpJob>> jobs;
+static bool jobs_closed;
+static std::thread tier_up_thread;
+
+void bt_optimize_module(llvm::Module &M) {
+  llvm::legacy::FunctionPassManager FPM(&M);
+  addOptimizationPasses(FPM);
+  FPM.doInitialization();
+  for (auto &F : M)
+    if (!F.isDeclaration())
+      FPM.run(F);
+  FPM.doFinalization();
+}
+
+static void compile_optimized(llvm::LLVMContext &Context, TierUpJob &Job) {
+  llvm::StringRef Bitcode(Job.Bitcode.data(), Job.Bitcode.size());
+  auto M = llvm::parseBitcodeFile(llvm::MemoryBufferRef(Bitcode, Job.Name), Context);
+  if (!M) {
+    // stay generic for good
+    llvm::consumeError(M.takeError());
+    fprintf(stderr, "Error: cannot read back %s.\n", Job.Name.c_str());
+    __atomic_store_n(&Job.info->deopts, BT_MAX_DEOPTS, __ATOMIC_RELAXED);
+    return;
+  }
+
+  bt_optimize_module(**M);
+  JIT->addModule(std::move(*M), llvm::CodeGenOpt::Aggressive);
+  void *Code = (void *) JIT->getSymbolAddress(Job.Name);
+  __atomic_store_n(&Job.info->optimized, Code, __ATOMIC_RELEASE);
+}
+
+static void tier_up_loop(void) {
+  // the modules of this thread, the driver's context is the main thread's
+  llvm::LLVMContext Context;
+  while (true) {
+    std::unique_ptr<TierUpJob> Job;
+    {
+      std::unique_lock<std::mutex> Lock(jobs_lock);
+      jobs_cond.wait(Lock, [] { return jobs_closed || !jobs.empty(); });
+      if (jobs_closed)
+        return;
+      Job = std::move(jobs.front());
+      jobs.pop_front();
+    }
+    compile_optimized(Context, *Job);
+    __atomic_store_n(&Job->info->compiling, 0, __ATOMIC_RELEASE);
+  }
+}
+
+void bt_compile_optimized(bt_function_info_t *info, std::unique_ptr<llvm::Module> M,
+                          const std::string &Name) {
+  std::unique_ptr<TierUpJob> Job(new TierUpJob());
+  Job->info = info;
+  Job->Name = Name;
+  llvm::raw_svector_ostream OS(Job->Bitcode);
+  llvm::WriteBitcodeToFile(M.get(), OS);
+
+  std::lock_guard<std::mutex> Lock(jobs_lock);
+  if (!tier_up_thread.joinable())
+    tier_up_thread = std::thread(tier_up_loop);
+  jobs.push_back(std::move(Job));
+  jobs_cond.notify_one();
+}
+
+void init_tier_up(void) {
+  if (getenv("BT_TIER_UP_ASYNC"))
+    bt_tier_up_async = atoi(getenv("BT_TIER_UP_ASYNC")) != 0;
+  if (bt_gc_statepoints || bt_profile_interval)
+    bt_tier_up_async = false;
+}
+
+void shutdown_tier_up(void) {
+  {
+    std::lock_guard<std::mutex> Lock(jobs_lock);
+    jobs_closed = true;
+    jobs.clear();
+    jobs_cond.notify_one();
+  }
+  if (tier_up_thread.joinable())
+    tier_up_thread.join();
+}
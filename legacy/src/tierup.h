@@ -0,0 +1,37 @@
+#ifndef _TIERUP_H
+#define _TIERUP_H
+
+#include <memory>
+#include <string>
+
+#include "llvm/IR/Module.h"
+#include "feedback.h"
+
+// Background compilation of optimized tiers (see feedback.h). The optimized
+// tier of a hot function is generated by bt_tier_up on the main thread,
+// which owns the LLVM context of the driver and reads the feedback. Its
+// module then goes to the tier-up thread as bitcode, into an LLVM context of
+// that thread. The thread runs the full pass pipeline and the backend at O3,
+// and publishes the code with a release store to info->optimized, which the
+// profiling tier loads on every call. The function keeps running in the
+// profiling tier meanwhile.
+//
+// Stack maps (BT_GC=statepoint) and the allocation profiler register JIT
+// code in tables that the main thread reads without locking, with either
+// one optimized tiers are compiled on the main thread instead, right away.
+// BT_TIER_UP_ASYNC=0 does the same.
+
+extern bool bt_tier_up_async;
+
+// Run the full optimization pipeline over every function of M
+void bt_optimize_module(llvm::Module &M);
+
+// Have the optimized tier Name of info in module M compiled in the background
+void bt_compile_optimized(bt_function_info_t *info, std::unique_ptr<llvm::Module> M,
+                          const std::string &Name);
+
+void init_tier_up(void);
+// Stop the tier-up thread, dropping what it has not started yet
+void shutdown_tier_up(void);
+
+#endif
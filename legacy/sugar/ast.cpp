@@ -38,6 +38,13 @@ static ExprAST* ParseIntExpr() {
   return Result;
 }
 
+/// float_expr ::= float
+static ExprAST* ParseFloatExpr() {
+  auto Result = new FloatExprAST(CUR_TOK.literal);
+  getNextToken(); // consume the number
+  return Result;
+}
+
 /// id_expr
 ///   ::= identifier
 static ExprAST* ParseIdentifierExpr() {
@@ -49,6 +56,7 @@ static ExprAST* ParseIdentifierExpr() {
 /// primary
 ///   ::= id_expr
 ///   ::= int_expr
+///   ::= float_expr
 ///   ::= nil
 static ExprAST* ParsePrimary() {
   switch (CUR_TOK.type) {
@@ -56,6 +64,8 @@ static ExprAST* ParsePrimary() {
     return ParseIdentifierExpr();
   case tok_integer:
     return ParseIntExpr();
+  case tok_float:
+    return ParseFloatExpr();
   case tok_nil:
     getNextToken(); // eat nil
     return new NilExprAST;
@@ -113,7 +123,14 @@ static ExprAST* ParseCondExpr() {
   while (CUR_TOK.type != tok_close) {
     if (!expectToken(tok_open)) return LogError("non '(' at begin of sub cond expression");
     getNextToken(); // eat open
-    if (auto pred = ParseExpression()) {
+    // an else clause is always taken, any value but #f is true
+    ExprAST *pred;
+    if (CUR_TOK.type == tok_symbol && CUR_TOK.literal == "else") {
+      getNextToken(); // eat else
+      pred = new IntExprAST(1);
+    } else
+      pred = ParseExpression();
+    if (pred) {
       if (auto expr = ParseExpression()) {  
         preds.push_back(pred);
         exprs.push_back(expr);
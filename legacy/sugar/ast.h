@@ -21,6 +21,13 @@ public:
   virtual std::string defName() { return std::string(""); }
 
   virtual void collectUsedNames(std::unordered_set<std::string> &use) {  }
+  // names that are set! in this expression
+  virtual void collectAssignedNames(std::unordered_set<std::string> &assigned) {  }
+  // names that are used as values, i.e. other than as callee of a call
+  virtual void collectValueNames(std::unordered_set<std::string> &val) {  }
+  // rewrite calls of Name into calls of Lifted with Extra args appended
+  virtual void liftCalls(const std::string &Name, const std::string &Lifted,
+                         const std::vector<std::string> &Extra) {  }
   
   virtual ExprAST* closureTransformationPass(FunctionScope *scope, ScopeMap &smap) { return nullptr; }
 };
@@ -34,6 +41,16 @@ public:
   void print() override { std::cout << Val; }
 };
 
+/// FloatExprAST - Expression class for float literals like "1.0". The
+/// literal is printed back as it was written, so it stays a float.
+class FloatExprAST : public ExprAST {
+  std::string Literal;
+
+public:
+  FloatExprAST(const std::string &Literal) : Literal(Literal) {}
+  void print() override { std::cout << Literal; }
+};
+
 /// IntExprAST - Expression class for numeric literals like "1.0".
 class NilExprAST : public ExprAST {
 public:
@@ -49,7 +66,10 @@ public:
   VariableExprAST(const std::string &Name) : Name(Name) {}
   void print() override { std::cout << Name; }
 
+  const std::string &getName() const { return Name; }
+
   void collectUsedNames(std::unordered_set<std::string> &use) override { use.insert(Name); }
+  void collectValueNames(std::unordered_set<std::string> &val) override { val.insert(Name); }
 
   virtual ExprAST* closureTransformationPass(FunctionScope *scope, ScopeMap &smap) override;
 };
@@ -70,6 +90,16 @@ public:
   std::string defName() override { return Name; }
 
   void collectUsedNames(std::unordered_set<std::string> &use) override { Init->collectUsedNames(use); }
+  void collectAssignedNames(std::unordered_set<std::string> &assigned) override {
+    Init->collectAssignedNames(assigned);
+  }
+  void collectValueNames(std::unordered_set<std::string> &val) override {
+    Init->collectValueNames(val);
+  }
+  void liftCalls(const std::string &Name, const std::string &Lifted,
+                 const std::vector<std::string> &Extra) override {
+    Init->liftCalls(Name, Lifted, Extra);
+  }
   virtual ExprAST* closureTransformationPass(FunctionScope *scope, ScopeMap &smap) override;
 };
 
@@ -90,6 +120,18 @@ public:
     use.insert(Name); 
     Expr->collectUsedNames(use); 
   }
+  void collectAssignedNames(std::unordered_set<std::string> &assigned) override {
+    assigned.insert(Name); 
+    Expr->collectAssignedNames(assigned); 
+  }
+  void collectValueNames(std::unordered_set<std::string> &val) override {
+    val.insert(Name); 
+    Expr->collectValueNames(val); 
+  }
+  void liftCalls(const std::string &Name, const std::string &Lifted,
+                 const std::vector<std::string> &Extra) override {
+    Expr->liftCalls(Name, Lifted, Extra);
+  }
   virtual ExprAST* closureTransformationPass(FunctionScope *scope, ScopeMap &smap) override;
 };
 
@@ -111,6 +153,16 @@ public:
   void collectUsedNames(std::unordered_set<std::string> &use) override {
     RHS->collectUsedNames(use); 
   }
+  void collectAssignedNames(std::unordered_set<std::string> &assigned) override {
+    RHS->collectAssignedNames(assigned); 
+  }
+  void collectValueNames(std::unordered_set<std::string> &val) override {
+    RHS->collectValueNames(val); 
+  }
+  void liftCalls(const std::string &Name, const std::string &Lifted,
+                 const std::vector<std::string> &Extra) override {
+    RHS->liftCalls(Name, Lifted, Extra);
+  }
 };
 
 /// BinaryExprAST - Expression class for a binary operator.
@@ -134,6 +186,19 @@ public:
     LHS->collectUsedNames(use);
     RHS->collectUsedNames(use); 
   }
+  void collectAssignedNames(std::unordered_set<std::string> &assigned) override {
+    LHS->collectAssignedNames(assigned);
+    RHS->collectAssignedNames(assigned); 
+  }
+  void collectValueNames(std::unordered_set<std::string> &val) override {
+    LHS->collectValueNames(val);
+    RHS->collectValueNames(val); 
+  }
+  void liftCalls(const std::string &Name, const std::string &Lifted,
+                 const std::vector<std::string> &Extra) override {
+    LHS->liftCalls(Name, Lifted, Extra);
+    RHS->liftCalls(Name, Lifted, Extra);
+  }
   virtual ExprAST* closureTransformationPass(FunctionScope *scope, ScopeMap &smap) override;
 };
 
@@ -155,6 +220,16 @@ public:
   void collectUsedNames(std::unordered_set<std::string> &use) override {
     RHS->collectUsedNames(use); 
   }
+  void collectAssignedNames(std::unordered_set<std::string> &assigned) override {
+    RHS->collectAssignedNames(assigned); 
+  }
+  void collectValueNames(std::unordered_set<std::string> &val) override {
+    RHS->collectValueNames(val); 
+  }
+  void liftCalls(const std::string &Name, const std::string &Lifted,
+                 const std::vector<std::string> &Extra) override {
+    RHS->liftCalls(Name, Lifted, Extra);
+  }
   virtual ExprAST* closureTransformationPass(FunctionScope *scope, ScopeMap &smap) override;
 };
 
@@ -181,6 +256,22 @@ public:
     Then->collectUsedNames(use);
     Else->collectUsedNames(use); 
   }
+  void collectAssignedNames(std::unordered_set<std::string> &assigned) override {
+    Pred->collectAssignedNames(assigned);
+    Then->collectAssignedNames(assigned);
+    Else->collectAssignedNames(assigned); 
+  }
+  void collectValueNames(std::unordered_set<std::string> &val) override {
+    Pred->collectValueNames(val);
+    Then->collectValueNames(val);
+    Else->collectValueNames(val); 
+  }
+  void liftCalls(const std::string &Name, const std::string &Lifted,
+                 const std::vector<std::string> &Extra) override {
+    Pred->liftCalls(Name, Lifted, Extra);
+    Then->liftCalls(Name, Lifted, Extra);
+    Else->liftCalls(Name, Lifted, Extra);
+  }
   virtual ExprAST* closureTransformationPass(FunctionScope *scope, ScopeMap &smap) override;
 };
 
@@ -218,6 +309,31 @@ public:
       e->collectUsedNames(use);
     } 
   }
+  void collectAssignedNames(std::unordered_set<std::string> &assigned) override {
+    for (auto &e : Preds) {
+      e->collectAssignedNames(assigned);
+    } 
+    for (auto &e : Exprs) {
+      e->collectAssignedNames(assigned);
+    } 
+  }
+  void collectValueNames(std::unordered_set<std::string> &val) override {
+    for (auto &e : Preds) {
+      e->collectValueNames(val);
+    } 
+    for (auto &e : Exprs) {
+      e->collectValueNames(val);
+    } 
+  }
+  void liftCalls(const std::string &Name, const std::string &Lifted,
+                 const std::vector<std::string> &Extra) override {
+    for (auto &e : Preds) {
+      e->liftCalls(Name, Lifted, Extra);
+    } 
+    for (auto &e : Exprs) {
+      e->liftCalls(Name, Lifted, Extra);
+    } 
+  }
   virtual ExprAST* closureTransformationPass(FunctionScope *scope, ScopeMap &smap) override;
 };
 
@@ -242,6 +358,22 @@ public:
       e->collectUsedNames(use);
     } 
   }
+  void collectAssignedNames(std::unordered_set<std::string> &assigned) override {
+    for (auto &e : Exprs) {
+      e->collectAssignedNames(assigned);
+    } 
+  }
+  void collectValueNames(std::unordered_set<std::string> &val) override {
+    for (auto &e : Exprs) {
+      e->collectValueNames(val);
+    } 
+  }
+  void liftCalls(const std::string &Name, const std::string &Lifted,
+                 const std::vector<std::string> &Extra) override {
+    for (auto &e : Exprs) {
+      e->liftCalls(Name, Lifted, Extra);
+    } 
+  }
   virtual ExprAST* closureTransformationPass(FunctionScope *scope, ScopeMap &smap) override;
 };
 
@@ -272,6 +404,22 @@ public:
       e->collectUsedNames(use);
     } 
   }
+  void collectAssignedNames(std::unordered_set<std::string> &assigned) override {
+    Callee->collectAssignedNames(assigned);
+    for (auto &e : Args) {
+      e->collectAssignedNames(assigned);
+    } 
+  }
+  void collectValueNames(std::unordered_set<std::string> &val) override {
+    // a direct call does not let the callee escape
+    if (!dynamic_cast<VariableExprAST *>(Callee))
+      Callee->collectValueNames(val);
+    for (auto &e : Args) {
+      e->collectValueNames(val);
+    } 
+  }
+  void liftCalls(const std::string &Name, const std::string &Lifted,
+                 const std::vector<std::string> &Extra) override;
   virtual ExprAST* closureTransformationPass(FunctionScope *scope, ScopeMap &smap) override;
 };
 
@@ -328,12 +476,19 @@ public:
 
   std::unordered_set<std::string> Closures; // inner function namespace
 
-  // escaped & enclosed var: a var cannot be both escaped and enclosed
+  // escaped & enclosed var: an enclosed var that is escaped, too, is only
+  // passed through to an inner closure
   // enclosed var will be pushed to closure-obj
-  // escaped var will be boxed and moved to new-closure
+  // escaped var will be moved to new-closure
   std::unordered_set<std::string> EscapedValues;
   std::vector<std::string> EnclosedValues;
 
+  // var set! here or, if enclosed, in an inner closure
+  std::unordered_set<std::string> AssignedValues;
+  // escaped or enclosed var that lives in a box: only those that are
+  // assigned somewhere, others are copied into closures by value
+  std::unordered_set<std::string> BoxedValues;
+
   FunctionScope() {}
 };
 
@@ -365,7 +520,28 @@ public:
       e->collectUsedNames(use);
     } 
   }
-
+  void collectAssignedNames(std::unordered_set<std::string> &assigned) override {
+    for (auto &e : Body) {
+      e->collectAssignedNames(assigned);
+    } 
+  }
+  void collectValueNames(std::unordered_set<std::string> &val) override {
+    for (auto &e : Body) {
+      e->collectValueNames(val);
+    } 
+  }
+  void liftCalls(const std::string &Name, const std::string &Lifted,
+                 const std::vector<std::string> &Extra) override;
+
+  // own name, args and body definitions
+  void collectDefinedNames(std::unordered_set<std::string> &def);
+  // names used here or in inner functions that are neither defined
+  // locally nor global
+  void collectFreeNames(std::unordered_set<std::string> &free);
+  // defined names of all inner functions, at any depth
+  void collectInnerDefinedNames(std::unordered_set<std::string> &def);
+
+  void liftingPass(std::vector<FunctionAST *> &lifted);
   void closurePass(void);
 
   virtual ExprAST* closureTransformationPass(FunctionScope *scope, ScopeMap &smap) override;
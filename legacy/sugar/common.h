@@ -56,6 +56,7 @@ enum token_type {
   // primitive types
   tok_symbol,
   tok_integer,
+  tok_float,
 
   // whitespaces
   tok_space,
@@ -35,6 +35,7 @@ std::string token_desc[] = {
                 "nil",
                 "tok_symbol",
                 "tok_integer",
+                "tok_float",
                 "tok_space",
                 "tok_newline",
               }; 
@@ -65,6 +66,33 @@ token_type getIntToken(const char *text, int *len) {
   }
 
   int int_len = readInt(text + sign);
+
+  // decimals: [sign] digits [. digits] [e [sign] digits], with digits on at
+  // least one side of the point
+  int n = sign + int_len;
+  bool is_float = false;
+  if (text[n] == '.') {
+    int frac_len = readInt(text + n + 1);
+    if (int_len == 0 && frac_len == 0)
+      return tok_error;
+    n += 1 + frac_len;
+    is_float = true;
+  }
+  if ((text[n] == 'e' || text[n] == 'E') && (int_len > 0 || is_float)) {
+    int exp_sign = (text[n+1] == '+' || text[n+1] == '-') ? 1 : 0;
+    int exp_len = readInt(text + n + 1 + exp_sign);
+    if (exp_len == 0)
+      return tok_error;
+    n += 1 + exp_sign + exp_len;
+    is_float = true;
+  }
+  if (is_float) {
+    if (!isDelim(text[n]))
+      return tok_error;
+    *len = n;
+    return tok_float;
+  }
+
   if (!isDelim(text[sign+int_len])) {
     return tok_error;
   }
@@ -3,6 +3,7 @@
 #include <string.h>
 #include <vector>
 #include <queue>
+#include <set>
 #include <algorithm>
 
 #include "common.h"
@@ -25,6 +26,9 @@ static void scopeDFS(std::string fn, std::map<std::string, FunctionScope *> &sco
       scopeDFS(child, scopes);
       for (auto const &clz : scopes[child]->EnclosedValues) {
         scopes[fn]->EscapedValues.insert(clz);
+        // a set! of an enclosed var assigns the var of this function
+        if (scopes[child]->AssignedValues.count(clz) > 0)
+          scopes[fn]->AssignedValues.insert(clz);
       }
     }
   }
@@ -66,8 +70,204 @@ static void scopeDFS(std::string fn, std::map<std::string, FunctionScope *> &sco
 */
 }
 
+// pre: scopeDFS is done, and the boxed vars of fn are known
+// post: boxed vars of every inner function
+// A var needs a box only if it is assigned somewhere, otherwise the closure
+// can hold a copy of its value. The function that defines a var decides,
+// inner functions that enclose it follow.
+static void boxDFS(std::string fn, std::map<std::string, FunctionScope *> &scopes) {
+  for (auto const &child : scopes[fn]->Closures) {
+    for (auto const &n : scopes[child]->EscapedValues) {
+      auto &v = scopes[child]->DefinedValues;
+      if ( scopes[child]->AssignedValues.count(n) > 0 &&
+             std::find(v.begin(), v.end(), n) != v.end() ) {
+        scopes[child]->BoxedValues.insert(n);
+      }
+    }
+    for (auto const &n : scopes[child]->EnclosedValues) {
+      if (scopes[fn]->BoxedValues.count(n) > 0)
+        scopes[child]->BoxedValues.insert(n);
+    }
+    boxDFS(child, scopes);
+  }
+}
+
+void FunctionAST::collectDefinedNames(std::unordered_set<std::string> &def) {
+  def.insert(Proto->Name);
+  for (auto const &Arg : Proto->Args)
+    def.insert(Arg);
+  for (auto const &e : Body) {
+    if (e->defType() >= 0)
+      def.insert(e->defName());
+  }
+}
+
+void FunctionAST::collectFreeNames(std::unordered_set<std::string> &free) {
+  std::unordered_set<std::string> def, use;
+  collectDefinedNames(def);
+  for (auto const &e : Body) {
+    if (e->isaFunction())
+      dynamic_cast<FunctionAST *>(e)->collectFreeNames(use);
+    else
+      e->collectUsedNames(use);
+  }
+  for (auto const &n : use) {
+    if (def.count(n) == 0 && !ISA_GLOBAL_NAME(n))
+      free.insert(n);
+  }
+}
+
+void FunctionAST::collectInnerDefinedNames(std::unordered_set<std::string> &def) {
+  for (auto const &e : Body) {
+    if (e->isaFunction()) {
+      FunctionAST *fn = dynamic_cast<FunctionAST *>(e);
+      fn->collectDefinedNames(def);
+      fn->collectInnerDefinedNames(def);
+    }
+  }
+}
+
+void CallExprAST::liftCalls(const std::string &Name, const std::string &Lifted,
+                            const std::vector<std::string> &Extra) {
+  Callee->liftCalls(Name, Lifted, Extra);
+  for (auto &e : Args) {
+    e->liftCalls(Name, Lifted, Extra);
+  }
+
+  VariableExprAST *callee = dynamic_cast<VariableExprAST *>(Callee);
+  if (callee && callee->getName() == Name) {
+    delete Callee;
+    Callee = new VariableExprAST(Lifted);
+    for (auto const &n : Extra)
+      Args.push_back(new VariableExprAST(n));
+  }
+}
+
+void FunctionAST::liftCalls(const std::string &Name, const std::string &Lifted,
+                            const std::vector<std::string> &Extra) {
+  // a local definition of Name hides the lifted function
+  auto &v = Proto->Args;
+  if (std::find(v.begin(), v.end(), Name) != v.end())
+    return;
+  for (auto const &e : Body) {
+    if (e->defType() >= 0 && e->defName() == Name)
+      return;
+  }
+
+  for (auto &e : Body) {
+    e->liftCalls(Name, Lifted, Extra);
+  }
+}
+
+// This pass is to lift inner functions that never escape to global functions
+// (lambda lifting), so they need no closure object and are called directly.
+// An inner function is lifted if it is only ever called by name, and its free
+// vars become extra args that every call passes along. Free vars that are
+// set! cannot be passed by value, functions that capture one stay closures.
+// Inner functions are lifted bottom-up, the lifted ones are returned.
+void FunctionAST::liftingPass(std::vector<FunctionAST *> &lifted) {
+  std::map<std::string, FunctionAST *> inner;
+  for (auto const &e : Body) {
+    if (e->isaFunction()) {
+      FunctionAST *fn = dynamic_cast<FunctionAST *>(e);
+      fn->liftingPass(lifted);
+      inner[fn->Proto->Name] = fn;
+    }
+  }
+  if (inner.empty())
+    return;
+
+  std::unordered_set<std::string> values, assigned, shadowed;
+  collectValueNames(values);
+  collectAssignedNames(assigned);
+  collectInnerDefinedNames(shadowed);
+
+  // candidates are the inner functions that never escape
+  std::set<std::string> cand;
+  std::map<std::string, std::unordered_set<std::string>> base;
+  for (auto const &fentry : inner) {
+    if (values.count(fentry.first) == 0 && assigned.count(fentry.first) == 0) {
+      cand.insert(fentry.first);
+      fentry.second->collectFreeNames(base[fentry.first]);
+    }
+  }
+
+  // a candidate also needs the free vars of the candidates it calls, which
+  // may drop it or them in turn, so iterate until nothing is dropped
+  std::map<std::string, std::set<std::string>> fvs;
+  while (true) {
+    fvs.clear();
+    for (auto const &g : cand) {
+      for (auto const &n : base[g]) {
+        if (cand.count(n) == 0)
+          fvs[g].insert(n);
+      }
+    }
+    for (bool grew = true; grew; ) {
+      grew = false;
+      for (auto const &g : cand) {
+        for (auto const &k : cand) {
+          if (k == g || base[g].count(k) == 0)
+            continue;
+          for (auto const &n : fvs[k])
+            grew |= fvs[g].insert(n).second;
+        }
+      }
+    }
+
+    // free vars must be passed by value and must mean the same var at
+    // every call site
+    std::set<std::string> drop;
+    for (auto const &g : cand) {
+      for (auto const &n : fvs[g]) {
+        if (assigned.count(n) > 0 || shadowed.count(n) > 0)
+          drop.insert(g);
+      }
+    }
+    if (drop.empty())
+      break;
+    for (auto const &g : drop)
+      cand.erase(g);
+  }
+
+  std::vector<FunctionAST *> here;
+  for (auto const &g : cand) {
+    FunctionAST *fn = inner[g];
+    fn->Proto->Name = genClosureSym(g);
+    FUNCTIONS[fn->Proto->Name] = fn;
+    for (auto const &n : fvs[g])
+      fn->Proto->Args.push_back(n);
+    auto pos = std::find(Body.begin(), Body.end(), fn);
+    if (pos + 1 == Body.end())
+      *pos = new NilExprAST;
+    else
+      Body.erase(pos);
+    here.push_back(fn);
+  }
+
+  for (auto const &fn : here) {
+    std::string name;
+    for (auto const &fentry : inner) {
+      if (fentry.second == fn)
+        name = fentry.first;
+    }
+    std::vector<std::string> extra(fvs[name].begin(), fvs[name].end());
+    liftCalls(name, fn->Proto->Name, extra);
+    for (auto const &other : here)
+      other->liftCalls(name, fn->Proto->Name, extra);
+  }
+
+  lifted.insert(lifted.end(), here.begin(), here.end());
+}
+
 // This pass is to replace innder function def with closure statements
 void FunctionAST::closurePass() {
+  // inner functions that never escape need no closure at all
+  std::vector<FunctionAST *> lifted;
+  liftingPass(lifted);
+  for (auto const &fn : lifted)
+    fn->closurePass();
+
   // Do a BFS search on closures, relace inner function with closure ast
 
   std::queue<FunctionAST *> worklist;
@@ -109,6 +309,7 @@ void FunctionAST::closurePass() {
     }
   }
   collectUsedNames(scopes[Proto->Name]->UsedValues);
+  collectAssignedNames(scopes[Proto->Name]->AssignedValues);
   
   while (!worklist.empty()) {
     FunctionAST *head = worklist.front();
@@ -150,6 +351,7 @@ void FunctionAST::closurePass() {
       }
     }
     head->collectUsedNames(scopes[head->Proto->Name]->UsedValues);
+    head->collectAssignedNames(scopes[head->Proto->Name]->AssignedValues);
     
     innerFunctions[head->Proto->Name] = head;
   }
@@ -158,6 +360,13 @@ void FunctionAST::closurePass() {
   // let's collect def/use problem
   scopeDFS(Proto->Name, scopes);
 
+  // the global function encloses nothing, its boxes are its own
+  for (auto const &n : scopes[Proto->Name]->EscapedValues) {
+    if (scopes[Proto->Name]->AssignedValues.count(n) > 0)
+      scopes[Proto->Name]->BoxedValues.insert(n);
+  }
+  boxDFS(Proto->Name, scopes);
+
   for(auto const &fentry : innerFunctions) {
     std::string fname = fentry.first;
     innerFunctions[fname]->closureTransformationPass(scopes[fname], scopes);
@@ -177,17 +386,20 @@ void FunctionAST::closurePass() {
 
 ExprAST *
 VariableExprAST::closureTransformationPass(FunctionScope *scope, ScopeMap &smap) {
-  auto escape = scope->EscapedValues.find(Name);
   auto enclose = find(scope->EnclosedValues.begin(), scope->EnclosedValues.end(), Name);
+  bool boxed = scope->BoxedValues.count(Name) > 0;
 
-  if ( escape != scope->EscapedValues.end() ) {
-    ExprAST *var = new VariableExprAST(Name);
-    ExprAST *unbox = new UnaryExprAST(tok_unbox, var);
-    return unbox;
-  } else if ( enclose != scope->EnclosedValues.end() ) {
+  // an enclosed var may be escaped as well, it still lives in _obj
+  if ( enclose != scope->EnclosedValues.end() ) {
     int pos = enclose - scope->EnclosedValues.begin();
     ExprAST *target = new VariableExprAST(std::string("_obj"));
     ExprAST *var = new GetFieldExprAST(pos + 1, target);
+    if (!boxed)
+      return var;
+    ExprAST *unbox = new UnaryExprAST(tok_unbox, var);
+    return unbox;
+  } else if ( boxed ) {
+    ExprAST *var = new VariableExprAST(Name);
     ExprAST *unbox = new UnaryExprAST(tok_unbox, var);
     return unbox;
   }
@@ -203,9 +415,8 @@ VarDefinitionExprAST::closureTransformationPass(FunctionScope *scope, ScopeMap &
     Init = new_init;
   }
 
-  auto escape = scope->EscapedValues.find(Name);
   // a defined var can't be enclosed: auto enclose = find(scope->EnclosedValues.begin(), scope->EnclosedValues.end(), Name);
-  if ( escape != scope->EscapedValues.end() ) {
+  if ( scope->BoxedValues.count(Name) > 0 ) {
     ExprAST *box = new UnaryExprAST(tok_box, Init);
     Init = box;
   }
@@ -347,19 +558,19 @@ VarSetExprAST::closureTransformationPass(FunctionScope *scope, ScopeMap &smap) {
     Expr = new_expr;
   }
 
-  auto escape = scope->EscapedValues.find(Name);
   auto enclose = find(scope->EnclosedValues.begin(), scope->EnclosedValues.end(), Name);
 
-  if ( escape != scope->EscapedValues.end() ) {
-    ExprAST *var = new VariableExprAST(Name);
-    ExprAST *setbox = new BinaryExprAST(tok_setbox, var, Expr);
-    return setbox;
-  } else if ( enclose != scope->EnclosedValues.end() ) {
+  // an assigned var that is enclosed or escaped is always boxed
+  if ( enclose != scope->EnclosedValues.end() ) {
     int pos = enclose - scope->EnclosedValues.begin();
     ExprAST *target = new VariableExprAST(std::string("_obj"));
     ExprAST *var = new GetFieldExprAST(pos + 1, target);
     ExprAST *setbox = new BinaryExprAST(tok_setbox, var, Expr);
     return setbox;
+  } else if ( scope->BoxedValues.count(Name) > 0 ) {
+    ExprAST *var = new VariableExprAST(Name);
+    ExprAST *setbox = new BinaryExprAST(tok_setbox, var, Expr);
+    return setbox;
   }
   
   return nullptr;
@@ -382,5 +593,13 @@ FunctionAST::closureTransformationPass(FunctionScope *scope, ScopeMap &smap) {
     // std::cout << std::endl;
   }
 
+  // boxed args are boxed on entry, before the body reads them
+  for (auto it = Proto->Args.rbegin(); it != Proto->Args.rend(); ++it) {
+    if (scope->BoxedValues.count(*it) > 0) {
+      ExprAST *box = new UnaryExprAST(tok_box, new VariableExprAST(*it));
+      Body.insert(Body.begin(), new VarSetExprAST(*it, box));
+    }
+  }
+
   return nullptr;
 }
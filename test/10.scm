@@ -0,0 +1,15 @@
+(define (greet name)
+        (string-append "hello, " name))
+
+(greet "world")
+
+(define (drop-prefix s n)
+        (substring s n (string-length s)))
+
+(drop-prefix "the quick brown fox jumps over the lazy dog" 4)
+
+(string=? (greet "x") "hello, x")
+
+(string<? "apple" "banana")
+
+(string-ref "A" 0)
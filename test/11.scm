@@ -0,0 +1,32 @@
+(define (count-into table words)
+        (if (null? words)
+            table
+            (begin
+              (hash-set! table (car words) (+ 1 (hash-ref table (car words) 0)))
+              (count-into table (cdr words)))))
+
+(define (make-counts) (count-into (make-hash-table) (list 'a 'b 'a "c" 'a "c")))
+
+(define (check-symbol)
+        (define counts (make-counts))
+        (hash-ref counts 'a 0))
+
+(define (check-string)
+        (define counts (make-counts))
+        (hash-ref counts "c" 0))
+
+(define (check-missing)
+        (define counts (make-counts))
+        (hash-ref counts 'z 0))
+
+(define (check-count)
+        (define counts (make-counts))
+        (hash-count counts))
+
+(check-symbol)
+
+(check-string)
+
+(check-missing)
+
+(check-count)
@@ -0,0 +1,31 @@
+(define (add1 x) (+ x 1))
+
+(define (adder#0 _obj x) (+ x (getfield 1 _obj)))
+
+(define (make-adder n) (closure adder#0 n))
+
+(define (sum9 a b c d e f g h i)
+        (+ a (+ b (+ c (+ d (+ e (+ f (+ g (+ h i)))))))))
+
+(begin (define a (add1 39))
+       (define b (+ a 2))
+       (set! b (+ b a))
+       (if (< b 100) b 0))
+
+(begin (define x (add1 0))
+       (define y (add1 1))
+       (if (< x y)
+           (begin (define t x) (set! x y) (set! y t))
+           0)
+       (list x y))
+
+(begin (define x (add1 0))
+       (if x 1 2))
+
+(begin (define f add1)
+       (f 41))
+
+(begin (define g (make-adder 10))
+       (g 32))
+
+(sum9 1 2 3 4 5 6 7 8 9)
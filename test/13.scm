@@ -0,0 +1,72 @@
+(define (fold-branch x)
+        (if (< (+ 2 3) 10)
+            (* (+ x 1) (+ 1 x))
+            7))
+
+(define (drop-dead x)
+        (define unused (list x x))
+        (+ x 1))
+
+(define (step-down n)
+        (define steps 0)
+        (define x n)
+        (if (> x 10)
+            (begin (set! x (- x 10)) (set! steps (+ steps 1)))
+            0)
+        (if (> x 5)
+            (begin (set! x (- x 5)) (set! steps (+ steps 1)))
+            0)
+        (+ (* x 100) steps))
+
+(define (sum-to i n acc)
+        (if (< i n)
+            (sum-to (+ i 1) n (+ acc i))
+            acc))
+
+(define (swap-times k a b)
+        (if (> k 0)
+            (swap-times (- k 1) b a)
+            (- (* a 10) b)))
+
+(define (ping n) (if (= n 0) 0 (pong (- n 1))))
+
+(define (pong n) (ping n))
+
+(define (range a b)
+        (if (> a b)
+            nil
+            (cons a (range (+ a 1) b))))
+
+(define (sum l)
+        (if (null? l)
+            0
+            (+ (car l) (sum (cdr l)))))
+
+(define (churn k)
+        (if (> k 0)
+            (begin (range 1 100) (churn (- k 1)))
+            0))
+
+(define (keep-alive n)
+        (define l (range 1 n))
+        (define m (sum l))
+        (churn 2000)
+        (+ (sum l) m))
+
+(= (fold-branch 5) 36)
+
+(= (drop-dead 1) 2)
+
+(= (step-down 17) 202)
+
+(= (step-down 3) 300)
+
+(= (sum-to 0 100000 0) 4999950000)
+
+(= (swap-times 3 1 2) 19)
+
+(= (swap-times 4 1 2) 8)
+
+(= (ping 1000001) 0)
+
+(= (keep-alive 1000) 1001000)
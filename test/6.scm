@@ -26,3 +26,19 @@
 (even 121)
 
 (odd 121)
+
+(even 1000001)
+
+(define (count-down n)
+        (cond ((= n 0) 0)
+              ((> n 1) (count-down (- n 2)))
+              (else (count-down (- n 1)))))
+
+(count-down 1000001)
+
+(define (sum n acc)
+        (if (= n 0)
+            acc
+            (sum (- n 1) (+ acc n))))
+
+(sum 1000000 0)
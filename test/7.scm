@@ -0,0 +1,19 @@
+(define (square x) (* x x))
+
+(define (sum l)
+        (if (null? l)
+            0
+            (+ (car l) (sum (cdr l)))))
+
+(define (range a b)
+        (if (> a b)
+            nil
+            (cons a (range (+ a 1) b))))
+
+(sum (list 1 2 3 4))
+
+(sum (map square (range 1 10)))
+
+(pair? (cdr (list 1 2)))
+
+(null? (cdr (list 1)))
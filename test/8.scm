@@ -0,0 +1,29 @@
+(define (fill v i n)
+        (if (< i n)
+            (begin (vector-set! v i (* i 0.5))
+                   (fill v (+ i 1) n))
+            v))
+
+(define (dot a b) (vector-sum (vector-mul a b)))
+
+(define (make-x) (fill (make-f64vector 1000) 0 1000))
+
+(define (check-dot)
+        (define x (make-x))
+        (dot x x))
+
+(define (check-fma)
+        (define x (make-x))
+        (vector-sum (vector-fma x x x)))
+
+(define (check-add)
+        (define x (make-x))
+        (vector-ref (vector-add x x) 10))
+
+(check-dot)
+
+(check-fma)
+
+(check-add)
+
+(vector-length (make-i64vector 7))
@@ -0,0 +1,10 @@
+(define (color-of fruit)
+        (cond ((eq? fruit 'banana) 'yellow)
+              ((eq? fruit 'apple) 'red)
+              (1 'unknown)))
+
+(color-of 'banana)
+
+(color-of (quote apple))
+
+(eq? (color-of 'kiwi) 'unknown)